@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "debug.hpp"
+
+int main(int argc, char* argv[]) {
+    // Servers create their files in the working directory, so the benchmarks run in a
+    // directory of their own. Output files are still written relative to the caller.
+    char* const previous = getcwd(nullptr, 0);
+    std::vector<std::string> arguments(argv, argv + argc);
+    for (std::string& argument : arguments) {
+        static const std::string OUT_OPTION = "--benchmark_out=";
+        if (argument.rfind(OUT_OPTION, 0) == 0 && argument.compare(OUT_OPTION.length(), 1, "/") != 0) {
+            argument.insert(OUT_OPTION.length(), std::string(previous) + "/");
+        }
+    }
+    free(previous);
+
+    char directory[] = "/tmp/BenchmarkXXXXXX";
+    if (mkdtemp(directory) == nullptr || chdir(directory) != 0) {
+        fprintf(stderr, "Can't create a directory for the benchmarks\n");
+        return 1;
+    }
+
+    // Only the logs of the code being measured would be written
+    Debug::setLevels("*=w");
+
+    std::vector<char*> pointers;
+    for (std::string& argument : arguments) {
+        pointers.push_back(argument.data());
+    }
+    int numArguments = pointers.size();
+    ::benchmark::Initialize(&numArguments, pointers.data());
+    if (::benchmark::ReportUnrecognizedArguments(numArguments, pointers.data())) {
+        return 1;
+    }
+    ::benchmark::RunSpecifiedBenchmarks();
+    ::benchmark::Shutdown();
+
+    const std::string command = std::string("rm -rf ") + directory;
+    return system(command.c_str());
+}
@@ -0,0 +1,53 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+
+#include <vector>
+
+#include "Communication.hpp"
+
+using server::comm::Message;
+
+static constexpr server::comm::MessageType TYPE = 0x11;
+
+// Payload sizes from a login token to the biggest message
+#define PAYLOAD_SIZES RangeMultiplier(8)->Range(16, 32768)
+
+static void BM_MessageCreate(benchmark::State& state) {
+    const std::vector<uint8_t> payload(state.range(0), 'x');
+    for (auto _ : state) {
+        // Calculates the checksum
+        const Message message(TYPE, payload.data(), payload.size());
+        benchmark::DoNotOptimize(message);
+    }
+    state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK(BM_MessageCreate)->PAYLOAD_SIZES;
+
+static void BM_MessageParse(benchmark::State& state) {
+    const std::vector<uint8_t> payload(state.range(0), 'x');
+    std::vector<uint8_t> frame;
+    Message(TYPE, payload.data(), payload.size()).serialize(frame);
+
+    for (auto _ : state) {
+        // Verifies the checksum
+        const Message message(frame.data(), frame.size());
+        benchmark::DoNotOptimize(message.isValid());
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+}
+BENCHMARK(BM_MessageParse)->PAYLOAD_SIZES;
+
+static void BM_MessageSerialize(benchmark::State& state) {
+    const std::vector<uint8_t> payload(state.range(0), 'x');
+    const Message message(TYPE, payload.data(), payload.size());
+    std::vector<uint8_t> frame;
+
+    for (auto _ : state) {
+        frame.clear();
+        message.serialize(frame);
+        benchmark::DoNotOptimize(frame.data());
+    }
+    state.SetBytesProcessed(state.iterations() * message.getLength());
+}
+BENCHMARK(BM_MessageSerialize)->PAYLOAD_SIZES;
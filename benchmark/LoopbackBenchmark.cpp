@@ -0,0 +1,146 @@
+#include <benchmark/benchmark.h>
+
+#include <sys/socket.h>
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "Communication.hpp"
+#include "MessageServer/MessageServer.hpp"
+#include "NotificationServer/NotificationServer.hpp"
+#include "Server.hpp"
+#include "net/Loopback.hpp"
+
+using server::comm::Message;
+using server::comm::MessageType;
+using server::net::Connection;
+using server::net::LoopbackChannel;
+
+static constexpr MessageType ECHO = 0x10;
+
+/** Server that sends every message back to the client that sent it */
+class EchoServer final : public server::Server {
+public:
+    EchoServer() : Server("EchoServer", 0) { }
+
+protected:
+    void onLogin(Client&) override { }
+
+    void onMessageReceived(Client& client, const Message& message) override {
+        sendMessage(message, client);
+    }
+};
+
+static void send(const Connection& connection, const Message& message) {
+    std::vector<uint8_t> frame;
+    message.serialize(frame);
+    connection.Send(frame.data(), frame.size());
+}
+
+/**
+ * \brief Read what a client received until a message of a type.
+ * \return false if it was not received yet, true otherwise.
+ */
+static bool receive(const Connection& connection, MessageType type) {
+    uint8_t buffer[64 * 1024];
+    ssize_t numBytes;
+    while ((numBytes = connection.Read(buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+        std::size_t position = 0;
+        while (numBytes - position >= sizeof(Message::Header)) {
+            const Message message(buffer + position, numBytes - position);
+            if (!message.isValid()) {
+                break;
+            }
+            if (message.getType() == type) {
+                return true;
+            }
+            position += message.getLength();
+        }
+    }
+    return false;
+}
+
+/**
+ * \brief Connect and log in a client, stepping the server until it is logged in.
+ */
+static Connection login(server::Server& server, const std::string& token) {
+    auto [client, serverEnd] = LoopbackChannel::createPair();
+    server.addConnection(serverEnd);
+    send(client, Message(server::comm::ServerMsgTypes::LOGIN,
+        (const uint8_t*) token.c_str(), token.length() + 1));
+    do {
+        server.step();
+    } while (!receive(client, server::comm::ServerMsgTypes::OK));
+    return client;
+}
+
+// A message of each client handled in each step, with no sockets or loop period
+static void BM_LoopbackEcho(benchmark::State& state) {
+    EchoServer server;
+    std::vector<Connection> clients;
+    for (int i = 0; i < state.range(0); i++) {
+        clients.push_back(login(server, "echo-" + std::to_string(i)));
+    }
+
+    const std::vector<uint8_t> payload(64, 'x');
+    const Message message(ECHO, payload.data(), payload.size());
+    for (auto _ : state) {
+        for (const Connection& client : clients) {
+            send(client, message);
+        }
+        server.step();
+        for (const Connection& client : clients) {
+            benchmark::DoNotOptimize(receive(client, ECHO));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * clients.size());
+}
+BENCHMARK(BM_LoopbackEcho)->RangeMultiplier(10)->Range(1, 1000);
+
+static void BM_MessageServerRelay(benchmark::State& state) {
+    MessageServer server(0);
+    const Connection sender = login(server, "relay-sender");
+    std::vector<Connection> receivers;
+    for (int i = 0; i < state.range(0); i++) {
+        receivers.push_back(login(server, "relay-" + std::to_string(i)));
+    }
+
+    const std::vector<uint8_t> payload(64, 'x');
+    const Message message(POST_MSG, payload.data(), payload.size());
+    for (auto _ : state) {
+        send(sender, message);
+        server.step();
+        for (const Connection& receiver : receivers) {
+            benchmark::DoNotOptimize(receive(receiver, POST_MSG));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * receivers.size());
+}
+BENCHMARK(BM_MessageServerRelay)->RangeMultiplier(10)->Range(1, 1000);
+
+// Notifications are read in the database executor, so the server is stepped until they arrive
+static void BM_NotificationServerRequestTasks(benchmark::State& state) {
+    NotificationServer server(0);
+
+    // Logins are authenticated
+    const std::string token = "tasks-user";
+    sqlite3* db;
+    sqlite3_open("server.db", &db);
+    const std::string sql = "INSERT OR REPLACE INTO Users (Token, Name, Notification) "
+                            "VALUES ('" + token + "', '" + token + "', 1);";
+    sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
+    sqlite3_close(db);
+
+    const Connection client = login(server, token);
+    for (auto _ : state) {
+        send(client, Message(NotificationServer::REQUEST_TASKS));
+        do {
+            server.step();
+        } while (!receive(client, server::comm::ServerMsgTypes::OK));
+    }
+}
+BENCHMARK(BM_NotificationServerRequestTasks);
@@ -0,0 +1,119 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "NotificationServer/NotificationDatabase.hpp"
+
+static const char* const WORDS[] = {
+    "water", "plants", "call", "dentist", "meeting", "report", "gym", "pay", "rent", "review",
+};
+static constexpr std::size_t NUM_WORDS = sizeof(WORDS) / sizeof(WORDS[0]);
+
+/**
+ * \brief Returns the database with a user that has a number of notifications.
+ *        Each size has a user of its own, filled the first time it is asked for.
+ */
+static NotificationDatabase& getDatabase(int size, std::string& user) {
+    static NotificationDatabase database;
+    static std::set<int> filledSizes;
+    static bool initialized = false;
+    if (!initialized) {
+        server::DatabaseManager::getInstance().initDatabase(database);
+        initialized = true;
+    }
+
+    user = "bench-" + std::to_string(size);
+    if (filledSizes.insert(size).second) {
+        std::vector<NotificationChange> changes;
+        for (int i = 0; i < size; i++) {
+            // Ids are unique across users
+            Notification notification;
+            notification.id = static_cast<int64_t>(size) * 1000000 + i;
+            notification.active = (i % 4 != 0);
+            notification.title = std::string(WORDS[i % NUM_WORDS]) + " " + std::to_string(i);
+            notification.description = std::string("Remember to ") + WORDS[(i * 7) % NUM_WORDS] +
+                " and " + WORDS[(i * 3) % NUM_WORDS];
+            notification.schedule = "0 9 * * 1-5";
+            changes.push_back({user, notification});
+        }
+        database.saveNotifications(changes);
+    }
+    return database;
+}
+
+#define TABLE_SIZES RangeMultiplier(10)->Range(100, 10000)
+
+static void BM_ReadActiveNotifications(benchmark::State& state) {
+    std::string user;
+    NotificationDatabase& database = getDatabase(state.range(0), user);
+    const NotificationQuery query;
+
+    for (auto _ : state) {
+        int rows = 0;
+        database.forEachNotification(user, query, [&rows](const NotificationView&) {
+            rows++;
+            return true;
+        });
+        benchmark::DoNotOptimize(rows);
+    }
+}
+BENCHMARK(BM_ReadActiveNotifications)->TABLE_SIZES;
+
+static void BM_ReadNotificationPage(benchmark::State& state) {
+    std::string user;
+    NotificationDatabase& database = getDatabase(state.range(0), user);
+    NotificationQuery query;
+    query.afterId = static_cast<int64_t>(state.range(0)) * 1000000 + state.range(0) / 2;
+    query.limit = 50;
+
+    for (auto _ : state) {
+        int rows = 0;
+        database.forEachNotification(user, query, [&rows](const NotificationView&) {
+            rows++;
+            return true;
+        });
+        benchmark::DoNotOptimize(rows);
+    }
+}
+BENCHMARK(BM_ReadNotificationPage)->TABLE_SIZES;
+
+static void BM_SearchNotifications(benchmark::State& state) {
+    std::string user;
+    NotificationDatabase& database = getDatabase(state.range(0), user);
+    const NotificationSearch search;
+
+    for (auto _ : state) {
+        int rows = 0;
+        database.searchNotifications(user, "dentist rent", search, [&rows](const NotificationView&) {
+            rows++;
+            return true;
+        });
+        benchmark::DoNotOptimize(rows);
+    }
+}
+BENCHMARK(BM_SearchNotifications)->TABLE_SIZES;
+
+static void BM_SaveNotification(benchmark::State& state) {
+    std::string user;
+    NotificationDatabase& database = getDatabase(state.range(0), user);
+
+    // Updates the same notification, which moves the versions of the table. The title
+    // changes every time, as saving a notification that did not change writes nothing.
+    Notification notification;
+    notification.id = static_cast<int64_t>(state.range(0)) * 1000000;
+    notification.active = true;
+    notification.title = "water plants";
+    notification.description = "Remember to water the plants";
+    notification.schedule = "0 9 * * 1-5";
+
+    uint64_t iteration = 0;
+    for (auto _ : state) {
+        notification.title = (iteration++ % 2 == 0)? "water plants" : "water the plants";
+        benchmark::DoNotOptimize(database.saveNotification(user, notification));
+    }
+}
+BENCHMARK(BM_SaveNotification)->TABLE_SIZES;
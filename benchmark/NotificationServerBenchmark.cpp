@@ -0,0 +1,35 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+
+#include "NotificationServer/NotificationServer.hpp"
+
+class NotificationServerBenchmark final {
+public:
+    static void encodeNotification(const NotificationView& notification, std::vector<uint8_t>& frames) {
+        NotificationServer::encodeNotification(notification, frames);
+    }
+};
+
+static void BM_EncodeNotification(benchmark::State& state) {
+    // Descriptions with characters that must be escaped
+    std::string description;
+    while (description.length() < static_cast<std::size_t>(state.range(0))) {
+        description += "Call \"the dentist\"\tat 9\n";
+    }
+    description.resize(state.range(0));
+
+    const NotificationView notification {12345, true, "Dentist", description, "0 9 * * 1-5", 678};
+    std::vector<uint8_t> frames;
+
+    for (auto _ : state) {
+        frames.clear();
+        NotificationServerBenchmark::encodeNotification(notification, frames);
+        benchmark::DoNotOptimize(frames.data());
+    }
+    state.SetBytesProcessed(state.iterations() * frames.size());
+}
+BENCHMARK(BM_EncodeNotification)->RangeMultiplier(8)->Range(16, 16384);
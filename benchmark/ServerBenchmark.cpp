@@ -0,0 +1,81 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "Communication.hpp"
+#include "Server.hpp"
+
+namespace server {
+
+/** Server that does nothing after a login, to measure only the base class */
+class BenchServer final : public Server {
+public:
+    BenchServer() : Server("BenchServer", 0) { }
+
+protected:
+    void onLogin(Client&) override { }
+    void onMessageReceived(Client&, const comm::Message&) override { }
+};
+
+class ServerBenchmark final {
+public:
+    /**
+     * \brief Log in a new client without a connection. What is sent to it is dropped.
+     */
+    static bool login(Server& server, const std::string& token) {
+        Server::Client client(net::Connection(), server.mNextClientId++);
+        return server.tryToLogin(token, client);
+    }
+
+    /**
+     * \brief Remove the last client of a user, leaving the user in place.
+     */
+    static void removeLastClient(Server& server, const std::string& token) {
+        server.findUser(token)->clients.pop_back();
+    }
+
+    /**
+     * \brief Remove the user that logged in last.
+     */
+    static void removeLastUser(Server& server) {
+        server.mUsers.pop_back();
+    }
+};
+
+}  // namespace server
+
+using server::ServerBenchmark;
+
+static std::string getToken(int user) {
+    return "bench-user-" + std::to_string(user);
+}
+
+// Users are searched by token, so the last one is the slowest to find
+static void BM_LoginExistingUser(benchmark::State& state) {
+    server::BenchServer server;
+    for (int i = 0; i < state.range(0); i++) {
+        ServerBenchmark::login(server, getToken(i));
+    }
+
+    const std::string token = getToken(state.range(0) - 1);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(ServerBenchmark::login(server, token));
+        ServerBenchmark::removeLastClient(server, token);
+    }
+}
+BENCHMARK(BM_LoginExistingUser)->RangeMultiplier(10)->Range(1, 10000);
+
+static void BM_LoginNewUser(benchmark::State& state) {
+    server::BenchServer server;
+    for (int i = 0; i < state.range(0); i++) {
+        ServerBenchmark::login(server, getToken(i));
+    }
+
+    // The whole list is searched before adding the user
+    const std::string token = getToken(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(ServerBenchmark::login(server, token));
+        ServerBenchmark::removeLastUser(server);
+    }
+}
+BENCHMARK(BM_LoginNewUser)->RangeMultiplier(10)->Range(1, 10000);
@@ -0,0 +1,27 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "util/TextUtils.hpp"
+
+static void BM_SplitSchedule(benchmark::State& state) {
+    const std::string expression = "0,15,30,45 8-18 * * 1-5";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(TextUtils::Split(expression, " "));
+    }
+}
+BENCHMARK(BM_SplitSchedule);
+
+static void BM_SplitFields(benchmark::State& state) {
+    std::string text;
+    for (int i = 0; i < state.range(0); i++) {
+        text += (i > 0)? "," : "";
+        text += "field" + std::to_string(i);
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(TextUtils::Split(text, ","));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SplitFields)->RangeMultiplier(8)->Range(8, 4096);
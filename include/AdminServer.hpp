@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_ADMIN_SERVER_HPP_
+#define _INCLUDE_ADMIN_SERVER_HPP_
+
+#include <cstdint>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Metrics.hpp"
+#include "net/Socket.hpp"
+
+namespace server {
+
+/**
+ * \brief State of a server shown by the admin endpoint.
+ */
+struct AdminStatus {
+    /** Build and configuration, as names and values */
+    std::vector<std::pair<std::string, std::string>> info;
+
+    /** Sessions and queue sizes, as names and values */
+    std::vector<std::pair<std::string, int64_t>> values;
+};
+
+/**
+ * \brief Admin endpoint with the metrics and status of a server.
+ *
+ *        It listens on its own port and answers each connection with a dump and closes it.
+ *        Since its commands change the logging and tracing of the server, it only listens
+ *        on the loopback interface unless it is given another address.
+ *        An HTTP request for /metrics is answered in the Prometheus text format, and any
+ *        other request in plain text, so it can be scraped or read with curl or nc.
+ *        "loglevel tag=level,..." or /loglevel?tag=level,... sets the log levels of the
+ *        tags at runtime, and answers with the levels of all the tags. "trace" or /trace
+ *        is answered with the traces of the last messages in the Chrome trace event
+ *        format, and "trace on" or "trace off" starts or stops tracing.
+ *
+ *        Requests are served one at a time in a thread of its own. The status is asked
+ *        to the server through a function, which should only copy it, so that a scrape
+ *        never delays the clients.
+ */
+class AdminServer final {
+public:
+    /** Function that fills the status of the server. Returns false if it is not available. */
+    using StatusProvider = std::function<bool(AdminStatus& status)>;
+
+    static constexpr const char* DEFAULT_ADDRESS = "127.0.0.1";
+
+    /**
+     * \param port Port of the admin endpoint.
+     * \param getStatus Function called from the admin thread to get the server status.
+     * \param address Address it listens on. 0.0.0.0 listens on all the interfaces.
+     */
+    AdminServer(uint16_t port, StatusProvider getStatus, const std::string& address = DEFAULT_ADDRESS);
+    ~AdminServer();
+
+    /**
+     * \brief Listen for requests in the admin thread.
+     * \return false if the port can't be used, true otherwise.
+     */
+    bool start();
+
+    /**
+     * \brief Stop the admin thread.
+     */
+    void stop();
+
+    /**
+     * \brief Write the metrics and status in the Prometheus text format.
+     * \param snapshot Metrics.
+     * \param status Server status.
+     */
+    static std::string formatPrometheus(const Metrics::Snapshot& snapshot, const AdminStatus& status);
+
+    /**
+     * \brief Write the metrics and status in plain text.
+     * \param snapshot Metrics.
+     * \param status Server status.
+     */
+    static std::string formatText(const Metrics::Snapshot& snapshot, const AdminStatus& status);
+
+    /**
+     * \brief Remove the "--admin <port>" option from command line arguments.
+     * \param args Arguments. The option and its value are erased.
+     * \return The admin port, or 0 if the option is not present.
+     */
+    static uint16_t takePortArgument(std::vector<std::string>& args);
+
+    /**
+     * \brief Remove the "--admin-address <address>" option from command line arguments.
+     * \param args Arguments. The option and its value are erased.
+     * \return The address, or DEFAULT_ADDRESS if the option is not present.
+     */
+    static std::string takeAddressArgument(std::vector<std::string>& args);
+
+private:
+    static constexpr std::size_t MAX_REQUEST_SIZE = 4096;
+    static constexpr unsigned REQUEST_TIMEOUT_ms = 1000;
+
+    /** Percentiles written for each timer */
+    static constexpr double PERCENTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+    const uint16_t mPort;
+    const std::string mAddress;
+    const StatusProvider mGetStatus;
+    const std::chrono::steady_clock::time_point mStartTime;
+
+    std::unique_ptr<net::ServerSocket> mServerSocket;
+    std::atomic<bool> mRunning {false};
+    std::thread mThread;
+
+    void serve();
+
+    /**
+     * \brief Read a request and answer it.
+     * \param connection Connection of the request.
+     */
+    void handleRequest(net::Connection& connection);
+
+    /**
+     * \brief Set log levels.
+     * \param spec Levels as accepted by Debug::setLevels(), or empty to only list them.
+     * \return Response.
+     */
+    static std::string handleLogLevel(const std::string& spec);
+
+    /**
+     * \brief Add the build information and uptime to a status.
+     */
+    void addBuildInfo(AdminStatus& status) const;
+};
+
+}  // namespace server
+
+#endif  // _INCLUDE_ADMIN_SERVER_HPP_
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_CAPTURE_HPP_
+#define _INCLUDE_CAPTURE_HPP_
+
+#include <cstdint>
+#include <cstdio>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace server {
+
+/**
+ * \brief Capture of the traffic of a server, to replay it later with TrafficReplay.
+ *
+ *        The file starts with MAGIC, followed by a record per event: its kind, the time
+ *        since the previous record in microseconds and the id of the connection, as
+ *        variable-length integers. FRAME records are followed by the size and the bytes
+ *        received, and SENT records by the number of bytes sent to the client. Records
+ *        are written to a stdio buffer, which is flushed by flush() and when the capture
+ *        is destroyed. Captures contain the tokens of the users that log in.
+ */
+class Capture final {
+public:
+    enum Kind : uint8_t {
+        CONNECT = 1,        // Connection accepted
+        FRAME = 2,          // Bytes received
+        SENT = 3,           // Bytes sent, without the data
+        DISCONNECT = 4,     // Connection closed by the client
+    };
+
+    struct Record {
+        Kind kind;
+        int64_t time_us;            // Since the start of the capture
+        uint64_t connection;
+        uint64_t size;              // Bytes received or sent
+        std::vector<uint8_t> data;  // Bytes received, for FRAME
+    };
+
+    static constexpr char MAGIC[] = "SRVCAP1\n";
+
+    ~Capture();
+
+    /**
+     * \brief Open a capture file. It is overwritten.
+     * \return true if the file could be opened, false otherwise.
+     */
+    bool open(const std::string& path);
+
+    void recordConnect(uint64_t connection);
+    void recordFrame(uint64_t connection, const uint8_t* data, std::size_t size);
+    void recordSent(uint64_t connection, std::size_t size);
+    void recordDisconnect(uint64_t connection);
+
+    /**
+     * \brief Write the buffered records to the file.
+     */
+    void flush();
+
+    /**
+     * \brief Read all the records of a capture file.
+     * \param in Capture file.
+     * \param records Output records. A truncated last record is left out.
+     * \return false if the file is not a capture, true otherwise.
+     */
+    static bool read(FILE* in, std::vector<Record>& records);
+
+    /**
+     * \brief Remove the "--capture <file>" option from command line arguments.
+     * \param args Arguments. The option and its value are erased.
+     * \return The capture file, or an empty string if the option is not present.
+     */
+    static std::string takeFileArgument(std::vector<std::string>& args);
+
+private:
+    static constexpr std::size_t BUFFER_SIZE = 1024 * 1024;
+
+    std::mutex mMutex;
+    FILE* mFile = nullptr;
+    std::chrono::steady_clock::time_point mStart;
+    int64_t mLastTime_us = 0;
+
+    /**
+     * \brief Write the kind, time and connection of a record.
+     */
+    void writeHeader(Kind kind, uint64_t connection);
+
+    void writeNumber(uint64_t value);
+};
+
+}  // namespace server
+
+#endif  // _INCLUDE_CAPTURE_HPP_
@@ -20,6 +20,9 @@
 
 #include <cstdint>
 
+#include <memory>
+#include <vector>
+
 namespace server {
 namespace comm {
 
@@ -33,8 +36,8 @@ using MessageType = uint16_t;
 */
 class Message {
 public:
-    Message(uint8_t* buffer, const uint16_t maxSize);
-    Message(MessageType type, uint8_t*  buffer, const uint16_t size);
+    Message(const uint8_t* buffer, const uint16_t maxSize);
+    Message(MessageType type, const uint8_t* buffer, const uint16_t size);
     Message(MessageType type);
 
     struct __attribute__((packed)) Header {
@@ -47,11 +50,11 @@ public:
         return header.type;
     }
 
-    inline uint8_t getPayloadSize() const{
+    inline uint16_t getPayloadSize() const{
         return header.size;
     }
 
-    inline uint8_t getLength() const {
+    inline uint16_t getLength() const {
         return header.size + sizeof(header);
     }
 
@@ -63,6 +66,19 @@ public:
 
     bool serialize(uint8_t* buffer, uint16_t bufferSize) const;
 
+    /**
+     * \brief Append the serialized message to the end of a buffer.
+     * \param buffer Buffer.
+     */
+    void serialize(std::vector<uint8_t>& buffer) const;
+
+    /**
+     * \brief Write only the header of the message. Used to build a frame whose payload
+     *        is already in place right after the header.
+     * \param buffer Buffer of at least sizeof(Header) bytes.
+     */
+    void serializeHeader(uint8_t* buffer) const;
+
 private:
     Header header;
     const uint8_t* payload = nullptr;
@@ -73,6 +89,9 @@ private:
 };
 
 
+/** A serialized message shared by all the clients it is sent to */
+using SharedFrame = std::shared_ptr<const std::vector<uint8_t>>;
+
 /**
  * \brief Reserved server messages types
  *
@@ -21,6 +21,8 @@
 #include <cstdint>
 
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <sqlite3.h>
 
@@ -33,6 +35,8 @@ class DatabaseManager;
  */
 class Database {
 public:
+    virtual ~Database();
+
     /**
      * \brief Check if a user token exists in the user database.
      * \
@@ -43,24 +47,79 @@ public:
 protected:
     sqlite3* mDb;
 
+    /**
+     * \brief A step in the evolution of a schema.
+     */
+    struct Migration {
+        int version;
+        const char* sql;
+    };
+
     /**
      * \brief Initialise database.
      */
     virtual void init();
 
+    /**
+     * \brief Bring a schema up to date by applying the migrations newer than its stored
+     *        version. Each migration runs in its own transaction together with the update
+     *        of the stored version, so a failed migration leaves the schema untouched.
+     * \param schema Name of the schema.
+     * \param migrations Migrations sorted by version.
+     * \return true if all the migrations were applied, false otherwise.
+     */
+    bool migrate(const char* schema, const std::vector<Migration>& migrations);
+
+    /**
+     * \brief Returns the stored version of a schema, or 0 if it was never migrated.
+     * \param schema Name of the schema.
+     */
+    int getSchemaVersion(const char* schema) const;
+
+    /**
+     * \brief Store the version of a schema.
+     * \param schema Name of the schema.
+     * \param version Version.
+     * \return SQLITE_OK, or the SQLite error code.
+     */
+    int setSchemaVersion(const char* schema, int version);
+
+    /**
+     * \brief Returns a prepared statement for a SQL string, preparing it the first time.
+     *        Statements are kept until the database is destroyed, so the SQL must be a
+     *        string literal. Bindings are cleared and the statement must be reset with
+     *        sqlite3_reset() after use.
+     * \param sql SQL string literal.
+     * \return The prepared statement, or nullptr if it could not be prepared.
+     */
+    sqlite3_stmt* prepareCached(const char* sql);
+
 private:
     /**
      * \brief Create table of registered users
      */
     void createUserTable();
 
+    /**
+     * \brief Create the table that stores the version of each schema.
+     */
+    void createSchemaVersionTable();
+
     /**
      * \brief Set the sqlite* database.
      * \param db Initialised sqlite*.
      */
     void setDb(sqlite3* db);
 
+    std::unordered_map<const char*, sqlite3_stmt*> mStatements;
+
+    /** Connection opened for this database alone, closed with it */
+    sqlite3* mOwnedDb = nullptr;
+
     friend DatabaseManager;
+
+    // Tests open databases of their own
+    friend class DatabaseTest;
 };
 
 class DatabaseManager final {
@@ -79,9 +138,21 @@ public:
      */
     void initDatabase(Database& database);
 
+    /**
+     * \brief Give a database a read-only connection of its own, so that its queries do
+     *        not wait for the ones of the shared connection. The schema is not migrated,
+     *        so the database must have been initialised with initDatabase() before.
+     * \param database Reference to an uninitialised database.
+     * \return true if the connection could be opened, false otherwise.
+     */
+    bool initReadOnlyDatabase(Database& database);
+
 private:
     DatabaseManager();
 
+    static constexpr const char* DATABASE_FILE = "server.db";
+    static constexpr int BUSY_TIMEOUT_ms = 5000;
+
     sqlite3* mDb;
 };
 
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_DATABASE_EXECUTOR_HPP_
+#define _INCLUDE_DATABASE_EXECUTOR_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "Metrics.hpp"
+
+namespace server {
+
+/**
+ * \brief Runs database jobs in a dedicated thread so that the threads handling
+ *        the network never wait on disk.
+ *
+ *        Jobs are run in the same order they are posted. All pending jobs are
+ *        taken from the queue at once, so a burst of requests is handled in a
+ *        single wake-up of the executor thread.
+ */
+class DatabaseExecutor final {
+public:
+    using Job = std::function<void()>;
+
+    /**
+     * \brief Start the executor thread.
+     * \param queueGauge Gauge with the number of jobs waiting to be run. Executors of
+     *        the same process need gauges of their own.
+     */
+    explicit DatabaseExecutor(Metrics::Gauge queueGauge = Metrics::DATABASE_QUEUE);
+    ~DatabaseExecutor();
+
+    /**
+     * \brief Queue a job to be run in the executor thread.
+     * \param job Job.
+     */
+    void post(Job job);
+
+    /**
+     * \brief Set a job that is run in the executor thread at a fixed period, between
+     *        the posted jobs. Replaces the previous periodic job.
+     * \param period Period.
+     * \param job Job.
+     */
+    void setPeriodicJob(std::chrono::milliseconds period, Job job);
+
+    /**
+     * \brief Run the jobs that are still queued and stop the executor thread.
+     *        Jobs posted after stopping are discarded.
+     */
+    void stop();
+
+    /**
+     * \brief Returns the number of jobs waiting to be run.
+     */
+    std::size_t getQueueSize() const;
+
+private:
+    mutable std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<Job> mJobs;
+    bool mRunning = true;
+    const Metrics::Gauge mQueueGauge;
+
+    Job mPeriodicJob;
+    std::chrono::milliseconds mPeriod;
+    std::chrono::steady_clock::time_point mNextPeriodicRun;
+
+    std::thread mThread;
+
+    /**
+     * \brief Executor thread loop.
+     */
+    void loop();
+};
+
+}  // namespace server
+
+#endif  // _INCLUDE_DATABASE_EXECUTOR_HPP_
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_MESSAGE_SERVER_CLUSTER_HPP_
+#define _INCLUDE_MESSAGE_SERVER_CLUSTER_HPP_
+
+#include <cstdint>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "Communication.hpp"
+#include "net/Socket.hpp"
+
+/**
+ * \brief Links between the MessageServer nodes of a cluster.
+ *
+ *        Every node connects to every other node, and only sends through the links it
+ *        opened. Inter-node frames use the same format as client messages. A node first
+ *        sends its address, then the users connected to it and the topics its clients
+ *        subscribed to, and then the changes to both. Client messages are forwarded to
+ *        every node, or only to the nodes with users online or with subscribers for a
+ *        topic. Forwarded messages are not forwarded again, so the cluster must be a full
+ *        mesh.
+ *
+ *        Frames are queued per link and written in batches by a thread, without blocking.
+ *        When a link does not keep up and its queue is full, forwarded messages are
+ *        dropped, but presence changes are always queued. Links that fail are opened
+ *        again, and the presence is sent from the start. Links are opened without blocking
+ *        the thread, and a connection attempt is abandoned after a timeout.
+ *
+ *        All the public functions can be called from any thread.
+ */
+class Cluster final {
+public:
+    /** Function called from the cluster thread with each message forwarded by another node */
+    using ForwardHandler = std::function<void(std::vector<uint8_t>&& frame)>;
+
+    /**
+     * \param address Address of this node as host:port. Other nodes connect to its port.
+     * \param peers Addresses of the other nodes as host:port.
+     * \param onForward Function called with the messages forwarded by other nodes.
+     */
+    Cluster(const std::string& address, const std::vector<std::string>& peers,
+            ForwardHandler onForward);
+    ~Cluster();
+
+    /**
+     * \brief Listen for the other nodes and start connecting to them.
+     * \return false if an address is not valid or the port can't be used, true otherwise.
+     */
+    bool start();
+
+    /**
+     * \brief Close all the links and stop the cluster threads.
+     */
+    void stop();
+
+    /**
+     * \brief Tell the other nodes that a user has clients connected to this node or not.
+     * \param user User token.
+     * \param online true when the first client connects, false when the last one leaves.
+     */
+    void setUserOnline(const std::string& user, bool online);
+
+    /**
+     * \brief Tell the other nodes that a topic has subscribers in this node or not.
+     * \param topic Topic name.
+     * \param active true when the first client subscribes, false when the last one leaves.
+     */
+    void setTopicActive(const std::string& topic, bool active);
+
+    /**
+     * \brief Forward a serialized message to the nodes with users online.
+     * \param frame Serialized message.
+     */
+    void forwardToAll(const std::vector<uint8_t>& frame);
+
+    /**
+     * \brief Forward a serialized message to every connected node, even without users
+     *        online, such as the messages that all the nodes keep in their log.
+     * \param frame Serialized message.
+     */
+    void forwardToNodes(const std::vector<uint8_t>& frame);
+
+    /**
+     * \brief Forward a serialized message to the nodes with subscribers for a topic.
+     * \param topic Topic name.
+     * \param frame Serialized message.
+     */
+    void forwardToTopic(const std::string& topic, const std::vector<uint8_t>& frame);
+
+    /**
+     * \brief Returns the address of this node.
+     */
+    const std::string& getAddress() const;
+
+    /**
+     * \brief Returns the number of nodes this node is connected to.
+     */
+    std::size_t getNumConnectedNodes() const;
+
+    /**
+     * \brief Returns the number of users online in the other nodes.
+     */
+    std::size_t getNumRemoteUsers() const;
+
+    /**
+     * \brief Returns true if a user has clients connected to another node.
+     * \param user User token.
+     */
+    bool isUserOnline(const std::string& user) const;
+
+    /**
+     * \brief Split an address in host and port.
+     * \param address Address as host:port.
+     * \param host Output host.
+     * \param port Output port.
+     * \return false if the address is not valid, true otherwise.
+     */
+    static bool parseAddress(const std::string& address, std::string& host, uint16_t& port);
+
+private:
+    enum FrameType : server::comm::MessageType {
+        HELLO = 0x80,           // Address of the node
+        USER_ONLINE = 0x81,     // User token
+        USER_OFFLINE = 0x82,
+        TOPIC_ADDED = 0x83,     // Topic name
+        TOPIC_REMOVED = 0x84,
+        FORWARD = 0x85,         // Serialized client message
+    };
+
+    static constexpr std::size_t LINK_MAX_PENDING_BYTES = 4 * 1024 * 1024;
+    static constexpr std::size_t READ_BUFFER_SIZE = 64 * 1024;
+    std::chrono::milliseconds mLinkPeriod_ms = std::chrono::milliseconds(2);
+    std::chrono::milliseconds mReconnectPeriod_ms = std::chrono::milliseconds(1000);
+    std::chrono::milliseconds mConnectTimeout_ms = std::chrono::milliseconds(1000);
+
+    struct Presence {
+        std::unordered_set<std::string> users;
+        std::unordered_set<std::string> topics;
+    };
+
+    /** A link opened by this node, to send frames */
+    struct OutgoingLink {
+        std::string address;
+        std::string host;
+        uint16_t port = 0;
+
+        std::unique_ptr<server::net::ClientSocket> socket;
+        bool connected = false;
+        std::chrono::steady_clock::time_point nextAttempt;
+
+        // Only used by the link thread, while connecting
+        std::unique_ptr<server::net::ClientSocket> connecting;
+        std::chrono::steady_clock::time_point connectDeadline;
+
+        std::vector<uint8_t> pending;
+        std::size_t dropped = 0;
+    };
+
+    /** A link opened by another node, to receive its frames */
+    struct IncomingLink {
+        server::net::Connection connection;
+        std::string node;   // Empty until its HELLO
+        std::vector<uint8_t> received;
+        Presence presence;
+    };
+
+    const std::string mAddress;
+    const ForwardHandler mOnForward;
+
+    mutable std::mutex mMutex;
+    std::vector<OutgoingLink> mOutgoing;
+    std::vector<IncomingLink> mIncoming;
+    Presence mLocal;
+
+    // Only used by the link thread
+    std::vector<uint8_t> mReadBuffer;
+
+    std::unique_ptr<server::net::ServerSocket> mServerSocket;
+    uint16_t mPort = 0;
+    std::atomic<bool> mRunning {false};
+    std::thread mAcceptThread;
+    std::thread mLinkThread;
+
+    void acceptLinks();
+    void runLinks();
+
+    /**
+     * \brief Open the outgoing links that are not connected and queue the presence of
+     *        this node in them. It does not wait for the connections: their progress is
+     *        checked in the next iterations.
+     */
+    void connectLinks();
+
+    /**
+     * \brief Write the queued frames of the outgoing links, as much as they take.
+     */
+    void flushLinks();
+
+    /**
+     * \brief Read the incoming links and handle their frames.
+     */
+    void readLinks();
+
+    /**
+     * \brief Handle a frame received from another node. Must be called with the mutex locked.
+     * \param link The link it was received from.
+     * \param message Frame.
+     * \param forwarded Output messages to pass to the forward handler.
+     */
+    void handleFrame(IncomingLink& link, const server::comm::Message& message,
+                     std::vector<std::vector<uint8_t>>& forwarded);
+
+    /**
+     * \brief Queue a frame in an outgoing link. Must be called with the mutex locked.
+     * \param link Link.
+     * \param type Frame type.
+     * \param payload Payload.
+     * \param size Size of the payload.
+     * \return false if the frame was dropped, true otherwise.
+     */
+    bool queueFrame(OutgoingLink& link, server::comm::MessageType type, const uint8_t* payload,
+                    std::size_t size);
+
+    /**
+     * \brief Queue a frame in all the connected outgoing links. Must be called with the mutex locked.
+     */
+    void queueFrameToAll(server::comm::MessageType type, const std::string& payload);
+
+    /**
+     * \brief Returns the presence sent by a node, or nullptr if it is not connected.
+     *        Must be called with the mutex locked.
+     * \param node Address of the node.
+     */
+    const Presence* findPresence(const std::string& node) const;
+
+    void disconnect(OutgoingLink& link);
+};
+
+#endif  // _INCLUDE_MESSAGE_SERVER_CLUSTER_HPP_
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_MESSAGE_SERVER_MESSAGE_LOG_HPP_
+#define _INCLUDE_MESSAGE_SERVER_MESSAGE_LOG_HPP_
+
+#include <cstdint>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Communication.hpp"
+
+/**
+ * \brief Append-only log of the messages relayed by the server.
+ *
+ *        Every record has an offset, which grows by one for each message, and a timestamp.
+ *        The log is split in segments. Each segment has a file with the serialized messages
+ *        back to back, exactly as they are sent to the clients, and an index file with the
+ *        timestamp, position and size of each record. Segment files are named after the
+ *        offset of their first record.
+ *
+ *        Appended messages are buffered in memory and written in batches by flush().
+ *        Replays send the flushed records straight from the memory-mapped segment files.
+ *        Old segments are deleted when the log grows over a size or their records get
+ *        older than an age. All functions can be called from any thread.
+ */
+class MessageLog final {
+public:
+    /**
+     * Function that sends a range of serialized messages. Returns the number of bytes sent,
+     * which ends at the end of a message. Fewer than size are sent when it would block.
+     */
+    using Sender = std::function<std::size_t(const uint8_t* data, std::size_t size)>;
+
+    /**
+     * \param directory Directory of the segment files. It is created if it does not exist.
+     * \param segmentMaxBytes Size at which a new segment is started.
+     * \param maxBytes Maximum size of the log. Older segments are deleted beyond it.
+     * \param maxAge_ms Maximum age of the records. Older segments are deleted.
+     */
+    MessageLog(const std::string& directory, std::size_t segmentMaxBytes, std::size_t maxBytes,
+               int64_t maxAge_ms);
+    ~MessageLog();
+
+    /**
+     * \brief Append a message to the log. It is written in the next flush().
+     * \param message Message.
+     * \param timestamp_ms Time of the message in milliseconds since epoch.
+     * \return Offset of the record.
+     */
+    uint64_t append(const server::comm::Message& message, int64_t timestamp_ms);
+
+    /**
+     * \brief Append a serialized message to the log. It is written in the next flush().
+     * \param frame Serialized message.
+     * \param size Size of the serialized message.
+     * \param timestamp_ms Time of the message in milliseconds since epoch.
+     * \return Offset of the record.
+     */
+    uint64_t append(const uint8_t* frame, std::size_t size, int64_t timestamp_ms);
+
+    /**
+     * \brief Write the appended messages to the segment files.
+     */
+    void flush();
+
+    /**
+     * \brief Delete the segments that exceed the maximum size or age of the log.
+     *        The segment being written is never deleted.
+     * \param now_ms Current time in milliseconds since epoch.
+     */
+    void applyRetention(int64_t now_ms);
+
+    /**
+     * \brief Returns the offset of the first record still in the log.
+     */
+    uint64_t getBeginOffset() const;
+
+    /**
+     * \brief Returns the offset of the next record that will be appended.
+     */
+    uint64_t getEndOffset() const;
+
+    /**
+     * \brief Returns the offset of the first record at or after a time, or the end offset
+     *        if there is none.
+     * \param timestamp_ms Time in milliseconds since epoch.
+     */
+    uint64_t findOffset(int64_t timestamp_ms);
+
+    /**
+     * \brief Send the records in a range of offsets. Flushed records are sent from the
+     *        segment files, and unflushed ones are copied from memory, so it never waits
+     *        for a flush. Records older than the first one in the log were deleted and are
+     *        skipped.
+     * \param fromOffset Offset of the first record.
+     * \param toOffset Offset after the last record.
+     * \param maxBytes Maximum number of bytes to send. At least one record is sent.
+     * \param sender Function called with each contiguous range of records. Sending stops
+     *        when it does not send a whole range.
+     * \return Offset of the first record that was not sent.
+     */
+    uint64_t replay(uint64_t fromOffset, uint64_t toOffset, std::size_t maxBytes, const Sender& sender);
+
+    /**
+     * \brief Returns the total size of the segments in bytes, including unflushed records.
+     */
+    std::size_t getSize() const;
+
+private:
+    struct __attribute__((packed)) IndexEntry {
+        int64_t timestamp;
+        uint64_t position;
+        uint32_t size;
+    };
+
+    /** A read-only mapping of a segment file. Unmapped when the last reference is released. */
+    struct Mapping {
+        uint8_t* data;
+        std::size_t size;
+
+        Mapping(uint8_t* data, std::size_t size) : data(data), size(size) { }
+        ~Mapping();
+    };
+
+    struct Segment {
+        uint64_t baseOffset;
+        std::string logPath;
+        std::string indexPath;
+        int logFd = -1;
+        int indexFd = -1;
+
+        std::vector<IndexEntry> index;  // Flushed and unflushed records
+        std::size_t flushedRecords = 0;
+        uint64_t size = 0;              // Including unflushed records
+        uint64_t flushedSize = 0;
+
+        // Appended and not yet written to the file
+        std::vector<uint8_t> pendingData;
+
+        // Being written by flush(), followed by pendingData
+        std::vector<uint8_t> writingData;
+
+        std::shared_ptr<const Mapping> mapping;
+
+        ~Segment();
+
+        /**
+         * \brief Returns a mapping that covers the flushed records, remapping the file if it
+         *        grew. Must be called with the mutex locked.
+         */
+        std::shared_ptr<const Mapping> map();
+    };
+
+    using SegmentPtr = std::shared_ptr<Segment>;
+
+    const std::string mDirectory;
+    const std::size_t mSegmentMaxBytes;
+    const std::size_t mMaxBytes;
+    const int64_t mMaxAge_ms;
+
+    mutable std::mutex mMutex;
+    std::mutex mFlushMutex;
+
+    std::map<uint64_t, SegmentPtr> mSegments;   // By base offset
+    std::size_t mSize = 0;
+    int64_t mLastTimestamp = 0;
+
+    /**
+     * \brief Open the segments found in the directory, dropping the records that were
+     *        not completely written.
+     */
+    void load();
+
+    /**
+     * \brief Create an empty segment at the end of the log. Must be called with the mutex locked.
+     * \param baseOffset Offset of its first record.
+     */
+    SegmentPtr createSegment(uint64_t baseOffset);
+
+    /**
+     * \brief Returns the active segment. Must be called with the mutex locked.
+     */
+    SegmentPtr getActiveSegment() const;
+
+    std::string getSegmentPath(uint64_t baseOffset, const char* extension) const;
+};
+
+#endif  // _INCLUDE_MESSAGE_SERVER_MESSAGE_LOG_HPP_
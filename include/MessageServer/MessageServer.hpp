@@ -18,27 +18,211 @@
 #ifndef _INCLUDE_MESSAGE_SERVER_MESSAGE_SERVER_HPP_
 #define _INCLUDE_MESSAGE_SERVER_MESSAGE_SERVER_HPP_
 
+#include <chrono>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "MessageServer/Cluster.hpp"
+#include "MessageServer/MessageLog.hpp"
+#include "MessageServer/OfflineQueues.hpp"
+#include "MessageServer/TopicIndex.hpp"
 #include "Server.hpp"
 
 using Message = server::comm::Message;
 
+/**
+ * POST_MSG is relayed to the clients of all the users, and queued for the users that are
+ * offline. The relayed payload starts with a PostHeader, followed by the token of the
+ * sender, a null character and the payload that was posted.
+ *
+ * REQUEST_REPLAY asks for the POST_MSG messages relayed since an offset or a time. Its
+ * payload is a ReplayRequest. The messages are sent as they were relayed, followed by
+ * REPLAY_END with the offset of the next message as a little-endian uint64_t. Replays are
+ * sent in parts of up to REPLAY_MAX_BYTES: a client asks again from that offset until it
+ * gets an empty replay.
+ *
+ * SUBSCRIBE and UNSUBSCRIBE carry the name of a topic, and are answered with OK or ERROR.
+ * PUBLISH carries the name of a topic, a null character and the data. It is relayed as is
+ * to the other clients subscribed to the topic, and is neither logged nor queued for
+ * offline users. Subscriptions end when the client disconnects.
+ *
+ * In a cluster, POST_MSG is also forwarded to every other node, which logs it and relays it to
+ * its clients. USER_LOGGED_IN and PUBLISH are forwarded to the other nodes with users online,
+ * or with subscribers for the topic. Messages are not queued for a user that went offline
+ * while it has clients in another node.
+ */
 enum MessageTypes : server::comm::MessageType {
     USER_LOGGED_IN = 0x10,
     POST_MSG = 0x11,
+    REQUEST_REPLAY = 0x12,
+    REPLAY_END = 0x13,
+    SUBSCRIBE = 0x14,
+    UNSUBSCRIBE = 0x15,
+    PUBLISH = 0x16,
+};
+
+struct __attribute__((packed)) PostHeader {
+    int64_t timestamp;  // Milliseconds since epoch, set by the server
+};
+
+struct __attribute__((packed)) ReplayRequest {
+    enum Mode : uint8_t {
+        FROM_OFFSET = 0,
+        FROM_TIME = 1,  // Milliseconds since epoch
+    };
+
+    uint8_t mode;
+    uint64_t value;
 };
 
 class MessageServer : public server::Server {
 public:
-    MessageServer(const uint16_t port);
+    /**
+     * \param port Port for the clients.
+     * \param nodeAddress Address of this node as host:port, or empty to run without a cluster.
+     * \param peers Addresses of the other nodes of the cluster.
+     * \param offlineLimits Limits of the messages queued for offline users.
+     */
+    MessageServer(const uint16_t port, const std::string& nodeAddress = "",
+                  const std::vector<std::string>& peers = {},
+                  const OfflineQueues::Limits& offlineLimits = OfflineQueues::Limits());
+    virtual ~MessageServer();
 
 private:
+    static constexpr const char* LOG_DIRECTORY = "message_log";
+    static constexpr std::size_t LOG_SEGMENT_MAX_BYTES = 64 * 1024 * 1024;
+    static constexpr std::size_t LOG_MAX_BYTES = 1024 * 1024 * 1024;
+    static constexpr int64_t LOG_MAX_AGE_ms = 7 * 24 * 3600 * 1000LL;
+    static constexpr std::size_t REPLAY_MAX_BYTES = 256 * 1024;
+    std::chrono::milliseconds mLogFlushPeriod_ms = std::chrono::milliseconds(20);
+
+    static constexpr std::size_t OFFLINE_BATCH_BYTES = 64 * 1024;
+
+    static constexpr std::size_t TOPIC_MAX_LENGTH = 255;
+    static constexpr std::size_t MAX_TOPICS_PER_CLIENT = 256;
+
+    /** Excludes no client when relaying a message */
+    static constexpr ClientId NO_CLIENT = UINT64_MAX;
+
+    MessageLog mLog;
+    OfflineQueues mOfflineQueues;
+    TopicIndex mTopics;
+    std::unique_ptr<Cluster> mCluster;
+
     void onLogin(Client& client) override;
+    void onClientRemoved(User& user, ClientId clientId) override;
     void onMessageReceived(Client& client, const Message& message) override;
+    void getStatus(server::AdminStatus& status) override;
+
+    /**
+     * \brief Handle a POST_MSG message.
+     * \param client The client that posted the message.
+     * \param message POST_MSG message.
+     */
+    void handlePostMessage(Client& client, const Message& message);
+
+    /**
+     * \brief Build the POST_MSG frame relayed for a posted message. The posted payload is
+     *        copied once, into the frame shared by the log, the offline queues and the
+     *        recipients.
+     * \param sender Token of the sender.
+     * \param timestamp_ms Time of the message in milliseconds since epoch.
+     * \param message POST_MSG message received from the sender.
+     * \return The frame, or nullptr if it does not fit in a message.
+     */
+    static server::comm::SharedFrame buildPostFrame(const std::string& sender, int64_t timestamp_ms,
+                                                    const Message& message);
+
+    void sendMsgToOthers(const Message& msg, const Client& client);
+
+    /**
+     * \brief Send a serialized message to all the clients except one.
+     * \param frame Serialized message.
+     * \param except Id of the client that does not receive it, or NO_CLIENT.
+     */
+    void sendFrameToOthers(const std::vector<uint8_t>& frame, ClientId except);
+
+    /**
+     * \brief Send a serialized message to the subscribers of a topic except one.
+     * \param topic Topic name.
+     * \param frame Serialized message.
+     * \param except Id of the client that does not receive it, or NO_CLIENT.
+     */
+    void sendFrameToSubscribers(const std::string& topic, const std::vector<uint8_t>& frame,
+                                ClientId except);
+
+    /**
+     * \brief Relay a message forwarded by another node of the cluster to the local clients.
+     * \param frame Serialized message.
+     */
+    void handleForwarded(const server::comm::SharedFrame& frame);
+
+    /**
+     * \brief Handle a REQUEST_REPLAY message.
+     * \param client The client that requested the replay.
+     * \param message REQUEST_REPLAY message.
+     */
+    void handleRequestReplay(Client& client, const Message& message);
+
+    /**
+     * \brief Send a part of a replay without blocking the server loop. If the socket of the
+     *        client is full, the rest is sent in the next iterations of the server loop. The
+     *        part ends with REPLAY_END.
+     * \param token User token.
+     * \param clientId Client that requested the replay.
+     * \param offset Offset of the next message to send.
+     * \param maxBytes Maximum number of bytes left in the part.
+     */
+    void continueReplay(const std::string& token, ClientId clientId, uint64_t offset, std::size_t maxBytes);
+
+    /**
+     * \brief Send serialized messages to a client without waiting for room in its socket.
+     *        A message that was partially sent is completed, so the client only gets whole
+     *        messages.
+     * \param data Serialized messages.
+     * \param size Size of the messages in bytes.
+     * \param client Client.
+     * \return Number of bytes of the messages that were sent.
+     */
+    std::size_t sendWithoutBlocking(const uint8_t* data, std::size_t size, const Client& client);
+
+    /**
+     * \brief Handle a SUBSCRIBE or UNSUBSCRIBE message.
+     * \param client The client that sent the message.
+     * \param message SUBSCRIBE or UNSUBSCRIBE message.
+     */
+    void handleSubscription(Client& client, const Message& message);
+
+    /**
+     * \brief Handle a PUBLISH message.
+     * \param client The client that published the message.
+     * \param message PUBLISH message.
+     */
+    void handlePublish(Client& client, const Message& message);
+
+    /**
+     * \brief Read the topic name at the beginning of a payload, up to a null character or
+     *        the end of the payload.
+     * \param message Message.
+     * \param topic Output topic name.
+     * \return false if the name is empty or too long, true otherwise.
+     */
+    static bool parseTopic(const Message& message, std::string& topic);
+
+    /**
+     * \brief Send the next batch of messages queued while a user was offline, and schedule
+     *        the following batch in the next iteration of the server loop. If the client
+     *        left, they are delivered to another client of the user.
+     * \param token User token.
+     * \param clientId Client that logged in.
+     */
+    void deliverOfflineMessages(const std::string& token, ClientId clientId);
 
-    void handlePostMessage(const char* rcv_msg, Client& client);
-    void sendMsgToOthers(Message& msg, Client& client);
+    /**
+     * \brief Returns the current time in milliseconds since epoch.
+     */
+    static int64_t getCurrentTime_ms();
 };
 
 #endif  // _INCLUDE_MESSAGE_SERVER_MESSAGE_SERVER_HPP_
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_MESSAGE_SERVER_OFFLINE_QUEUES_HPP_
+#define _INCLUDE_MESSAGE_SERVER_OFFLINE_QUEUES_HPP_
+
+#include <cstdint>
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Communication.hpp"
+#include "MessageServer/MessageLog.hpp"
+
+/**
+ * \brief Messages relayed while users had no connected clients, to be delivered when
+ *        they log in again.
+ *
+ *        Every offline user receives the same messages, which are also in the message log.
+ *        So a queue is just the offset of the first message the user missed. The most
+ *        recent messages are kept once in memory and shared by all queues. Older messages
+ *        spill to the message log and are read back from it. Each queue is limited to the
+ *        last maxMessagesPerUser messages, and at most maxUsers users are queued: the users
+ *        that have been offline the longest are dropped first.
+ *
+ *        Not thread safe. Used from the server loop.
+ */
+class OfflineQueues final {
+public:
+    struct Limits {
+        std::size_t maxMemoryBytes = 16 * 1024 * 1024;  // Size of the messages kept in memory
+        std::size_t maxMessagesPerUser = 10000;         // Messages delivered to a user
+        std::size_t maxUsers = 100000;                  // Users with a queue
+    };
+
+    /**
+     * \param log Message log with all the relayed messages.
+     * \param limits Limits of the queues.
+     */
+    OfflineQueues(MessageLog& log, const Limits& limits);
+
+    /**
+     * \brief Start queueing messages for a user with no connected clients. If the user
+     *        still had messages to deliver, they are kept.
+     * \param user User token.
+     */
+    void addUser(const std::string& user);
+
+    /**
+     * \brief Stop queueing messages for a user that logged in. The messages queued so far
+     *        are delivered with drain(), and newer ones are sent to the user directly.
+     * \param user User token.
+     * \return true if there are messages to deliver, false otherwise. It is also false while
+     *         the messages are being delivered to another client of the user.
+     */
+    bool stopQueueing(const std::string& user);
+
+    /**
+     * \brief Keep a message that was appended to the log for the offline users.
+     * \param offset Offset of the message in the log.
+     * \param frame Serialized message. It is shared, not copied.
+     */
+    void push(uint64_t offset, const server::comm::SharedFrame& frame);
+
+    /**
+     * \brief Send the next batch of messages queued for a user after stopQueueing().
+     *        The queue is removed when it is empty.
+     * \param user User token.
+     * \param maxBytes Maximum size of the batch. At least one message is sent.
+     * \param sender Function that sends the serialized messages. The messages it does not
+     *        send because it would block are sent in the next batch.
+     * \return true if there are more messages queued, false otherwise.
+     */
+    bool drain(const std::string& user, std::size_t maxBytes, const MessageLog::Sender& sender);
+
+    /**
+     * \brief Returns the size of the messages kept in memory.
+     */
+    std::size_t getMemorySize() const;
+
+    /**
+     * \brief Returns the number of users with a queue.
+     */
+    std::size_t getNumUsers() const;
+
+private:
+    struct Queue {
+        uint64_t from;      // First message not delivered
+        uint64_t until;     // End of the queued messages
+    };
+
+    struct Entry {
+        uint64_t offset;
+        server::comm::SharedFrame frame;
+    };
+
+    MessageLog& mLog;
+    const Limits mLimits;
+
+    std::unordered_map<std::string, Queue> mQueues;
+
+    std::deque<Entry> mRecent;
+    std::size_t mRecentBytes = 0;
+    uint64_t mEndOffset;
+
+    /**
+     * \brief Drop the queues of the users that have been offline the longest to make room
+     *        for new ones. Queues being delivered are kept.
+     */
+    void dropOldestQueues();
+};
+
+#endif  // _INCLUDE_MESSAGE_SERVER_OFFLINE_QUEUES_HPP_
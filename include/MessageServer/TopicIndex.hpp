@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_MESSAGE_SERVER_TOPIC_INDEX_HPP_
+#define _INCLUDE_MESSAGE_SERVER_TOPIC_INDEX_HPP_
+
+#include <cstdint>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "net/Socket.hpp"
+
+/**
+ * \brief Subscriptions of clients to named topics.
+ *
+ *        Topics map to the connections of their subscribers, so a message is published
+ *        to a topic without going through the other clients. Each client also keeps the
+ *        list of its topics, to remove its subscriptions when it goes away. Subscribing,
+ *        unsubscribing and removing a client do not depend on the number of topics.
+ *
+ *        Not thread safe. Used from the server loop.
+ */
+class TopicIndex final {
+public:
+    using ClientId = uint64_t;
+    using Subscribers = std::unordered_map<ClientId, server::net::Connection>;
+
+    /**
+     * \param maxTopicsPerClient Maximum number of topics a client can subscribe to.
+     */
+    TopicIndex(std::size_t maxTopicsPerClient);
+
+    /**
+     * \brief Subscribe a client to a topic.
+     * \param topic Topic name.
+     * \param clientId Id of the client.
+     * \param connection Connection of the client.
+     * \return false if the client reached the maximum number of topics, true otherwise.
+     */
+    bool subscribe(const std::string& topic, ClientId clientId, const server::net::Connection& connection);
+
+    /**
+     * \brief Unsubscribe a client from a topic. Topics with no subscribers are removed.
+     * \param topic Topic name.
+     * \param clientId Id of the client.
+     * \return true if the client was subscribed to the topic, false otherwise.
+     */
+    bool unsubscribe(const std::string& topic, ClientId clientId);
+
+    /**
+     * \brief Unsubscribe a client from all its topics.
+     * \param clientId Id of the client.
+     * \return The topics that were left without subscribers.
+     */
+    std::vector<std::string> removeClient(ClientId clientId);
+
+    /**
+     * \brief Returns the subscribers of a topic, or nullptr if it has none.
+     * \param topic Topic name.
+     */
+    const Subscribers* getSubscribers(const std::string& topic) const;
+
+    /**
+     * \brief Returns the number of topics with subscribers.
+     */
+    std::size_t getNumTopics() const;
+
+private:
+    const std::size_t mMaxTopicsPerClient;
+
+    std::unordered_map<std::string, Subscribers> mTopics;
+    std::unordered_map<ClientId, std::vector<std::string>> mClientTopics;
+
+    /**
+     * \brief Remove a client from the subscribers of a topic, and the topic if it was the last.
+     */
+    void removeSubscriber(const std::string& topic, ClientId clientId);
+};
+
+#endif  // _INCLUDE_MESSAGE_SERVER_TOPIC_INDEX_HPP_
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_METRICS_HPP_
+#define _INCLUDE_METRICS_HPP_
+
+#include <cstdint>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "Communication.hpp"
+
+namespace server {
+
+/**
+ * \brief Latency histogram with buckets of logarithmic size, like HdrHistogram. Each
+ *        power of two is split in SUB_BUCKETS linear buckets, so a value is known with
+ *        a relative error below 1 / SUB_BUCKETS.
+ */
+struct HistogramSnapshot {
+    static constexpr unsigned SUB_BUCKET_BITS = 5;
+    static constexpr uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr unsigned MAX_VALUE_BITS = 40;     // About 18 minutes in nanoseconds
+    static constexpr std::size_t NUM_BUCKETS =
+        SUB_BUCKETS + (MAX_VALUE_BITS - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(NUM_BUCKETS, 0);
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    /**
+     * \brief Returns the bucket of a value. Values that are too large go to the last one.
+     */
+    static std::size_t getBucket(uint64_t value);
+
+    /**
+     * \brief Returns the highest value of a bucket.
+     */
+    static uint64_t getBucketLimit(std::size_t bucket);
+
+    /**
+     * \brief Returns the value below which a fraction of the values are, or 0 if empty.
+     * \param fraction Fraction between 0 and 1.
+     */
+    uint64_t getPercentile(double fraction) const;
+
+    void merge(const HistogramSnapshot& other);
+};
+
+/**
+ * \brief Server metrics.
+ *
+ *        Counters and timers are written without locks: each thread writes to its own
+ *        shard, which only it modifies, and reads add up the shards. A timer allocates its
+ *        histogram the first time a thread records a message type, and never again.
+ *        Gauges hold a current value, so they are single atomic values.
+ */
+class Metrics final {
+public:
+    enum Counter : unsigned {
+        CONNECTIONS_ACCEPTED,
+        LOGINS,
+        AUTH_FAILURES,
+        MESSAGES_IN,
+        INVALID_MESSAGES,
+        BYTES_IN,
+        BYTES_OUT,
+        DROPPED_FRAMES,
+        NUM_COUNTERS
+    };
+
+    enum Gauge : unsigned {
+        CONNECTIONS_LOGGED,
+        CONNECTIONS_UNLOGGED,
+        USERS,
+        COMPLETION_QUEUE,
+        DATABASE_QUEUE,
+        SEARCH_QUEUE,
+        NUM_GAUGES
+    };
+
+    enum Timer : unsigned {
+        HANDLER_TIME,       // Handling a message in the server loop
+        DATABASE_TIME,      // Running the queries of a message in the database executor
+        NUM_TIMERS
+    };
+
+    /** Message types with their own histogram. Higher types share one. */
+    static constexpr std::size_t NUM_TIMED_TYPES = 256;
+
+    /** Histograms by message type. Types from NUM_TIMED_TYPES on are under NUM_TIMED_TYPES. */
+    struct Snapshot {
+        std::array<uint64_t, NUM_COUNTERS> counters {};
+        std::array<int64_t, NUM_GAUGES> gauges {};
+        std::array<std::map<comm::MessageType, HistogramSnapshot>, NUM_TIMERS> timers;
+
+        void merge(const Snapshot& other);
+    };
+
+    static void increment(Counter counter, uint64_t value = 1);
+    static void set(Gauge gauge, int64_t value);
+
+    /**
+     * \brief Record a duration.
+     * \param timer Timer.
+     * \param type Type of the message the time was spent on.
+     * \param duration_ns Duration in nanoseconds.
+     */
+    static void record(Timer timer, comm::MessageType type, uint64_t duration_ns);
+
+    /**
+     * \brief Returns the nanoseconds elapsed since a time point. A helper for record().
+     */
+    static uint64_t getElapsed_ns(std::chrono::steady_clock::time_point start);
+
+    /**
+     * \brief Add up the shards of all the threads.
+     */
+    static Snapshot getSnapshot();
+
+    static const char* getName(Counter counter);
+    static const char* getName(Gauge gauge);
+    static const char* getName(Timer timer);
+
+private:
+    struct Histogram;
+    struct Shard;
+
+    // Shards are never freed, so that the counts of finished threads are kept
+    static std::mutex sShardsMutex;
+    static std::vector<Shard*> sShards;
+    static std::array<std::atomic<int64_t>, NUM_GAUGES> sGauges;
+
+    /**
+     * \brief Returns the shard of the calling thread, creating it the first time.
+     */
+    static Shard& getShard();
+};
+
+}  // namespace server
+
+#endif  // _INCLUDE_METRICS_HPP_
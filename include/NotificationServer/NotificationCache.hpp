@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_CACHE_HPP_
+#define _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_CACHE_HPP_
+
+#include <cstdint>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * \brief A cache of the encoded REQUEST_TASKS responses of each user.
+ *
+ *        Entries are the serialized messages ready to be sent to a client. The cache
+ *        is bounded in bytes and evicts the least recently used users first.
+ *        All functions can be called from any thread.
+ */
+class NotificationCache final {
+public:
+    using Frames = std::shared_ptr<const std::vector<uint8_t>>;
+
+    /**
+     * \param maxBytes Maximum size of all the cached entries.
+     * \param maxEntryBytes Maximum size of a single entry. Bigger responses are not cached.
+     */
+    NotificationCache(std::size_t maxBytes, std::size_t maxEntryBytes);
+
+    /**
+     * \brief Returns the cached response of a user, or nullptr if it is not cached.
+     * \param user User token.
+     */
+    Frames get(const std::string& user);
+
+    /**
+     * \brief Returns the current generation of the cache. Must be called before loading an
+     *        entry from the database and passed to put().
+     */
+    uint64_t getGeneration() const;
+
+    /**
+     * \brief Cache the response of a user. The entry is discarded if the cache was
+     *        invalidated after the given generation, because it may hold stale data.
+     * \param user User token.
+     * \param frames Encoded response.
+     * \param generation Generation of the cache when the entry started to load.
+     */
+    void put(const std::string& user, Frames frames, uint64_t generation);
+
+    /**
+     * \brief Remove the entry of a user.
+     * \param user User token.
+     */
+    void invalidate(const std::string& user);
+
+    /**
+     * \brief Remove all entries.
+     */
+    void clear();
+
+    /**
+     * \brief Returns the size of all the cached entries in bytes.
+     */
+    std::size_t getSize() const;
+
+private:
+    struct Entry {
+        std::string user;
+        Frames frames;
+    };
+
+    const std::size_t mMaxBytes;
+    const std::size_t mMaxEntryBytes;
+
+    mutable std::mutex mMutex;
+    std::list<Entry> mEntries;  // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> mIndex;
+    std::size_t mSize = 0;
+    uint64_t mGeneration = 0;
+
+    void erase(std::list<Entry>::iterator entry);
+};
+
+#endif  // _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_CACHE_HPP_
@@ -18,13 +18,18 @@
 #ifndef _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_DATABASE_HPP_
 #define _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_DATABASE_HPP_
 
+#include <climits>
 #include <cstdint>
 
+#include <functional>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include <sqlite3.h>
 
 #include "Database.hpp"
+#include "NotificationServer/NotificationScheduler.hpp"
 
 struct Notification {
     int64_t id;
@@ -32,19 +37,193 @@ struct Notification {
     std::string title;
     std::string description;
     std::string schedule;
+    int64_t version = 0;    // Change version of the last write to this notification
+};
+
+/**
+ * \brief A notification read from the database. The texts point into the current row
+ *        of the query and are only valid while the row is visited.
+ */
+struct NotificationView {
+    int64_t id;
+    bool active;
+    std::string_view title;
+    std::string_view description;
+    std::string_view schedule;
+    int64_t version;
+};
+
+/**
+ * \brief Filters and page of a query for the notifications of a user.
+ *
+ *        Without sinceVersion notifications are sorted by id and afterId is the keyset
+ *        cursor. With sinceVersion only the notifications that changed after that version
+ *        are returned, including deactivated ones, sorted by version.
+ */
+struct NotificationQuery {
+    int64_t sinceVersion = 0;       // Modified-since filter. 0 to disable it.
+    int64_t afterId = INT64_MIN;    // Only notifications with a bigger id
+    int limit = -1;                 // Maximum number of notifications. -1 for no limit.
+    bool includeInactive = false;   // Also return deactivated notifications
+};
+
+/**
+ * \brief Page of a full-text search. Results are sorted by relevance.
+ */
+struct NotificationSearch {
+    int limit = 20;                 // Maximum number of notifications
+    int offset = 0;                 // Number of results to skip
+    bool includeInactive = false;   // Also return deactivated notifications
+};
+
+struct NotificationChange {
+    std::string user;
+    Notification notification;
 };
 
 class NotificationDatabase : public server::Database {
 public:
+    /** Function called after the notifications of a user change */
+    using ChangeListener = std::function<void(const std::string& user)>;
+
+    /** Function called for each row of a query. Returns false to stop the query. */
+    using Visitor = std::function<bool(const NotificationView& notification)>;
+
     void init() override;
 
-    std::vector<Notification> getNotificationsFromUser(std::string userToken);
+    /**
+     * \brief Visit the notifications of a user that match a query without copying them.
+     * \param user User token.
+     * \param query Filters and page.
+     * \param visitor Function called for each notification.
+     */
+    void forEachNotification(const std::string& user, const NotificationQuery& query, const Visitor& visitor);
+
+    /**
+     * \brief Visit the notifications of a user whose title or description contain all the
+     *        words of a text, the last one as a prefix, from the most to the least relevant.
+     * \param user User token.
+     * \param text Words to search.
+     * \param search Page of the results.
+     * \param visitor Function called for each notification.
+     */
+    void searchNotifications(const std::string& user, const std::string& text,
+                             const NotificationSearch& search, const Visitor& visitor);
+
+    /**
+     * \brief Get the changes to the notifications of all users after a version,
+     *        sorted by version.
+     * \param sinceVersion Version of the last change already processed.
+     * \param limit Maximum number of changes.
+     */
+    std::vector<NotificationChange> getChangesSince(int64_t sinceVersion, int limit);
+
+    /**
+     * \brief Get a notification by its id.
+     * \param id Notification id.
+     * \param change Output for the notification and its user.
+     * \return true if the notification exists, false otherwise.
+     */
+    bool getNotification(int64_t id, NotificationChange& change);
+
+    /**
+     * \brief Get the schedules of all active notifications.
+     */
+    std::vector<NotificationScheduler::ScheduledNotification> getActiveSchedules();
+
+    /**
+     * \brief Returns the version of the last change to any notification.
+     */
+    int64_t getClockVersion();
+
+    /**
+     * \brief Returns the version of the last change to the notifications of a user.
+     * \param user User token.
+     */
+    int64_t getUserVersion(const std::string& user);
+
+    /**
+     * \brief Insert a notification, or update it if it already exists. The user a
+     *        notification belongs to cannot change. Saving a notification that did not
+     *        change keeps its version.
+     * \param user User token.
+     * \param notification Notification.
+     * \return true if the notification was saved, false otherwise.
+     */
+    bool saveNotification(const std::string& user, const Notification& notification);
+
+    /**
+     * \brief Insert or update a batch of notifications in a single transaction. Notifications
+     *        that belong to another user are skipped, and the ones that did not change are
+     *        counted as saved but keep their version. The change listener is called once for
+     *        each user with changes after the transaction commits.
+     * \param changes Notifications and the users they belong to.
+     * \return Number of notifications saved, or -1 if the transaction failed and nothing was saved.
+     */
+    int saveNotifications(const std::vector<NotificationChange>& changes);
+
+    /**
+     * \brief Set the function called after a change is written through this database.
+     *        It is called in the thread that wrote the change.
+     * \param listener Change listener.
+     */
+    void setChangeListener(ChangeListener listener);
+
+    /**
+     * \brief Check whether another connection to the database file, like an external
+     *        script, has committed changes since the last call.
+     * \return true if the database was changed externally, false otherwise.
+     */
+    bool hasExternalChanges();
 
 private:
     /**
-     * \brief Create table of registered users
+     * \brief Create table of notifications and its indexes
      */
     void createNotificationTable();
+
+    /**
+     * \brief Run a query whose columns are id, active, title, description, schedule and
+     *        version, and visit its rows. Resets the statement.
+     * \param stmt Prepared statement with its parameters bound.
+     * \param visitor Function called for each row.
+     */
+    void visitRows(sqlite3_stmt* stmt, const Visitor& visitor);
+
+    /**
+     * \brief Build an FTS5 query that matches the words of a text in the notifications of a user.
+     * \param user User token.
+     * \param text Words to search.
+     * \return The query, or an empty string if the text has no words.
+     */
+    static std::string buildMatchExpression(const std::string& user, const std::string& text);
+
+    enum UpsertResult {
+        UPSERT_ERROR,
+        UPSERT_SAVED,       // Inserted or updated with the new version
+        UPSERT_UNCHANGED,   // Already saved as it is. It keeps its version.
+        UPSERT_OTHER_USER,  // Belongs to another user. Not saved.
+    };
+
+    /**
+     * \brief Insert a notification, or update it if it belongs to the same user and
+     *        changed. Must be called in a transaction.
+     * \param user User token.
+     * \param notification Notification.
+     * \param version Change version of the write.
+     */
+    UpsertResult upsertNotification(const std::string& user, const Notification& notification,
+                                    int64_t version);
+
+    /**
+     * \brief Set the version of the last change to any notification.
+     * \param version Change version.
+     * \return true if the version was set, false otherwise.
+     */
+    bool setClockVersion(int64_t version);
+
+    ChangeListener mChangeListener;
+    int64_t mDataVersion = 0;
 };
 
 #endif  // _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_DATABASE_HPP_
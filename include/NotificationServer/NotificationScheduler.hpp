@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_SCHEDULER_HPP_
+#define _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_SCHEDULER_HPP_
+
+#include <cstdint>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "NotificationServer/Schedule.hpp"
+
+/**
+ * \brief Keeps the next fire time of every scheduled notification and reports the
+ *        notifications that become due.
+ *
+ *        Fire times are kept in a binary min-heap, so scheduling and firing take
+ *        O(log n). Updated or cancelled notifications leave their old heap entries
+ *        behind, which are skipped when they reach the top.
+ */
+class NotificationScheduler final {
+public:
+    struct DueNotification {
+        int64_t id;
+        std::string user;
+        int64_t fireTime;
+    };
+
+    struct ScheduledNotification {
+        int64_t id;
+        std::string user;
+        std::string schedule;
+    };
+
+    /** Function called in the scheduler thread with the notifications that became due */
+    using DueListener = std::function<void(std::vector<DueNotification>& due)>;
+
+    NotificationScheduler(DueListener listener);
+    ~NotificationScheduler();
+
+    /**
+     * \brief Replace all the scheduled notifications. The heap is built in O(n).
+     * \param notifications Active notifications.
+     */
+    void rebuild(const std::vector<ScheduledNotification>& notifications);
+
+    /**
+     * \brief Schedule a notification, or reschedule it if it was already scheduled.
+     *        Notifications with an invalid schedule or that do not fire again are cancelled.
+     * \param id Notification id.
+     * \param user User token.
+     * \param schedule Schedule expression.
+     */
+    void schedule(int64_t id, const std::string& user, const std::string& schedule);
+
+    /**
+     * \brief Cancel a scheduled notification.
+     * \param id Notification id.
+     */
+    void cancel(int64_t id);
+
+    /**
+     * \brief Returns the number of scheduled notifications.
+     */
+    std::size_t getNumScheduled() const;
+
+private:
+    friend class NotificationSchedulerTest;
+
+    struct HeapEntry {
+        int64_t fireTime;
+        int64_t id;
+        uint32_t generation;
+
+        bool operator>(const HeapEntry& other) const {
+            return fireTime > other.fireTime;
+        }
+    };
+
+    struct Slot {
+        std::string user;
+        Schedule schedule;
+        uint32_t generation;
+    };
+
+    static constexpr std::size_t MAX_DUE_BATCH = 1024;
+
+    DueListener mListener;
+
+    mutable std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::vector<HeapEntry> mHeap;
+    std::unordered_map<int64_t, Slot> mSlots;
+    uint32_t mNextGeneration = 0;
+    bool mRunning = true;
+
+    std::thread mThread;
+
+    /**
+     * \brief Scheduler thread loop.
+     */
+    void loop();
+
+    /**
+     * \brief Pop the due entries from the heap and push the next occurrences of
+     *        recurrent notifications. Must be called with mMutex locked.
+     * \param now Current time.
+     * \param due Output for the due notifications.
+     */
+    void popDue(int64_t now, std::vector<DueNotification>& due);
+
+    /**
+     * \brief Report the notifications due at a time to the listener. Called by the
+     *        scheduler thread, and by the tests to drive the time.
+     * \param now Current time.
+     */
+    void fireDue(int64_t now);
+
+    /**
+     * \brief Drop the stale entries when they take most of the heap, so cancelled and
+     *        rescheduled notifications do not make it grow. Must be called with mMutex locked.
+     */
+    void compactHeap();
+
+    /**
+     * \brief Returns true if a heap entry belongs to the current schedule of its notification.
+     */
+    bool isCurrent(const HeapEntry& entry) const;
+
+    /**
+     * \brief Returns the current time in seconds from epoch.
+     */
+    static int64_t getCurrentTime();
+};
+
+#endif  // _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_SCHEDULER_HPP_
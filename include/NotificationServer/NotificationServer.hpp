@@ -18,7 +18,15 @@
 #ifndef _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_SERVER_HPP_
 #define _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_SERVER_HPP_
 
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "NotificationServer/NotificationCache.hpp"
 #include "NotificationServer/NotificationDatabase.hpp"
+#include "NotificationServer/NotificationScheduler.hpp"
 
 #include "Server.hpp"
 
@@ -29,20 +37,192 @@
 class NotificationServer final : public server::Server {
 public:
     NotificationServer(const uint16_t port);
-    virtual ~NotificationServer() = default;
+    virtual ~NotificationServer();
 
+    /**
+     * REQUEST_TASKS without payload is answered with the active notifications of the user
+     * as RESPONSE_TASKS messages followed by OK.
+     * REQUEST_TASKS with a JSON payload is answered with RESPONSE_TASKS messages followed by
+     * RESPONSE_TASKS_END {"version": version, "next": cursor}. All fields are optional:
+     *   - "since": version. Only the notifications that changed after that version, including
+     *     deactivated ones, sorted by version. Otherwise notifications are sorted by id.
+     *   - "limit": maximum number of notifications, up to MAX_PAGE_SIZE.
+     *   - "after": id. Only the notifications with a bigger id.
+     *   - "all": true to include deactivated notifications.
+     * "version" is the version to sync from next time, and "next" is only present when there
+     * are more notifications: pass it as "after", or as "since" when syncing.
+     * NOTIFICATION_CHANGED is pushed to the logged clients of a user when one of their
+     * notifications is written, with the same payload as RESPONSE_TASKS.
+     * NOTIFICATION_DUE is pushed to the logged clients of a user when the schedule of
+     * one of their active notifications fires, with the same payload as RESPONSE_TASKS.
+     * SEARCH_TASKS with a JSON payload {"query": text, "limit": n, "offset": n, "all": bool}
+     * is answered with the notifications whose title or description contain all the words
+     * of the text, sorted by relevance, as RESPONSE_SEARCH messages with the same payload as
+     * RESPONSE_TASKS, followed by RESPONSE_SEARCH_END {"next": offset}. "next" is only present
+     * when there are more results.
+     */
     enum MessageTypes : server::comm::MessageType {
-        REQUEST_TASKS  = 0x10,
-        RESPONSE_TASKS = 0x11,
+        REQUEST_TASKS           = 0x10,
+        RESPONSE_TASKS          = 0x11,
+        RESPONSE_TASKS_END      = 0x12,
+        NOTIFICATION_CHANGED    = 0x13,
+        NOTIFICATION_DUE        = 0x14,
+        SEARCH_TASKS            = 0x15,
+        RESPONSE_SEARCH         = 0x16,
+        RESPONSE_SEARCH_END     = 0x17,
     };
 
 private:
+    /** Measures the encoding of notifications */
+    friend class NotificationServerBenchmark;
+
     void onLogin(Client& client) override;
     void onMessageReceived(Client& client, const server::comm::Message& message) override;
+    void getStatus(server::AdminStatus& status) override;
+
+    static constexpr std::size_t CACHE_MAX_BYTES = 64 * 1024 * 1024;
+    static constexpr std::size_t CACHE_MAX_ENTRY_BYTES = 256 * 1024;
+    static constexpr std::size_t STREAM_CHUNK_BYTES = CACHE_MAX_ENTRY_BYTES;
+    static constexpr int FEED_BATCH_SIZE = 1000;
+    static constexpr int MAX_PAGE_SIZE = 1000;
+    std::chrono::milliseconds mExternalChangesPeriod_ms = std::chrono::milliseconds(1000);
+
+    /** Version of the last change pushed to the clients. Only used in the database executor. */
+    int64_t mFeedVersion = 0;
 
     NotificationDatabase mNotificationDb;
 
-    void sendNotification(const Notification& notification, Client& client);
+    /**
+     * Searches can take long, so they run in an executor of their own on a read-only
+     * connection, and logins and syncs do not wait for them. If the connection can't be
+     * opened they run in the database executor.
+     */
+    NotificationDatabase mSearchDb;
+    bool mHasSearchDb = false;
+    server::DatabaseExecutor mSearchExecutor;
+
+    NotificationCache mCache;
+    NotificationScheduler mScheduler;
+
+    /** Clients that receive the response to a query */
+    using Recipients = std::shared_ptr<std::vector<ClientId>>;
+
+    /**
+     * Clients waiting for the notifications of a user. Requests from the same user that
+     * arrive before a query starts to send its response are answered by that query.
+     */
+    std::unordered_map<std::string, Recipients> mPendingTaskRequests;
+
+    /**
+     * \brief Handle a REQUEST_TASKS message.
+     * \param client The client that requested the tasks.
+     */
+    void handleRequestTasks(Client& client);
+
+    /**
+     * \brief Handle a REQUEST_TASKS message with query parameters.
+     * \param client The client that requested the tasks.
+     * \param query Filters and page.
+     */
+    void handleQueryTasks(Client& client, const NotificationQuery& query);
+
+    /**
+     * \brief Read and encode the active notifications of a user followed by OK, and deliver
+     *        them in chunks. Must be called in the database executor.
+     * \param token User token.
+     * \param recipients Clients that receive the response.
+     * \param generation Generation of the cache when the request was received.
+     */
+    void streamTasks(const std::string& token, const Recipients& recipients, uint64_t generation);
+
+    /**
+     * \brief Read and encode the notifications of a user that match a query followed by
+     *        RESPONSE_TASKS_END, and deliver them in chunks. Must be called in the database
+     *        executor.
+     * \param token User token.
+     * \param recipients Clients that receive the response.
+     * \param query Filters and page.
+     */
+    void streamQuery(const std::string& token, const Recipients& recipients, const NotificationQuery& query);
+
+    /**
+     * \brief Handle a SEARCH_TASKS message.
+     * \param client The client that requested the search.
+     * \param text Words to search.
+     * \param search Page of the results.
+     */
+    void handleSearchTasks(Client& client, const std::string& text, const NotificationSearch& search);
+
+    /**
+     * \brief Search the notifications of a user and deliver the results followed by
+     *        RESPONSE_SEARCH_END. Must be called in the executor of the database.
+     * \param database Database to search.
+     * \param token User token.
+     * \param recipients Clients that receive the response.
+     * \param text Words to search.
+     * \param search Page of the results.
+     */
+    void streamSearch(NotificationDatabase& database, const std::string& token,
+                      const Recipients& recipients, const std::string& text,
+                      const NotificationSearch& search);
+
+    /**
+     * \brief Send a chunk of a response from the server loop.
+     * \param token User token.
+     * \param recipients Clients that receive the response.
+     * \param frames Chunk of the response.
+     */
+    void deliverTasks(const std::string& token, const Recipients& recipients,
+                      const NotificationCache::Frames& frames);
+
+    /**
+     * \brief Parse the payload of a REQUEST_TASKS message.
+     * \param message REQUEST_TASKS message.
+     * \param query Output for the query parameters.
+     * \return true if the message has query parameters, false for a plain request.
+     */
+    static bool parseTasksRequest(const server::comm::Message& message, NotificationQuery& query);
+
+    /**
+     * \brief Parse the payload of a SEARCH_TASKS message.
+     * \param message SEARCH_TASKS message.
+     * \param text Output for the words to search.
+     * \param search Output for the page of the results.
+     * \return true if the payload is valid, false otherwise.
+     */
+    static bool parseSearchRequest(const server::comm::Message& message, std::string& text,
+                                   NotificationSearch& search);
+
+    /**
+     * \brief Read the changes that were not pushed yet and deliver them to the server loop.
+     *        Must be called in the database executor.
+     */
+    void publishChanges();
+
+    /**
+     * \brief Push notifications to the logged clients of their users.
+     * \param changes Notifications and their users.
+     * \param type Type of the pushed messages.
+     */
+    void pushToUsers(const std::vector<NotificationChange>& changes, server::comm::MessageType type);
+
+    /**
+     * \brief Load the notifications that became due and push them to their users.
+     *        Called in the scheduler thread.
+     * \param due Due notifications.
+     */
+    void onNotificationsDue(std::vector<NotificationScheduler::DueNotification>& due);
+
+    /**
+     * \brief Encode a notification as JSON and append it to a buffer as a message.
+     * \param notification Notification.
+     * \param frames Buffer.
+     * \param type Type of the message.
+     */
+    static void encodeNotification(const NotificationView& notification, std::vector<uint8_t>& frames,
+                                   server::comm::MessageType type = RESPONSE_TASKS);
+
+    static void appendJsonString(std::string& json, std::string_view str);
 };
 
 #endif  // _INCLUDE_NOTIFICATION_SERVER_NOTIFICATION_SERVER_HPP_
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_NOTIFICATION_SERVER_SCHEDULE_HPP_
+#define _INCLUDE_NOTIFICATION_SERVER_SCHEDULE_HPP_
+
+#include <cstdint>
+
+#include <string>
+
+/**
+ * \brief A parsed notification schedule.
+ *
+ *        A schedule is either a one-shot time or a cron-like recurrence, both in UTC:
+ *        - One-shot: seconds since epoch ("1600000000") or an ISO 8601 date and time
+ *          ("2020-09-13T12:26:40", optionally with seconds and a trailing 'Z').
+ *        - Recurrence: five cron fields "minute hour day-of-month month day-of-week".
+ *          Each field accepts '*', numbers, ranges "a-b", comma-separated lists and a
+ *          step "/n" after '*' or a range. Day of week goes from 0 (Sunday) to 7 (Sunday).
+ *          As in cron, if both days are restricted a day matches if either does.
+ *
+ *        Recurrences are stored as bit sets, so a schedule takes a few bytes.
+ */
+class Schedule final {
+public:
+    static constexpr int64_t NEVER = -1;
+
+    /**
+     * \brief Parse a schedule expression.
+     * \param expression Schedule expression.
+     * \param schedule Output schedule.
+     * \return true if the expression is valid, false otherwise.
+     */
+    static bool parse(const std::string& expression, Schedule& schedule);
+
+    /**
+     * \brief Returns the first fire time strictly after a given time.
+     * \param after Time in seconds from epoch.
+     * \return Fire time in seconds from epoch, or NEVER if the schedule does not fire again.
+     */
+    int64_t nextFireTime(int64_t after) const;
+
+    /**
+     * \brief Returns true if the schedule fires more than once.
+     */
+    bool isRecurrent() const;
+
+private:
+    enum class Kind : uint8_t {
+        ONCE,
+        CRON,
+    };
+
+    Kind mKind = Kind::ONCE;
+    int64_t mTime = NEVER;
+
+    uint64_t mMinutes = 0;      // Bits 0-59
+    uint32_t mHours = 0;        // Bits 0-23
+    uint32_t mDaysOfMonth = 0;  // Bits 1-31
+    uint16_t mMonths = 0;       // Bits 1-12
+    uint8_t mDaysOfWeek = 0;    // Bits 0-6
+    bool mDayOfMonthRestricted = false;
+    bool mDayOfWeekRestricted = false;
+
+    static bool parseOnce(const std::string& expression, Schedule& schedule);
+    static bool parseCron(const std::string& expression, Schedule& schedule);
+    static bool parseField(const std::string& field, int min, int max, uint64_t& bits);
+
+    bool matchesDay(int dayOfMonth, int dayOfWeek) const;
+};
+
+#endif  // _INCLUDE_NOTIFICATION_SERVER_SCHEDULE_HPP_
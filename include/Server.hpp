@@ -21,14 +21,23 @@
 #include <cstdint>
 #include <cstring>
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 
+#include "AdminServer.hpp"
+#include "Capture.hpp"
 #include "Communication.hpp"
 #include "Database.hpp"
+#include "DatabaseExecutor.hpp"
+#include "Metrics.hpp"
 #include "net/Socket.hpp"
+#include "Tracing.hpp"
 
 /** Server classes */
 namespace server {
@@ -42,29 +51,77 @@ static constexpr uint16_t BUFFER_SIZE = 1536;
 class Server {
 public:
     Server(std::string serverName, const uint16_t port, bool requireAuth = false);
-    virtual ~Server() = default;
+    virtual ~Server();
 
+    /**
+     * \brief Accept connections and handle their messages until stop() is called.
+     */
     void run();
+
+    /**
+     * \brief Make run() return. Can be called from any thread.
+     */
+    void stop();
+
     std::string getName() const;
 
+    /**
+     * \brief Serve the admin endpoint on a port while the server runs.
+     *        Must be called before run().
+     * \param port Admin port, or 0 to disable it.
+     * \param address Address the admin endpoint listens on. Only local by default.
+     */
+    void setAdminPort(uint16_t port, const std::string& address = AdminServer::DEFAULT_ADDRESS);
+
+    /**
+     * \brief Accept the connections from an acceptor instead of listening on the port,
+     *        such as a net::LoopbackAcceptor. Must be called before run().
+     * \param acceptor Acceptor.
+     */
+    void setAcceptor(std::unique_ptr<net::Acceptor> acceptor);
+
+    /**
+     * \brief Capture the frames received from the clients and the sizes of the responses
+     *        to a file, to replay them with TrafficReplay. Must be called before run().
+     * \param path Capture file. It is overwritten.
+     * \return false if the file can't be written, true otherwise.
+     */
+    bool setCaptureFile(const std::string& path);
+
+    /**
+     * \brief Add a connection as an unlogged client, as if it had been accepted.
+     *        Can be called from any thread.
+     * \param connection Connection.
+     */
+    void addConnection(const net::Connection& connection);
+
+    /**
+     * \brief Run the completions and read a message from each client once, as the loop of
+     *        run() does in each period. Lets tests and benchmarks drive a server that is
+     *        not running, with connections added with addConnection().
+     */
+    void step();
+
 protected:
     using BufferSize = uint16_t;
+    using ClientId = uint64_t;
 
     struct User;
     struct Client;
 
     struct Client final {
         net::Connection connection;
+        ClientId id;
         int64_t lastActiveTime;
         User* user = nullptr;
 
-        Client(const net::Connection connection, User* user)
-        :   connection(connection), user(user)
+        Client(const net::Connection connection, ClientId id, User* user)
+        :   connection(connection), id(id), user(user)
         {
             refreshTime();
         }
 
-        Client(const net::Connection connection) : Client(connection, nullptr) { }
+        Client(const net::Connection connection, ClientId id) : Client(connection, id, nullptr) { }
 
         void refreshTime() {
             lastActiveTime = getCurrentTime();
@@ -98,6 +155,13 @@ protected:
      */
     virtual void onLogin(Client& client) = 0;
 
+    /**
+     * \brief Called after a logged client disconnects, logs out or times out.
+     * \param user The user of the client. It has no clients left if this was the last one.
+     * \param clientId Id of the removed client.
+     */
+    virtual void onClientRemoved(User& user, ClientId clientId);
+
     /**
      * \brief Called when a message is received.
      * \param client The client that sent the message.
@@ -105,6 +169,14 @@ protected:
      */
     virtual void onMessageReceived(Client& client, const comm::Message& message) = 0;
 
+    /**
+     * \brief Called in the server loop to fill the status shown by the admin endpoint.
+     *        Implementations add their configuration and queue sizes after calling this.
+     *        It must only copy values, since it delays the clients.
+     * \param status Output status.
+     */
+    virtual void getStatus(AdminStatus& status);
+
     /**
      * \brief Send message to a client
      * \param message Message
@@ -112,28 +184,162 @@ protected:
      */
     virtual void sendMessage(const comm::Message& message, const Client& client);
 
+    /**
+     * \brief Send a buffer of serialized messages to a client in a single write.
+     * \param frames Serialized messages.
+     * \param client Client.
+     */
+    void sendFrames(const std::vector<uint8_t>& frames, const Client& client);
+
+    /**
+     * \brief Send serialized messages to a client and account for them in the metrics, the
+     *        traces and the capture. All the sends to the clients go through it.
+     * \param data Serialized messages.
+     * \param size Size of the messages in bytes.
+     * \param clientId Id of the client.
+     * \param connection Connection of the client.
+     * \param flags Flags of send(), in addition to MSG_NOSIGNAL.
+     * \return Number of bytes sent, or -1 on error.
+     */
+    ssize_t sendRaw(const uint8_t* data, std::size_t size, ClientId clientId,
+                    const net::Connection& connection, int flags = 0);
+
+    ssize_t sendRaw(const uint8_t* data, std::size_t size, const Client& client, int flags = 0) {
+        return sendRaw(data, size, client.id, client.connection, flags);
+    }
+
+    /**
+     * \brief Run a query in the database executor and deliver its result back into the
+     *        server loop, where it is safe to access users and clients.
+     * \param query Function run in the database executor thread.
+     * \param onComplete Function called in the server loop with the result of the query.
+     */
+    template <typename Result>
+    void queryAsync(std::function<Result()> query, std::function<void(Result&)> onComplete) {
+        postQuery(mDbExecutor, [this, query, onComplete]() {
+            std::shared_ptr<Result> result = std::make_shared<Result>(query());
+            postQueryCompletion([result, onComplete]() {
+                onComplete(*result);
+            });
+        });
+    }
+
+    /**
+     * \brief Run a job in a database executor, charging its time and trace to the message
+     *        being handled. For the jobs that deliver their results themselves, like streams,
+     *        with postQueryCompletion().
+     * \param executor Executor that runs the job.
+     * \param job Function run in the executor thread.
+     */
+    void postQuery(DatabaseExecutor& executor, std::function<void()> job);
+
+    /**
+     * \brief Queue a function to be called in the server loop from a job of postQuery(),
+     *        tracing it as a completion of the message that posted the job. Queries made
+     *        by the function are charged to the same message.
+     * \param completion Function.
+     */
+    void postQueryCompletion(std::function<void()> completion);
+
+    /**
+     * \brief Queue a function to be called in the server loop.
+     *        This function can be called from any thread.
+     * \param completion Function.
+     */
+    void postCompletion(std::function<void()> completion);
+
+    /**
+     * \brief Find a logged user by its token.
+     * \param token User token.
+     * \return A pointer to the user, or nullptr if the user is not logged.
+     */
+    User* findUser(const std::string& token);
+
+    /**
+     * \brief Find a logged client.
+     * \param token User token.
+     * \param id Id of the client.
+     * \return A pointer to the client, or nullptr if it is no longer connected.
+     */
+    Client* findClient(const std::string& token, ClientId id);
+
     std::vector<User> mUsers;
     std::vector<Client> mUnloggedConnections;
     std::mutex mUserMutex;
 
+    DatabaseExecutor mDbExecutor;
+
 private:
+    /** Measures the login path without a connection */
+    friend class ServerBenchmark;
+
     static constexpr unsigned int MAX_UNLOGGED_CONNECTIONS = 50;
     std::chrono::seconds mRemoveIdlePeriod_sec = std::chrono::seconds(10);
     std::chrono::seconds mUnloggedClientMaxIdleTimeout_sec = std::chrono::seconds(30);
     std::chrono::seconds mLoggedClientMaxIdleTimeout_sec = std::chrono::seconds(10);
     std::chrono::milliseconds mHandleMessagesPeriod_ms = std::chrono::milliseconds(5);
+    std::chrono::milliseconds mAdminStatusTimeout_ms = std::chrono::milliseconds(1000);
 
     const bool mRequireAuthentication;
 
     Database mDatabase;
 
     std::string mServerName;
-    volatile bool mRunning = false;
+    std::atomic<bool> mRunning {false};
 
-    net::ServerSocket mServerSocket;
+    // Wakes up the threads of run() when it stops
+    std::mutex mStopMutex;
+    std::condition_variable mStopCondition;
+
+    const uint16_t mPort;
+    std::unique_ptr<net::Acceptor> mAcceptor;
+
+    uint16_t mAdminPort = 0;
+    std::string mAdminAddress = AdminServer::DEFAULT_ADDRESS;
+    std::unique_ptr<AdminServer> mAdminServer;
+
+    std::unique_ptr<Capture> mCapture;
 
     uint8_t mMessageBuffer[BUFFER_SIZE];
 
+    ClientId mNextClientId = 0;
+
+    /** Message being handled and its client, to time and trace the queries it runs */
+    static constexpr comm::MessageType NO_MESSAGE_TYPE = UINT16_MAX;
+    comm::MessageType mCurrentMessageType = NO_MESSAGE_TYPE;
+    ClientId mCurrentClientId = Tracing::NO_CLIENT;
+
+    /** Message and client of the job of postQuery() running in an executor thread */
+    static thread_local comm::MessageType sQueryMessageType;
+    static thread_local ClientId sQueryClientId;
+
+    std::mutex mCompletionMutex;
+    std::vector<std::function<void()>> mCompletions;
+
+    /**
+     * \brief Get the status for the admin endpoint from the server loop.
+     *        Called from the admin thread.
+     * \param status Output status.
+     * \return false if the server loop did not answer in time, true otherwise.
+     */
+    bool collectStatus(AdminStatus& status);
+
+    /**
+     * \brief Wait while the server is running.
+     * \param duration Maximum time to wait.
+     * \return true if the server is still running, false otherwise.
+     */
+    template <typename Duration>
+    bool waitWhileRunning(Duration duration) {
+        std::unique_lock<std::mutex> lock(mStopMutex);
+        return !mStopCondition.wait_for(lock, duration, [this]() { return !mRunning; });
+    }
+
+    /**
+     * \brief Run the completions posted to the server loop.
+     */
+    void runCompletions();
+
     /**
      * \brief Removes idle clients from the server.
      *        An client is considered idle when no messages are received from it in a
@@ -146,6 +352,12 @@ private:
      */
     void removeUnloggedUsers();
 
+    /**
+     * \brief Point the clients back to their users after mUsers was reallocated or
+     *        users were moved by an erase.
+     */
+    void relinkUsers();
+
     /**
      * \brief Read incoming messages from logged and unlogged clients and handle them.
      *        Messages coming from logged clients are relayed to the server implementation using
@@ -182,6 +394,29 @@ private:
      */
     bool tryToLogin(std::string token, Client& client);
 
+    /**
+     * \brief Called in the server loop when the authentication of a login request that was
+     *        run in the database executor finishes.
+     * \param token User token.
+     * \param clientId Id of the unlogged client that sent the login request.
+     * \param authenticated Result of the authentication.
+     */
+    void onLoginAuthenticated(const std::string& token, ClientId clientId, bool authenticated);
+
+    /**
+     * \brief Add an authenticated client to the list of users.
+     * \param token User token.
+     * \param client The client that sent the login request.
+     */
+    void loginUser(const std::string& token, Client& client);
+
+    /**
+     * \brief Reply to a login request with an error.
+     * \param token User token.
+     * \param client The client that sent the login request.
+     */
+    void rejectLogin(const std::string& token, const Client& client);
+
     /**
      * \brief Returns the current time.
      * \return Current timestamp in seconds from epoch.
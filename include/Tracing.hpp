@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_TRACING_HPP_
+#define _INCLUDE_TRACING_HPP_
+
+#include <sys/types.h>
+
+#include <cstdint>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Communication.hpp"
+
+namespace server {
+
+/**
+ * \brief Traces of the stages each message goes through, to find where the time of slow
+ *        messages went.
+ *
+ *        Each thread records its events in a ring of its own, without locks, so only
+ *        the last RING_SIZE events of each thread are kept. getChromeTrace() reads the
+ *        rings of all the threads in the Chrome trace event format, which can be opened
+ *        in chrome://tracing or Perfetto.
+ */
+class Tracing final {
+public:
+    enum Stage : uint8_t {
+        DECODE,         // Parsing a message, from the time it was read
+        HANDLER,        // Handling a message in the server loop
+        DB_QUEUED,      // Query posted to the database executor
+        AUTHENTICATE,   // Authenticating a login in the database executor
+        DATABASE,       // Running a query in the database executor
+        COMPLETION,     // Handling the result of a query in the server loop
+        SEND,           // Writing to a client
+        NUM_STAGES
+    };
+
+    static constexpr std::size_t RING_SIZE = 16384;
+
+    /** Client of the events that do not belong to a client */
+    static constexpr uint64_t NO_CLIENT = UINT64_MAX;
+
+    /**
+     * \brief Returns the current time for the events.
+     */
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool isEnabled() {
+        return sEnabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief Start or stop recording events. Recorded events are kept.
+     */
+    static void setEnabled(bool enabled);
+
+    /**
+     * \brief Record a stage that took some time.
+     * \param stage Stage.
+     * \param clientId Client of the message, or NO_CLIENT.
+     * \param type Type of the message.
+     * \param start_ns Start time from now_ns().
+     * \param bytes Bytes received or sent, or 0.
+     */
+    static void record(Stage stage, uint64_t clientId, comm::MessageType type, int64_t start_ns,
+                       uint32_t bytes = 0);
+
+    /**
+     * \brief Record a stage that happened at an instant.
+     */
+    static void mark(Stage stage, uint64_t clientId, comm::MessageType type, uint32_t bytes = 0);
+
+    /**
+     * \brief Returns the events of all the threads in the Chrome trace event JSON format.
+     */
+    static std::string getChromeTrace();
+
+    static const char* getName(Stage stage);
+
+private:
+    /**
+     * Events are written with a sequence number around them, and skipped by readers if
+     * the number changed while reading them.
+     */
+    struct Event {
+        std::atomic<uint64_t> sequence {0};
+        int64_t start_ns;
+        int64_t duration_ns;    // -1 for instants
+        uint64_t clientId;
+        comm::MessageType type;
+        Stage stage;
+        uint32_t bytes;
+    };
+
+    struct Ring {
+        pid_t threadId;
+        std::atomic<uint64_t> next {0};
+        std::array<Event, RING_SIZE> events;
+    };
+
+    static std::atomic<bool> sEnabled;
+
+    // Rings are never freed, so that the events of finished threads are kept
+    static std::mutex sRingsMutex;
+    static std::vector<Ring*> sRings;
+
+    /**
+     * \brief Returns the ring of the calling thread, creating it the first time.
+     */
+    static Ring& getRing();
+
+    static void write(Stage stage, uint64_t clientId, comm::MessageType type, int64_t start_ns,
+                      int64_t duration_ns, uint32_t bytes);
+};
+
+}  // namespace server
+
+#endif  // _INCLUDE_TRACING_HPP_
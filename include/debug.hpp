@@ -18,7 +18,19 @@
 #ifndef _INCLUDE_DEBUG_HPP_
 #define _INCLUDE_DEBUG_HPP_
 
+#include <sys/types.h>
+
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
 
 namespace Debug
 {
@@ -29,11 +41,273 @@ namespace Debug
     static constexpr int defined_level = 0;
 #endif
 
+    static constexpr int LEVEL_ERROR = -2;
+    static constexpr int LEVEL_WARNING = -1;
+    static constexpr int LEVEL_INFO = 0;
+    static constexpr int LEVEL_DEBUG = 1;
+    static constexpr int LEVEL_VERBOSE = 2;
+
+    /**
+     * \brief Log tag of a module, with a level that can be changed at runtime.
+     *
+     *        Tags are registered while they exist, usually one static per module. They start at
+     *        the level set for them in the LOG_LEVELS environment variable, or at
+     *        DEBUG_LEVEL. Levels above DEBUG_LEVEL are compiled out and can't be enabled.
+     */
+    class Tag final {
+    public:
+        explicit Tag(const char* name);
+        ~Tag();
+
+        Tag(const Tag&) = delete;
+        Tag& operator=(const Tag&) = delete;
+
+        const char* getName() const {
+            return mName;
+        }
+
+        bool isEnabled(int level) const {
+            return level <= mLevel.load(std::memory_order_relaxed);
+        }
+
+        int getLevel() const {
+            return mLevel.load(std::memory_order_relaxed);
+        }
+
+        void setLevel(int level) {
+            mLevel.store(level, std::memory_order_relaxed);
+        }
+
+    private:
+        const char* const mName;
+        std::atomic<int> mLevel {defined_level};
+    };
+
+    /**
+     * \brief Set the level of tags at runtime.
+     * \param spec Comma-separated list of tag=level, where the level is a number or one of
+     *        e, w, i, d, v, and the tag * matches all the tags. Rules are applied in order,
+     *        also to the tags registered later.
+     * \return false if the list is not valid, in which case nothing is changed.
+     */
+    bool setLevels(const std::string& spec);
+
+    /**
+     * \brief Returns the levels of all the tags as a list of tag=level.
+     */
+    std::string getLevels();
+
+    /**
+     * \brief Asynchronous log backend.
+     *
+     *        Lines are formatted by the thread that logs into a slot of a bounded ring,
+     *        which is claimed without locks. A background thread adds the time and the
+     *        thread id and writes them to stdout in batches. When the ring is full the line
+     *        is dropped and counted, so logging never blocks. The pending lines are written
+     *        at exit, and from then on lines are written directly.
+     *
+     *        When the LOG_BINARY_FILE environment variable names a file, lines are not
+     *        formatted. The thread that logs copies the raw arguments, and the background
+     *        thread appends them to that file with the addresses of the format string and
+     *        the tags, which identify them. Each of these strings is written to the file the
+     *        first time it is used. decodeBinaryLog() turns the file back into text.
+     */
+    class AsyncLog final {
+    public:
+        static constexpr std::size_t CAPACITY = 4096;      // Must be a power of two
+        static constexpr std::size_t LINE_SIZE = 512;       // Longer lines are truncated
+        static constexpr std::size_t BATCH_SIZE = 64 * 1024;
+
+        static AsyncLog& getInstance();
+
+        /**
+         * \brief Queue a line.
+         * \param levelTag Name of the level.
+         * \param tag Tag of the module.
+         * \param fmt printf format.
+         */
+        template <typename... Args>
+        void write(const char* levelTag, const char* tag, const char* fmt, Args... args) {
+            // Counted before checking mRunning, so that stop() waits for the lines of
+            // the writers that saw it running
+            mWriters.fetch_add(1);
+            if (!mRunning.load()) {
+                mWriters.fetch_sub(1, std::memory_order_release);
+                char text[LINE_SIZE];
+                snprintf(text, sizeof(text), fmt, args...);
+                printf("[%s] %s: %s\n", levelTag, tag, text);
+                return;
+            }
+
+            Record* record = claim();
+            if (record == nullptr) {
+                mWriters.fetch_sub(1, std::memory_order_release);
+                return;
+            }
+
+            record->levelTag = levelTag;
+            record->tag = tag;
+            record->fmt = fmt;
+            if (mBinaryFile != nullptr) {
+                record->size = encodeArgs(record->text, sizeof(record->text), args...);
+            } else {
+                snprintf(record->text, sizeof(record->text), fmt, args...);
+            }
+            publish(record);
+            mWriters.fetch_sub(1, std::memory_order_release);
+        }
+
+        /**
+         * \brief Copy printf arguments to a buffer as a type and a value each. Strings are
+         *        copied. Arguments that do not fit are left out.
+         * \param buffer Output buffer.
+         * \param size Size of the buffer.
+         * \return Number of bytes written.
+         */
+        template <typename... Args>
+        static std::size_t encodeArgs(char* buffer, std::size_t size, Args... args) {
+            std::size_t offset = 0;
+            (encodeArg(buffer, size, offset, args), ...);
+            return offset;
+        }
+
+        /**
+         * \brief Format arguments copied by encodeArgs().
+         * \param fmt printf format.
+         * \param args Encoded arguments.
+         * \param size Size of the encoded arguments.
+         * \return Formatted text. Missing arguments are written as "?".
+         */
+        static std::string formatArgs(const char* fmt, const char* args, std::size_t size);
+
+        /**
+         * \brief Write the pending lines and stop the background thread.
+         *        Lines logged after this are written directly.
+         */
+        void stop();
+
+        /**
+         * \brief Returns the number of lines dropped because the ring was full.
+         */
+        uint64_t getDroppedLines() const;
+
+    private:
+        enum ArgType : uint8_t {
+            ARG_INT,        // int64_t
+            ARG_UINT,       // uint64_t
+            ARG_DOUBLE,     // double
+            ARG_STRING,     // Null-terminated
+            ARG_POINTER,    // uint64_t
+        };
+
+        struct Record {
+            std::atomic<std::size_t> sequence;
+            int64_t time_us;
+            pid_t threadId;
+            const char* levelTag;
+            const char* tag;
+            const char* fmt;
+            std::size_t size;       // Size of the encoded arguments in binary mode
+            char text[LINE_SIZE];   // Formatted line, or encoded arguments in binary mode
+        };
+
+        std::unique_ptr<Record[]> mRecords;
+        std::atomic<std::size_t> mTail {0};     // Next slot to claim
+        std::size_t mHead = 0;                  // Next slot to write. Only used by the thread.
+        std::atomic<uint64_t> mDropped {0};
+        uint64_t mReportedDropped = 0;
+
+        std::atomic<bool> mRunning {false};
+        std::atomic<std::size_t> mWriters {0};  // Threads in write() that may queue a line
+        std::thread mThread;
+
+        // Binary mode. Only used by the thread after the constructor.
+        FILE* mBinaryFile = nullptr;
+        std::unordered_set<const char*> mWrittenStrings;
+
+        AsyncLog();
+
+        template <typename T>
+        static void encodeArg(char* buffer, std::size_t size, std::size_t& offset, T value) {
+            if constexpr (std::is_same_v<T, const char*> || std::is_same_v<T, char*>) {
+                const char* string = (value != nullptr)? value : "(null)";
+                if (offset + 2 > size) {
+                    offset = size;
+                    return;
+                }
+                buffer[offset++] = ARG_STRING;
+                const std::size_t length = std::min(strlen(string), size - offset - 1);
+                memcpy(buffer + offset, string, length);
+                buffer[offset + length] = '\0';
+                offset += length + 1;
+            } else if constexpr (std::is_enum_v<T>) {
+                encodeArg(buffer, size, offset, static_cast<std::underlying_type_t<T>>(value));
+            } else {
+                uint8_t type;
+                uint64_t bits;
+                if constexpr (std::is_pointer_v<T>) {
+                    type = ARG_POINTER;
+                    bits = reinterpret_cast<uintptr_t>(value);
+                } else if constexpr (std::is_floating_point_v<T>) {
+                    type = ARG_DOUBLE;
+                    const double number = value;
+                    memcpy(&bits, &number, sizeof(bits));
+                } else if constexpr (std::is_signed_v<T>) {
+                    type = ARG_INT;
+                    bits = static_cast<uint64_t>(static_cast<int64_t>(value));
+                } else {
+                    type = ARG_UINT;
+                    bits = static_cast<uint64_t>(value);
+                }
+
+                if (offset + 1 + sizeof(bits) > size) {
+                    offset = size;
+                    return;
+                }
+                buffer[offset++] = type;
+                memcpy(buffer + offset, &bits, sizeof(bits));
+                offset += sizeof(bits);
+            }
+        }
+
+        /**
+         * \brief Claim the next slot and set its time and thread.
+         * \return The slot, or nullptr if the ring is full.
+         */
+        Record* claim();
+
+        /**
+         * \brief Pass a claimed slot to the background thread.
+         */
+        void publish(Record* record);
+
+        void run();
+
+        /**
+         * \brief Write the published lines.
+         * \param batch Buffer for the lines.
+         * \return Number of lines written.
+         */
+        std::size_t drain(std::string& batch);
+
+        /**
+         * \brief Add a record to a batch of the binary file, after the strings it uses
+         *        that were not written yet.
+         */
+        void appendBinary(const Record& record, std::string& batch);
+    };
+
+    /**
+     * \brief Write a binary log file as text, as it would have been logged.
+     * \param in Binary log file.
+     * \param out Output.
+     * \return false if the file is not a binary log or is corrupt, true otherwise.
+     */
+    bool decodeBinaryLog(FILE* in, FILE* out);
+
     template <typename... Args>
     static void log(const char* tag, const char* levelTag, const char* fmt, Args... args) {
-        printf("[%s] %s: ", levelTag, tag);
-        printf(fmt, args...);
-        printf("\n");
+        AsyncLog::getInstance().write(levelTag, tag, fmt, args...);
     }
 
     template <typename... Args>
@@ -41,22 +315,25 @@ namespace Debug
         log(tag, levelTag, "%s", str);
     }
 
+// Arguments are only formatted when the level is enabled for the tag
 #define LOG_FUNCTION(name, level, level_tag) \
         template <typename... Args> \
-            static inline void name(const char* tag, Args... args) { \
+            static inline void name(const Tag& tag, Args... args) { \
                 if constexpr (defined_level >= level) { \
-                    log(tag, level_tag, args...); \
+                    if (tag.isEnabled(level)) { \
+                        log(tag.getName(), level_tag, args...); \
+                    } \
                 } \
             }
 
     // Visible debug functions
     class Log {
     public:
-        LOG_FUNCTION(e, -2, "ERROR");
-        LOG_FUNCTION(w, -1, "WARNING");
-        LOG_FUNCTION(i,  0, "INFO");
-        LOG_FUNCTION(d,  1, "DEBUG");
-        LOG_FUNCTION(v,  2, "VERBOSE");
+        LOG_FUNCTION(e, LEVEL_ERROR, "ERROR");
+        LOG_FUNCTION(w, LEVEL_WARNING, "WARNING");
+        LOG_FUNCTION(i, LEVEL_INFO, "INFO");
+        LOG_FUNCTION(d, LEVEL_DEBUG, "DEBUG");
+        LOG_FUNCTION(v, LEVEL_VERBOSE, "VERBOSE");
     };
 }
 
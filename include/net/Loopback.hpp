@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INCLUDE_NET_LOOPBACK_HPP_
+#define _INCLUDE_NET_LOOPBACK_HPP_
+
+#include <cstdint>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "net/Socket.hpp"
+
+namespace server::net {
+
+/**
+ * \brief In-memory connection, to run servers in tests and benchmarks without sockets.
+ *
+ *        Each end queues what it sends for the other one. Each Send() is returned by a
+ *        single Read(), or by several if the buffer is shorter, as a socket that is read
+ *        faster than it is written does. Reads block unless MSG_DONTWAIT is passed, in
+ *        which case they fail with EAGAIN when there is nothing to read. An end is closed
+ *        when it is disconnected or when the last copy of its connection is destroyed.
+ */
+class LoopbackChannel final : public Channel {
+public:
+    /**
+     * \brief Create the two ends of a connection.
+     */
+    static std::pair<Connection, Connection> createPair();
+
+    ~LoopbackChannel();
+
+    ssize_t Send(const void* buffer, std::size_t len, int flags) override;
+    ssize_t Read(void* buffer, std::size_t len, int flags) override;
+    void Disconnect() override;
+    void SetReceiveTimeout(unsigned timeout_ms) override;
+
+private:
+    /** Data sent in one direction */
+    struct Queue {
+        std::mutex mutex;
+        std::condition_variable readable;
+        std::deque<std::vector<uint8_t>> segments;
+        std::size_t offset = 0;     // Bytes of the first segment already read
+        bool closed = false;
+    };
+
+    const std::shared_ptr<Queue> mIn;
+    const std::shared_ptr<Queue> mOut;
+    std::atomic<unsigned> mReceiveTimeout_ms {0};
+
+    LoopbackChannel(std::shared_ptr<Queue> in, std::shared_ptr<Queue> out);
+
+    static void close(Queue& queue);
+};
+
+/**
+ * \brief Acceptor of loopback connections, which clients open with Connect().
+ */
+class LoopbackAcceptor final : public Acceptor {
+public:
+    void Listen() override;
+    Connection Accept() override;
+    void Shutdown() override;
+
+    /**
+     * \brief Open a connection to this acceptor.
+     * \return The end of the client. It reads 0 if the acceptor was shut down.
+     */
+    Connection Connect();
+
+private:
+    std::mutex mMutex;
+    std::condition_variable mPendingCondition;
+    std::deque<Connection> mPending;
+    bool mShutdown = false;
+};
+
+}  // namespace server::net
+
+#endif  // _INCLUDE_NET_LOOPBACK_HPP_
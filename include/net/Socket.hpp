@@ -22,12 +22,32 @@
 #include <sys/socket.h>
 
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
 /** Networking classes and utilities */
 namespace server::net {
 
+/**
+ * \brief End of a connection that is not a socket, such as an in-memory loopback.
+ *        Its functions behave like the socket calls of Connection.
+ */
+class Channel {
+public:
+    virtual ~Channel() = default;
+
+    virtual ssize_t Send(const void* buffer, std::size_t len, int flags) = 0;
+    virtual ssize_t Read(void* buffer, std::size_t len, int flags) = 0;
+
+    /**
+     * \brief Close this end. The other end reads the pending data and then 0.
+     */
+    virtual void Disconnect() = 0;
+
+    virtual void SetReceiveTimeout(unsigned timeout_ms) = 0;
+};
+
 /**
  * \brief An established connection with a socket
  */
@@ -35,14 +55,21 @@ class Connection {
 public:
     Connection() = default;
     Connection(int sockfd);
+
+    /**
+     * \brief Construct a connection that sends and reads through a channel instead of a
+     *        socket. Copies of the connection share the channel.
+     */
+    Connection(std::shared_ptr<Channel> channel);
     virtual ~Connection();
 
     /** \brief Send a buffer of bytes
     * \param buffer A pointer to a buffer.
 	* \param len The size of the buffer.
+	* \param flags Flags passed to send().
 	* \returns Number of bytes sent.
     */
-    virtual ssize_t Send(void* buffer, std::size_t len) const;
+    virtual ssize_t Send(void* buffer, std::size_t len, int flags = 0) const;
 
     /** \brief Read a buffer of bytes
     * \param buffer A pointer to a buffer to store the received data.
@@ -56,9 +83,28 @@ public:
      */
     void Close();
 
+    /**
+     * \brief Close the file descriptor. Copies of this connection must not be used after it.
+     */
+    void Disconnect();
+
+    /**
+     * \brief Send small writes right away instead of waiting to coalesce them.
+     */
+    void SetNoDelay();
+
+    /**
+     * \brief Make blocking reads fail after a timeout.
+     * \param timeout_ms Timeout in milliseconds.
+     */
+    void SetReceiveTimeout(unsigned timeout_ms);
+
 protected:
     /** File descriptor for the socket */
-    int m_sockfd;
+    int m_sockfd = -1;
+
+    /** Channel used instead of the socket, if any */
+    std::shared_ptr<Channel> m_channel;
 };
 
 
@@ -113,8 +159,25 @@ protected:
     uint16_t m_port;
 };
 
+/**
+ * \brief Source of the connections of a server.
+ */
+class Acceptor {
+public:
+    virtual ~Acceptor() = default;
+
+    /** \brief Start accepting connections. */
+    virtual void Listen() = 0;
+
+    /** \brief Wait for the next connection. Throws a SocketException if it fails. */
+    virtual Connection Accept() = 0;
+
+    /** \brief Stop accepting connections and make a waiting Accept() fail. */
+    virtual void Shutdown() = 0;
+};
+
 /** \brief A server socket */
-class ServerSocket : public Socket {
+class ServerSocket : public Socket, public Acceptor {
 public:
     /** \brief Construct a ServerSocket
      * \param domain IPv4, IPv6 or LOCAL
@@ -123,13 +186,23 @@ public:
      */
     ServerSocket(Domain domain, Type type, uint16_t port);
 
+    /** \brief Construct a ServerSocket that only listens on one address
+     * \param domain IPv4
+     * \param type Stream or datagram
+     * \param port Port number
+     * \param address IP address of a local interface, such as 127.0.0.1 for local connections
+     */
+    ServerSocket(Domain domain, Type type, uint16_t port, const std::string& address);
+
     virtual ~ServerSocket() = default;
 
     /** \brief Listen for incoming connections. */
-    void Listen();
+    void Listen() override;
 
     /** \brief Accept the next incoming connection request. */
-    Connection Accept();
+    Connection Accept() override;
+
+    void Shutdown() override;
 };
 
 
@@ -148,6 +221,19 @@ public:
 
     /** Connect this socket to a server with the parameters specified in the constructor*/
     void Connect();
+
+    /**
+     * \brief Start connecting to the server without waiting for it. Throws a
+     *        SocketException if it fails. FinishConnect() tells when it is connected.
+     */
+    void StartConnect();
+
+    /**
+     * \brief Check a connection started with StartConnect(), without waiting. Throws a
+     *        SocketException if it failed. The socket blocks again once connected.
+     * \return true if the socket is connected, false if it is still connecting.
+     */
+    bool FinishConnect();
 };
 
 }  // namespace server::net
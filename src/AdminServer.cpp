@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "debug.hpp"
+#include "Metrics.hpp"
+#include "net/Socket.hpp"
+#include "Tracing.hpp"
+
+#include "AdminServer.hpp"
+
+static __attribute_used__ Debug::Tag LOG_TAG("AdminServer");
+
+namespace server {
+
+using net::ClientSocket;
+using net::ServerSocket;
+using net::Socket;
+using net::SocketException;
+
+AdminServer::AdminServer(uint16_t port, StatusProvider getStatus, const std::string& address)
+:   mPort(port),
+    mAddress(address),
+    mGetStatus(getStatus),
+    mStartTime(std::chrono::steady_clock::now())
+{ }
+
+AdminServer::~AdminServer() {
+    stop();
+}
+
+bool AdminServer::start() {
+    try {
+        mServerSocket = std::make_unique<ServerSocket>(Socket::Domain::IPv4, Socket::Type::STREAM,
+                                                       mPort, mAddress);
+        mServerSocket->Listen();
+    }
+    catch (SocketException& exception) {
+        Debug::Log::e(LOG_TAG, "Can't listen on %s:%u: %s", mAddress.c_str(), mPort, exception.what());
+        return false;
+    }
+
+    Debug::Log::i(LOG_TAG, "Admin endpoint at %s:%u", mAddress.c_str(), mPort);
+
+    mRunning = true;
+    mThread = std::thread(&AdminServer::serve, this);
+    return true;
+}
+
+void AdminServer::stop() {
+    if (!mRunning.exchange(false)) {
+        return;
+    }
+
+    // Wake up the accept
+    const std::string wakeUpAddress = (mAddress == "0.0.0.0")? DEFAULT_ADDRESS : mAddress;
+    ClientSocket wakeUp(Socket::Domain::IPv4, Socket::Type::STREAM, wakeUpAddress, mPort);
+    try {
+        wakeUp.Connect();
+    }
+    catch (SocketException& exception) {
+        Debug::Log::w(LOG_TAG, "%s(): %s", __func__, exception.what());
+    }
+    mThread.join();
+    wakeUp.Disconnect();
+    mServerSocket->Disconnect();
+}
+
+void AdminServer::serve() {
+    while (mRunning) {
+        try {
+            net::Connection connection = mServerSocket->Accept();
+            if (mRunning) {
+                handleRequest(connection);
+            }
+            connection.Disconnect();
+        }
+        catch (SocketException& exception) {
+            Debug::Log::e(LOG_TAG, "%s(): %s", __func__, exception.what());
+        }
+    }
+}
+
+void AdminServer::handleRequest(net::Connection& connection) {
+    // Read up to the end of the first line, which is all that is needed
+    std::string request;
+    char buffer[512];
+    connection.SetReceiveTimeout(REQUEST_TIMEOUT_ms);
+    while (request.find('\n') == std::string::npos && request.size() < MAX_REQUEST_SIZE) {
+        const ssize_t size = connection.Read(buffer, sizeof(buffer), 0);
+        if (size <= 0) {
+            break;
+        }
+        request.append(buffer, size);
+    }
+    request = request.substr(0, request.find_first_of("\r\n"));
+
+    Debug::Log::v(LOG_TAG, "%s(): Request \"%s\"", __func__, request.c_str());
+
+    // "GET /command?argument HTTP/1.1" or "command argument"
+    const bool isHttp = (request.rfind("GET ", 0) == 0);
+    std::string command = request;
+    if (isHttp) {
+        command = request.substr(4, request.find(' ', 4) - 4);
+        std::replace(command.begin(), command.end(), '?', ' ');
+        command.erase(0, command.find_first_not_of('/'));
+    }
+    const std::size_t separator = command.find(' ');
+    const std::string argument = (separator == std::string::npos)? "" : command.substr(separator + 1);
+    command = command.substr(0, separator);
+
+    std::string response;
+    const char* contentType = "text/plain; version=0.0.4; charset=utf-8";
+    if (command == "loglevel") {
+        response = handleLogLevel(argument);
+    } else if (command == "trace") {
+        if (argument == "on" || argument == "off") {
+            Tracing::setEnabled(argument == "on");
+            response = std::string("Tracing ") + (Tracing::isEnabled()? "on" : "off") + "\n";
+        } else {
+            response = Tracing::getChromeTrace();
+            contentType = "application/json";
+        }
+    } else {
+        AdminStatus status;
+        if (!mGetStatus(status)) {
+            Debug::Log::w(LOG_TAG, "%s(): The server status is not available", __func__);
+        }
+        addBuildInfo(status);
+
+        const Metrics::Snapshot snapshot = Metrics::getSnapshot();
+        response = (command == "metrics")?
+            formatPrometheus(snapshot, status) : formatText(snapshot, status);
+    }
+
+    if (isHttp) {
+        const std::string body = std::move(response);
+        response =
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: " + std::string(contentType) + "\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "Connection: close\r\n"
+            "\r\n" + body;
+    }
+
+    std::size_t sent = 0;
+    while (sent < response.size()) {
+        const ssize_t size = connection.Send(response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (size <= 0) {
+            break;
+        }
+        sent += size;
+    }
+}
+
+std::string AdminServer::handleLogLevel(const std::string& spec) {
+    if (!spec.empty()) {
+        if (!Debug::setLevels(spec)) {
+            return "Invalid log levels \"" + spec + "\". Expected tag=level,... with levels e, w, i, d, v\n";
+        }
+        Debug::Log::i(LOG_TAG, "Log levels set to %s", spec.c_str());
+    }
+
+    std::string levels = Debug::getLevels();
+    std::replace(levels.begin(), levels.end(), ',', '\n');
+    return levels + "\n";
+}
+
+void AdminServer::addBuildInfo(AdminStatus& status) const {
+    status.info.emplace_back("build", __DATE__ " " __TIME__);
+    status.info.emplace_back("compiler", __VERSION__);
+#ifdef DEBUG_LEVEL
+    status.info.emplace_back("debug_level", std::to_string(DEBUG_LEVEL));
+#endif
+    status.info.emplace_back("admin_address", mAddress);
+    status.info.emplace_back("admin_port", std::to_string(mPort));
+
+    status.values.emplace_back("uptime_seconds",
+        std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - mStartTime).count());
+}
+
+/**
+ * \brief Escape a Prometheus label value.
+ */
+static std::string escapeLabel(const std::string& value) {
+    std::string escaped;
+    for (const char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static std::string formatType(comm::MessageType type) {
+    if (type >= Metrics::NUM_TIMED_TYPES) {
+        return "other";
+    }
+
+    char name[8];
+    snprintf(name, sizeof(name), "0x%02X", type);
+    return name;
+}
+
+std::string AdminServer::formatPrometheus(const Metrics::Snapshot& snapshot, const AdminStatus& status) {
+    std::string out;
+    char line[256];
+
+    out += "# TYPE server_info gauge\nserver_info{";
+    for (std::size_t i = 0; i < status.info.size(); i++) {
+        out += (i > 0)? "," : "";
+        out += status.info[i].first + "=\"" + escapeLabel(status.info[i].second) + "\"";
+    }
+    out += "} 1\n";
+
+    for (unsigned i = 0; i < Metrics::NUM_COUNTERS; i++) {
+        const char* name = Metrics::getName(static_cast<Metrics::Counter>(i));
+        snprintf(line, sizeof(line), "# TYPE server_%s_total counter\nserver_%s_total %" PRIu64 "\n",
+            name, name, snapshot.counters[i]);
+        out += line;
+    }
+
+    for (unsigned i = 0; i < Metrics::NUM_GAUGES; i++) {
+        const char* name = Metrics::getName(static_cast<Metrics::Gauge>(i));
+        snprintf(line, sizeof(line), "# TYPE server_%s gauge\nserver_%s %" PRId64 "\n",
+            name, name, snapshot.gauges[i]);
+        out += line;
+    }
+
+    for (const auto& value : status.values) {
+        snprintf(line, sizeof(line), "# TYPE server_%s gauge\nserver_%s %" PRId64 "\n",
+            value.first.c_str(), value.first.c_str(), value.second);
+        out += line;
+    }
+
+    for (unsigned i = 0; i < Metrics::NUM_TIMERS; i++) {
+        const char* name = Metrics::getName(static_cast<Metrics::Timer>(i));
+        snprintf(line, sizeof(line), "# TYPE server_%s summary\n", name);
+        out += line;
+
+        for (const auto& timer : snapshot.timers[i]) {
+            const std::string type = formatType(timer.first);
+            const HistogramSnapshot& histogram = timer.second;
+            for (const double percentile : PERCENTILES) {
+                snprintf(line, sizeof(line), "server_%s{type=\"%s\",quantile=\"%g\"} %" PRIu64 "\n",
+                    name, type.c_str(), percentile, histogram.getPercentile(percentile));
+                out += line;
+            }
+            snprintf(line, sizeof(line),
+                "server_%s_sum{type=\"%s\"} %" PRIu64 "\nserver_%s_count{type=\"%s\"} %" PRIu64 "\n",
+                name, type.c_str(), histogram.sum, name, type.c_str(), histogram.count);
+            out += line;
+        }
+    }
+
+    return out;
+}
+
+std::string AdminServer::formatText(const Metrics::Snapshot& snapshot, const AdminStatus& status) {
+    std::string out;
+    char line[256];
+
+    for (const auto& info : status.info) {
+        out += info.first + ": " + info.second + "\n";
+    }
+
+    out += "\n";
+    for (const auto& value : status.values) {
+        snprintf(line, sizeof(line), "%-28s %" PRId64 "\n", value.first.c_str(), value.second);
+        out += line;
+    }
+    for (unsigned i = 0; i < Metrics::NUM_GAUGES; i++) {
+        snprintf(line, sizeof(line), "%-28s %" PRId64 "\n",
+            Metrics::getName(static_cast<Metrics::Gauge>(i)), snapshot.gauges[i]);
+        out += line;
+    }
+
+    out += "\n";
+    for (unsigned i = 0; i < Metrics::NUM_COUNTERS; i++) {
+        snprintf(line, sizeof(line), "%-28s %" PRIu64 "\n",
+            Metrics::getName(static_cast<Metrics::Counter>(i)), snapshot.counters[i]);
+        out += line;
+    }
+
+    for (unsigned i = 0; i < Metrics::NUM_TIMERS; i++) {
+        snprintf(line, sizeof(line), "\n%-16s %10s %10s %10s %10s %10s %10s\n",
+            Metrics::getName(static_cast<Metrics::Timer>(i)), "count", "p50", "p90", "p99", "p99.9", "max");
+        out += line;
+
+        for (const auto& timer : snapshot.timers[i]) {
+            const HistogramSnapshot& histogram = timer.second;
+            snprintf(line, sizeof(line), "%-16s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+                " %10" PRIu64 " %10" PRIu64 "\n",
+                formatType(timer.first).c_str(), histogram.count,
+                histogram.getPercentile(0.5), histogram.getPercentile(0.9),
+                histogram.getPercentile(0.99), histogram.getPercentile(0.999), histogram.max);
+            out += line;
+        }
+    }
+
+    return out;
+}
+
+uint16_t AdminServer::takePortArgument(std::vector<std::string>& args) {
+    const auto option = std::find(args.begin(), args.end(), "--admin");
+    if (option == args.end()) {
+        return 0;
+    }
+
+    uint16_t port = 0;
+    if (option + 1 != args.end()) {
+        port = std::clamp(atoi((option + 1)->c_str()), 0, UINT16_MAX);
+        args.erase(option, option + 2);
+    } else {
+        args.erase(option);
+    }
+    return port;
+}
+
+std::string AdminServer::takeAddressArgument(std::vector<std::string>& args) {
+    const auto option = std::find(args.begin(), args.end(), "--admin-address");
+    if (option == args.end()) {
+        return DEFAULT_ADDRESS;
+    }
+
+    std::string address = DEFAULT_ADDRESS;
+    if (option + 1 != args.end()) {
+        address = *(option + 1);
+        args.erase(option, option + 2);
+    } else {
+        args.erase(option);
+    }
+    return address;
+}
+
+}  // namespace server
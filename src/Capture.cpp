@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "Capture.hpp"
+
+static __attribute_used__ Debug::Tag LOG_TAG("Capture");
+
+namespace server {
+
+/**
+ * \brief Read a variable-length integer.
+ * \return false at the end of the file, true otherwise.
+ */
+static bool readNumber(FILE* in, uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        const int byte = fgetc(in);
+        if (byte == EOF) {
+            return false;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Capture::~Capture() {
+    if (mFile != nullptr) {
+        fclose(mFile);
+    }
+}
+
+bool Capture::open(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mFile = fopen(path.c_str(), "wb");
+    if (mFile == nullptr) {
+        Debug::Log::e(LOG_TAG, "%s(): Can't open capture file %s", __func__, path.c_str());
+        return false;
+    }
+
+    // Records are only copied to the buffer in the server loop
+    setvbuf(mFile, nullptr, _IOFBF, BUFFER_SIZE);
+    fwrite(MAGIC, 1, sizeof(MAGIC) - 1, mFile);
+    mStart = std::chrono::steady_clock::now();
+    mLastTime_us = 0;
+
+    Debug::Log::i(LOG_TAG, "Capturing traffic to %s", path.c_str());
+    return true;
+}
+
+void Capture::recordConnect(uint64_t connection) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeHeader(CONNECT, connection);
+}
+
+void Capture::recordFrame(uint64_t connection, const uint8_t* data, std::size_t size) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeHeader(FRAME, connection);
+    writeNumber(size);
+    fwrite(data, 1, size, mFile);
+}
+
+void Capture::recordSent(uint64_t connection, std::size_t size) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeHeader(SENT, connection);
+    writeNumber(size);
+}
+
+void Capture::recordDisconnect(uint64_t connection) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeHeader(DISCONNECT, connection);
+}
+
+void Capture::flush() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    fflush(mFile);
+}
+
+void Capture::writeHeader(Kind kind, uint64_t connection) {
+    const int64_t time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - mStart).count();
+
+    fputc(kind, mFile);
+    writeNumber(time_us - mLastTime_us);
+    writeNumber(connection);
+    mLastTime_us = time_us;
+}
+
+void Capture::writeNumber(uint64_t value) {
+    uint8_t bytes[10];
+    std::size_t length = 0;
+    do {
+        bytes[length] = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            bytes[length] |= 0x80;
+        }
+        length++;
+    } while (value != 0);
+    fwrite(bytes, 1, length, mFile);
+}
+
+bool Capture::read(FILE* in, std::vector<Record>& records) {
+    char magic[sizeof(MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+        memcmp(magic, MAGIC, sizeof(magic)) != 0)
+    {
+        return false;
+    }
+
+    int64_t time_us = 0;
+    int kind;
+    while ((kind = fgetc(in)) != EOF) {
+        Record record;
+        record.kind = static_cast<Kind>(kind);
+        record.size = 0;
+
+        uint64_t delta_us;
+        if (!readNumber(in, delta_us) || !readNumber(in, record.connection)) {
+            break;
+        }
+        time_us += delta_us;
+        record.time_us = time_us;
+
+        if (kind == FRAME || kind == SENT) {
+            if (!readNumber(in, record.size)) {
+                break;
+            }
+        }
+        if (kind == FRAME) {
+            record.data.resize(record.size);
+            if (fread(record.data.data(), 1, record.size, in) != record.size) {
+                break;
+            }
+        } else if (kind != CONNECT && kind != SENT && kind != DISCONNECT) {
+            return false;
+        }
+
+        records.push_back(std::move(record));
+    }
+    return true;
+}
+
+std::string Capture::takeFileArgument(std::vector<std::string>& args) {
+    const auto option = std::find(args.begin(), args.end(), "--capture");
+    if (option == args.end()) {
+        return "";
+    }
+
+    std::string path;
+    if (option + 1 != args.end()) {
+        path = *(option + 1);
+        args.erase(option, option + 2);
+    } else {
+        args.erase(option);
+    }
+    return path;
+}
+
+}  // namespace server
@@ -18,18 +18,25 @@
 #include <cstring>
 
 #include <numeric>
+#include <vector>
 
 #include "Communication.hpp"
 #include "debug.hpp"
 
-static __attribute_used__ const char* LOG_TAG = "Communication";
+static __attribute_used__ Debug::Tag LOG_TAG("Communication");
 
 namespace server {
 namespace comm {
 
-Message::Message(uint8_t* buffer, const uint16_t bufferSize) {
+Message::Message(const uint8_t* buffer, const uint16_t bufferSize) {
     Debug::Log::v(LOG_TAG, "%s()", __func__);
 
+    if (bufferSize < sizeof(header)) {
+        header.type = 0;
+        Debug::Log::w(LOG_TAG, "%s(): buffer shorter than a message header", __func__);
+        return;
+    }
+
     static constexpr uint8_t typeOffset = 0;
     static constexpr uint8_t checksumOffset = typeOffset + sizeof(header.type);
     static constexpr uint8_t sizeOffset = checksumOffset + sizeof(header.checksum);
@@ -40,20 +47,21 @@ Message::Message(uint8_t* buffer, const uint16_t bufferSize) {
     header.size = *(reinterpret_cast<const uint16_t* const>(buffer + sizeOffset));
     payload = reinterpret_cast<const uint8_t* const>(buffer + payloadOffset);
 
-    const uint8_t calculatedChecksum = calculateChecksum();
-
-    if (header.size > bufferSize) {
+    // The checksum covers the payload, which must be inside the buffer
+    if (header.size > bufferSize - sizeof(header)) {
         validFlag = false;
         Debug::Log::w(LOG_TAG, "%s(): declared message size bigger than buffer", __func__);
-    } else {
-        validFlag = calculatedChecksum == header.checksum;
+        return;
     }
 
+    const uint8_t calculatedChecksum = calculateChecksum();
+    validFlag = calculatedChecksum == header.checksum;
+
     Debug::Log::v(LOG_TAG, "%s(): Processed message type=%u, csum/calc=%u/%u, size=%u, valid=%u",
         __func__, header.type, header.checksum, calculatedChecksum, header.size, validFlag);
 }
 
-Message::Message(MessageType type, uint8_t* buffer, const uint16_t size) {
+Message::Message(MessageType type, const uint8_t* buffer, const uint16_t size) {
     header.type = type;
     header.size = size;
     payload = buffer;
@@ -93,5 +101,18 @@ bool Message::serialize(uint8_t* buffer, uint16_t bufferSize) const {
     return true;
 }
 
+void Message::serialize(std::vector<uint8_t>& buffer) const {
+    const std::size_t offset = buffer.size();
+    buffer.resize(offset + getLength());
+    memcpy(buffer.data() + offset, &header, sizeof(header));
+    if (header.size > 0) {
+        memcpy(buffer.data() + offset + sizeof(header), payload, header.size);
+    }
+}
+
+void Message::serializeHeader(uint8_t* buffer) const {
+    memcpy(buffer, &header, sizeof(header));
+}
+
 }  // namespace comm
 }  // namespace server
@@ -17,20 +17,49 @@
 
 #include <array>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <sqlite3.h>
 
 #include "Database.hpp"
 #include "debug.hpp"
 
-static __attribute_used__ const char* LOG_TAG = "Database";
+static __attribute_used__ Debug::Tag LOG_TAG("Database");
 
 namespace server {
 
+Database::~Database() {
+    for (auto& statement : mStatements) {
+        sqlite3_finalize(statement.second);
+    }
+
+    if (mOwnedDb != nullptr) {
+        sqlite3_close(mOwnedDb);
+    }
+}
+
 void Database::setDb(sqlite3* db) {
     mDb = db;
 }
 
+sqlite3_stmt* Database::prepareCached(const char* sql) {
+    auto found = mStatements.find(sql);
+    if (found != mStatements.end()) {
+        sqlite3_clear_bindings(found->second);
+        return found->second;
+    }
+
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v3(mDb, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+        Debug::Log::e(LOG_TAG, "%s(): SQL error: %s", __func__, sqlite3_errmsg(mDb));
+        return nullptr;
+    }
+
+    mStatements[sql] = stmt;
+    return stmt;
+}
+
 void Database::init() {
     createUserTable();
 }
@@ -38,15 +67,29 @@ void Database::init() {
 void Database::createUserTable() {
     Debug::Log::d(LOG_TAG, "%s()", __func__);
 
-    static const char* SQL_CREATE_USER_TABLE =
-    "CREATE TABLE IF NOT EXISTS Users ("
-        "Token TEXT PRIMARY KEY NOT NULL, "
-        "Name TEXT NOT NULL, "
-        "Notification INT NOT NULL"
+    // Token is the primary key, so authentication is a lookup in its index. The column
+    // with the name of the server is only checked in the row that was found.
+    static const std::vector<Migration> USER_MIGRATIONS = {
+        {1,
+            "CREATE TABLE IF NOT EXISTS Users ("
+                "Token TEXT PRIMARY KEY NOT NULL, "
+                "Name TEXT NOT NULL, "
+                "Notification INT NOT NULL"
+            ");"},
+    };
+
+    migrate("Users", USER_MIGRATIONS);
+}
+
+void Database::createSchemaVersionTable() {
+    static const char* SQL_CREATE_SCHEMA_VERSION_TABLE =
+    "CREATE TABLE IF NOT EXISTS SchemaVersions ("
+        "Schema TEXT PRIMARY KEY NOT NULL, "
+        "Version INT NOT NULL"
     ");";
 
     char *zErrMsg = 0;
-    const int result = sqlite3_exec(mDb, SQL_CREATE_USER_TABLE, nullptr, nullptr, &zErrMsg);
+    const int result = sqlite3_exec(mDb, SQL_CREATE_SCHEMA_VERSION_TABLE, nullptr, nullptr, &zErrMsg);
 
     if(result != SQLITE_OK){
         Debug::Log::e(LOG_TAG, "%s(): SQL error: %s", __func__, zErrMsg);
@@ -54,40 +97,124 @@ void Database::createUserTable() {
     }
 }
 
-bool Database::authenticateUserToken(std::string token, std::string serverName) const {
-    Debug::Log::d(LOG_TAG, "%s()", __func__);
+int Database::getSchemaVersion(const char* schema) const {
+    static const char* SQL_SELECT_VERSION =
+        "SELECT Version FROM SchemaVersions WHERE Schema = ?;";
 
-    bool auth = false;
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(mDb, SQL_SELECT_VERSION, -1, &stmt, nullptr) != SQLITE_OK) {
+        Debug::Log::e(LOG_TAG, "%s(): SQL error: %s", __func__, sqlite3_errmsg(mDb));
+        return 0;
+    }
 
-    char sql[256];
-    static const char* SQL_SELECT_USER =
-        "SELECT COUNT(*) FROM Users "
-        "WHERE Token = '%s' AND %s = '1';";
+    sqlite3_bind_text(stmt, 1, schema, -1, SQLITE_STATIC);
 
-    sprintf(sql, SQL_SELECT_USER, token.c_str(), serverName.c_str());
+    int version = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
 
-    const auto callback = [](void* auth, int argc, char** argv, char** azColName) -> int {
-        (void) argc;
-        (void) azColName;
+    sqlite3_finalize(stmt);
+    return version;
+}
 
-        const int count = atoi(argv[0]);
-        *((bool*) auth) = count > 0;
-        return 0;
-    };
+int Database::setSchemaVersion(const char* schema, int version) {
+    static const char* SQL_UPDATE_VERSION =
+        "INSERT INTO SchemaVersions (Schema, Version) VALUES (?, ?) "
+        "ON CONFLICT(Schema) DO UPDATE SET Version = excluded.Version;";
 
-    char *zErrMsg = 0;
-    const int rc = sqlite3_exec(mDb, sql, callback, &auth, &zErrMsg);
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(mDb, SQL_UPDATE_VERSION, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        Debug::Log::e(LOG_TAG, "%s():%d SQL error: %s", __func__, __LINE__, zErrMsg);
-        sqlite3_free(zErrMsg);
+        return rc;
+    }
+
+    sqlite3_bind_text(stmt, 1, schema, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, version);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE)? SQLITE_OK : rc;
+}
+
+bool Database::migrate(const char* schema, const std::vector<Migration>& migrations) {
+    createSchemaVersionTable();
+
+    const int currentVersion = getSchemaVersion(schema);
+    Debug::Log::d(LOG_TAG, "%s(): Schema %s at version %d", __func__, schema, currentVersion);
+
+    for (const Migration& migration : migrations) {
+        if (migration.version <= currentVersion) {
+            continue;
+        }
+
+        Debug::Log::i(LOG_TAG, "Migrating schema %s to version %d", schema, migration.version);
+
+        char *zErrMsg = 0;
+        int rc = sqlite3_exec(mDb, "BEGIN IMMEDIATE;", nullptr, nullptr, &zErrMsg);
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(mDb, migration.sql, nullptr, nullptr, &zErrMsg);
+        }
+        if (rc == SQLITE_OK) {
+            rc = setSchemaVersion(schema, migration.version);
+            if (rc != SQLITE_OK) {
+                zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(mDb));
+            }
+        }
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(mDb, "COMMIT;", nullptr, nullptr, &zErrMsg);
+        }
+
+        if (rc != SQLITE_OK) {
+            Debug::Log::e(LOG_TAG, "%s(): Migration of schema %s to version %d failed: %s",
+                __func__, schema, migration.version, zErrMsg);
+            sqlite3_free(zErrMsg);
+            sqlite3_exec(mDb, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Database::authenticateUserToken(std::string token, std::string serverName) const {
+    Debug::Log::d(LOG_TAG, "%s()", __func__);
+
+    // The token is bound as a parameter so that the lookup uses the primary key index.
+    // Column names cannot be bound, so the server name is quoted as an identifier.
+    std::string column;
+    for (const char c : serverName) {
+        column += c;
+        if (c == '"') {
+            column += c;
+        }
+    }
+
+    const std::string sql =
+        "SELECT COUNT(*) FROM Users "
+        "WHERE Token = ? AND \"" + column + "\" = '1';";
+
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(mDb, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        Debug::Log::e(LOG_TAG, "%s():%d SQL error: %s", __func__, __LINE__, sqlite3_errmsg(mDb));
         return false;
     }
 
+    sqlite3_bind_text(stmt, 1, token.c_str(), token.length(), SQLITE_STATIC);
+
+    bool auth = false;
+    const int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        auth = sqlite3_column_int(stmt, 0) > 0;
+    } else {
+        Debug::Log::e(LOG_TAG, "%s():%d SQL error: %s", __func__, __LINE__, sqlite3_errmsg(mDb));
+    }
+
+    sqlite3_finalize(stmt);
     return auth;
 }
 
 DatabaseManager::DatabaseManager() {
-    const int result = sqlite3_open("server.db", &mDb);
+    const int result = sqlite3_open(DATABASE_FILE, &mDb);
 
     if(result) {
         Debug::Log::e(LOG_TAG, "%s(): Can't open database: %s", __func__, sqlite3_errmsg(mDb));
@@ -95,6 +222,20 @@ DatabaseManager::DatabaseManager() {
     } else {
         Debug::Log::i(LOG_TAG, "%s(): Opened database", __func__);
     }
+
+    // Servers and tools open the same file. With a write-ahead log readers are not
+    // blocked by a writer, and writers wait for each other instead of failing.
+    // A bigger page cache keeps the indexes in memory during bulk writes.
+    char *zErrMsg = 0;
+    if (sqlite3_exec(mDb,
+            "PRAGMA journal_mode = WAL; "
+            "PRAGMA synchronous = NORMAL; "
+            "PRAGMA cache_size = -16384;",
+            nullptr, nullptr, &zErrMsg) != SQLITE_OK) {
+        Debug::Log::w(LOG_TAG, "%s(): Could not configure database: %s", __func__, zErrMsg);
+        sqlite3_free(zErrMsg);
+    }
+    sqlite3_busy_timeout(mDb, BUSY_TIMEOUT_ms);
 }
 
 DatabaseManager::~DatabaseManager() {
@@ -111,4 +252,19 @@ void DatabaseManager::initDatabase(Database& database) {
     database.init();
 }
 
+bool DatabaseManager::initReadOnlyDatabase(Database& database) {
+    sqlite3* db;
+    if (sqlite3_open_v2(DATABASE_FILE, &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        Debug::Log::e(LOG_TAG, "%s(): Can't open database: %s", __func__, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return false;
+    }
+
+    // Readers see the last commit of the write-ahead log and never block the writer
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_ms);
+    database.setDb(db);
+    database.mOwnedDb = db;
+    return true;
+}
+
 }  // namespace server
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "debug.hpp"
+
+#include "DatabaseExecutor.hpp"
+#include "Metrics.hpp"
+
+static __attribute_used__ Debug::Tag LOG_TAG("DatabaseExecutor");
+
+namespace server {
+
+DatabaseExecutor::DatabaseExecutor(Metrics::Gauge queueGauge)
+:   mQueueGauge(queueGauge),
+    mThread(&DatabaseExecutor::loop, this)
+{
+}
+
+DatabaseExecutor::~DatabaseExecutor() {
+    stop();
+}
+
+void DatabaseExecutor::post(Job job) {
+    {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mRunning) {
+        Debug::Log::w(LOG_TAG, "%s(): Executor stopped. Job discarded", __func__);
+        return;
+    }
+    mJobs.push_back(std::move(job));
+    Metrics::set(mQueueGauge, mJobs.size());
+    }
+
+    mCondition.notify_one();
+}
+
+void DatabaseExecutor::setPeriodicJob(std::chrono::milliseconds period, Job job) {
+    {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mPeriodicJob = std::move(job);
+    mPeriod = period;
+    mNextPeriodicRun = std::chrono::steady_clock::now() + period;
+    }
+
+    mCondition.notify_one();
+}
+
+void DatabaseExecutor::stop() {
+    {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mRunning = false;
+    }
+
+    mCondition.notify_one();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+std::size_t DatabaseExecutor::getQueueSize() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mJobs.size();
+}
+
+void DatabaseExecutor::loop() {
+    Debug::Log::d(LOG_TAG, "%s(): Executor thread started", __func__);
+
+    std::deque<Job> jobs;
+    while (true) {
+        Job periodicJob;
+
+        {
+        std::unique_lock<std::mutex> lock(mMutex);
+        const auto hasWork = [this]() { return !mRunning || !mJobs.empty(); };
+        if (mPeriodicJob) {
+            mCondition.wait_until(lock, mNextPeriodicRun, hasWork);
+        } else {
+            mCondition.wait(lock, hasWork);
+        }
+
+        if (!mRunning && mJobs.empty()) {
+            break;
+        }
+        jobs.swap(mJobs);
+        Metrics::set(mQueueGauge, 0);
+
+        const auto now = std::chrono::steady_clock::now();
+        if (mPeriodicJob && now >= mNextPeriodicRun) {
+            periodicJob = mPeriodicJob;
+            mNextPeriodicRun = now + mPeriod;
+        }
+        }
+
+        if (periodicJob) {
+            periodicJob();
+        }
+
+        Debug::Log::v(LOG_TAG, "%s(): Running %u jobs", __func__, jobs.size());
+        for (Job& job : jobs) {
+            job();
+        }
+        jobs.clear();
+    }
+
+    Debug::Log::d(LOG_TAG, "%s(): Executor thread stopped", __func__);
+}
+
+}  // namespace server
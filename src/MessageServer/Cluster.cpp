@@ -0,0 +1,521 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <arpa/inet.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "Metrics.hpp"
+#include "MessageServer/Cluster.hpp"
+
+static __attribute_used__ Debug::Tag LOG_TAG("Cluster");
+
+using server::comm::Message;
+using server::net::ClientSocket;
+using server::net::ServerSocket;
+using server::net::Socket;
+using server::net::SocketException;
+
+Cluster::Cluster(const std::string& address, const std::vector<std::string>& peers,
+                 ForwardHandler onForward)
+:   mAddress(address),
+    mOnForward(onForward),
+    mOutgoing(peers.size()),
+    mReadBuffer(READ_BUFFER_SIZE)
+{
+    for (std::size_t i = 0; i < peers.size(); i++) {
+        mOutgoing[i].address = peers[i];
+    }
+}
+
+Cluster::~Cluster() {
+    stop();
+}
+
+bool Cluster::start() {
+    std::string host;
+    if (!parseAddress(mAddress, host, mPort)) {
+        Debug::Log::e(LOG_TAG, "Invalid node address %s", mAddress.c_str());
+        return false;
+    }
+
+    for (OutgoingLink& link : mOutgoing) {
+        if (!parseAddress(link.address, link.host, link.port)) {
+            Debug::Log::e(LOG_TAG, "Invalid node address %s", link.address.c_str());
+            return false;
+        }
+    }
+
+    try {
+        mServerSocket = std::make_unique<ServerSocket>(Socket::Domain::IPv4, Socket::Type::STREAM, mPort);
+        mServerSocket->Listen();
+    }
+    catch (SocketException& exception) {
+        Debug::Log::e(LOG_TAG, "Can't listen on port %u: %s", mPort, exception.what());
+        return false;
+    }
+
+    Debug::Log::i(LOG_TAG, "Node %s with %lu peers", mAddress.c_str(), mOutgoing.size());
+
+    mRunning = true;
+    mAcceptThread = std::thread(&Cluster::acceptLinks, this);
+    mLinkThread = std::thread(&Cluster::runLinks, this);
+    return true;
+}
+
+void Cluster::stop() {
+    if (!mRunning.exchange(false)) {
+        return;
+    }
+
+    // Wake up the accept thread
+    ClientSocket wakeUp(Socket::Domain::IPv4, Socket::Type::STREAM, "127.0.0.1", mPort);
+    try {
+        wakeUp.Connect();
+    }
+    catch (SocketException& exception) {
+        Debug::Log::w(LOG_TAG, "%s(): %s", __func__, exception.what());
+    }
+    mAcceptThread.join();
+    wakeUp.Disconnect();
+    mLinkThread.join();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (OutgoingLink& link : mOutgoing) {
+        disconnect(link);
+    }
+    for (IncomingLink& link : mIncoming) {
+        link.connection.Disconnect();
+    }
+    mIncoming.clear();
+    mServerSocket->Disconnect();
+}
+
+void Cluster::setUserOnline(const std::string& user, bool online) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (online && mLocal.users.insert(user).second) {
+        queueFrameToAll(USER_ONLINE, user);
+    } else if (!online && mLocal.users.erase(user) > 0) {
+        queueFrameToAll(USER_OFFLINE, user);
+    }
+}
+
+void Cluster::setTopicActive(const std::string& topic, bool active) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (active && mLocal.topics.insert(topic).second) {
+        queueFrameToAll(TOPIC_ADDED, topic);
+    } else if (!active && mLocal.topics.erase(topic) > 0) {
+        queueFrameToAll(TOPIC_REMOVED, topic);
+    }
+}
+
+void Cluster::forwardToAll(const std::vector<uint8_t>& frame) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (OutgoingLink& link : mOutgoing) {
+        const Presence* presence = findPresence(link.address);
+        if (link.connected && presence != nullptr && !presence->users.empty()) {
+            queueFrame(link, FORWARD, frame.data(), frame.size());
+        }
+    }
+}
+
+void Cluster::forwardToNodes(const std::vector<uint8_t>& frame) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (OutgoingLink& link : mOutgoing) {
+        if (link.connected) {
+            queueFrame(link, FORWARD, frame.data(), frame.size());
+        }
+    }
+}
+
+void Cluster::forwardToTopic(const std::string& topic, const std::vector<uint8_t>& frame) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (OutgoingLink& link : mOutgoing) {
+        const Presence* presence = findPresence(link.address);
+        if (link.connected && presence != nullptr && presence->topics.count(topic) > 0) {
+            queueFrame(link, FORWARD, frame.data(), frame.size());
+        }
+    }
+}
+
+const std::string& Cluster::getAddress() const {
+    return mAddress;
+}
+
+std::size_t Cluster::getNumConnectedNodes() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::size_t count = 0;
+    for (const OutgoingLink& link : mOutgoing) {
+        count += link.connected? 1 : 0;
+    }
+    return count;
+}
+
+std::size_t Cluster::getNumRemoteUsers() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::size_t count = 0;
+    for (const IncomingLink& link : mIncoming) {
+        count += link.presence.users.size();
+    }
+    return count;
+}
+
+bool Cluster::isUserOnline(const std::string& user) const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const IncomingLink& link : mIncoming) {
+        if (link.presence.users.count(user) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Cluster::parseAddress(const std::string& address, std::string& host, uint16_t& port) {
+    const std::size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        return false;
+    }
+
+    char* end;
+    const long value = strtol(address.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || value <= 0 || value > UINT16_MAX) {
+        return false;
+    }
+
+    // Only IPv4 addresses, like the sockets
+    in_addr parsed;
+    host = address.substr(0, colon);
+    if (inet_pton(AF_INET, host.c_str(), &parsed) != 1) {
+        return false;
+    }
+
+    port = static_cast<uint16_t>(value);
+    return true;
+}
+
+void Cluster::acceptLinks() {
+    while (mRunning) {
+        try {
+            server::net::Connection connection = mServerSocket->Accept();
+            if (!mRunning) {
+                connection.Disconnect();
+                break;
+            }
+
+            std::lock_guard<std::mutex> lock(mMutex);
+            mIncoming.emplace_back();
+            mIncoming.back().connection = connection;
+        }
+        catch (SocketException& exception) {
+            Debug::Log::e(LOG_TAG, "%s(): %s", __func__, exception.what());
+        }
+    }
+}
+
+void Cluster::runLinks() {
+    while (mRunning) {
+        connectLinks();
+        flushLinks();
+        readLinks();
+
+        std::this_thread::sleep_for(mLinkPeriod_ms);
+    }
+}
+
+void Cluster::connectLinks() {
+    const auto now = std::chrono::steady_clock::now();
+
+    for (OutgoingLink& link : mOutgoing) {
+        // Only this thread opens links, so the connecting socket is used without the mutex
+        if (link.connecting == nullptr) {
+            {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (link.connected || now < link.nextAttempt) {
+                continue;
+            }
+            link.nextAttempt = now + mReconnectPeriod_ms;
+            }
+
+            link.connecting = std::make_unique<ClientSocket>(
+                Socket::Domain::IPv4, Socket::Type::STREAM, link.host, link.port);
+            link.connectDeadline = now + mConnectTimeout_ms;
+            try {
+                link.connecting->StartConnect();
+            }
+            catch (SocketException& exception) {
+                Debug::Log::v(LOG_TAG, "%s(): Node %s not available", __func__, link.address.c_str());
+                link.connecting->Disconnect();
+                link.connecting.reset();
+                continue;
+            }
+        }
+
+        bool connected = false;
+        try {
+            connected = link.connecting->FinishConnect();
+        }
+        catch (SocketException& exception) {
+            Debug::Log::v(LOG_TAG, "%s(): Node %s not available", __func__, link.address.c_str());
+            link.connecting->Disconnect();
+            link.connecting.reset();
+            continue;
+        }
+
+        if (!connected) {
+            if (now >= link.connectDeadline) {
+                Debug::Log::v(LOG_TAG, "%s(): Timed out connecting to node %s", __func__, link.address.c_str());
+                link.connecting->Disconnect();
+                link.connecting.reset();
+            }
+            continue;
+        }
+
+        std::unique_ptr<ClientSocket> socket = std::move(link.connecting);
+        socket->SetNoDelay();
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        link.socket = std::move(socket);
+        link.connected = true;
+        link.pending.clear();
+
+        queueFrame(link, HELLO, (const uint8_t*) mAddress.c_str(), mAddress.length());
+        for (const std::string& user : mLocal.users) {
+            queueFrame(link, USER_ONLINE, (const uint8_t*) user.c_str(), user.length());
+        }
+        for (const std::string& topic : mLocal.topics) {
+            queueFrame(link, TOPIC_ADDED, (const uint8_t*) topic.c_str(), topic.length());
+        }
+
+        Debug::Log::i(LOG_TAG, "Connected to node %s", link.address.c_str());
+    }
+}
+
+void Cluster::flushLinks() {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    for (OutgoingLink& link : mOutgoing) {
+        if (!link.connected) {
+            continue;
+        }
+
+        // Nothing is received through outgoing links, so this only detects a closed link
+        uint8_t byte;
+        if (link.socket->Read(&byte, sizeof(byte), MSG_DONTWAIT) == 0) {
+            Debug::Log::w(LOG_TAG, "Node %s closed the link", link.address.c_str());
+            disconnect(link);
+            continue;
+        }
+
+        if (link.dropped > 0) {
+            Debug::Log::w(LOG_TAG, "Dropped %lu messages to node %s, which is not keeping up",
+                link.dropped, link.address.c_str());
+            link.dropped = 0;
+        }
+
+        if (link.pending.empty()) {
+            continue;
+        }
+
+        const ssize_t sent = link.socket->Send(link.pending.data(), link.pending.size(),
+                                               MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                Debug::Log::w(LOG_TAG, "Link to node %s failed: %s",
+                    link.address.c_str(), strerror(errno));
+                disconnect(link);
+            }
+            continue;
+        }
+
+        link.pending.erase(link.pending.begin(), link.pending.begin() + sent);
+    }
+}
+
+void Cluster::readLinks() {
+    std::vector<std::vector<uint8_t>> forwarded;
+
+    {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    for (auto link = mIncoming.begin(); link != mIncoming.end(); ) {
+        bool closed = false;
+
+        while (true) {
+            const ssize_t numBytes = link->connection.Read(mReadBuffer.data(), mReadBuffer.size(),
+                                                           MSG_DONTWAIT);
+            if (numBytes == 0 || (numBytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                closed = true;
+                break;
+            }
+            if (numBytes < 0) {
+                break;
+            }
+
+            link->received.insert(link->received.end(), mReadBuffer.data(), mReadBuffer.data() + numBytes);
+            if (static_cast<std::size_t>(numBytes) < mReadBuffer.size()) {
+                break;
+            }
+        }
+
+        // Frames can be split across reads
+        std::vector<uint8_t>& received = link->received;
+        std::size_t position = 0;
+        while (!closed && received.size() - position >= sizeof(Message::Header)) {
+            Message::Header header;
+            memcpy(&header, received.data() + position, sizeof(header));
+            if (received.size() - position - sizeof(header) < header.size) {
+                break;
+            }
+
+            const Message message(received.data() + position, sizeof(header) + header.size);
+            if (!message.isValid()) {
+                Debug::Log::e(LOG_TAG, "Invalid frame from node %s", link->node.c_str());
+                closed = true;
+                break;
+            }
+
+            handleFrame(*link, message, forwarded);
+            position += message.getLength();
+        }
+        received.erase(received.begin(), received.begin() + position);
+
+        if (closed) {
+            Debug::Log::i(LOG_TAG, "Node %s disconnected", link->node.c_str());
+            link->connection.Disconnect();
+            link = mIncoming.erase(link);
+        } else {
+            link++;
+        }
+    }
+    }
+
+    for (std::vector<uint8_t>& frame : forwarded) {
+        mOnForward(std::move(frame));
+    }
+}
+
+void Cluster::handleFrame(IncomingLink& link, const Message& message,
+                          std::vector<std::vector<uint8_t>>& forwarded)
+{
+    const char* payload = (const char*) message.getPayload();
+    const std::size_t size = message.getPayloadSize();
+
+    switch (message.getType()) {
+    case HELLO:
+        link.node.assign(payload, size);
+        link.presence = {};
+        Debug::Log::i(LOG_TAG, "Node %s connected", link.node.c_str());
+
+        // The node is up, so do not wait to open the link to it
+        for (OutgoingLink& outgoing : mOutgoing) {
+            if (outgoing.address == link.node && !outgoing.connected) {
+                outgoing.nextAttempt = {};
+            }
+        }
+        break;
+
+    case USER_ONLINE:
+        link.presence.users.emplace(payload, size);
+        break;
+
+    case USER_OFFLINE:
+        link.presence.users.erase(std::string(payload, size));
+        break;
+
+    case TOPIC_ADDED:
+        link.presence.topics.emplace(payload, size);
+        break;
+
+    case TOPIC_REMOVED:
+        link.presence.topics.erase(std::string(payload, size));
+        break;
+
+    case FORWARD:
+        forwarded.emplace_back(message.getPayload(), message.getPayload() + size);
+        break;
+
+    default:
+        Debug::Log::w(LOG_TAG, "Unknown frame type %u from node %s",
+            message.getType(), link.node.c_str());
+        break;
+    }
+}
+
+bool Cluster::queueFrame(OutgoingLink& link, server::comm::MessageType type, const uint8_t* payload,
+                         std::size_t size)
+{
+    if (size > UINT16_MAX) {
+        Debug::Log::w(LOG_TAG, "%s(): Frame of %lu bytes is too big", __func__, size);
+        return false;
+    }
+
+    // Presence is never dropped, or the other node would keep a wrong view of this one
+    if (type == FORWARD &&
+        link.pending.size() + sizeof(Message::Header) + size > LINK_MAX_PENDING_BYTES)
+    {
+        link.dropped++;
+        server::Metrics::increment(server::Metrics::DROPPED_FRAMES);
+        return false;
+    }
+
+    const Message message(type, payload, static_cast<uint16_t>(size));
+    message.serialize(link.pending);
+    return true;
+}
+
+void Cluster::queueFrameToAll(server::comm::MessageType type, const std::string& payload) {
+    for (OutgoingLink& link : mOutgoing) {
+        if (link.connected) {
+            queueFrame(link, type, (const uint8_t*) payload.c_str(), payload.length());
+        }
+    }
+}
+
+const Cluster::Presence* Cluster::findPresence(const std::string& node) const {
+    // The newest link of a node is the current one
+    for (auto link = mIncoming.rbegin(); link != mIncoming.rend(); link++) {
+        if (link->node == node) {
+            return &link->presence;
+        }
+    }
+    return nullptr;
+}
+
+void Cluster::disconnect(OutgoingLink& link) {
+    if (link.socket != nullptr) {
+        link.socket->Disconnect();
+        link.socket.reset();
+    }
+    if (link.connecting != nullptr) {
+        link.connecting->Disconnect();
+        link.connecting.reset();
+    }
+    link.connected = false;
+    link.pending.clear();
+    link.dropped = 0;
+}
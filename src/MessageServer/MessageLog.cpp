@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+
+#include "MessageServer/MessageLog.hpp"
+
+static __attribute_used__ Debug::Tag LOG_TAG("MessageLog");
+
+static const char* LOG_EXTENSION = ".log";
+static const char* INDEX_EXTENSION = ".idx";
+
+/**
+ * \brief Write a whole buffer to a file descriptor.
+ * \return true if all the bytes were written, false otherwise.
+ */
+static bool writeAll(int fd, const void* buffer, std::size_t size) {
+    const uint8_t* data = static_cast<const uint8_t*>(buffer);
+    while (size > 0) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+MessageLog::Mapping::~Mapping() {
+    munmap(data, size);
+}
+
+MessageLog::Segment::~Segment() {
+    if (logFd >= 0) {
+        close(logFd);
+    }
+    if (indexFd >= 0) {
+        close(indexFd);
+    }
+}
+
+std::shared_ptr<const MessageLog::Mapping> MessageLog::Segment::map() {
+    if (mapping != nullptr && mapping->size >= flushedSize) {
+        return mapping;
+    }
+
+    if (flushedSize == 0) {
+        return nullptr;
+    }
+
+    const int fd = open(logPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Debug::Log::e(LOG_TAG, "%s(): Can't open %s: %s", __func__, logPath.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    void* data = mmap(nullptr, flushedSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        Debug::Log::e(LOG_TAG, "%s(): Can't map %s: %s", __func__, logPath.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    // Replays still sending from the previous mapping keep it alive
+    mapping = std::make_shared<const Mapping>(static_cast<uint8_t*>(data), flushedSize);
+    return mapping;
+}
+
+MessageLog::MessageLog(const std::string& directory, std::size_t segmentMaxBytes, std::size_t maxBytes,
+                       int64_t maxAge_ms)
+:   mDirectory(directory),
+    mSegmentMaxBytes(segmentMaxBytes),
+    mMaxBytes(maxBytes),
+    mMaxAge_ms(maxAge_ms)
+{
+    load();
+}
+
+MessageLog::~MessageLog() {
+    flush();
+}
+
+uint64_t MessageLog::append(const server::comm::Message& message, int64_t timestamp_ms) {
+    std::vector<uint8_t> frame;
+    message.serialize(frame);
+    return append(frame.data(), frame.size(), timestamp_ms);
+}
+
+uint64_t MessageLog::append(const uint8_t* frame, std::size_t size, int64_t timestamp_ms) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    SegmentPtr segment = getActiveSegment();
+    if (segment->size > 0 && segment->size + size > mSegmentMaxBytes) {
+        segment = createSegment(segment->baseOffset + segment->index.size());
+    }
+
+    // Timestamps never go back, so that records can be searched by time
+    mLastTimestamp = std::max(mLastTimestamp, timestamp_ms);
+
+    segment->index.push_back({mLastTimestamp, segment->size, static_cast<uint32_t>(size)});
+    segment->pendingData.insert(segment->pendingData.end(), frame, frame + size);
+    segment->size += size;
+    mSize += size;
+
+    return segment->baseOffset + segment->index.size() - 1;
+}
+
+void MessageLog::flush() {
+    std::lock_guard<std::mutex> flushLock(mFlushMutex);
+
+    struct PendingWrite {
+        SegmentPtr segment;
+        std::vector<IndexEntry> entries;
+    };
+
+    std::vector<PendingWrite> writes;
+    {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& segment : mSegments) {
+        Segment& s = *segment.second;
+        if (s.pendingData.empty()) {
+            continue;
+        }
+
+        PendingWrite write;
+        write.segment = segment.second;
+        s.writingData.swap(s.pendingData);
+        write.entries.assign(s.index.begin() + s.flushedRecords, s.index.end());
+        writes.push_back(std::move(write));
+    }
+    }
+
+    // Files are written without holding the mutex, so appends are not blocked. Only
+    // flush() changes writingData, and replays only read it.
+    for (PendingWrite& write : writes) {
+        Segment& segment = *write.segment;
+
+        // The data goes first. Index entries of records that were not completely written
+        // are dropped when the log is loaded.
+        const bool written =
+            writeAll(segment.logFd, segment.writingData.data(), segment.writingData.size()) &&
+            writeAll(segment.indexFd, write.entries.data(), write.entries.size() * sizeof(IndexEntry));
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!written) {
+            Debug::Log::e(LOG_TAG, "%s(): Can't write segment %s: %s",
+                __func__, segment.logPath.c_str(), strerror(errno));
+
+            // Written again in the next flush
+            segment.pendingData.insert(segment.pendingData.begin(),
+                segment.writingData.begin(), segment.writingData.end());
+            segment.writingData.clear();
+            continue;
+        }
+
+        segment.flushedRecords += write.entries.size();
+        segment.flushedSize += segment.writingData.size();
+        segment.writingData.clear();
+    }
+}
+
+void MessageLog::applyRetention(int64_t now_ms) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    while (mSegments.size() > 1) {
+        const SegmentPtr oldest = mSegments.begin()->second;
+        if (oldest->flushedRecords < oldest->index.size()) {
+            break;
+        }
+
+        const bool tooBig = mSize > mMaxBytes;
+        const bool tooOld = oldest->index.empty() || oldest->index.back().timestamp < now_ms - mMaxAge_ms;
+        if (!tooBig && !tooOld) {
+            break;
+        }
+
+        Debug::Log::i(LOG_TAG, "Deleting segment %s (%" PRIu64 " bytes)",
+            oldest->logPath.c_str(), oldest->size);
+
+        // Replays still sending from its mapping keep it alive
+        unlink(oldest->logPath.c_str());
+        unlink(oldest->indexPath.c_str());
+        mSize -= oldest->size;
+        mSegments.erase(mSegments.begin());
+    }
+}
+
+uint64_t MessageLog::getBeginOffset() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSegments.begin()->first;
+}
+
+uint64_t MessageLog::getEndOffset() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    const SegmentPtr segment = getActiveSegment();
+    return segment->baseOffset + segment->index.size();
+}
+
+std::size_t MessageLog::getSize() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSize;
+}
+
+uint64_t MessageLog::findOffset(int64_t timestamp_ms) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    uint64_t endOffset = 0;
+    for (auto& entry : mSegments) {
+        const Segment& segment = *entry.second;
+        const auto begin = segment.index.begin();
+        const auto end = segment.index.end();
+
+        const auto found = std::lower_bound(begin, end, timestamp_ms,
+            [](const IndexEntry& record, int64_t timestamp) {
+                return record.timestamp < timestamp;
+            });
+
+        if (found != end) {
+            return segment.baseOffset + (found - begin);
+        }
+        endOffset = segment.baseOffset + segment.index.size();
+    }
+
+    return endOffset;
+}
+
+uint64_t MessageLog::replay(uint64_t fromOffset, uint64_t toOffset, std::size_t maxBytes,
+                            const Sender& sender) {
+    uint64_t offset = fromOffset;
+    std::size_t sentBytes = 0;
+
+    while (sentBytes < maxBytes && offset < toOffset) {
+        SegmentPtr segment;
+        std::shared_ptr<const Mapping> mapping;
+        std::vector<uint8_t> unflushed;
+        std::size_t firstRecord;
+        std::size_t record;
+        std::size_t position;
+        std::size_t size = 0;
+
+        {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto found = mSegments.upper_bound(offset);
+        if (found == mSegments.begin()) {
+            Debug::Log::d(LOG_TAG, "%s(): Records before %" PRIu64 " were deleted",
+                __func__, found->first);
+            offset = found->first;
+        } else {
+            found--;
+        }
+
+        segment = found->second;
+        record = offset - segment->baseOffset;
+
+        if (record >= segment->index.size()) {
+            // Continue in the next segment, if there is one
+            auto next = std::next(found);
+            if (next == mSegments.end() || next->first <= offset) {
+                break;
+            }
+            offset = next->first;
+            continue;
+        }
+
+        // Records of a segment are contiguous, so a range of them is sent at once. A range
+        // is either in the file or in memory.
+        const bool flushed = (record < segment->flushedRecords);
+        std::size_t endRecord = std::min<uint64_t>(segment->index.size(), toOffset - segment->baseOffset);
+        if (flushed) {
+            endRecord = std::min(endRecord, segment->flushedRecords);
+        }
+
+        firstRecord = record;
+        position = segment->index[record].position;
+        while (record < endRecord &&
+               (size == 0 || sentBytes + size + segment->index[record].size <= maxBytes))
+        {
+            size += segment->index[record].size;
+            record++;
+        }
+
+        if (flushed) {
+            mapping = segment->map();
+            if (mapping == nullptr) {
+                break;
+            }
+        } else {
+            // Copied, since the buffers change with the next append or flush
+            const std::vector<uint8_t>& writing = segment->writingData;
+            const std::vector<uint8_t>& pending = segment->pendingData;
+            const std::size_t begin = position - segment->flushedSize;
+            if (begin + size > writing.size() + pending.size()) {
+                Debug::Log::e(LOG_TAG, "%s(): Records from %" PRIu64 " are not in memory", __func__, offset);
+                break;
+            }
+
+            unflushed.reserve(size);
+            if (begin < writing.size()) {
+                unflushed.insert(unflushed.end(), writing.begin() + begin,
+                    writing.begin() + std::min(writing.size(), begin + size));
+            }
+            if (unflushed.size() < size) {
+                const std::size_t pendingBegin = (begin > writing.size())? begin - writing.size() : 0;
+                unflushed.insert(unflushed.end(), pending.begin() + pendingBegin,
+                    pending.begin() + pendingBegin + (size - unflushed.size()));
+            }
+        }
+        }
+
+        const uint8_t* data = (mapping != nullptr)? mapping->data + position : unflushed.data();
+        const std::size_t sent = sender(data, size);
+        sentBytes += sent;
+
+        if (sent < size) {
+            // Resumed from the first record that was not sent
+            std::lock_guard<std::mutex> lock(mMutex);
+            record = firstRecord;
+            for (std::size_t bytes = 0; bytes < sent; record++) {
+                bytes += segment->index[record].size;
+            }
+            offset = segment->baseOffset + record;
+            break;
+        }
+        offset = segment->baseOffset + record;
+    }
+
+    return offset;
+}
+
+void MessageLog::load() {
+    if (mkdir(mDirectory.c_str(), 0755) != 0 && errno != EEXIST) {
+        Debug::Log::e(LOG_TAG, "%s(): Can't create %s: %s", __func__, mDirectory.c_str(), strerror(errno));
+    }
+
+    std::vector<uint64_t> baseOffsets;
+    DIR* dir = opendir(mDirectory.c_str());
+    if (dir != nullptr) {
+        struct dirent* file;
+        while ((file = readdir(dir)) != nullptr) {
+            uint64_t baseOffset;
+            char extension[8];
+            if (sscanf(file->d_name, "%" SCNu64 "%7s", &baseOffset, extension) == 2 &&
+                strcmp(extension, LOG_EXTENSION) == 0)
+            {
+                baseOffsets.push_back(baseOffset);
+            }
+        }
+        closedir(dir);
+    }
+
+    std::sort(baseOffsets.begin(), baseOffsets.end());
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const uint64_t baseOffset : baseOffsets) {
+        SegmentPtr segment = createSegment(baseOffset);
+
+        struct stat logStat;
+        struct stat indexStat;
+        if (fstat(segment->logFd, &logStat) != 0 || fstat(segment->indexFd, &indexStat) != 0) {
+            continue;
+        }
+
+        segment->index.resize(indexStat.st_size / sizeof(IndexEntry));
+        if (pread(segment->indexFd, segment->index.data(), segment->index.size() * sizeof(IndexEntry), 0) < 0) {
+            segment->index.clear();
+        }
+
+        // Keep the records that were completely written
+        uint64_t size = 0;
+        std::size_t records = 0;
+        while (records < segment->index.size() &&
+               segment->index[records].position == size &&
+               size + segment->index[records].size <= static_cast<uint64_t>(logStat.st_size))
+        {
+            size += segment->index[records].size;
+            records++;
+        }
+
+        if (records < segment->index.size() || size < static_cast<uint64_t>(logStat.st_size)) {
+            Debug::Log::w(LOG_TAG, "%s(): Dropping incomplete records of %s", __func__, segment->logPath.c_str());
+            segment->index.resize(records);
+            if (ftruncate(segment->logFd, size) != 0 ||
+                ftruncate(segment->indexFd, records * sizeof(IndexEntry)) != 0)
+            {
+                Debug::Log::e(LOG_TAG, "%s(): Can't truncate %s", __func__, segment->logPath.c_str());
+            }
+        }
+
+        segment->size = size;
+        segment->flushedSize = size;
+        segment->flushedRecords = records;
+        mSize += size;
+
+        if (!segment->index.empty()) {
+            mLastTimestamp = std::max(mLastTimestamp, segment->index.back().timestamp);
+        }
+    }
+
+    if (mSegments.empty()) {
+        createSegment(0);
+    }
+
+    Debug::Log::i(LOG_TAG, "Loaded %u segments (%u bytes)", mSegments.size(), mSize);
+}
+
+MessageLog::SegmentPtr MessageLog::createSegment(uint64_t baseOffset) {
+    SegmentPtr segment = std::make_shared<Segment>();
+    segment->baseOffset = baseOffset;
+    segment->logPath = getSegmentPath(baseOffset, LOG_EXTENSION);
+    segment->indexPath = getSegmentPath(baseOffset, INDEX_EXTENSION);
+    segment->logFd = open(segment->logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    segment->indexFd = open(segment->indexPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+
+    if (segment->logFd < 0 || segment->indexFd < 0) {
+        Debug::Log::e(LOG_TAG, "%s(): Can't open segment %s: %s",
+            __func__, segment->logPath.c_str(), strerror(errno));
+    }
+
+    mSegments[baseOffset] = segment;
+    return segment;
+}
+
+MessageLog::SegmentPtr MessageLog::getActiveSegment() const {
+    return std::prev(mSegments.end())->second;
+}
+
+std::string MessageLog::getSegmentPath(uint64_t baseOffset, const char* extension) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%020" PRIu64 "%s", baseOffset, extension);
+    return mDirectory + "/" + name;
+}
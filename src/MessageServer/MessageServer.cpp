@@ -15,24 +15,137 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cerrno>
+#include <cstring>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "debug.hpp"
 
 #include "MessageServer/MessageServer.hpp"
 
-static __attribute_used__ const char* LOG_TAG = "MessageServer";
+static __attribute_used__ Debug::Tag LOG_TAG("MessageServer");
 static const char* SERVER_NAME = "Message";
 
-MessageServer::MessageServer(const uint16_t port) : Server(SERVER_NAME, port, false) {
+MessageServer::MessageServer(const uint16_t port, const std::string& nodeAddress,
+                             const std::vector<std::string>& peers,
+                             const OfflineQueues::Limits& offlineLimits)
+:   Server(SERVER_NAME, port, false),
+    mLog(LOG_DIRECTORY, LOG_SEGMENT_MAX_BYTES, LOG_MAX_BYTES, LOG_MAX_AGE_ms),
+    mOfflineQueues(mLog, offlineLimits),
+    mTopics(MAX_TOPICS_PER_CLIENT)
+{
+    // Relayed messages are written to the log in batches, off the server loop
+    mDbExecutor.setPeriodicJob(mLogFlushPeriod_ms, [this]() {
+        mLog.flush();
+        mLog.applyRetention(getCurrentTime_ms());
+    });
+
+    if (!nodeAddress.empty()) {
+        mCluster = std::make_unique<Cluster>(nodeAddress, peers, [this](std::vector<uint8_t>&& frame) {
+            const server::comm::SharedFrame shared =
+                std::make_shared<const std::vector<uint8_t>>(std::move(frame));
+            postCompletion([this, shared]() {
+                handleForwarded(shared);
+            });
+        });
+
+        if (!mCluster->start()) {
+            Debug::Log::e(LOG_TAG, "Could not join the cluster. Running as a single node");
+            mCluster.reset();
+        }
+    }
+}
+
+MessageServer::~MessageServer() {
+    // The cluster posts completions, and the periodic job uses mLog
+    mCluster.reset();
+    mDbExecutor.stop();
 }
 
 void MessageServer::onLogin(Client& client) {
     Message msg(
         MessageTypes::USER_LOGGED_IN,
-        (uint8_t*) client.user->token.c_str(),
+        (const uint8_t*) client.user->token.c_str(),
         client.user->token.length() + 1
     );
 
     sendMsgToOthers(msg, client);
+
+    if (mCluster != nullptr) {
+        if (client.user->clients.size() == 1) {
+            mCluster->setUserOnline(client.user->token, true);
+        }
+
+        std::vector<uint8_t> frame;
+        msg.serialize(frame);
+        mCluster->forwardToAll(frame);
+    }
+
+    if (mOfflineQueues.stopQueueing(client.user->token)) {
+        deliverOfflineMessages(client.user->token, client.id);
+    }
+}
+
+void MessageServer::onClientRemoved(User& user, ClientId clientId) {
+    const std::vector<std::string> emptiedTopics = mTopics.removeClient(clientId);
+
+    // Clients of the user in other nodes still receive the messages
+    if (user.clients.empty() && (mCluster == nullptr || !mCluster->isUserOnline(user.token))) {
+        mOfflineQueues.addUser(user.token);
+    }
+
+    if (mCluster != nullptr) {
+        for (const std::string& topic : emptiedTopics) {
+            mCluster->setTopicActive(topic, false);
+        }
+        if (user.clients.empty()) {
+            mCluster->setUserOnline(user.token, false);
+        }
+    }
+}
+
+void MessageServer::getStatus(server::AdminStatus& status) {
+    Server::getStatus(status);
+
+    status.values.emplace_back("offline_queue_bytes", mOfflineQueues.getMemorySize());
+    status.values.emplace_back("offline_users", mOfflineQueues.getNumUsers());
+    status.values.emplace_back("topics", mTopics.getNumTopics());
+    status.values.emplace_back("log_bytes", mLog.getSize());
+    status.values.emplace_back("log_end_offset", mLog.getEndOffset());
+
+    if (mCluster != nullptr) {
+        status.info.emplace_back("node", mCluster->getAddress());
+        status.values.emplace_back("cluster_connected_nodes", mCluster->getNumConnectedNodes());
+        status.values.emplace_back("cluster_remote_users", mCluster->getNumRemoteUsers());
+    }
+}
+
+void MessageServer::deliverOfflineMessages(const std::string& token, ClientId clientId) {
+    Client* client = findClient(token, clientId);
+    if (client == nullptr) {
+        // The client left, but the user may have others
+        User* user = findUser(token);
+        if (user == nullptr || user->clients.empty()) {
+            return;
+        }
+        client = &user->clients.front();
+    }
+
+    const bool more = mOfflineQueues.drain(token, OFFLINE_BATCH_BYTES,
+        [this, client](const uint8_t* data, std::size_t size) {
+            return sendWithoutBlocking(data, size, *client);
+        });
+
+    // Let other clients be served between batches, and a slow client read what it got
+    if (more) {
+        postCompletion([this, token, id = client->id]() {
+            deliverOfflineMessages(token, id);
+        });
+    }
 }
 
 void MessageServer::onMessageReceived(Client& client, const Message& message) {
@@ -40,35 +153,302 @@ void MessageServer::onMessageReceived(Client& client, const Message& message) {
 
     switch (message.getType()) {
     case  MessageTypes::POST_MSG:
-        handlePostMessage((const char*) message.getPayload(), client);
+        handlePostMessage(client, message);
+        break;
+
+    case MessageTypes::REQUEST_REPLAY:
+        handleRequestReplay(client, message);
+        break;
+
+    case MessageTypes::SUBSCRIBE:
+    case MessageTypes::UNSUBSCRIBE:
+        handleSubscription(client, message);
+        break;
+
+    case MessageTypes::PUBLISH:
+        handlePublish(client, message);
+        break;
     }
 }
 
-void MessageServer::handlePostMessage(const char* rcv_msg, Client& client) {
-    (void) rcv_msg;
+void MessageServer::handlePostMessage(Client& client, const Message& message) {
+    const int64_t now = getCurrentTime_ms();
+    const server::comm::SharedFrame frame = buildPostFrame(client.user->token, now, message);
+    if (frame == nullptr) {
+        const Message errMsg(server::comm::ServerMsgTypes::ERROR);
+        sendMessage(errMsg, client);
+        return;
+    }
 
-    Message msg(MessageTypes::POST_MSG, nullptr, 0);
-    sendMsgToOthers(msg, client);
+    const uint64_t offset = mLog.append(frame->data(), frame->size(), now);
+    mOfflineQueues.push(offset, frame);
+    sendFrameToOthers(*frame, client.id);
+
+    // Every node logs it, even without users online, for replays and offline users
+    if (mCluster != nullptr) {
+        mCluster->forwardToNodes(*frame);
+    }
+}
+
+server::comm::SharedFrame MessageServer::buildPostFrame(const std::string& sender, int64_t timestamp_ms,
+                                                        const Message& message)
+{
+    // Other nodes receive the whole frame as the payload of a cluster frame
+    const std::size_t payloadSize =
+        sizeof(PostHeader) + sender.length() + 1 + message.getPayloadSize();
+    if (payloadSize > UINT16_MAX - sizeof(Message::Header)) {
+        return nullptr;
+    }
+
+    auto frame = std::make_shared<std::vector<uint8_t>>(sizeof(Message::Header) + payloadSize);
+    uint8_t* payload = frame->data() + sizeof(Message::Header);
+
+    const PostHeader header {timestamp_ms};
+    memcpy(payload, &header, sizeof(header));
+    memcpy(payload + sizeof(header), sender.c_str(), sender.length() + 1);
+    memcpy(payload + sizeof(header) + sender.length() + 1, message.getPayload(),
+           message.getPayloadSize());
+
+    // The header goes in front of the payload built in place
+    const Message post(MessageTypes::POST_MSG, payload, payloadSize);
+    post.serializeHeader(frame->data());
+    return frame;
+}
+
+void MessageServer::handleRequestReplay(Client& client, const Message& message) {
+    if (message.getPayloadSize() < sizeof(ReplayRequest)) {
+        const Message errMsg(server::comm::ServerMsgTypes::ERROR);
+        sendMessage(errMsg, client);
+        return;
+    }
+
+    ReplayRequest request;
+    memcpy(&request, message.getPayload(), sizeof(request));
+
+    const uint64_t fromOffset = (request.mode == ReplayRequest::FROM_TIME)?
+        mLog.findOffset(static_cast<int64_t>(request.value)) : request.value;
+
+    continueReplay(client.user->token, client.id, fromOffset, REPLAY_MAX_BYTES);
+}
+
+void MessageServer::continueReplay(const std::string& token, ClientId clientId, uint64_t offset,
+                                   std::size_t maxBytes)
+{
+    Client* client = findClient(token, clientId);
+    if (client == nullptr) {
+        return;
+    }
+
+    std::size_t sentBytes = 0;
+    bool blocked = false;
+    const uint64_t nextOffset = mLog.replay(offset, UINT64_MAX, maxBytes,
+        [this, client, &sentBytes, &blocked](const uint8_t* data, std::size_t size) {
+            const std::size_t sent = sendWithoutBlocking(data, size, *client);
+            sentBytes += sent;
+            blocked = (sent < size);
+            return sent;
+        });
+
+    // The rest of the part is sent when the client has read some of it
+    if (blocked && sentBytes < maxBytes) {
+        postCompletion([this, token, clientId, nextOffset, rest = maxBytes - sentBytes]() {
+            continueReplay(token, clientId, nextOffset, rest);
+        });
+        return;
+    }
+
+    Debug::Log::d(LOG_TAG, "%s(): Replayed messages up to %lu for user %s",
+        __func__, nextOffset, token.c_str());
+
+    Message endMsg(MessageTypes::REPLAY_END, (const uint8_t*) &nextOffset, sizeof(nextOffset));
+    sendMessage(endMsg, *client);
+}
+
+std::size_t MessageServer::sendWithoutBlocking(const uint8_t* data, std::size_t size, const Client& client) {
+    const ssize_t sent = sendRaw(data, size, client, MSG_DONTWAIT);
+    if (sent < 0) {
+        // Otherwise the connection failed, and the client is removed by the server loop
+        return (errno == EAGAIN || errno == EWOULDBLOCK)? 0 : size;
+    }
+
+    // End of the message where the socket buffer filled up
+    std::size_t end = 0;
+    while (end < static_cast<std::size_t>(sent)) {
+        Message::Header header;
+        memcpy(&header, data + end, sizeof(header));
+        end += sizeof(header) + header.size;
+    }
+
+    // The client must not get part of a message followed by another one
+    for (std::size_t position = sent; position < end;) {
+        const ssize_t rest = sendRaw(data + position, end - position, client);
+        if (rest <= 0) {
+            return size;
+        }
+        position += rest;
+    }
+    return end;
+}
+
+void MessageServer::handleSubscription(Client& client, const Message& message) {
+    std::string topic;
+    bool ok = parseTopic(message, topic);
+
+    const bool wasActive = ok && (mTopics.getSubscribers(topic) != nullptr);
+    if (ok && message.getType() == MessageTypes::SUBSCRIBE) {
+        ok = mTopics.subscribe(topic, client.id, client.connection);
+    } else if (ok) {
+        ok = mTopics.unsubscribe(topic, client.id);
+    }
+
+    const bool isActive = (mTopics.getSubscribers(topic) != nullptr);
+    if (ok && mCluster != nullptr && wasActive != isActive) {
+        mCluster->setTopicActive(topic, isActive);
+    }
+
+    Debug::Log::d(LOG_TAG, "%s(): %s of user %s to topic %s %s", __func__,
+        (message.getType() == MessageTypes::SUBSCRIBE)? "Subscription" : "Unsubscription",
+        client.user->token.c_str(), topic.c_str(), ok? "done" : "failed");
+
+    const Message reply(ok? server::comm::ServerMsgTypes::OK : server::comm::ServerMsgTypes::ERROR);
+    sendMessage(reply, client);
+}
+
+void MessageServer::handlePublish(Client& client, const Message& message) {
+    std::string topic;
+    if (!parseTopic(message, topic) || topic.length() == message.getPayloadSize()) {
+        const Message errMsg(server::comm::ServerMsgTypes::ERROR);
+        sendMessage(errMsg, client);
+        return;
+    }
+
+    // Serialized once for all the subscribers
+    std::vector<uint8_t> frame;
+    message.serialize(frame);
+    sendFrameToSubscribers(topic, frame, client.id);
+
+    if (mCluster != nullptr) {
+        mCluster->forwardToTopic(topic, frame);
+    }
+}
+
+void MessageServer::sendFrameToSubscribers(const std::string& topic, const std::vector<uint8_t>& frame,
+                                           ClientId except)
+{
+    const TopicIndex::Subscribers* subscribers = mTopics.getSubscribers(topic);
+    if (subscribers == nullptr) {
+        return;
+    }
+
+    for (const auto& subscriber : *subscribers) {
+        if (subscriber.first != except) {
+            sendRaw(frame.data(), frame.size(), subscriber.first, subscriber.second);
+        }
+    }
 }
 
-void MessageServer::sendMsgToOthers(Message& msg, Client& client) {
+void MessageServer::handleForwarded(const server::comm::SharedFrame& frame) {
+    const Message message(frame->data(), frame->size());
+    if (!message.isValid()) {
+        Debug::Log::w(LOG_TAG, "%s(): Invalid message forwarded by another node", __func__);
+        return;
+    }
+
+    switch (message.getType()) {
+    case MessageTypes::USER_LOGGED_IN:
+        sendFrameToOthers(*frame, NO_CLIENT);
+        break;
+
+    case MessageTypes::POST_MSG: {
+        // Logged with the time of the node that received it
+        PostHeader header {getCurrentTime_ms()};
+        if (message.getPayloadSize() >= sizeof(header)) {
+            memcpy(&header, message.getPayload(), sizeof(header));
+        }
+
+        const uint64_t offset = mLog.append(frame->data(), frame->size(), header.timestamp);
+        mOfflineQueues.push(offset, frame);
+        sendFrameToOthers(*frame, NO_CLIENT);
+        break;
+    }
+
+    case MessageTypes::PUBLISH: {
+        std::string topic;
+        if (parseTopic(message, topic)) {
+            sendFrameToSubscribers(topic, *frame, NO_CLIENT);
+        }
+        break;
+    }
+
+    default:
+        Debug::Log::w(LOG_TAG, "%s(): Unexpected message type %u forwarded by another node",
+            __func__, message.getType());
+        break;
+    }
+}
+
+bool MessageServer::parseTopic(const Message& message, std::string& topic) {
+    const char* payload = (const char*) message.getPayload();
+    const std::size_t length = strnlen(payload, message.getPayloadSize());
+    if (length == 0 || length > TOPIC_MAX_LENGTH) {
+        return false;
+    }
+
+    topic.assign(payload, length);
+    return true;
+}
+
+int64_t MessageServer::getCurrentTime_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void MessageServer::sendMsgToOthers(const Message& msg, const Client& client) {
+    std::vector<uint8_t> frame;
+    msg.serialize(frame);
+    sendFrameToOthers(frame, client.id);
+}
+
+void MessageServer::sendFrameToOthers(const std::vector<uint8_t>& frame, ClientId except) {
     for (auto& user : mUsers) {
         for (auto& snd_client : user.clients) {
-            if (&client != &snd_client) {
-                sendMessage(msg, snd_client);
+            if (snd_client.id != except) {
+                sendFrames(frame, snd_client);
             }
         }
     }
 }
 
+// The benchmarks and the tests link the server with a main of their own
+#if !defined(BENCHMARK) && !defined(TEST)
+
+/*
+ * Usage: MessageServer [--admin port] [--admin-address address] [--capture file] [port]
+ *                      [node address] [peer addresses...]
+ *        Addresses are host:port. With a node address, the server joins a cluster with
+ *        the peers, which must list this node too.
+ */
 int main(int argc, char const *argv[]) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    const uint16_t adminPort = server::AdminServer::takePortArgument(args);
+    const std::string adminAddress = server::AdminServer::takeAddressArgument(args);
+    const std::string captureFile = server::Capture::takeFileArgument(args);
+
     // Port numbers up to 1024 are reserved
-    uint16_t port = (argc <= 1)? 3001 : std::max(atoi(argv[1]), 1024 + 1);
+    uint16_t port = args.empty()? 3001 : std::max(atoi(args[0].c_str()), 1024 + 1);
+
+    const std::string nodeAddress = (args.size() <= 1)? "" : args[1];
+    const std::vector<std::string> peers(args.begin() + std::min<std::size_t>(args.size(), 2), args.end());
 
-    MessageServer server(port);
+    MessageServer server(port, nodeAddress, peers);
+    server.setAdminPort(adminPort, adminAddress);
+    if (!captureFile.empty() && !server.setCaptureFile(captureFile)) {
+        return 1;
+    }
     server.run();
 
     Debug::Log::i(LOG_TAG, "Server shut down");
 
     return 0;
 }
+#endif  // !defined(BENCHMARK) && !defined(TEST)
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "MessageServer/OfflineQueues.hpp"
+
+static __attribute_used__ Debug::Tag LOG_TAG("OfflineQueues");
+
+OfflineQueues::OfflineQueues(MessageLog& log, const Limits& limits)
+:   mLog(log),
+    mLimits(limits),
+    mEndOffset(log.getEndOffset())
+{
+}
+
+void OfflineQueues::addUser(const std::string& user) {
+    Debug::Log::d(LOG_TAG, "%s(): Queueing messages for user %s", __func__, user.c_str());
+
+    // The messages not delivered yet stay in the queue
+    auto found = mQueues.find(user);
+    if (found != mQueues.end()) {
+        found->second.until = UINT64_MAX;
+        return;
+    }
+
+    if (mQueues.size() >= mLimits.maxUsers) {
+        dropOldestQueues();
+    }
+    mQueues[user] = {mEndOffset, UINT64_MAX};
+}
+
+bool OfflineQueues::stopQueueing(const std::string& user) {
+    auto found = mQueues.find(user);
+    if (found == mQueues.end()) {
+        return false;
+    }
+
+    // Another client of the user is receiving them
+    Queue& queue = found->second;
+    if (queue.until != UINT64_MAX) {
+        return false;
+    }
+
+    queue.until = mEndOffset;
+    if (queue.from >= queue.until) {
+        mQueues.erase(found);
+        return false;
+    }
+
+    // Only the last messages are delivered
+    if (queue.until - queue.from > mLimits.maxMessagesPerUser) {
+        Debug::Log::w(LOG_TAG, "%s(): Dropping %lu old messages of user %s",
+            __func__, queue.until - queue.from - mLimits.maxMessagesPerUser, user.c_str());
+        queue.from = queue.until - mLimits.maxMessagesPerUser;
+    }
+    return true;
+}
+
+void OfflineQueues::push(uint64_t offset, const server::comm::SharedFrame& frame) {
+    mEndOffset = offset + 1;
+
+    // Nobody would read it
+    if (mQueues.empty()) {
+        mRecent.clear();
+        mRecentBytes = 0;
+        return;
+    }
+
+    mRecentBytes += frame->size();
+    mRecent.push_back({offset, frame});
+
+    // Older messages are read from the log
+    while (mRecentBytes > mLimits.maxMemoryBytes) {
+        mRecentBytes -= mRecent.front().frame->size();
+        mRecent.pop_front();
+    }
+}
+
+bool OfflineQueues::drain(const std::string& user, std::size_t maxBytes, const MessageLog::Sender& sender) {
+    auto found = mQueues.find(user);
+    if (found == mQueues.end() || found->second.until == UINT64_MAX) {
+        return false;
+    }
+
+    Queue& queue = found->second;
+    const uint64_t from = queue.from;
+    bool blocked = false;
+
+    if (!mRecent.empty() && queue.from >= mRecent.front().offset) {
+        std::vector<uint8_t> batch;
+        const auto first = mRecent.begin() + (queue.from - mRecent.front().offset);
+        auto entry = first;
+        while (entry != mRecent.end() && entry->offset < queue.until &&
+               (batch.empty() || batch.size() + entry->frame->size() <= maxBytes))
+        {
+            batch.insert(batch.end(), entry->frame->begin(), entry->frame->end());
+            entry++;
+        }
+
+        if (!batch.empty()) {
+            const std::size_t sent = sender(batch.data(), batch.size());
+            blocked = (sent < batch.size());
+
+            // Resumed from the first message that was not sent
+            std::size_t bytes = 0;
+            for (entry = first; bytes < sent; entry++) {
+                bytes += entry->frame->size();
+                queue.from = entry->offset + 1;
+            }
+        }
+    } else {
+        Debug::Log::v(LOG_TAG, "%s(): Reading messages of user %s from the log", __func__, user.c_str());
+        queue.from = mLog.replay(queue.from, queue.until, maxBytes,
+            [&sender, &blocked](const uint8_t* data, std::size_t size) {
+                const std::size_t sent = sender(data, size);
+                blocked = (sent < size);
+                return sent;
+            });
+    }
+
+    if (queue.from >= queue.until || (queue.from == from && !blocked)) {
+        mQueues.erase(found);
+        return false;
+    }
+    return true;
+}
+
+std::size_t OfflineQueues::getMemorySize() const {
+    return mRecentBytes;
+}
+
+std::size_t OfflineQueues::getNumUsers() const {
+    return mQueues.size();
+}
+
+void OfflineQueues::dropOldestQueues() {
+    // The users that have been offline the longest have the oldest messages
+    std::vector<uint64_t> froms;
+    froms.reserve(mQueues.size());
+    for (const auto& queue : mQueues) {
+        if (queue.second.until == UINT64_MAX) {
+            froms.push_back(queue.second.from);
+        }
+    }
+
+    // The others are being delivered
+    if (froms.empty()) {
+        return;
+    }
+
+    // Make room for several users at once, so it does not run again on every addUser()
+    const std::size_t count = std::min(froms.size(), std::max<std::size_t>(1, mLimits.maxUsers / 16));
+    std::nth_element(froms.begin(), froms.begin() + (count - 1), froms.end());
+    const uint64_t threshold = froms[count - 1];
+
+    std::size_t dropped = 0;
+    for (auto queue = mQueues.begin(); queue != mQueues.end();) {
+        if (queue->second.until == UINT64_MAX && queue->second.from <= threshold) {
+            queue = mQueues.erase(queue);
+            dropped++;
+        } else {
+            queue++;
+        }
+    }
+
+    Debug::Log::w(LOG_TAG, "%s(): Dropped the queues of %zu offline users", __func__, dropped);
+}
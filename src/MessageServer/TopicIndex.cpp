@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "MessageServer/TopicIndex.hpp"
+
+static __attribute_used__ Debug::Tag LOG_TAG("TopicIndex");
+
+TopicIndex::TopicIndex(std::size_t maxTopicsPerClient)
+:   mMaxTopicsPerClient(maxTopicsPerClient)
+{
+}
+
+bool TopicIndex::subscribe(const std::string& topic, ClientId clientId,
+                           const server::net::Connection& connection)
+{
+    std::vector<std::string>& clientTopics = mClientTopics[clientId];
+    if (std::find(clientTopics.begin(), clientTopics.end(), topic) != clientTopics.end()) {
+        return true;
+    }
+
+    if (clientTopics.size() >= mMaxTopicsPerClient) {
+        Debug::Log::w(LOG_TAG, "%s(): Client %lu reached the maximum number of topics",
+            __func__, clientId);
+        return false;
+    }
+
+    clientTopics.push_back(topic);
+    mTopics[topic].emplace(clientId, connection);
+    return true;
+}
+
+bool TopicIndex::unsubscribe(const std::string& topic, ClientId clientId) {
+    auto found = mClientTopics.find(clientId);
+    if (found == mClientTopics.end()) {
+        return false;
+    }
+
+    std::vector<std::string>& clientTopics = found->second;
+    auto position = std::find(clientTopics.begin(), clientTopics.end(), topic);
+    if (position == clientTopics.end()) {
+        return false;
+    }
+
+    // Order does not matter
+    std::swap(*position, clientTopics.back());
+    clientTopics.pop_back();
+    if (clientTopics.empty()) {
+        mClientTopics.erase(found);
+    }
+
+    removeSubscriber(topic, clientId);
+    return true;
+}
+
+std::vector<std::string> TopicIndex::removeClient(ClientId clientId) {
+    std::vector<std::string> emptied;
+
+    auto found = mClientTopics.find(clientId);
+    if (found == mClientTopics.end()) {
+        return emptied;
+    }
+
+    for (const std::string& topic : found->second) {
+        removeSubscriber(topic, clientId);
+        if (mTopics.count(topic) == 0) {
+            emptied.push_back(topic);
+        }
+    }
+    mClientTopics.erase(found);
+    return emptied;
+}
+
+const TopicIndex::Subscribers* TopicIndex::getSubscribers(const std::string& topic) const {
+    auto found = mTopics.find(topic);
+    return (found != mTopics.end())? &found->second : nullptr;
+}
+
+std::size_t TopicIndex::getNumTopics() const {
+    return mTopics.size();
+}
+
+void TopicIndex::removeSubscriber(const std::string& topic, ClientId clientId) {
+    auto found = mTopics.find(topic);
+    if (found == mTopics.end()) {
+        return;
+    }
+
+    found->second.erase(clientId);
+    if (found->second.empty()) {
+        mTopics.erase(found);
+    }
+}
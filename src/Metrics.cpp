@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "Metrics.hpp"
+
+namespace server {
+
+std::size_t HistogramSnapshot::getBucket(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+
+    const unsigned shift = (63 - __builtin_clzll(value)) - SUB_BUCKET_BITS;
+    const std::size_t bucket = SUB_BUCKETS + shift * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+    return std::min(bucket, NUM_BUCKETS - 1);
+}
+
+uint64_t HistogramSnapshot::getBucketLimit(std::size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+
+    const unsigned shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+    const uint64_t mantissa = SUB_BUCKETS + (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t HistogramSnapshot::getPercentile(double fraction) const {
+    if (count == 0) {
+        return 0;
+    }
+
+    const uint64_t rank = std::max<uint64_t>(1, fraction * count + 0.5);
+    uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < buckets.size(); bucket++) {
+        seen += buckets[bucket];
+        if (seen >= rank) {
+            return std::min(getBucketLimit(bucket), max);
+        }
+    }
+    return max;
+}
+
+void HistogramSnapshot::merge(const HistogramSnapshot& other) {
+    for (std::size_t bucket = 0; bucket < buckets.size(); bucket++) {
+        buckets[bucket] += other.buckets[bucket];
+    }
+    count += other.count;
+    sum += other.sum;
+    max = std::max(max, other.max);
+}
+
+void Metrics::Snapshot::merge(const Snapshot& other) {
+    for (unsigned i = 0; i < NUM_COUNTERS; i++) {
+        counters[i] += other.counters[i];
+    }
+    for (unsigned i = 0; i < NUM_GAUGES; i++) {
+        gauges[i] += other.gauges[i];
+    }
+    for (unsigned i = 0; i < NUM_TIMERS; i++) {
+        for (const auto& histogram : other.timers[i]) {
+            timers[i][histogram.first].merge(histogram.second);
+        }
+    }
+}
+
+/**
+ * Only the thread of the shard writes, so relaxed loads and stores are enough and
+ * cheaper than atomic additions. Readers may see a slightly old value.
+ */
+struct Metrics::Histogram {
+    std::array<std::atomic<uint64_t>, HistogramSnapshot::NUM_BUCKETS> buckets {};
+    std::atomic<uint64_t> count {0};
+    std::atomic<uint64_t> sum {0};
+    std::atomic<uint64_t> max {0};
+};
+
+struct Metrics::Shard {
+    std::array<std::atomic<uint64_t>, NUM_COUNTERS> counters {};
+
+    // Index NUM_TIMED_TYPES is shared by the higher message types
+    std::array<std::array<std::atomic<Histogram*>, NUM_TIMED_TYPES + 1>, NUM_TIMERS> histograms {};
+};
+
+static inline void add(std::atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+std::mutex Metrics::sShardsMutex;
+std::vector<Metrics::Shard*> Metrics::sShards;
+std::array<std::atomic<int64_t>, Metrics::NUM_GAUGES> Metrics::sGauges {};
+
+Metrics::Shard& Metrics::getShard() {
+    static thread_local Shard* shard = nullptr;
+    if (shard == nullptr) {
+        shard = new Shard();
+        std::lock_guard<std::mutex> lock(sShardsMutex);
+        sShards.push_back(shard);
+    }
+    return *shard;
+}
+
+void Metrics::increment(Counter counter, uint64_t value) {
+    add(getShard().counters[counter], value);
+}
+
+void Metrics::set(Gauge gauge, int64_t value) {
+    sGauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+void Metrics::record(Timer timer, comm::MessageType type, uint64_t duration_ns) {
+    std::atomic<Histogram*>& slot = getShard().histograms[timer][std::min<std::size_t>(type, NUM_TIMED_TYPES)];
+
+    Histogram* histogram = slot.load(std::memory_order_acquire);
+    if (histogram == nullptr) {
+        histogram = new Histogram();
+        slot.store(histogram, std::memory_order_release);
+    }
+
+    add(histogram->buckets[HistogramSnapshot::getBucket(duration_ns)], 1);
+    add(histogram->count, 1);
+    add(histogram->sum, duration_ns);
+    if (duration_ns > histogram->max.load(std::memory_order_relaxed)) {
+        histogram->max.store(duration_ns, std::memory_order_relaxed);
+    }
+}
+
+uint64_t Metrics::getElapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+Metrics::Snapshot Metrics::getSnapshot() {
+    Snapshot snapshot;
+    for (unsigned i = 0; i < NUM_GAUGES; i++) {
+        snapshot.gauges[i] = sGauges[i].load(std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(sShardsMutex);
+    for (const Shard* shard : sShards) {
+        for (unsigned i = 0; i < NUM_COUNTERS; i++) {
+            snapshot.counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+        }
+
+        for (unsigned timer = 0; timer < NUM_TIMERS; timer++) {
+            for (std::size_t type = 0; type <= NUM_TIMED_TYPES; type++) {
+                const Histogram* histogram = shard->histograms[timer][type].load(std::memory_order_acquire);
+                if (histogram == nullptr) {
+                    continue;
+                }
+
+                HistogramSnapshot& merged = snapshot.timers[timer][type];
+                for (std::size_t bucket = 0; bucket < HistogramSnapshot::NUM_BUCKETS; bucket++) {
+                    merged.buckets[bucket] += histogram->buckets[bucket].load(std::memory_order_relaxed);
+                }
+                merged.count += histogram->count.load(std::memory_order_relaxed);
+                merged.sum += histogram->sum.load(std::memory_order_relaxed);
+                merged.max = std::max(merged.max, histogram->max.load(std::memory_order_relaxed));
+            }
+        }
+    }
+    return snapshot;
+}
+
+const char* Metrics::getName(Counter counter) {
+    static constexpr const char* NAMES[NUM_COUNTERS] = {
+        "connections_accepted",
+        "logins",
+        "auth_failures",
+        "messages_in",
+        "invalid_messages",
+        "bytes_in",
+        "bytes_out",
+        "dropped_frames",
+    };
+    return NAMES[counter];
+}
+
+const char* Metrics::getName(Gauge gauge) {
+    static constexpr const char* NAMES[NUM_GAUGES] = {
+        "connections_logged",
+        "connections_unlogged",
+        "users",
+        "completion_queue",
+        "database_queue",
+        "search_queue",
+    };
+    return NAMES[gauge];
+}
+
+const char* Metrics::getName(Timer timer) {
+    static constexpr const char* NAMES[NUM_TIMERS] = {
+        "handler_time_ns",
+        "database_time_ns",
+    };
+    return NAMES[timer];
+}
+
+}  // namespace server
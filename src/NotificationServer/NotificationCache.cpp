@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <string>
+
+#include "debug.hpp"
+
+#include "NotificationServer/NotificationCache.hpp"
+
+static __attribute_used__ Debug::Tag LOG_TAG("NotificationCache");
+
+NotificationCache::NotificationCache(std::size_t maxBytes, std::size_t maxEntryBytes)
+:   mMaxBytes(maxBytes),
+    mMaxEntryBytes(maxEntryBytes)
+{
+}
+
+NotificationCache::Frames NotificationCache::get(const std::string& user) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto found = mIndex.find(user);
+    if (found == mIndex.end()) {
+        return nullptr;
+    }
+
+    // Move to the front of the LRU list
+    mEntries.splice(mEntries.begin(), mEntries, found->second);
+    return found->second->frames;
+}
+
+uint64_t NotificationCache::getGeneration() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mGeneration;
+}
+
+void NotificationCache::put(const std::string& user, Frames frames, uint64_t generation) {
+    const std::size_t size = frames->size();
+    if (size > mMaxEntryBytes || size > mMaxBytes) {
+        Debug::Log::v(LOG_TAG, "%s(): Response of user %s too big to cache (%u bytes)",
+            __func__, user.c_str(), size);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (generation != mGeneration) {
+        Debug::Log::v(LOG_TAG, "%s(): Discarded stale response of user %s", __func__, user.c_str());
+        return;
+    }
+
+    auto found = mIndex.find(user);
+    if (found != mIndex.end()) {
+        erase(found->second);
+    }
+
+    while (mSize + size > mMaxBytes && !mEntries.empty()) {
+        erase(std::prev(mEntries.end()));
+    }
+
+    mEntries.push_front({user, std::move(frames)});
+    mIndex[user] = mEntries.begin();
+    mSize += size;
+}
+
+void NotificationCache::invalidate(const std::string& user) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mGeneration++;
+
+    auto found = mIndex.find(user);
+    if (found != mIndex.end()) {
+        erase(found->second);
+    }
+}
+
+void NotificationCache::clear() {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mGeneration++;
+    mEntries.clear();
+    mIndex.clear();
+    mSize = 0;
+}
+
+std::size_t NotificationCache::getSize() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSize;
+}
+
+void NotificationCache::erase(std::list<Entry>::iterator entry) {
+    mSize -= entry->frames->size();
+    mIndex.erase(entry->user);
+    mEntries.erase(entry);
+}
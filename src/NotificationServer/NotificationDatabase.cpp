@@ -15,6 +15,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <unordered_set>
 #include <vector>
 
 #include <sqlite3.h>
@@ -23,70 +27,539 @@
 
 #include "NotificationServer/NotificationServer.hpp"
 
-static __attribute_used__ const char* LOG_TAG = "NotificationDatabase";
+static __attribute_used__ Debug::Tag LOG_TAG("NotificationDatabase");
 
 void NotificationDatabase::init() {
     createNotificationTable();
+    hasExternalChanges();
 }
 
 void NotificationDatabase::createNotificationTable() {
     Debug::Log::d(LOG_TAG, "%s()", __func__);
 
-    static const char* SQL_CREATE_USER_TABLE =
-    "CREATE TABLE IF NOT EXISTS Notifications ("
-        "id INT PRIMARY KEY NOT NULL, "
-        "user TEXT NOT NULL, "
-        "active INT NOT NULL, "
-        "title TEXT NOT NULL, "
-        "description TEXT, "
-        "schedule TEXT NOT NULL"
-    ");";
+    static const std::vector<Migration> NOTIFICATION_MIGRATIONS = {
+        {1,
+            "CREATE TABLE IF NOT EXISTS Notifications ("
+                "id INT PRIMARY KEY NOT NULL, "
+                "user TEXT NOT NULL, "
+                "active INT NOT NULL, "
+                "title TEXT NOT NULL, "
+                "description TEXT, "
+                "schedule TEXT NOT NULL"
+            ");"},
 
-    char *zErrMsg = 0;
-    const int result = sqlite3_exec(mDb, SQL_CREATE_USER_TABLE, nullptr, nullptr, &zErrMsg);
+        // Notifications are always looked up by user and active state
+        {2,
+            "CREATE INDEX IF NOT EXISTS NotificationsByUser "
+                "ON Notifications (user, active);"},
 
-    if(result != SQLITE_OK){
-        Debug::Log::e(LOG_TAG, "%s(): SQL error: %s", __func__, zErrMsg);
-        sqlite3_free(zErrMsg);
+        // Every write to a notification stamps it with the next value of a global clock,
+        // so that clients can ask for the changes after the last version they know.
+        // Triggers also cover the writes done by external scripts.
+        {3,
+            "ALTER TABLE Notifications ADD COLUMN version INT NOT NULL DEFAULT 0;"
+            "CREATE TABLE NotificationClock (version INT NOT NULL);"
+            "INSERT INTO NotificationClock (version) VALUES (0);"
+            "CREATE INDEX NotificationsByVersion ON Notifications (user, version);"
+            "CREATE TRIGGER NotificationsInsertVersion AFTER INSERT ON Notifications "
+            "BEGIN "
+                "UPDATE NotificationClock SET version = version + 1; "
+                "UPDATE Notifications SET version = (SELECT version FROM NotificationClock) "
+                    "WHERE rowid = NEW.rowid; "
+            "END;"
+            "CREATE TRIGGER NotificationsUpdateVersion "
+                "AFTER UPDATE OF user, active, title, description, schedule ON Notifications "
+            "BEGIN "
+                "UPDATE NotificationClock SET version = version + 1; "
+                "UPDATE Notifications SET version = (SELECT version FROM NotificationClock) "
+                    "WHERE rowid = NEW.rowid; "
+            "END;"},
+
+        // Change feed across all users
+        {4,
+            "CREATE INDEX NotificationsByGlobalVersion ON Notifications (version);"},
+
+        // Writes through NotificationDatabase stamp the version themselves, which saves
+        // the triggers two extra writes per row. Writes that leave it untouched still
+        // get a version from the triggers.
+        {5,
+            "DROP TRIGGER NotificationsInsertVersion;"
+            "DROP TRIGGER NotificationsUpdateVersion;"
+            "CREATE TRIGGER NotificationsInsertVersion AFTER INSERT ON Notifications "
+                "WHEN NEW.version = 0 "
+            "BEGIN "
+                "UPDATE NotificationClock SET version = version + 1; "
+                "UPDATE Notifications SET version = (SELECT version FROM NotificationClock) "
+                    "WHERE rowid = NEW.rowid; "
+            "END;"
+            "CREATE TRIGGER NotificationsUpdateVersion "
+                "AFTER UPDATE OF user, active, title, description, schedule ON Notifications "
+                "WHEN NEW.version = OLD.version "
+            "BEGIN "
+                "UPDATE NotificationClock SET version = version + 1; "
+                "UPDATE Notifications SET version = (SELECT version FROM NotificationClock) "
+                    "WHERE rowid = NEW.rowid; "
+            "END;"},
+
+        // Pages of notifications are sorted by id. The id is not the rowid, so it
+        // needs to be in the indexes.
+        {6,
+            "DROP INDEX NotificationsByUser;"
+            "CREATE INDEX NotificationsByUser ON Notifications (user, active, id);"
+            "CREATE INDEX NotificationsByUserId ON Notifications (user, id);"},
+
+        // Full-text index over the titles and descriptions. It reads the texts from
+        // Notifications and is kept in sync by triggers. The user is indexed too, so a
+        // search only goes through the documents of one user.
+        {7,
+            "CREATE VIRTUAL TABLE NotificationsSearch USING fts5("
+                "user, title, description, "
+                "content = 'Notifications', content_rowid = 'id'"
+            ");"
+            "CREATE TRIGGER NotificationsSearchInsert AFTER INSERT ON Notifications "
+            "BEGIN "
+                "INSERT INTO NotificationsSearch (rowid, user, title, description) "
+                    "VALUES (NEW.id, NEW.user, NEW.title, NEW.description); "
+            "END;"
+            "CREATE TRIGGER NotificationsSearchDelete AFTER DELETE ON Notifications "
+            "BEGIN "
+                "INSERT INTO NotificationsSearch (NotificationsSearch, rowid, user, title, description) "
+                    "VALUES ('delete', OLD.id, OLD.user, OLD.title, OLD.description); "
+            "END;"
+            "CREATE TRIGGER NotificationsSearchUpdate "
+                "AFTER UPDATE OF id, user, title, description ON Notifications "
+            "BEGIN "
+                "INSERT INTO NotificationsSearch (NotificationsSearch, rowid, user, title, description) "
+                    "VALUES ('delete', OLD.id, OLD.user, OLD.title, OLD.description); "
+                "INSERT INTO NotificationsSearch (rowid, user, title, description) "
+                    "VALUES (NEW.id, NEW.user, NEW.title, NEW.description); "
+            "END;"
+            "INSERT INTO NotificationsSearch (NotificationsSearch) VALUES ('rebuild');"},
+    };
+
+    migrate("Notifications", NOTIFICATION_MIGRATIONS);
+}
+
+void NotificationDatabase::forEachNotification(const std::string& user, const NotificationQuery& query,
+                                               const Visitor& visitor) {
+    Debug::Log::d(LOG_TAG, "%s()", __func__);
+
+    // Each query is served in order by one of the indexes on user
+    static const char* SQL_SELECT_ACTIVE =
+        "SELECT id, active, title, description, schedule, version FROM Notifications "
+        "WHERE user = ? AND active = 1 AND id > ? ORDER BY id LIMIT ?;";
+
+    static const char* SQL_SELECT_ALL =
+        "SELECT id, active, title, description, schedule, version FROM Notifications "
+        "WHERE user = ? AND id > ? ORDER BY id LIMIT ?;";
+
+    static const char* SQL_SELECT_CHANGES =
+        "SELECT id, active, title, description, schedule, version FROM Notifications "
+        "WHERE user = ? AND version > ? ORDER BY version LIMIT ?;";
+
+    sqlite3_stmt* stmt;
+    if (query.sinceVersion > 0) {
+        stmt = prepareCached(SQL_SELECT_CHANGES);
+    } else if (query.includeInactive) {
+        stmt = prepareCached(SQL_SELECT_ALL);
+    } else {
+        stmt = prepareCached(SQL_SELECT_ACTIVE);
+    }
+
+    if (stmt == nullptr) {
+        return;
     }
+
+    sqlite3_bind_text(stmt, 1, user.c_str(), user.length(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (query.sinceVersion > 0)? query.sinceVersion : query.afterId);
+    sqlite3_bind_int(stmt, 3, query.limit);
+    visitRows(stmt, visitor);
 }
 
-std::vector<Notification> NotificationDatabase::getNotificationsFromUser(std::string userToken)
-{
+void NotificationDatabase::searchNotifications(const std::string& user, const std::string& text,
+                                               const NotificationSearch& search, const Visitor& visitor) {
     Debug::Log::d(LOG_TAG, "%s()", __func__);
-    std::vector<Notification> notifications;
 
-    char sql[256];
-    static const char* SQL_SELECT_NOTIFICATIONS =
-        "SELECT * FROM Notifications "
-        "WHERE user = '%s' AND active = '1';";
+    // Matches in the title weigh more than matches in the description
+    static const char* SQL_SEARCH =
+        "SELECT n.id, n.active, n.title, n.description, n.schedule, n.version "
+        "FROM NotificationsSearch JOIN Notifications AS n ON n.id = NotificationsSearch.rowid "
+        "WHERE NotificationsSearch MATCH ? AND n.user = ? AND (n.active = 1 OR ?) "
+        "ORDER BY bm25(NotificationsSearch, 0.0, 10.0, 1.0) LIMIT ? OFFSET ?;";
+
+    const std::string match = buildMatchExpression(user, text);
+    if (match.empty()) {
+        return;
+    }
+
+    sqlite3_stmt* stmt = prepareCached(SQL_SEARCH);
+    if (stmt == nullptr) {
+        return;
+    }
+
+    sqlite3_bind_text(stmt, 1, match.c_str(), match.length(), SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, user.c_str(), user.length(), SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 3, search.includeInactive);
+    sqlite3_bind_int(stmt, 4, search.limit);
+    sqlite3_bind_int(stmt, 5, search.offset);
+    visitRows(stmt, visitor);
+}
+
+std::string NotificationDatabase::buildMatchExpression(const std::string& user, const std::string& text) {
+    // Every word is quoted so that no input is parsed as FTS5 syntax. Words must all
+    // match, and the last one also matches as a prefix while the user is typing.
+    const auto quote = [](std::string_view str) {
+        std::string quoted = "\"";
+        for (const char c : str) {
+            quoted += c;
+            if (c == '"') {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    };
+
+    std::string terms;
+    std::size_t start = 0;
+    while (start < text.length()) {
+        const std::size_t end = std::min(text.find_first_of(" \t\n", start), text.length());
+        if (end > start) {
+            if (!terms.empty()) {
+                terms += " ";
+            }
+            terms += quote(std::string_view(text).substr(start, end - start));
+        }
+        start = end + 1;
+    }
+
+    if (terms.empty()) {
+        return terms;
+    }
 
-    sprintf(sql, SQL_SELECT_NOTIFICATIONS, userToken.c_str());
+    return "user : " + quote(user) + " AND {title description} : (" + terms + "*)";
+}
 
-    const auto callback = [](void* notifications, int argc, char** argv, char** azColName) -> int {
-        (void) argc;
-        (void) azColName;
+void NotificationDatabase::visitRows(sqlite3_stmt* stmt, const Visitor& visitor) {
+    const auto columnText = [stmt](int column) -> std::string_view {
+        const char* text = (const char*) sqlite3_column_text(stmt, column);
+        return (text != nullptr)?
+            std::string_view(text, sqlite3_column_bytes(stmt, column)) : std::string_view();
+    };
 
-        struct Notification notification {
-            atoi(argv[0]),                      // id
-            static_cast<bool>(atoi(argv[2])),   // active
-            std::string(argv[3]),               // title
-            std::string(argv[4]),               // description
-            std::string(argv[5])                // schedule
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const NotificationView notification {
+            sqlite3_column_int64(stmt, 0),                  // id
+            static_cast<bool>(sqlite3_column_int(stmt, 1)), // active
+            columnText(2),                                  // title
+            columnText(3),                                  // description
+            columnText(4),                                  // schedule
+            sqlite3_column_int64(stmt, 5)                   // version
         };
 
-        static_cast<std::vector<Notification>*>(notifications)->emplace_back(notification);
+        if (!visitor(notification)) {
+            break;
+        }
+    }
 
-        return 0;
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        Debug::Log::e(LOG_TAG, "%s():%d SQL error: %s", __func__, __LINE__, sqlite3_errmsg(mDb));
+    }
+
+    sqlite3_reset(stmt);
+}
+
+std::vector<NotificationChange> NotificationDatabase::getChangesSince(int64_t sinceVersion, int limit) {
+    Debug::Log::d(LOG_TAG, "%s()", __func__);
+    std::vector<NotificationChange> changes;
+
+    static const char* SQL_SELECT_CHANGES_SINCE =
+        "SELECT user, id, active, title, description, schedule, version FROM Notifications "
+        "WHERE version > ? ORDER BY version LIMIT ?;";
+
+    sqlite3_stmt* stmt = prepareCached(SQL_SELECT_CHANGES_SINCE);
+    if (stmt == nullptr) {
+        return changes;
+    }
+
+    sqlite3_bind_int64(stmt, 1, sinceVersion);
+    sqlite3_bind_int(stmt, 2, limit);
+
+    const auto columnText = [stmt](int column) -> std::string {
+        const unsigned char* text = sqlite3_column_text(stmt, column);
+        return (text != nullptr)? std::string((const char*) text) : std::string();
+    };
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        changes.push_back({
+            columnText(0),                                      // user
+            {
+                sqlite3_column_int64(stmt, 1),                  // id
+                static_cast<bool>(sqlite3_column_int(stmt, 2)), // active
+                columnText(3),                                  // title
+                columnText(4),                                  // description
+                columnText(5),                                  // schedule
+                sqlite3_column_int64(stmt, 6)                   // version
+            }
+        });
+    }
+
+    sqlite3_reset(stmt);
+    return changes;
+}
+
+bool NotificationDatabase::getNotification(int64_t id, NotificationChange& change) {
+    static const char* SQL_SELECT_NOTIFICATION =
+        "SELECT user, id, active, title, description, schedule, version FROM Notifications "
+        "WHERE id = ?;";
+
+    sqlite3_stmt* stmt = prepareCached(SQL_SELECT_NOTIFICATION);
+    if (stmt == nullptr) {
+        return false;
+    }
+
+    sqlite3_bind_int64(stmt, 1, id);
+
+    const auto columnText = [stmt](int column) -> std::string {
+        const unsigned char* text = sqlite3_column_text(stmt, column);
+        return (text != nullptr)? std::string((const char*) text) : std::string();
     };
 
+    const bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    if (found) {
+        change = {
+            columnText(0),                                      // user
+            {
+                sqlite3_column_int64(stmt, 1),                  // id
+                static_cast<bool>(sqlite3_column_int(stmt, 2)), // active
+                columnText(3),                                  // title
+                columnText(4),                                  // description
+                columnText(5),                                  // schedule
+                sqlite3_column_int64(stmt, 6)                   // version
+            }
+        };
+    }
+
+    sqlite3_reset(stmt);
+    return found;
+}
+
+std::vector<NotificationScheduler::ScheduledNotification> NotificationDatabase::getActiveSchedules() {
+    Debug::Log::d(LOG_TAG, "%s()", __func__);
+    std::vector<NotificationScheduler::ScheduledNotification> schedules;
+
+    static const char* SQL_SELECT_SCHEDULES =
+        "SELECT id, user, schedule FROM Notifications WHERE active = 1;";
+
+    sqlite3_stmt* stmt = prepareCached(SQL_SELECT_SCHEDULES);
+    if (stmt == nullptr) {
+        return schedules;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        schedules.push_back({
+            sqlite3_column_int64(stmt, 0),
+            std::string((const char*) sqlite3_column_text(stmt, 1)),
+            std::string((const char*) sqlite3_column_text(stmt, 2))
+        });
+    }
+
+    sqlite3_reset(stmt);
+    return schedules;
+}
+
+int64_t NotificationDatabase::getClockVersion() {
+    sqlite3_stmt* stmt = prepareCached("SELECT version FROM NotificationClock;");
+    if (stmt == nullptr) {
+        return 0;
+    }
+
+    int64_t version = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int64(stmt, 0);
+    }
+
+    sqlite3_reset(stmt);
+    return version;
+}
+
+int64_t NotificationDatabase::getUserVersion(const std::string& user) {
+    static const char* SQL_SELECT_USER_VERSION =
+        "SELECT MAX(version) FROM Notifications WHERE user = ?;";
+
+    sqlite3_stmt* stmt = prepareCached(SQL_SELECT_USER_VERSION);
+    if (stmt == nullptr) {
+        return 0;
+    }
+
+    sqlite3_bind_text(stmt, 1, user.c_str(), user.length(), SQLITE_STATIC);
+
+    int64_t version = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int64(stmt, 0);
+    }
+
+    sqlite3_reset(stmt);
+    return version;
+}
+
+bool NotificationDatabase::saveNotification(const std::string& user, const Notification& notification) {
+    Debug::Log::d(LOG_TAG, "%s()", __func__);
+    return saveNotifications({{user, notification}}) == 1;
+}
+
+int NotificationDatabase::saveNotifications(const std::vector<NotificationChange>& changes) {
+    Debug::Log::d(LOG_TAG, "%s(): %u notifications", __func__, changes.size());
+
+    // The write lock is taken upfront, so no other connection can move the clock
+    // while the versions of the batch are assigned
     char *zErrMsg = 0;
-    const int rc = sqlite3_exec(mDb, sql, callback, &notifications, &zErrMsg);
-    if (rc != SQLITE_OK) {
+    if (sqlite3_exec(mDb, "BEGIN IMMEDIATE;", nullptr, nullptr, &zErrMsg) != SQLITE_OK) {
         Debug::Log::e(LOG_TAG, "%s():%d SQL error: %s", __func__, __LINE__, zErrMsg);
         sqlite3_free(zErrMsg);
-        return notifications;
+        return -1;
+    }
+
+    int64_t version = getClockVersion();
+    int saved = 0;
+    std::unordered_set<std::string> users;
+
+    const auto rollback = [this]() {
+        sqlite3_exec(mDb, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return -1;
+    };
+
+    for (const NotificationChange& change : changes) {
+        const UpsertResult result = upsertNotification(change.user, change.notification, version + 1);
+        if (result == UPSERT_ERROR) {
+            return rollback();
+        } else if (result == UPSERT_OTHER_USER) {
+            Debug::Log::w(LOG_TAG, "%s(): Notification %ld belongs to another user",
+                __func__, change.notification.id);
+            continue;
+        }
+
+        saved++;
+        if (result == UPSERT_SAVED) {
+            version++;
+            users.insert(change.user);
+        }
+    }
+
+    if (!setClockVersion(version)) {
+        return rollback();
+    }
+
+    if (sqlite3_exec(mDb, "COMMIT;", nullptr, nullptr, &zErrMsg) != SQLITE_OK) {
+        Debug::Log::e(LOG_TAG, "%s():%d SQL error: %s", __func__, __LINE__, zErrMsg);
+        sqlite3_free(zErrMsg);
+        return rollback();
+    }
+
+    if (mChangeListener) {
+        for (const std::string& user : users) {
+            mChangeListener(user);
+        }
+    }
+    return saved;
+}
+
+NotificationDatabase::UpsertResult NotificationDatabase::upsertNotification(
+        const std::string& user, const Notification& notification, int64_t version) {
+    // Rows that would not change are not written, so that saving a notification again
+    // does not give it a new version
+    static const char* SQL_UPSERT_NOTIFICATION =
+        "INSERT INTO Notifications (id, user, active, title, description, schedule, version) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?) "
+        "ON CONFLICT(id) DO UPDATE SET "
+            "active = excluded.active, "
+            "title = excluded.title, "
+            "description = excluded.description, "
+            "schedule = excluded.schedule, "
+            "version = excluded.version "
+        "WHERE user = excluded.user AND ("
+            "active IS NOT excluded.active OR "
+            "title IS NOT excluded.title OR "
+            "description IS NOT excluded.description OR "
+            "schedule IS NOT excluded.schedule);";
+
+    static const char* SQL_SELECT_OWNER =
+        "SELECT user = ? FROM Notifications WHERE id = ?;";
+
+    sqlite3_stmt* stmt = prepareCached(SQL_UPSERT_NOTIFICATION);
+    if (stmt == nullptr) {
+        return UPSERT_ERROR;
+    }
+
+    sqlite3_bind_int64(stmt, 1, notification.id);
+    sqlite3_bind_text(stmt, 2, user.c_str(), user.length(), SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 3, notification.active);
+    sqlite3_bind_text(stmt, 4, notification.title.c_str(), notification.title.length(), SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, notification.description.c_str(), notification.description.length(), SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 6, notification.schedule.c_str(), notification.schedule.length(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 7, version);
+
+    const int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE) {
+        Debug::Log::e(LOG_TAG, "%s():%d SQL error: %s", __func__, __LINE__, sqlite3_errmsg(mDb));
+        return UPSERT_ERROR;
+    }
+
+    if (sqlite3_changes(mDb) > 0) {
+        return UPSERT_SAVED;
+    }
+
+    // Nothing was written: either the row is already as saved or it belongs to another user
+    stmt = prepareCached(SQL_SELECT_OWNER);
+    if (stmt == nullptr) {
+        return UPSERT_ERROR;
+    }
+
+    sqlite3_bind_text(stmt, 1, user.c_str(), user.length(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, notification.id);
+    const bool sameUser = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) != 0;
+    sqlite3_reset(stmt);
+
+    return sameUser? UPSERT_UNCHANGED : UPSERT_OTHER_USER;
+}
+
+bool NotificationDatabase::setClockVersion(int64_t version) {
+    sqlite3_stmt* stmt = prepareCached("UPDATE NotificationClock SET version = ?;");
+    if (stmt == nullptr) {
+        return false;
+    }
+
+    sqlite3_bind_int64(stmt, 1, version);
+    const int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE) {
+        Debug::Log::e(LOG_TAG, "%s():%d SQL error: %s", __func__, __LINE__, sqlite3_errmsg(mDb));
+        return false;
+    }
+    return true;
+}
+
+void NotificationDatabase::setChangeListener(ChangeListener listener) {
+    mChangeListener = listener;
+}
+
+bool NotificationDatabase::hasExternalChanges() {
+    // data_version only changes when other connections commit to the database file
+    sqlite3_stmt* stmt = prepareCached("PRAGMA data_version;");
+    if (stmt == nullptr) {
+        return false;
+    }
+
+    int64_t dataVersion = mDataVersion;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        dataVersion = sqlite3_column_int64(stmt, 0);
     }
+    sqlite3_reset(stmt);
 
-    return notifications;
+    const bool changed = dataVersion != mDataVersion;
+    mDataVersion = dataVersion;
+    return changed;
 }
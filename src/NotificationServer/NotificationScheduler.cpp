@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "NotificationServer/NotificationScheduler.hpp"
+
+static __attribute_used__ Debug::Tag LOG_TAG("NotificationScheduler");
+
+NotificationScheduler::NotificationScheduler(DueListener listener)
+:   mListener(listener),
+    mThread(&NotificationScheduler::loop, this)
+{
+}
+
+NotificationScheduler::~NotificationScheduler() {
+    {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mRunning = false;
+    }
+
+    mCondition.notify_one();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+int64_t NotificationScheduler::getCurrentTime() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::system_clock::now()
+                                          .time_since_epoch())
+                                          .count();
+}
+
+void NotificationScheduler::rebuild(const std::vector<ScheduledNotification>& notifications) {
+    const int64_t now = getCurrentTime();
+
+    std::vector<HeapEntry> heap;
+    std::unordered_map<int64_t, Slot> slots;
+    heap.reserve(notifications.size());
+    slots.reserve(notifications.size());
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    for (const ScheduledNotification& notification : notifications) {
+        Schedule schedule;
+        if (!Schedule::parse(notification.schedule, schedule)) {
+            Debug::Log::w(LOG_TAG, "%s(): Invalid schedule '%s' in notification %ld",
+                __func__, notification.schedule.c_str(), notification.id);
+            continue;
+        }
+
+        const int64_t fireTime = schedule.nextFireTime(now);
+        if (fireTime == Schedule::NEVER) {
+            continue;
+        }
+
+        const uint32_t generation = mNextGeneration++;
+        slots[notification.id] = {notification.user, schedule, generation};
+        heap.push_back({fireTime, notification.id, generation});
+    }
+
+    std::make_heap(heap.begin(), heap.end(), std::greater<HeapEntry>());
+    mHeap.swap(heap);
+    mSlots.swap(slots);
+
+    Debug::Log::i(LOG_TAG, "Scheduled %u notifications", mSlots.size());
+    mCondition.notify_one();
+}
+
+void NotificationScheduler::schedule(int64_t id, const std::string& user, const std::string& expression) {
+    Schedule schedule;
+    if (!Schedule::parse(expression, schedule)) {
+        Debug::Log::w(LOG_TAG, "%s(): Invalid schedule '%s' in notification %ld",
+            __func__, expression.c_str(), id);
+        cancel(id);
+        return;
+    }
+
+    const int64_t fireTime = schedule.nextFireTime(getCurrentTime());
+    if (fireTime == Schedule::NEVER) {
+        cancel(id);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    const uint32_t generation = mNextGeneration++;
+    mSlots[id] = {user, schedule, generation};
+    mHeap.push_back({fireTime, id, generation});
+    std::push_heap(mHeap.begin(), mHeap.end(), std::greater<HeapEntry>());
+    compactHeap();
+
+    if (mHeap.front().id == id) {
+        mCondition.notify_one();
+    }
+}
+
+void NotificationScheduler::cancel(int64_t id) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSlots.erase(id);
+    compactHeap();
+}
+
+void NotificationScheduler::compactHeap() {
+    // Drop stale entries if they take most of the heap
+    if (mHeap.size() > 2 * mSlots.size() + MAX_DUE_BATCH) {
+        mHeap.erase(
+            std::remove_if(mHeap.begin(), mHeap.end(),
+                [this](const HeapEntry& entry) { return !isCurrent(entry); }),
+            mHeap.end());
+        std::make_heap(mHeap.begin(), mHeap.end(), std::greater<HeapEntry>());
+    }
+}
+
+std::size_t NotificationScheduler::getNumScheduled() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSlots.size();
+}
+
+bool NotificationScheduler::isCurrent(const HeapEntry& entry) const {
+    auto slot = mSlots.find(entry.id);
+    return (slot != mSlots.end()) && (slot->second.generation == entry.generation);
+}
+
+void NotificationScheduler::popDue(int64_t now, std::vector<DueNotification>& due) {
+    while (!mHeap.empty() && mHeap.front().fireTime <= now && due.size() < MAX_DUE_BATCH) {
+        std::pop_heap(mHeap.begin(), mHeap.end(), std::greater<HeapEntry>());
+        const HeapEntry entry = mHeap.back();
+        mHeap.pop_back();
+
+        if (!isCurrent(entry)) {
+            continue;
+        }
+
+        Slot& slot = mSlots[entry.id];
+        due.push_back({entry.id, slot.user, entry.fireTime});
+
+        // Occurrences missed while the server was busy are not fired
+        const int64_t nextFireTime = slot.schedule.nextFireTime(now);
+        if (nextFireTime == Schedule::NEVER) {
+            mSlots.erase(entry.id);
+        } else {
+            mHeap.push_back({nextFireTime, entry.id, entry.generation});
+            std::push_heap(mHeap.begin(), mHeap.end(), std::greater<HeapEntry>());
+        }
+    }
+}
+
+void NotificationScheduler::fireDue(int64_t now) {
+    std::vector<DueNotification> due;
+    {
+    std::lock_guard<std::mutex> lock(mMutex);
+    popDue(now, due);
+    }
+
+    if (!due.empty()) {
+        Debug::Log::d(LOG_TAG, "%s(): %u notifications due", __func__, due.size());
+        mListener(due);
+    }
+}
+
+void NotificationScheduler::loop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (mRunning) {
+        while (!mHeap.empty() && !isCurrent(mHeap.front())) {
+            std::pop_heap(mHeap.begin(), mHeap.end(), std::greater<HeapEntry>());
+            mHeap.pop_back();
+        }
+
+        if (mHeap.empty()) {
+            mCondition.wait(lock);
+            continue;
+        }
+
+        const int64_t fireTime = mHeap.front().fireTime;
+        if (fireTime > getCurrentTime()) {
+            const std::chrono::system_clock::time_point wakeUpTime{std::chrono::seconds(fireTime)};
+            mCondition.wait_until(lock, wakeUpTime);
+            continue;
+        }
+
+        lock.unlock();
+        fireDue(getCurrentTime());
+        lock.lock();
+    }
+}
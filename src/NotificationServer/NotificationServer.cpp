@@ -17,6 +17,13 @@
 
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #ifdef OS_UBUNTU
 #include <jsoncpp/json/json.h>
@@ -31,17 +38,62 @@
 using server::comm::Message;
 using server::DatabaseManager;
 
-static __attribute_used__ const char* LOG_TAG = "NotificationServer";
+static __attribute_used__ Debug::Tag LOG_TAG("NotificationServer");
 static const char* SERVER_NAME = "Notification";
 
-NotificationServer::NotificationServer(const uint16_t port) : Server(SERVER_NAME, port, true) {
+NotificationServer::NotificationServer(const uint16_t port)
+:   Server(SERVER_NAME, port, true),
+    mSearchExecutor(server::Metrics::SEARCH_QUEUE),
+    mCache(CACHE_MAX_BYTES, CACHE_MAX_ENTRY_BYTES),
+    mScheduler([this](std::vector<NotificationScheduler::DueNotification>& due) {
+        onNotificationsDue(due);
+    })
+{
     DatabaseManager& dbManager = DatabaseManager::getInstance();
     dbManager.initDatabase(mNotificationDb);
+    mHasSearchDb = dbManager.initReadOnlyDatabase(mSearchDb);
+
+    mFeedVersion = mNotificationDb.getClockVersion();
+
+    mDbExecutor.post([this]() {
+        mScheduler.rebuild(mNotificationDb.getActiveSchedules());
+    });
+
+    mNotificationDb.setChangeListener([this](const std::string& user) {
+        mCache.invalidate(user);
+        mDbExecutor.post([this]() {
+            publishChanges();
+        });
+    });
+
+    // Changes written by other processes do not go through mNotificationDb
+    mDbExecutor.setPeriodicJob(mExternalChangesPeriod_ms, [this]() {
+        if (mNotificationDb.hasExternalChanges()) {
+            Debug::Log::d(LOG_TAG, "Database changed externally. Clearing cache");
+            mCache.clear();
+            publishChanges();
+        }
+    });
+}
+
+NotificationServer::~NotificationServer() {
+    // Queued queries use mNotificationDb and mSearchDb
+    mSearchExecutor.stop();
+    mDbExecutor.stop();
 }
 
 void NotificationServer::onLogin(Client& client) {
     (void) client;
-    // Do nothing
+    // Changes are pushed while the user is logged in. Clients catch up with the changes
+    // made while they were away with a REQUEST_TASKS {"since": version}.
+}
+
+void NotificationServer::getStatus(server::AdminStatus& status) {
+    Server::getStatus(status);
+
+    status.values.emplace_back("cache_bytes", mCache.getSize());
+    status.values.emplace_back("notifications_scheduled", mScheduler.getNumScheduled());
+    status.values.emplace_back("pending_task_requests", mPendingTaskRequests.size());
 }
 
 void NotificationServer::onMessageReceived(Client& client, const Message& message) {
@@ -50,16 +102,25 @@ void NotificationServer::onMessageReceived(Client& client, const Message& messag
     switch(message.getType()) {
         case REQUEST_TASKS: {
             Debug::Log::v(LOG_TAG, "%s(): REQUEST_TASKS", __func__);
-            std::vector<Notification> notifications =
-                    mNotificationDb.getNotificationsFromUser(client.user->token);
-
-            for (Notification& notification : notifications) {
-                sendNotification(notification, client);
+            NotificationQuery query;
+            if (parseTasksRequest(message, query)) {
+                handleQueryTasks(client, query);
+            } else {
+                handleRequestTasks(client);
             }
+            break;
+        }
 
-            const server::comm::Message okMsg(server::comm::ServerMsgTypes::OK);
-            sendMessage(okMsg, client);
-
+        case SEARCH_TASKS: {
+            Debug::Log::v(LOG_TAG, "%s(): SEARCH_TASKS", __func__);
+            std::string text;
+            NotificationSearch search;
+            if (parseSearchRequest(message, text, search)) {
+                handleSearchTasks(client, text, search);
+            } else {
+                const Message errMsg(server::comm::ServerMsgTypes::ERROR);
+                sendMessage(errMsg, client);
+            }
             break;
         }
 
@@ -68,29 +129,430 @@ void NotificationServer::onMessageReceived(Client& client, const Message& messag
     }
 }
 
-void NotificationServer::sendNotification(const Notification& notification, Client& client) {
+void NotificationServer::handleRequestTasks(Client& client) {
+    const std::string token = client.user->token;
+
+    const NotificationCache::Frames cached = mCache.get(token);
+    if (cached != nullptr) {
+        Debug::Log::v(LOG_TAG, "%s(): Cache hit for user %s", __func__, token.c_str());
+        sendFrames(*cached, client);
+        return;
+    }
+
+    auto pending = mPendingTaskRequests.find(token);
+    if (pending != mPendingTaskRequests.end()) {
+        Debug::Log::v(LOG_TAG, "%s(): Query for user %s already in flight", __func__, token.c_str());
+        pending->second->push_back(client.id);
+        return;
+    }
+
+    const Recipients recipients = std::make_shared<std::vector<ClientId>>(1, client.id);
+    mPendingTaskRequests[token] = recipients;
+
+    const uint64_t generation = mCache.getGeneration();
+    postQuery(mDbExecutor, [this, token, recipients, generation]() {
+        streamTasks(token, recipients, generation);
+    });
+}
+
+void NotificationServer::handleQueryTasks(Client& client, const NotificationQuery& query) {
+    const std::string token = client.user->token;
+    const Recipients recipients = std::make_shared<std::vector<ClientId>>(1, client.id);
+
+    postQuery(mDbExecutor, [this, token, recipients, query]() {
+        streamQuery(token, recipients, query);
+    });
+}
+
+void NotificationServer::streamTasks(const std::string& token, const Recipients& recipients,
+                                     uint64_t generation) {
+    std::shared_ptr<std::vector<uint8_t>> frames = std::make_shared<std::vector<uint8_t>>();
+    bool cacheable = true;
+
+    mNotificationDb.forEachNotification(token, NotificationQuery(), [&](const NotificationView& notification) {
+        encodeNotification(notification, *frames);
+
+        // Responses bigger than a chunk are sent as they are read and not cached
+        if (frames->size() >= STREAM_CHUNK_BYTES) {
+            deliverTasks(token, recipients, frames);
+            frames = std::make_shared<std::vector<uint8_t>>();
+            cacheable = false;
+        }
+        return true;
+    });
+
+    const Message okMsg(server::comm::ServerMsgTypes::OK);
+    okMsg.serialize(*frames);
+
+    if (cacheable) {
+        mCache.put(token, frames, generation);
+    }
+    deliverTasks(token, recipients, frames);
+}
+
+void NotificationServer::streamQuery(const std::string& token, const Recipients& recipients,
+                                     const NotificationQuery& query) {
+    std::shared_ptr<std::vector<uint8_t>> frames = std::make_shared<std::vector<uint8_t>>();
+
+    // Read the version first. A change written in between is sent again in the next sync.
+    const int64_t userVersion = mNotificationDb.getUserVersion(token);
+
+    // One row more than the page is read to know whether there is a next page
+    NotificationQuery pageQuery = query;
+    if (query.limit >= 0) {
+        pageQuery.limit = query.limit + 1;
+    }
+
+    int count = 0;
+    bool more = false;
+    int64_t lastId = 0;
+    int64_t lastVersion = 0;
+
+    const auto visitor = [&](const NotificationView& notification) {
+        if (count == query.limit) {
+            more = true;
+            return false;
+        }
+
+        encodeNotification(notification, *frames);
+        count++;
+        lastId = notification.id;
+        lastVersion = notification.version;
+
+        if (frames->size() >= STREAM_CHUNK_BYTES) {
+            deliverTasks(token, recipients, frames);
+            frames = std::make_shared<std::vector<uint8_t>>();
+        }
+        return true;
+    };
+
+    if (query.sinceVersion <= 0 || userVersion > query.sinceVersion) {
+        mNotificationDb.forEachNotification(token, pageQuery, visitor);
+    } else {
+        Debug::Log::v(LOG_TAG, "%s(): User %s up to date", __func__, token.c_str());
+    }
+
+    // A client syncs from "version". "next" is only sent when the page is not the last one
+    // and is the cursor of the next page: the last id, or the last version when syncing.
+    std::string json = "{\"version\":";
+    if (query.sinceVersion > 0) {
+        json += std::to_string(more? lastVersion : std::max(userVersion, query.sinceVersion));
+    } else {
+        json += std::to_string(userVersion);
+    }
+    if (more) {
+        json += ",\"next\":";
+        json += std::to_string((query.sinceVersion > 0)? lastVersion : lastId);
+    }
+    json += "}";
+
+    const Message endMsg(RESPONSE_TASKS_END, (const uint8_t*) json.c_str(), json.length() + 1);
+    endMsg.serialize(*frames);
+
+    deliverTasks(token, recipients, frames);
+}
+
+void NotificationServer::handleSearchTasks(Client& client, const std::string& text,
+                                           const NotificationSearch& search) {
+    const std::string token = client.user->token;
+    const Recipients recipients = std::make_shared<std::vector<ClientId>>(1, client.id);
+
+    if (!mHasSearchDb) {
+        postQuery(mDbExecutor, [this, token, recipients, text, search]() {
+            streamSearch(mNotificationDb, token, recipients, text, search);
+        });
+        return;
+    }
+
+    postQuery(mSearchExecutor, [this, token, recipients, text, search]() {
+        streamSearch(mSearchDb, token, recipients, text, search);
+    });
+}
+
+void NotificationServer::streamSearch(NotificationDatabase& database, const std::string& token,
+                                      const Recipients& recipients, const std::string& text,
+                                      const NotificationSearch& search) {
+    std::shared_ptr<std::vector<uint8_t>> frames = std::make_shared<std::vector<uint8_t>>();
+
+    // One result more than the page is read to know whether there is a next page
+    NotificationSearch pageSearch = search;
+    pageSearch.limit = search.limit + 1;
+
+    int count = 0;
+    bool more = false;
+
+    database.searchNotifications(token, text, pageSearch, [&](const NotificationView& notification) {
+        if (count == search.limit) {
+            more = true;
+            return false;
+        }
+
+        encodeNotification(notification, *frames, RESPONSE_SEARCH);
+        count++;
+        return true;
+    });
+
+    const std::string json = more?
+        "{\"next\":" + std::to_string(search.offset + count) + "}" : "{}";
+    const Message endMsg(RESPONSE_SEARCH_END, (const uint8_t*) json.c_str(), json.length() + 1);
+    endMsg.serialize(*frames);
+
+    deliverTasks(token, recipients, frames);
+}
+
+void NotificationServer::deliverTasks(const std::string& token, const Recipients& recipients,
+                                      const NotificationCache::Frames& frames) {
+    postQueryCompletion([this, token, recipients, frames]() {
+        // Once the response starts to be sent, new requests need a query of their own
+        auto pending = mPendingTaskRequests.find(token);
+        if (pending != mPendingTaskRequests.end() && pending->second == recipients) {
+            mPendingTaskRequests.erase(pending);
+        }
+
+        for (const ClientId clientId : *recipients) {
+            Client* client = findClient(token, clientId);
+            if (client != nullptr) {
+                sendFrames(*frames, *client);
+            }
+        }
+    });
+}
+
+bool NotificationServer::parseTasksRequest(const Message& message, NotificationQuery& query) {
+    const uint16_t size = message.getPayloadSize();
+    if (size == 0) {
+        return false;
+    }
+
+    const char* payload = (const char*) message.getPayload();
+    const std::size_t length = strnlen(payload, size);
+
     Json::Value root;
+    std::string errors;
+    std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+    if (!reader->parse(payload, payload + length, &root, &errors) || !root.isObject()) {
+        Debug::Log::w(LOG_TAG, "%s(): Malformed REQUEST_TASKS payload: %s", __func__, errors.c_str());
+        return false;
+    }
+
+    if (root["since"].isIntegral()) {
+        query.sinceVersion = root["since"].asInt64();
+    }
+    if (root["after"].isIntegral()) {
+        query.afterId = root["after"].asInt64();
+    }
+    if (root["limit"].isIntegral()) {
+        query.limit = std::clamp<int64_t>(root["limit"].asInt64(), 1, MAX_PAGE_SIZE);
+    }
+    if (root["all"].isBool()) {
+        query.includeInactive = root["all"].asBool();
+    }
+
+    return true;
+}
+
+bool NotificationServer::parseSearchRequest(const Message& message, std::string& text,
+                                            NotificationSearch& search) {
+    const uint16_t size = message.getPayloadSize();
+    if (size == 0) {
+        return false;
+    }
+
+    const char* payload = (const char*) message.getPayload();
+    const std::size_t length = strnlen(payload, size);
+
+    Json::Value root;
+    std::string errors;
+    std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+    if (!reader->parse(payload, payload + length, &root, &errors) || !root.isObject() ||
+        !root["query"].isString())
+    {
+        Debug::Log::w(LOG_TAG, "%s(): Malformed SEARCH_TASKS payload: %s", __func__, errors.c_str());
+        return false;
+    }
+
+    text = root["query"].asString();
+    if (root["limit"].isIntegral()) {
+        search.limit = std::clamp<int64_t>(root["limit"].asInt64(), 1, MAX_PAGE_SIZE);
+    }
+    if (root["offset"].isIntegral()) {
+        search.offset = std::clamp<int64_t>(root["offset"].asInt64(), 0, INT32_MAX);
+    }
+    if (root["all"].isBool()) {
+        search.includeInactive = root["all"].asBool();
+    }
+
+    return true;
+}
+
+void NotificationServer::publishChanges() {
+    std::vector<NotificationChange> changes =
+        mNotificationDb.getChangesSince(mFeedVersion, FEED_BATCH_SIZE);
+    if (changes.empty()) {
+        return;
+    }
+
+    Debug::Log::d(LOG_TAG, "%s(): %u changes after version %ld", __func__, changes.size(), mFeedVersion);
+    mFeedVersion = changes.back().notification.version;
+    const bool hasMoreChanges = changes.size() == FEED_BATCH_SIZE;
+
+    for (const NotificationChange& change : changes) {
+        if (change.notification.active) {
+            mScheduler.schedule(change.notification.id, change.user, change.notification.schedule);
+        } else {
+            mScheduler.cancel(change.notification.id);
+        }
+    }
 
-    root["id"] = notification.id;
-    root["active"] = notification.active? "true" : "false";
-    root["title"] = notification.title;
-    root["description"] = notification.description;
-    root["schedule"] = notification.schedule;
+    std::shared_ptr<std::vector<NotificationChange>> batch =
+        std::make_shared<std::vector<NotificationChange>>(std::move(changes));
+    postCompletion([this, batch]() {
+        pushToUsers(*batch, NOTIFICATION_CHANGED);
+    });
 
-    std::string json = root.toStyledString();
-    Debug::Log::v(LOG_TAG, "notification json = \n%s", json.c_str());
-    const Message msg(RESPONSE_TASKS, (uint8_t*) json.c_str(), json.length() + 1);
-    sendMessage(msg, client);
+    // Let other queries run between batches
+    if (hasMoreChanges) {
+        mDbExecutor.post([this]() {
+            publishChanges();
+        });
+    }
 }
 
+void NotificationServer::onNotificationsDue(std::vector<NotificationScheduler::DueNotification>& due) {
+    mDbExecutor.post([this, due]() {
+        std::shared_ptr<std::vector<NotificationChange>> notifications =
+            std::make_shared<std::vector<NotificationChange>>();
 
+        for (const NotificationScheduler::DueNotification& dueNotification : due) {
+            NotificationChange notification;
+            if (mNotificationDb.getNotification(dueNotification.id, notification) &&
+                notification.notification.active)
+            {
+                notifications->push_back(std::move(notification));
+            } else {
+                mScheduler.cancel(dueNotification.id);
+            }
+        }
+
+        postCompletion([this, notifications]() {
+            pushToUsers(*notifications, NOTIFICATION_DUE);
+        });
+    });
+}
+
+void NotificationServer::pushToUsers(const std::vector<NotificationChange>& changes,
+                                     server::comm::MessageType type) {
+    std::unordered_map<std::string, std::vector<const Notification*>> notificationsByUser;
+    for (const NotificationChange& change : changes) {
+        notificationsByUser[change.user].push_back(&change.notification);
+    }
+
+    for (User& user : mUsers) {
+        auto userNotifications = notificationsByUser.find(user.token);
+        if (userNotifications == notificationsByUser.end() || user.clients.empty()) {
+            continue;
+        }
+
+        std::vector<uint8_t> frames;
+        for (const Notification* notification : userNotifications->second) {
+            const NotificationView view {
+                notification->id,
+                notification->active,
+                notification->title,
+                notification->description,
+                notification->schedule,
+                notification->version
+            };
+            encodeNotification(view, frames, type);
+        }
+
+        Debug::Log::v(LOG_TAG, "%s(): Pushing %u notifications to user %s",
+            __func__, userNotifications->second.size(), user.token.c_str());
+        for (Client& client : user.clients) {
+            sendFrames(frames, client);
+        }
+    }
+}
+
+void NotificationServer::encodeNotification(const NotificationView& notification, std::vector<uint8_t>& frames,
+                                            server::comm::MessageType type) {
+    // Reused between calls to avoid an allocation per notification
+    thread_local std::string json;
+    json.clear();
+
+    json += "{\"id\":";
+    json += std::to_string(notification.id);
+    json += ",\"active\":";
+    json += notification.active? "\"true\"" : "\"false\"";
+    json += ",\"title\":";
+    appendJsonString(json, notification.title);
+    json += ",\"description\":";
+    appendJsonString(json, notification.description);
+    json += ",\"schedule\":";
+    appendJsonString(json, notification.schedule);
+    json += ",\"version\":";
+    json += std::to_string(notification.version);
+    json += "}";
+
+    if (json.length() + 1 > UINT16_MAX) {
+        Debug::Log::w(LOG_TAG, "%s(): Notification %ld too big to send (%u bytes)",
+            __func__, notification.id, json.length());
+        return;
+    }
+
+    Debug::Log::v(LOG_TAG, "notification json = %s", json.c_str());
+    const Message msg(type, (const uint8_t*) json.c_str(), json.length() + 1);
+    msg.serialize(frames);
+}
+
+void NotificationServer::appendJsonString(std::string& json, std::string_view str) {
+    static constexpr char HEX[] = "0123456789abcdef";
+
+    json += '"';
+    for (const char c : str) {
+        switch (c) {
+            case '"':  json += "\\\""; break;
+            case '\\': json += "\\\\"; break;
+            case '\n': json += "\\n"; break;
+            case '\r': json += "\\r"; break;
+            case '\t': json += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    json += "\\u00";
+                    json += HEX[(c >> 4) & 0xF];
+                    json += HEX[c & 0xF];
+                } else {
+                    json += c;
+                }
+                break;
+        }
+    }
+    json += '"';
+}
+
+// The benchmarks and the tests link the server with a main of their own
+#if !defined(BENCHMARK) && !defined(TEST)
+
+/*
+ * Usage: NotificationServer [--admin port] [--admin-address address] [--capture file] [port]
+ */
 int main(int argc, char* argv[]) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    const uint16_t adminPort = server::AdminServer::takePortArgument(args);
+    const std::string adminAddress = server::AdminServer::takeAddressArgument(args);
+    const std::string captureFile = server::Capture::takeFileArgument(args);
+
     // Port numbers up to 1024 are reserved
-    uint16_t port = (argc <= 1)? 3000 : std::max(atoi(argv[1]), 1024 + 1);
+    uint16_t port = args.empty()? 3000 : std::max(atoi(args[0].c_str()), 1024 + 1);
 
     NotificationServer server(port);
+    server.setAdminPort(adminPort, adminAddress);
+    if (!captureFile.empty() && !server.setCaptureFile(captureFile)) {
+        return 1;
+    }
     server.run();
 
     Debug::Log::i(LOG_TAG, "Server shut down");
     return 0;
 }
+#endif  // !defined(BENCHMARK) && !defined(TEST)
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cctype>
+#include <cstdio>
+#include <ctime>
+
+#include <string>
+#include <vector>
+
+#include "util/TextUtils.hpp"
+
+#include "NotificationServer/Schedule.hpp"
+
+/**
+ * \brief Returns the position of the first bit set at or after a position.
+ * \param bits Bit set.
+ * \param from First position.
+ * \param max Last position.
+ * \return Position of the bit, or -1 if there is none.
+ */
+static int nextBit(uint64_t bits, int from, int max) {
+    for (int bit = from; bit <= max; bit++) {
+        if (bits & (1ULL << bit)) {
+            return bit;
+        }
+    }
+    return -1;
+}
+
+static bool parseNumber(const std::string& str, int& number) {
+    if (str.empty() || str.size() > 9) {
+        return false;
+    }
+
+    number = 0;
+    for (const char c : str) {
+        if (!isdigit(c)) {
+            return false;
+        }
+        number = number * 10 + (c - '0');
+    }
+    return true;
+}
+
+static void normalize(struct tm& time) {
+    const time_t t = timegm(&time);
+    gmtime_r(&t, &time);
+}
+
+bool Schedule::parse(const std::string& expression, Schedule& schedule) {
+    std::vector<std::string> fields;
+    for (const std::string& field : TextUtils::Split(expression, " ")) {
+        if (!field.empty()) {
+            fields.push_back(field);
+        }
+    }
+
+    if (fields.size() == 1) {
+        return parseOnce(fields[0], schedule);
+    }
+
+    return parseCron(expression, schedule);
+}
+
+bool Schedule::parseOnce(const std::string& expression, Schedule& schedule) {
+    schedule = Schedule();
+    schedule.mKind = Kind::ONCE;
+
+    bool allDigits = !expression.empty();
+    for (const char c : expression) {
+        allDigits = allDigits && isdigit(c);
+    }
+
+    if (allDigits) {
+        if (expression.size() > 18) {
+            return false;
+        }
+        schedule.mTime = std::stoll(expression);
+        return true;
+    }
+
+    struct tm time = {};
+    int consumed = 0;
+    const int numFields = sscanf(expression.c_str(), "%4d-%2d-%2dT%2d:%2d%n",
+        &time.tm_year, &time.tm_mon, &time.tm_mday, &time.tm_hour, &time.tm_min, &consumed);
+    if (numFields != 5) {
+        return false;
+    }
+
+    std::size_t pos = consumed;
+    if (pos < expression.size() && expression[pos] == ':') {
+        int seconds;
+        if (pos + 3 > expression.size() ||
+            !parseNumber(expression.substr(pos + 1, 2), seconds) || seconds > 60) {
+            return false;
+        }
+        time.tm_sec = seconds;
+        pos += 3;
+    }
+    if (pos < expression.size() && expression[pos] == 'Z') {
+        pos++;
+    }
+    if (pos != expression.size()) {
+        return false;
+    }
+
+    if (time.tm_mon < 1 || time.tm_mon > 12 || time.tm_mday < 1 || time.tm_mday > 31 ||
+        time.tm_hour > 23 || time.tm_min > 59) {
+        return false;
+    }
+
+    time.tm_year -= 1900;
+    time.tm_mon -= 1;
+    schedule.mTime = timegm(&time);
+    return true;
+}
+
+bool Schedule::parseCron(const std::string& expression, Schedule& schedule) {
+    schedule = Schedule();
+    schedule.mKind = Kind::CRON;
+
+    std::vector<std::string> fields;
+    for (const std::string& field : TextUtils::Split(expression, " ")) {
+        if (!field.empty()) {
+            fields.push_back(field);
+        }
+    }
+
+    if (fields.size() != 5) {
+        return false;
+    }
+
+    uint64_t minutes, hours, daysOfMonth, months, daysOfWeek;
+    if (!parseField(fields[0], 0, 59, minutes) ||
+        !parseField(fields[1], 0, 23, hours) ||
+        !parseField(fields[2], 1, 31, daysOfMonth) ||
+        !parseField(fields[3], 1, 12, months) ||
+        !parseField(fields[4], 0, 7, daysOfWeek))
+    {
+        return false;
+    }
+
+    // 7 is also Sunday
+    if (daysOfWeek & (1 << 7)) {
+        daysOfWeek |= 1;
+    }
+
+    schedule.mMinutes = minutes;
+    schedule.mHours = static_cast<uint32_t>(hours);
+    schedule.mDaysOfMonth = static_cast<uint32_t>(daysOfMonth);
+    schedule.mMonths = static_cast<uint16_t>(months);
+    schedule.mDaysOfWeek = static_cast<uint8_t>(daysOfWeek & 0x7F);
+    schedule.mDayOfMonthRestricted = fields[2][0] != '*';
+    schedule.mDayOfWeekRestricted = fields[4][0] != '*';
+    return true;
+}
+
+bool Schedule::parseField(const std::string& field, int min, int max, uint64_t& bits) {
+    bits = 0;
+
+    for (const std::string& item : TextUtils::Split(field, ",")) {
+        std::string range = item;
+        int step = 1;
+
+        const std::size_t slash = item.find('/');
+        if (slash != std::string::npos) {
+            range = item.substr(0, slash);
+            if (!parseNumber(item.substr(slash + 1), step) || step == 0) {
+                return false;
+            }
+        }
+
+        int first, last;
+        if (range == "*") {
+            first = min;
+            last = max;
+        } else {
+            const std::size_t dash = range.find('-');
+            if (dash == std::string::npos) {
+                if (!parseNumber(range, first)) {
+                    return false;
+                }
+                // "a/n" means from a to the end of the range
+                last = (slash != std::string::npos)? max : first;
+            } else if (!parseNumber(range.substr(0, dash), first) ||
+                       !parseNumber(range.substr(dash + 1), last)) {
+                return false;
+            }
+        }
+
+        if (first < min || last > max || first > last) {
+            return false;
+        }
+
+        for (int value = first; value <= last; value += step) {
+            bits |= (1ULL << value);
+        }
+    }
+
+    return bits != 0;
+}
+
+bool Schedule::matchesDay(int dayOfMonth, int dayOfWeek) const {
+    const bool dayOfMonthMatches = mDaysOfMonth & (1U << dayOfMonth);
+    const bool dayOfWeekMatches = mDaysOfWeek & (1U << dayOfWeek);
+
+    if (mDayOfMonthRestricted && mDayOfWeekRestricted) {
+        return dayOfMonthMatches || dayOfWeekMatches;
+    }
+    return dayOfMonthMatches && dayOfWeekMatches;
+}
+
+bool Schedule::isRecurrent() const {
+    return mKind == Kind::CRON;
+}
+
+int64_t Schedule::nextFireTime(int64_t after) const {
+    if (mKind == Kind::ONCE) {
+        return (mTime > after)? mTime : NEVER;
+    }
+
+    // Recurrences fire at whole minutes
+    const time_t start = (after - (after % 60 + 60) % 60) + 60;
+    struct tm time;
+    gmtime_r(&start, &time);
+
+    // Impossible dates like February 30th never fire
+    const int lastYear = time.tm_year + 8;
+
+    while (time.tm_year <= lastYear) {
+        if (!(mMonths & (1U << (time.tm_mon + 1)))) {
+            time.tm_mon++;
+            time.tm_mday = 1;
+            time.tm_hour = 0;
+            time.tm_min = 0;
+            normalize(time);
+            continue;
+        }
+
+        if (!matchesDay(time.tm_mday, time.tm_wday)) {
+            time.tm_mday++;
+            time.tm_hour = 0;
+            time.tm_min = 0;
+            normalize(time);
+            continue;
+        }
+
+        const int hour = nextBit(mHours, time.tm_hour, 23);
+        if (hour < 0) {
+            time.tm_mday++;
+            time.tm_hour = 0;
+            time.tm_min = 0;
+            normalize(time);
+            continue;
+        }
+        if (hour != time.tm_hour) {
+            time.tm_hour = hour;
+            time.tm_min = 0;
+        }
+
+        const int minute = nextBit(mMinutes, time.tm_min, 59);
+        if (minute < 0) {
+            time.tm_hour++;
+            time.tm_min = 0;
+            normalize(time);
+            continue;
+        }
+
+        time.tm_min = minute;
+        time.tm_sec = 0;
+        return timegm(&time);
+    }
+
+    return NEVER;
+}
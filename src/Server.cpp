@@ -19,29 +19,41 @@
 #include <cstring>
 #include <ctime>
 
+#include <algorithm>
 #include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "AdminServer.hpp"
+#include "Capture.hpp"
 #include "Communication.hpp"
 #include "debug.hpp"
 #include "Database.hpp"
+#include "DatabaseExecutor.hpp"
+#include "Metrics.hpp"
 #include "net/Socket.hpp"
+#include "Tracing.hpp"
 #include "util/TextUtils.hpp"
 
 #include "Server.hpp"
 
-static __attribute_used__ const char* LOG_TAG = "Server";
+static __attribute_used__ Debug::Tag LOG_TAG("Server");
 
 namespace server {
 
+thread_local comm::MessageType Server::sQueryMessageType = Server::NO_MESSAGE_TYPE;
+thread_local Server::ClientId Server::sQueryClientId = Tracing::NO_CLIENT;
+
 Server::Server(std::string serverName, const uint16_t port, bool requireAuth)
 :
     mRequireAuthentication(requireAuth),
     mServerName(serverName),
-    mServerSocket(net::Socket::Domain::IPv4, net::Socket::Type::STREAM, port)
+    mPort(port)
 {
     DatabaseManager& dbManager = DatabaseManager::getInstance();
     dbManager.initDatabase(mDatabase);
@@ -49,6 +61,11 @@ Server::Server(std::string serverName, const uint16_t port, bool requireAuth)
     Debug::Log::i(LOG_TAG, "Created server at port %d", port);
 }
 
+Server::~Server() {
+    // Pending jobs may still post completions referencing this server
+    mDbExecutor.stop();
+}
+
 int64_t Server::getCurrentTime() {
     return std::chrono::duration_cast<std::chrono::seconds>(
                 std::chrono::system_clock::now()
@@ -60,18 +77,50 @@ std::string Server::getName() const {
     return mServerName;
 }
 
+void Server::setAdminPort(uint16_t port, const std::string& address) {
+    mAdminPort = port;
+    mAdminAddress = address;
+}
+
+void Server::setAcceptor(std::unique_ptr<net::Acceptor> acceptor) {
+    mAcceptor = std::move(acceptor);
+}
+
+bool Server::setCaptureFile(const std::string& path) {
+    auto capture = std::make_unique<Capture>();
+    if (!capture->open(path)) {
+        return false;
+    }
+    mCapture = std::move(capture);
+    return true;
+}
+
 void Server::run() {
-    mRunning = true;
     Debug::Log::i(LOG_TAG, "Running server");
 
     try {
-        mServerSocket.Listen();
+        std::lock_guard<std::mutex> stopGuard(mStopMutex);
+        if (mAcceptor == nullptr) {
+            mAcceptor = std::make_unique<net::ServerSocket>(
+                net::Socket::Domain::IPv4, net::Socket::Type::STREAM, mPort);
+        }
+        mAcceptor->Listen();
+        mRunning = true;
     }
     catch (server::net::SocketException& exception) {
         Debug::Log::e(LOG_TAG, exception.what());
         return;
     }
 
+    if (mAdminPort != 0) {
+        mAdminServer = std::make_unique<AdminServer>(mAdminPort, [this](AdminStatus& status) {
+            return collectStatus(status);
+        }, mAdminAddress);
+        if (!mAdminServer->start()) {
+            mAdminServer.reset();
+        }
+    }
+
     std::thread listenForConnectionsThread([&]() {
         Debug::Log::d(LOG_TAG, "Listening for new connections");
         while (mRunning) {
@@ -84,23 +133,17 @@ void Server::run() {
                 removeIdleClients();
                 }
 
-                std::this_thread::sleep_for(std::chrono::seconds(5));
+                waitWhileRunning(std::chrono::seconds(5));
                 continue;
             }
 
             try {
-                net::Connection connection = mServerSocket.Accept();
-
-                {
-                std::lock_guard<std::mutex> userGuard(mUserMutex);
-                Client newClient(connection);
-                mUnloggedConnections.push_back(newClient);
-                }
-
-                Debug::Log::i(LOG_TAG, "New unlogged connection");
-                printNumClients();
+                addConnection(mAcceptor->Accept());
             }
             catch (net::SocketException& exception) {
+                if (!mRunning) {
+                    break;  // Shut down by stop()
+                }
                 Debug::Log::e(LOG_TAG,
                     "listenForConnections: Could not accept incoming connection",
                     __func__);
@@ -116,28 +159,101 @@ void Server::run() {
             removeIdleClients();
             }
 
-            std::this_thread::sleep_for(mRemoveIdlePeriod_sec);
+            if (mCapture != nullptr) {
+                mCapture->flush();
+            }
+            waitWhileRunning(mRemoveIdlePeriod_sec);
         }
     });
 
     std::thread handleMessagesThread([&]() {
         while (mRunning) {
-            {
-            std::lock_guard<std::mutex> userGuard(mUserMutex);
-            pollMessages();
-            }
-
+            step();
             std::this_thread::sleep_for(mHandleMessagesPeriod_ms);
         }
     });
 
-    listenForConnectionsThread.detach();
-    removeIdleClientsThread.detach();
     handleMessagesThread.join();
+    listenForConnectionsThread.join();
+    removeIdleClientsThread.join();
+
+    if (mCapture != nullptr) {
+        mCapture->flush();
+    }
+
+    if (mAdminServer != nullptr) {
+        mAdminServer->stop();
+    }
 
     Debug::Log::i(LOG_TAG, "Exit %s()", __func__);
 }
 
+void Server::stop() {
+    {
+    std::lock_guard<std::mutex> stopGuard(mStopMutex);
+    mRunning = false;
+    if (mAcceptor != nullptr) {
+        mAcceptor->Shutdown();
+    }
+    }
+    mStopCondition.notify_all();
+}
+
+void Server::addConnection(const net::Connection& connection) {
+    {
+    std::lock_guard<std::mutex> userGuard(mUserMutex);
+    Client newClient(connection, mNextClientId++);
+    mUnloggedConnections.push_back(newClient);
+    if (mCapture != nullptr) {
+        mCapture->recordConnect(newClient.id);
+    }
+    }
+    Metrics::increment(Metrics::CONNECTIONS_ACCEPTED);
+
+    Debug::Log::i(LOG_TAG, "New unlogged connection");
+    printNumClients();
+}
+
+void Server::step() {
+    std::lock_guard<std::mutex> userGuard(mUserMutex);
+    runCompletions();
+    pollMessages();
+}
+
+bool Server::collectStatus(AdminStatus& status) {
+    auto promise = std::make_shared<std::promise<AdminStatus>>();
+    std::future<AdminStatus> result = promise->get_future();
+
+    postCompletion([this, promise]() {
+        AdminStatus loopStatus;
+        getStatus(loopStatus);
+        promise->set_value(std::move(loopStatus));
+    });
+
+    if (result.wait_for(mAdminStatusTimeout_ms) != std::future_status::ready) {
+        return false;
+    }
+    status = result.get();
+    return true;
+}
+
+void Server::getStatus(AdminStatus& status) {
+    status.info.emplace_back("name", mServerName);
+    status.info.emplace_back("port", std::to_string(mPort));
+    status.info.emplace_back("require_auth", mRequireAuthentication? "true" : "false");
+
+    std::size_t maxClientsPerUser = 0;
+    for (const User& user : mUsers) {
+        maxClientsPerUser = std::max(maxClientsPerUser, user.clients.size());
+    }
+
+    status.values.emplace_back("session_users", mUsers.size());
+    status.values.emplace_back("session_clients_logged", getNumLoggedConnections());
+    status.values.emplace_back("session_clients_unlogged", getNumUnloggedConnections());
+    status.values.emplace_back("session_max_clients_per_user", maxClientsPerUser);
+    status.values.emplace_back("log_dropped_lines", Debug::AsyncLog::getInstance().getDroppedLines());
+}
+
 void Server::removeUnloggedUsers() {
     for (auto user = mUsers.begin(); user != mUsers.end(); user++) {
         if (user->clients.size() == 0) {
@@ -146,6 +262,16 @@ void Server::removeUnloggedUsers() {
             user--;
         }
     }
+
+    relinkUsers();
+}
+
+void Server::relinkUsers() {
+    for (auto& user : mUsers) {
+        for (auto& client : user.clients) {
+            client.user = &user;
+        }
+    }
 }
 
 void Server::removeIdleClients() {
@@ -159,8 +285,10 @@ void Server::removeIdleClients() {
             if (idleTime >= mLoggedClientMaxIdleTimeout_sec.count()) {
                 Debug::Log::i(LOG_TAG,
                     "Client from user %s timed out (%d s)", user->token.c_str(), idleTime);
+                const ClientId clientId = client->id;
                 userClients.erase(client);
                 client--;
+                onClientRemoved(*user, clientId);
             }
         }
     }
@@ -191,7 +319,44 @@ bool Server::handleLogin(Client& client, const comm::Message& loginMsg) {
 
     std::string token = std::string((const char*) loginMsg.getPayload());
     Debug::Log::d(LOG_TAG, "%s(): token = %s", __func__, token.c_str());
-    return tryToLogin(token, client);
+
+    if (!mRequireAuthentication) {
+        return tryToLogin(token, client);
+    }
+
+    // Authenticate in the database executor. The client stays unlogged until the
+    // result is delivered back into the server loop.
+    const ClientId clientId = client.id;
+    queryAsync<bool>(
+        [this, token]() {
+            return authenticate(token);
+        },
+        [this, token, clientId](bool& authenticated) {
+            onLoginAuthenticated(token, clientId, authenticated);
+        });
+
+    return false;
+}
+
+void Server::onLoginAuthenticated(const std::string& token, ClientId clientId, bool authenticated) {
+    for (auto client_it = mUnloggedConnections.begin(); client_it != mUnloggedConnections.end(); client_it++) {
+        if (client_it->id != clientId) {
+            continue;
+        }
+
+        if (!authenticated) {
+            rejectLogin(token, *client_it);
+            return;
+        }
+
+        loginUser(token, *client_it);
+        mUnloggedConnections.erase(client_it);
+        printNumClients();
+        return;
+    }
+
+    Debug::Log::d(LOG_TAG, "%s(): Client of user %s disconnected before authentication",
+        __func__, token.c_str());
 }
 
 void Server::pollUnlogged() {
@@ -201,21 +366,43 @@ void Server::pollUnlogged() {
             continue;
         }
         else if (numBytes == 0) {
+            if (mCapture != nullptr) {
+                mCapture->recordDisconnect(client_it->id);
+            }
             mUnloggedConnections.erase(client_it);
             client_it--;
             printNumClients();
             continue;
         }
 
+        Metrics::increment(Metrics::BYTES_IN, numBytes);
+        Metrics::increment(Metrics::MESSAGES_IN);
+        const int64_t received_ns = Tracing::now_ns();
+        if (mCapture != nullptr) {
+            mCapture->recordFrame(client_it->id, mMessageBuffer, numBytes);
+        }
+
         client_it->refreshTime();
         comm::Message msg(mMessageBuffer, numBytes);
-        if (msg.isValid()) {
+        Tracing::record(Tracing::DECODE, client_it->id, msg.getType(), received_ns, numBytes);
+        if (!msg.isValid()) {
+            Metrics::increment(Metrics::INVALID_MESSAGES);
+        } else {
             const comm::MessageType type = msg.getType();
+            bool loggedIn;
+            int64_t handler_ns;
             switch (type)
             {
             case comm::ServerMsgTypes::LOGIN:
                 Debug::Log::v(LOG_TAG, "%s(): Unlogged client message LOGIN", __func__);
-                if (handleLogin(*client_it, msg) == true) {
+                handler_ns = Tracing::now_ns();
+                mCurrentMessageType = type;
+                mCurrentClientId = client_it->id;
+                loggedIn = handleLogin(*client_it, msg);
+                mCurrentMessageType = NO_MESSAGE_TYPE;
+                mCurrentClientId = Tracing::NO_CLIENT;
+                Tracing::record(Tracing::HANDLER, client_it->id, type, handler_ns);
+                if (loggedIn) {
                     mUnloggedConnections.erase(client_it);
                     client_it--;
                     printNumClients();
@@ -238,16 +425,31 @@ void Server::pollUsers() {
                 continue;
             }
             else if (numBytes == 0) {
+                const ClientId clientId = client_it->id;
+                if (mCapture != nullptr) {
+                    mCapture->recordDisconnect(clientId);
+                }
                 user->clients.erase(client_it);
                 client_it--;
+                onClientRemoved(*user, clientId);
 
                 printNumClients();
                 continue;
             }
 
+            Metrics::increment(Metrics::BYTES_IN, numBytes);
+            Metrics::increment(Metrics::MESSAGES_IN);
+            const int64_t received_ns = Tracing::now_ns();
+            if (mCapture != nullptr) {
+                mCapture->recordFrame(client_it->id, mMessageBuffer, numBytes);
+            }
+
             // client_it->refreshTime();
             comm::Message msg(mMessageBuffer, numBytes);
-            if (msg.isValid()) {
+            Tracing::record(Tracing::DECODE, client_it->id, msg.getType(), received_ns, numBytes);
+            if (!msg.isValid()) {
+                Metrics::increment(Metrics::INVALID_MESSAGES);
+            } else {
                 const comm::MessageType type = msg.getType();
 
                 switch(type) {
@@ -261,13 +463,24 @@ void Server::pollUsers() {
                         Debug::Log::v(LOG_TAG, "%s(): Logged client (user %s) message LOGOUT",
                             __func__, client_it->user->token.c_str());
                         client_it->connection.Close();
+                        const ClientId clientId = client_it->id;
                         user->clients.erase(client_it);
                         client_it--;
+                        onClientRemoved(*user, clientId);
                         continue;
                     }
 
                     default: {
+                        const auto start = std::chrono::steady_clock::now();
+                        const int64_t handler_ns = Tracing::now_ns();
+                        const ClientId clientId = client_it->id;
+                        mCurrentMessageType = type;
+                        mCurrentClientId = clientId;
                         onMessageReceived(*client_it, msg);
+                        mCurrentMessageType = NO_MESSAGE_TYPE;
+                        mCurrentClientId = Tracing::NO_CLIENT;
+                        Metrics::record(Metrics::HANDLER_TIME, type, Metrics::getElapsed_ns(start));
+                        Tracing::record(Tracing::HANDLER, clientId, type, handler_ns);
                         continue;
                     }
                 }
@@ -281,6 +494,11 @@ void Server::pollMessages() {
     pollUnlogged();
 }
 
+void Server::onClientRemoved(User& user, ClientId clientId) {
+    (void) user;
+    (void) clientId;
+}
+
 bool Server::authenticate(std::string token) {
     const bool success = mDatabase.authenticateUserToken(token, mServerName);
     if (success) {
@@ -300,12 +518,23 @@ bool Server::tryToLogin(std::string token, Client& client) {
     Debug::Log::i(LOG_TAG, "Login attempt with token %s", token.c_str());
 
     if (mRequireAuthentication && !authenticate(token)) {
-        Debug::Log::i(LOG_TAG, "User token %s not registered in this server", token.c_str());
-        const comm::Message errMsg(comm::ServerMsgTypes::ERROR);
-        sendMessage(errMsg, client);
+        rejectLogin(token, client);
         return false;
     }
 
+    loginUser(token, client);
+    return true;
+}
+
+void Server::rejectLogin(const std::string& token, const Client& client) {
+    Metrics::increment(Metrics::AUTH_FAILURES);
+    Debug::Log::i(LOG_TAG, "User token %s not registered in this server", token.c_str());
+    const comm::Message errMsg(comm::ServerMsgTypes::ERROR);
+    sendMessage(errMsg, client);
+}
+
+void Server::loginUser(const std::string& token, Client& client) {
+    Metrics::increment(Metrics::LOGINS);
     const comm::Message okMsg(comm::ServerMsgTypes::OK);
 
     for (auto& user : mUsers) {
@@ -313,27 +542,106 @@ bool Server::tryToLogin(std::string token, Client& client) {
             sendMessage(okMsg, client);
 
             client.user = &user;
-            user.clients.emplace_back(client.connection, &user);
+            user.clients.emplace_back(client.connection, client.id, &user);
             Debug::Log::i(LOG_TAG, "User %s logged in with new client", user.token.c_str());
             onLogin(client);
-            return true;
+            return;
         }
     }
 
     mUsers.emplace_back(token, client);
+    relinkUsers();
+    client.user = &mUsers.back();
 
     Debug::Log::i(LOG_TAG, "New user %s logged in", token.c_str());
     sendMessage(okMsg, client);
     onLogin(client);
-    return true;
+}
+
+void Server::postQuery(DatabaseExecutor& executor, std::function<void()> job) {
+    const comm::MessageType type = mCurrentMessageType;
+    const ClientId clientId = mCurrentClientId;
+    Tracing::mark(Tracing::DB_QUEUED, clientId, type);
+
+    executor.post([job, type, clientId]() {
+        const auto start = std::chrono::steady_clock::now();
+        const int64_t start_ns = Tracing::now_ns();
+        sQueryMessageType = type;
+        sQueryClientId = clientId;
+        job();
+        sQueryMessageType = NO_MESSAGE_TYPE;
+        sQueryClientId = Tracing::NO_CLIENT;
+
+        if (type != NO_MESSAGE_TYPE) {
+            Metrics::record(Metrics::DATABASE_TIME, type, Metrics::getElapsed_ns(start));
+        }
+        Tracing::record((type == comm::ServerMsgTypes::LOGIN)? Tracing::AUTHENTICATE : Tracing::DATABASE,
+                        clientId, type, start_ns);
+    });
+}
+
+void Server::postQueryCompletion(std::function<void()> completion) {
+    const comm::MessageType type = sQueryMessageType;
+    const ClientId clientId = sQueryClientId;
+
+    postCompletion([this, completion, type, clientId]() {
+        const int64_t completion_ns = Tracing::now_ns();
+        mCurrentMessageType = type;
+        mCurrentClientId = clientId;
+        completion();
+        mCurrentMessageType = NO_MESSAGE_TYPE;
+        mCurrentClientId = Tracing::NO_CLIENT;
+        Tracing::record(Tracing::COMPLETION, clientId, type, completion_ns);
+    });
+}
+
+void Server::postCompletion(std::function<void()> completion) {
+    std::lock_guard<std::mutex> completionGuard(mCompletionMutex);
+    mCompletions.push_back(std::move(completion));
+    Metrics::set(Metrics::COMPLETION_QUEUE, mCompletions.size());
+}
+
+void Server::runCompletions() {
+    std::vector<std::function<void()>> completions;
+    {
+    std::lock_guard<std::mutex> completionGuard(mCompletionMutex);
+    completions.swap(mCompletions);
+    Metrics::set(Metrics::COMPLETION_QUEUE, 0);
+    }
+
+    for (auto& completion : completions) {
+        completion();
+    }
+}
+
+Server::User* Server::findUser(const std::string& token) {
+    for (auto& user : mUsers) {
+        if (TextUtils::Equals(user.token, token)) {
+            return &user;
+        }
+    }
+    return nullptr;
+}
+
+Server::Client* Server::findClient(const std::string& token, ClientId id) {
+    User* user = findUser(token);
+    if (user == nullptr) {
+        return nullptr;
+    }
+
+    for (auto& client : user->clients) {
+        if (client.id == id) {
+            return &client;
+        }
+    }
+    return nullptr;
 }
 
 void Server::sendMessage(const comm::Message& message, const Client& client) {
     const bool serializeOk = message.serialize(mMessageBuffer, BUFFER_SIZE);
     const uint16_t msgSize =  message.getLength();
     if (serializeOk) {
-        client.connection.Send(mMessageBuffer, msgSize);
-        Debug::Log::v(LOG_TAG, "Sent message of size %d", msgSize);
+        sendRaw(mMessageBuffer, msgSize, client);
     } else {
         Debug::Log::v(LOG_TAG,
             "Could not send message because the buffer "
@@ -341,6 +649,33 @@ void Server::sendMessage(const comm::Message& message, const Client& client) {
     }
 }
 
+void Server::sendFrames(const std::vector<uint8_t>& frames, const Client& client) {
+    sendRaw(frames.data(), frames.size(), client);
+}
+
+ssize_t Server::sendRaw(const uint8_t* data, std::size_t size, ClientId clientId,
+                        const net::Connection& connection, int flags)
+{
+    const int64_t send_ns = Tracing::now_ns();
+    const ssize_t sent = connection.Send(const_cast<uint8_t*>(data), size, flags | MSG_NOSIGNAL);
+    if (sent <= 0) {
+        return sent;
+    }
+
+    // Traced with the type of the first message
+    comm::MessageType type = NO_MESSAGE_TYPE;
+    if (size >= sizeof(type)) {
+        memcpy(&type, data, sizeof(type));
+    }
+    Tracing::record(Tracing::SEND, clientId, type, send_ns, sent);
+    if (mCapture != nullptr) {
+        mCapture->recordSent(clientId, sent);
+    }
+    Metrics::increment(Metrics::BYTES_OUT, sent);
+    Debug::Log::v(LOG_TAG, "Sent %zd bytes", sent);
+    return sent;
+}
+
 std::size_t Server::getNumUnloggedConnections() const {
     return mUnloggedConnections.size();
 }
@@ -356,6 +691,9 @@ std::size_t Server::getNumLoggedConnections() const {
 void Server::printNumClients() const {
     const std::size_t numLogged = getNumLoggedConnections();
     const std::size_t numUnlogged = getNumUnloggedConnections();
+    Metrics::set(Metrics::CONNECTIONS_LOGGED, numLogged);
+    Metrics::set(Metrics::CONNECTIONS_UNLOGGED, numUnlogged);
+    Metrics::set(Metrics::USERS, mUsers.size());
     Debug::Log::i(LOG_TAG,
         "%u connections (%u logged, %u unlogged), %u users",
         numUnlogged + numLogged,
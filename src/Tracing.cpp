@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Tracing.hpp"
+
+namespace server {
+
+std::atomic<bool> Tracing::sEnabled {true};
+std::mutex Tracing::sRingsMutex;
+std::vector<Tracing::Ring*> Tracing::sRings;
+
+void Tracing::setEnabled(bool enabled) {
+    sEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+Tracing::Ring& Tracing::getRing() {
+    static thread_local Ring* ring = nullptr;
+    if (ring == nullptr) {
+        ring = new Ring();
+        ring->threadId = syscall(SYS_gettid);
+        std::lock_guard<std::mutex> lock(sRingsMutex);
+        sRings.push_back(ring);
+    }
+    return *ring;
+}
+
+void Tracing::record(Stage stage, uint64_t clientId, comm::MessageType type, int64_t start_ns,
+                     uint32_t bytes)
+{
+    if (isEnabled()) {
+        write(stage, clientId, type, start_ns, now_ns() - start_ns, bytes);
+    }
+}
+
+void Tracing::mark(Stage stage, uint64_t clientId, comm::MessageType type, uint32_t bytes) {
+    if (isEnabled()) {
+        write(stage, clientId, type, now_ns(), -1, bytes);
+    }
+}
+
+void Tracing::write(Stage stage, uint64_t clientId, comm::MessageType type, int64_t start_ns,
+                    int64_t duration_ns, uint32_t bytes)
+{
+    Ring& ring = getRing();
+    const uint64_t position = ring.next.load(std::memory_order_relaxed);
+    Event& event = ring.events[position % RING_SIZE];
+
+    // Odd while it is being written
+    event.sequence.store(2 * position + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    event.start_ns = start_ns;
+    event.duration_ns = duration_ns;
+    event.clientId = clientId;
+    event.type = type;
+    event.stage = stage;
+    event.bytes = bytes;
+
+    event.sequence.store(2 * position + 2, std::memory_order_release);
+    ring.next.store(position + 1, std::memory_order_release);
+}
+
+std::string Tracing::getChromeTrace() {
+    struct Copy {
+        pid_t threadId;
+        int64_t start_ns;
+        int64_t duration_ns;
+        uint64_t clientId;
+        comm::MessageType type;
+        Stage stage;
+        uint32_t bytes;
+    };
+    std::vector<Copy> copies;
+
+    {
+    std::lock_guard<std::mutex> lock(sRingsMutex);
+    for (const Ring* ring : sRings) {
+        const uint64_t end = ring->next.load(std::memory_order_acquire);
+        const uint64_t begin = (end > RING_SIZE)? end - RING_SIZE : 0;
+        for (uint64_t position = begin; position < end; position++) {
+            const Event& event = ring->events[position % RING_SIZE];
+            const uint64_t sequence = event.sequence.load(std::memory_order_acquire);
+            if (sequence != 2 * position + 2) {
+                continue;   // Overwritten since
+            }
+
+            const Copy copy {ring->threadId, event.start_ns, event.duration_ns, event.clientId,
+                             event.type, event.stage, event.bytes};
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (event.sequence.load(std::memory_order_relaxed) == sequence) {
+                copies.push_back(copy);
+            }
+        }
+    }
+    }
+
+    std::sort(copies.begin(), copies.end(), [](const Copy& a, const Copy& b) {
+        return a.start_ns < b.start_ns;
+    });
+
+    std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    char line[320];
+    const pid_t processId = getpid();
+    for (std::size_t i = 0; i < copies.size(); i++) {
+        const Copy& copy = copies[i];
+
+        // Chrome times are in microseconds
+        int length = snprintf(line, sizeof(line),
+            "%s\n{\"name\":\"%s\",\"cat\":\"0x%02X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,",
+            (i > 0)? "," : "", getName(copy.stage), copy.type, processId, copy.threadId,
+            copy.start_ns / 1000.0);
+        if (copy.duration_ns >= 0) {
+            length += snprintf(line + length, sizeof(line) - length, "\"ph\":\"X\",\"dur\":%.3f,",
+                copy.duration_ns / 1000.0);
+        } else {
+            length += snprintf(line + length, sizeof(line) - length, "\"ph\":\"i\",\"s\":\"t\",");
+        }
+
+        length += snprintf(line + length, sizeof(line) - length, "\"args\":{\"type\":\"0x%02X\"",
+            copy.type);
+        if (copy.clientId != NO_CLIENT) {
+            length += snprintf(line + length, sizeof(line) - length, ",\"client\":%" PRIu64,
+                copy.clientId);
+        }
+        if (copy.bytes != 0) {
+            length += snprintf(line + length, sizeof(line) - length, ",\"bytes\":%u", copy.bytes);
+        }
+        snprintf(line + length, sizeof(line) - length, "}}");
+        json += line;
+    }
+    json += "\n]}\n";
+    return json;
+}
+
+const char* Tracing::getName(Stage stage) {
+    static constexpr const char* NAMES[NUM_STAGES] = {
+        "decode",
+        "handler",
+        "db_queued",
+        "authenticate",
+        "database",
+        "completion",
+        "send",
+    };
+    return NAMES[stage];
+}
+
+}  // namespace server
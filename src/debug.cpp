@@ -0,0 +1,562 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "debug.hpp"
+
+namespace Debug {
+
+static constexpr std::chrono::milliseconds FLUSH_PERIOD_ms(2);
+
+/*
+ * A binary log is a sequence of records that start with their kind. Every process that
+ * opens the file starts with BINARY_MAGIC, since string ids are only valid in a process.
+ */
+static constexpr char BINARY_MAGIC[8] = {'S', 'R', 'V', 'L', 'O', 'G', '1', '\n'};
+
+enum BinaryKind : uint8_t {
+    BINARY_STRING = 1,
+    BINARY_LINE = 2,
+    BINARY_DROPPED = 3,
+};
+
+/** Followed by the characters of the string */
+struct __attribute__((packed)) BinaryString {
+    uint8_t kind;
+    uint64_t id;
+    uint16_t length;
+};
+
+/** Followed by the encoded arguments */
+struct __attribute__((packed)) BinaryLine {
+    uint8_t kind;
+    uint64_t format;
+    uint64_t tag;
+    uint64_t levelTag;
+    int64_t time_us;
+    int32_t threadId;
+    uint16_t argsSize;
+};
+
+struct __attribute__((packed)) BinaryDropped {
+    uint8_t kind;
+    uint64_t count;
+};
+
+/**
+ * \brief Write the time, thread and tags that start a line.
+ * \param date Cache of the date of the last second formatted.
+ * \param second Second of the cached date.
+ */
+static void formatPrefix(char* prefix, std::size_t size, int64_t time_us, int threadId,
+                         const char* levelTag, const char* tag, char (&date)[32], int64_t& second)
+{
+    const int64_t lineSecond = time_us / 1000000;
+    if (lineSecond != second) {
+        second = lineSecond;
+        const time_t time = static_cast<time_t>(second);
+        struct tm local;
+        localtime_r(&time, &local);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+    }
+
+    snprintf(prefix, size, "%s.%06" PRId64 " %d [%s] %s: ",
+        date, time_us % 1000000, threadId, levelTag, tag);
+}
+
+/**
+ * Tags and the level rules applied to them. Never destroyed, since tags unregister
+ * during exit.
+ */
+struct TagRegistry {
+    std::mutex mutex;
+    std::vector<Tag*> tags;
+    std::vector<std::pair<std::string, int>> rules;
+};
+
+static bool parseRules(const std::string& spec, std::vector<std::pair<std::string, int>>& rules);
+
+static TagRegistry& getTagRegistry() {
+    static TagRegistry* registry = []() {
+        TagRegistry* newRegistry = new TagRegistry();
+        const char* env = getenv("LOG_LEVELS");
+        if (env != nullptr && !parseRules(env, newRegistry->rules)) {
+            fprintf(stderr, "Invalid LOG_LEVELS \"%s\"\n", env);
+        }
+        return newRegistry;
+    }();
+    return *registry;
+}
+
+static bool parseLevel(const std::string& text, int& level) {
+    static const std::pair<const char*, int> NAMES[] = {
+        {"e", LEVEL_ERROR}, {"w", LEVEL_WARNING}, {"i", LEVEL_INFO},
+        {"d", LEVEL_DEBUG}, {"v", LEVEL_VERBOSE},
+    };
+    for (const auto& name : NAMES) {
+        if (text == name.first) {
+            level = name.second;
+            return true;
+        }
+    }
+
+    char* end;
+    level = strtol(text.c_str(), &end, 10);
+    return !text.empty() && *end == '\0';
+}
+
+static bool parseRules(const std::string& spec, std::vector<std::pair<std::string, int>>& rules) {
+    std::vector<std::pair<std::string, int>> parsed;
+    std::size_t start = 0;
+    while (start <= spec.size()) {
+        std::size_t end = spec.find(',', start);
+        if (end == std::string::npos) {
+            end = spec.size();
+        }
+
+        const std::string rule = spec.substr(start, end - start);
+        const std::size_t equals = rule.find('=');
+        int level;
+        if (equals == std::string::npos || equals == 0 ||
+            !parseLevel(rule.substr(equals + 1), level))
+        {
+            return false;
+        }
+        parsed.emplace_back(rule.substr(0, equals), level);
+        start = end + 1;
+    }
+
+    rules.insert(rules.end(), parsed.begin(), parsed.end());
+    return true;
+}
+
+static void applyRule(Tag& tag, const std::pair<std::string, int>& rule) {
+    if (rule.first == "*" || rule.first == tag.getName()) {
+        tag.setLevel(rule.second);
+    }
+}
+
+Tag::Tag(const char* name) : mName(name) {
+    TagRegistry& registry = getTagRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (const auto& rule : registry.rules) {
+        applyRule(*this, rule);
+    }
+    registry.tags.push_back(this);
+}
+
+Tag::~Tag() {
+    TagRegistry& registry = getTagRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.tags.erase(std::remove(registry.tags.begin(), registry.tags.end(), this),
+                        registry.tags.end());
+}
+
+bool setLevels(const std::string& spec) {
+    std::vector<std::pair<std::string, int>> rules;
+    if (!parseRules(spec, rules)) {
+        return false;
+    }
+
+    TagRegistry& registry = getTagRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (const auto& rule : rules) {
+        for (Tag* tag : registry.tags) {
+            applyRule(*tag, rule);
+        }
+    }
+    registry.rules.insert(registry.rules.end(), rules.begin(), rules.end());
+    return true;
+}
+
+std::string getLevels() {
+    TagRegistry& registry = getTagRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    std::string levels;
+    for (const Tag* tag : registry.tags) {
+        levels += (levels.empty()? "" : ",");
+        levels += std::string(tag->getName()) + "=" + std::to_string(std::min(tag->getLevel(), defined_level));
+    }
+    return levels;
+}
+
+static pid_t getThreadId() {
+    static thread_local const pid_t threadId = syscall(SYS_gettid);
+    return threadId;
+}
+
+AsyncLog& AsyncLog::getInstance() {
+    // Never destroyed, since detached threads may still log during exit
+    static AsyncLog* instance = []() {
+        AsyncLog* log = new AsyncLog();
+        std::atexit([]() {
+            getInstance().stop();
+        });
+        return log;
+    }();
+    return *instance;
+}
+
+AsyncLog::AsyncLog() : mRecords(new Record[CAPACITY]) {
+    for (std::size_t i = 0; i < CAPACITY; i++) {
+        mRecords[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    const char* binaryPath = getenv("LOG_BINARY_FILE");
+    if (binaryPath != nullptr) {
+        mBinaryFile = fopen(binaryPath, "ab");
+        if (mBinaryFile == nullptr) {
+            fprintf(stderr, "Can't open LOG_BINARY_FILE %s. Logging as text\n", binaryPath);
+        } else {
+            fwrite(BINARY_MAGIC, 1, sizeof(BINARY_MAGIC), mBinaryFile);
+        }
+    }
+
+    mRunning = true;
+    mThread = std::thread(&AsyncLog::run, this);
+}
+
+void AsyncLog::stop() {
+    if (!mRunning.exchange(false)) {
+        return;
+    }
+    mThread.join();
+}
+
+uint64_t AsyncLog::getDroppedLines() const {
+    return mDropped.load(std::memory_order_relaxed);
+}
+
+AsyncLog::Record* AsyncLog::claim() {
+    std::size_t position = mTail.load(std::memory_order_relaxed);
+    Record* record;
+    while (true) {
+        record = &mRecords[position & (CAPACITY - 1)];
+        const std::size_t sequence = record->sequence.load(std::memory_order_acquire);
+        const intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+        if (difference == 0) {
+            if (mTail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // The slot was not written yet since the last lap: the ring is full
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        } else {
+            position = mTail.load(std::memory_order_relaxed);
+        }
+    }
+
+    record->time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record->threadId = getThreadId();
+    return record;
+}
+
+void AsyncLog::publish(Record* record) {
+    // The slot at position p is published with sequence p + 1
+    const std::size_t position = record->sequence.load(std::memory_order_relaxed);
+    record->sequence.store(position + 1, std::memory_order_release);
+}
+
+void AsyncLog::run() {
+    std::string batch;
+    batch.reserve(BATCH_SIZE + LINE_SIZE);
+
+    while (mRunning.load(std::memory_order_acquire)) {
+        if (drain(batch) == 0) {
+            std::this_thread::sleep_for(FLUSH_PERIOD_ms);
+        }
+    }
+
+    // Lines of the writers that saw the log running before stop()
+    while (mWriters.load() != 0) {
+        std::this_thread::yield();
+    }
+    drain(batch);
+}
+
+std::size_t AsyncLog::drain(std::string& batch) {
+    FILE* out = (mBinaryFile != nullptr)? mBinaryFile : stdout;
+    std::size_t count = 0;
+    int64_t second = -1;
+    char prefix[96];
+    char date[32];
+
+    while (true) {
+        Record& record = mRecords[mHead & (CAPACITY - 1)];
+        if (record.sequence.load(std::memory_order_acquire) != mHead + 1) {
+            break;
+        }
+
+        if (mBinaryFile != nullptr) {
+            appendBinary(record, batch);
+        } else {
+            formatPrefix(prefix, sizeof(prefix), record.time_us, record.threadId,
+                record.levelTag, record.tag, date, second);
+            batch += prefix;
+            batch += record.text;
+            batch += '\n';
+        }
+
+        // Free the slot for the next lap
+        record.sequence.store(mHead + CAPACITY, std::memory_order_release);
+        mHead++;
+        count++;
+
+        if (batch.size() >= BATCH_SIZE) {
+            fwrite(batch.data(), 1, batch.size(), out);
+            batch.clear();
+        }
+    }
+
+    const uint64_t dropped = mDropped.load(std::memory_order_relaxed);
+    if (dropped != mReportedDropped) {
+        if (mBinaryFile != nullptr) {
+            const BinaryDropped line {BINARY_DROPPED, dropped - mReportedDropped};
+            batch.append(reinterpret_cast<const char*>(&line), sizeof(line));
+        } else {
+            snprintf(prefix, sizeof(prefix), "[WARNING] Debug: %" PRIu64 " log lines dropped\n",
+                dropped - mReportedDropped);
+            batch += prefix;
+        }
+        mReportedDropped = dropped;
+    }
+
+    if (!batch.empty()) {
+        fwrite(batch.data(), 1, batch.size(), out);
+        fflush(out);
+        batch.clear();
+    }
+    return count;
+}
+
+void AsyncLog::appendBinary(const Record& record, std::string& batch) {
+    for (const char* string : {record.fmt, record.tag, record.levelTag}) {
+        if (mWrittenStrings.insert(string).second) {
+            const std::size_t length = std::min<std::size_t>(strlen(string), UINT16_MAX);
+            const BinaryString header {BINARY_STRING, reinterpret_cast<uintptr_t>(string),
+                                       static_cast<uint16_t>(length)};
+            batch.append(reinterpret_cast<const char*>(&header), sizeof(header));
+            batch.append(string, length);
+        }
+    }
+
+    const BinaryLine line {
+        BINARY_LINE,
+        reinterpret_cast<uintptr_t>(record.fmt),
+        reinterpret_cast<uintptr_t>(record.tag),
+        reinterpret_cast<uintptr_t>(record.levelTag),
+        record.time_us,
+        record.threadId,
+        static_cast<uint16_t>(record.size)
+    };
+    batch.append(reinterpret_cast<const char*>(&line), sizeof(line));
+    batch.append(record.text, record.size);
+}
+
+std::string AsyncLog::formatArgs(const char* fmt, const char* args, std::size_t size) {
+    std::string text;
+    std::size_t offset = 0;
+    char value[LINE_SIZE];
+
+    // Reads the int argument of a * width or precision
+    const auto takeInt = [args, size, &offset](int64_t& number) {
+        if (offset + 1 + sizeof(number) > size || (args[offset] != ARG_INT && args[offset] != ARG_UINT)) {
+            offset = size;
+            return false;
+        }
+        memcpy(&number, args + offset + 1, sizeof(number));
+        offset += 1 + sizeof(number);
+        return true;
+    };
+
+    for (const char* c = fmt; *c != '\0'; c++) {
+        if (*c != '%') {
+            text += *c;
+            continue;
+        }
+        if (*(c + 1) == '%') {
+            text += '%';
+            c++;
+            continue;
+        }
+
+        // Flags, width, precision and length, up to the conversion
+        const char* end = c + 1;
+        while (*end != '\0' && strchr("diouxXeEfFgGaAcspn", *end) == nullptr) {
+            end++;
+        }
+        if (*end == '\0') {
+            text += c;
+            break;
+        }
+
+        // Length modifiers are dropped, since values are decoded as 64 bits. A * width or
+        // precision is replaced by the value of its argument.
+        std::string spec;
+        bool missing = false;
+        for (const char* s = c; s < end && !missing; s++) {
+            if (*s == '*') {
+                int64_t number;
+                if (!takeInt(number)) {
+                    missing = true;
+                } else if (*(s - 1) == '.' && number < 0) {
+                    spec.pop_back();    // A negative precision is taken as omitted
+                } else {
+                    const int64_t limit = LINE_SIZE;
+                    spec += std::to_string(std::clamp(number, -limit, limit));
+                }
+            } else if (strchr("hljztqL", *s) == nullptr) {
+                spec += *s;
+            }
+        }
+        const char conversion = *end;
+        c = end;
+
+        if (missing || offset >= size) {
+            text += '?';
+            continue;
+        }
+
+        const uint8_t type = args[offset++];
+        if (type == ARG_STRING) {
+            const char* string = args + offset;
+            offset += strnlen(string, size - offset) + 1;
+            snprintf(value, sizeof(value), (spec + 's').c_str(), string);
+            text += value;
+            continue;
+        }
+
+        uint64_t bits;
+        if (offset + sizeof(bits) > size) {
+            offset = size;
+            text += '?';
+            continue;
+        }
+        memcpy(&bits, args + offset, sizeof(bits));
+        offset += sizeof(bits);
+
+        if (type == ARG_DOUBLE) {
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            snprintf(value, sizeof(value), (spec + conversion).c_str(), number);
+        } else if (type == ARG_POINTER || conversion == 'p') {
+            snprintf(value, sizeof(value), (spec + 'p').c_str(), reinterpret_cast<void*>(bits));
+        } else if (conversion == 'c') {
+            snprintf(value, sizeof(value), (spec + 'c').c_str(), static_cast<int>(bits));
+        } else if (strchr("di", conversion) != nullptr) {
+            snprintf(value, sizeof(value), (spec + "ll" + conversion).c_str(), static_cast<long long>(bits));
+        } else {
+            snprintf(value, sizeof(value), (spec + "ll" + conversion).c_str(), static_cast<unsigned long long>(bits));
+        }
+        text += value;
+    }
+    return text;
+}
+
+bool decodeBinaryLog(FILE* in, FILE* out) {
+    std::unordered_map<uint64_t, std::string> strings;
+    std::vector<char> args;
+    int64_t second = -1;
+    char prefix[96];
+    char date[32];
+
+    const auto findString = [&strings](uint64_t id) {
+        const auto string = strings.find(id);
+        return (string != strings.end())? string->second.c_str() : "?";
+    };
+
+    int kind;
+    bool started = false;
+    while ((kind = fgetc(in)) != EOF) {
+        if (kind == BINARY_MAGIC[0]) {
+            char magic[sizeof(BINARY_MAGIC)];
+            magic[0] = kind;
+            if (fread(magic + 1, 1, sizeof(magic) - 1, in) != sizeof(magic) - 1 ||
+                memcmp(magic, BINARY_MAGIC, sizeof(magic)) != 0)
+            {
+                return false;
+            }
+            strings.clear();
+            started = true;
+            continue;
+        }
+        if (!started) {
+            return false;
+        }
+
+        ungetc(kind, in);
+        if (kind == BINARY_STRING) {
+            BinaryString header;
+            if (fread(&header, sizeof(header), 1, in) != 1) {
+                return false;
+            }
+            std::string string(header.length, '\0');
+            if (fread(string.data(), 1, header.length, in) != header.length) {
+                return false;
+            }
+            strings[header.id] = std::move(string);
+        } else if (kind == BINARY_LINE) {
+            BinaryLine line;
+            if (fread(&line, sizeof(line), 1, in) != 1) {
+                return false;
+            }
+            args.resize(line.argsSize);
+            if (fread(args.data(), 1, args.size(), in) != args.size()) {
+                return false;
+            }
+
+            formatPrefix(prefix, sizeof(prefix), line.time_us, line.threadId,
+                findString(line.levelTag), findString(line.tag), date, second);
+            const std::string text = AsyncLog::formatArgs(findString(line.format), args.data(), args.size());
+            fprintf(out, "%s%s\n", prefix, text.c_str());
+        } else if (kind == BINARY_DROPPED) {
+            BinaryDropped dropped;
+            if (fread(&dropped, sizeof(dropped), 1, in) != 1) {
+                return false;
+            }
+            fprintf(out, "[WARNING] Debug: %" PRIu64 " log lines dropped\n", dropped.count);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace Debug
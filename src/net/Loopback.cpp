@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "net/Loopback.hpp"
+
+namespace server::net {
+
+std::pair<Connection, Connection> LoopbackChannel::createPair() {
+    const auto forward = std::make_shared<Queue>();
+    const auto backward = std::make_shared<Queue>();
+
+    // The constructor is private, so make_shared can't be used
+    std::shared_ptr<Channel> first(new LoopbackChannel(backward, forward));
+    std::shared_ptr<Channel> second(new LoopbackChannel(forward, backward));
+    return {Connection(std::move(first)), Connection(std::move(second))};
+}
+
+LoopbackChannel::LoopbackChannel(std::shared_ptr<Queue> in, std::shared_ptr<Queue> out)
+:   mIn(std::move(in)),
+    mOut(std::move(out))
+{
+}
+
+LoopbackChannel::~LoopbackChannel() {
+    Disconnect();
+}
+
+ssize_t LoopbackChannel::Send(const void* buffer, std::size_t len, int flags) {
+    (void) flags;
+
+    std::lock_guard<std::mutex> lock(mOut->mutex);
+    if (mOut->closed) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(buffer);
+    mOut->segments.emplace_back(bytes, bytes + len);
+    mOut->readable.notify_one();
+    return len;
+}
+
+ssize_t LoopbackChannel::Read(void* buffer, std::size_t len, int flags) {
+    std::unique_lock<std::mutex> lock(mIn->mutex);
+
+    if (mIn->segments.empty() && !mIn->closed) {
+        if ((flags & MSG_DONTWAIT) != 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        const auto ready = [this]() { return !mIn->segments.empty() || mIn->closed; };
+        const unsigned timeout_ms = mReceiveTimeout_ms.load(std::memory_order_relaxed);
+        if (timeout_ms == 0) {
+            mIn->readable.wait(lock, ready);
+        } else if (!mIn->readable.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready)) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    if (mIn->segments.empty()) {
+        return 0;   // Closed
+    }
+
+    const std::vector<uint8_t>& segment = mIn->segments.front();
+    const std::size_t size = std::min(len, segment.size() - mIn->offset);
+    memcpy(buffer, segment.data() + mIn->offset, size);
+    mIn->offset += size;
+    if (mIn->offset == segment.size()) {
+        mIn->segments.pop_front();
+        mIn->offset = 0;
+    }
+    return size;
+}
+
+void LoopbackChannel::Disconnect() {
+    close(*mOut);
+    close(*mIn);
+}
+
+void LoopbackChannel::SetReceiveTimeout(unsigned timeout_ms) {
+    mReceiveTimeout_ms.store(timeout_ms, std::memory_order_relaxed);
+}
+
+void LoopbackChannel::close(Queue& queue) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.closed = true;
+    queue.readable.notify_all();
+}
+
+
+void LoopbackAcceptor::Listen() {
+}
+
+Connection LoopbackAcceptor::Accept() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingCondition.wait(lock, [this]() { return !mPending.empty() || mShutdown; });
+    if (mPending.empty()) {
+        throw SocketException(SocketException::Action::ACCEPT, "Loopback acceptor was shut down");
+    }
+
+    Connection connection = mPending.front();
+    mPending.pop_front();
+    return connection;
+}
+
+void LoopbackAcceptor::Shutdown() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mShutdown = true;
+    mPending.clear();
+    mPendingCondition.notify_all();
+}
+
+Connection LoopbackAcceptor::Connect() {
+    auto [client, server] = LoopbackChannel::createPair();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mShutdown) {
+        server.Disconnect();
+    } else {
+        mPending.push_back(server);
+        mPendingCondition.notify_one();
+    }
+    return client;
+}
+
+}  // namespace server::net
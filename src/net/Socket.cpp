@@ -18,13 +18,18 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#include <cerrno>
+
 #include "net/Socket.hpp"
 #include "debug.hpp"
 
-static __attribute_used__ const char* LOG_TAG = "net::Socket";
+static __attribute_used__ Debug::Tag LOG_TAG("net::Socket");
 
 namespace server {
 namespace net {
@@ -32,15 +37,24 @@ namespace net {
 Connection::Connection(int sockfd) : m_sockfd(sockfd) {
 }
 
+Connection::Connection(std::shared_ptr<Channel> channel) : m_channel(std::move(channel)) {
+}
+
 Connection::~Connection() {
     Close();
 }
 
-ssize_t Connection::Send(void* buffer, std::size_t len) const {
-    return send(m_sockfd, buffer, len, 0);
+ssize_t Connection::Send(void* buffer, std::size_t len, int flags) const {
+    if (m_channel != nullptr) {
+        return m_channel->Send(buffer, len, flags);
+    }
+    return send(m_sockfd, buffer, len, flags);
 }
 
 ssize_t Connection::Read(void* buffer, std::size_t len, int flags) const {
+    if (m_channel != nullptr) {
+        return m_channel->Read(buffer, len, flags);
+    }
     return recv(m_sockfd, buffer, len, flags);
 }
 
@@ -48,6 +62,33 @@ void Connection::Close() {
     setsockopt(m_sockfd ,SOL_SOCKET, SO_REUSEADDR, (const void*) true, sizeof(int));
 }
 
+void Connection::SetNoDelay() {
+    const int enable = 1;
+    setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+void Connection::SetReceiveTimeout(unsigned timeout_ms) {
+    if (m_channel != nullptr) {
+        m_channel->SetReceiveTimeout(timeout_ms);
+        return;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(m_sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+void Connection::Disconnect() {
+    if (m_channel != nullptr) {
+        m_channel->Disconnect();
+    }
+    if (m_sockfd >= 0) {
+        close(m_sockfd);
+        m_sockfd = -1;
+    }
+}
+
 
 Socket::Socket(Domain domain, Type type)
 :   m_domain(static_cast<int>(domain)),
@@ -58,14 +99,27 @@ Socket::Socket(Domain domain, Type type)
 
 
 ServerSocket::ServerSocket(Domain domain, Type type, uint16_t port)
+:   ServerSocket(domain, type, port, "0.0.0.0")
+{
+}
+
+ServerSocket::ServerSocket(Domain domain, Type type, uint16_t port, const std::string& address)
 :   Socket(domain, type)
 {
     Debug::Log::d(LOG_TAG, "%s():", __func__);
 
     m_port = port;
     m_address.sin_family = m_domain;
-    m_address.sin_addr.s_addr = INADDR_ANY;
     m_address.sin_port = htons(m_port);
+    if (inet_pton(AF_INET, address.c_str(), &m_address.sin_addr) != 1) {
+        throw SocketException(
+            SocketException::Action::BIND,
+            "Invalid server socket address");
+    }
+
+    // Allow listening again on the port while old connections are in TIME_WAIT
+    const int reuse = 1;
+    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     int ret = bind(m_sockfd, (struct sockaddr*) &m_address, sizeof(m_address));
     if (ret < 0) {
@@ -108,6 +162,11 @@ Connection ServerSocket::Accept() {
         "Server socket could not accept a connection");
 }
 
+void ServerSocket::Shutdown() {
+    // Wakes up a blocked accept()
+    shutdown(m_sockfd, SHUT_RDWR);
+}
+
 
 ClientSocket::ClientSocket(Domain domain, Type type, std::string address, uint16_t port)
 :   Socket(domain, type)
@@ -131,5 +190,46 @@ void ClientSocket::Connect() {
     }
 }
 
+void ClientSocket::StartConnect() {
+    const int flags = fcntl(m_sockfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(m_sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        throw SocketException(
+            SocketException::Action::CONNECT,
+            "Error making client socket non-blocking");
+    }
+
+    int ret = connect(m_sockfd, (struct sockaddr*) &m_address, sizeof(m_address));
+    if (ret < 0 && errno != EINPROGRESS) {
+        throw SocketException(
+            SocketException::Action::CONNECT,
+            "Error connecting client socket");
+    }
+}
+
+bool ClientSocket::FinishConnect() {
+    struct pollfd pollFd {m_sockfd, POLLOUT, 0};
+    const int ready = poll(&pollFd, 1, 0);
+    if (ready < 0) {
+        throw SocketException(
+            SocketException::Action::CONNECT,
+            "Error waiting for client socket");
+    }
+    if (ready == 0) {
+        return false;
+    }
+
+    int error = 0;
+    socklen_t size = sizeof(error);
+    if (getsockopt(m_sockfd, SOL_SOCKET, SO_ERROR, &error, &size) < 0 || error != 0) {
+        throw SocketException(
+            SocketException::Action::CONNECT,
+            "Error connecting client socket");
+    }
+
+    const int flags = fcntl(m_sockfd, F_GETFL, 0);
+    fcntl(m_sockfd, F_SETFL, flags & ~O_NONBLOCK);
+    return true;
+}
+
 }  // namespace net
 }  // namespace server
@@ -0,0 +1,47 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "AdminServer.hpp"
+
+using namespace server;
+
+TEST(AdminServerTest, FormatsPrometheus) {
+    Metrics::Snapshot snapshot;
+    snapshot.counters[Metrics::LOGINS] = 3;
+    snapshot.gauges[Metrics::USERS] = 2;
+    HistogramSnapshot& histogram = snapshot.timers[Metrics::HANDLER_TIME][0x11];
+    histogram.buckets[HistogramSnapshot::getBucket(10)] = 1;
+    histogram.count = 1;
+    histogram.sum = 10;
+    histogram.max = 10;
+
+    AdminStatus status;
+    status.info.emplace_back("name", "Test \"server\"");
+    status.values.emplace_back("topics", 5);
+
+    const std::string text = AdminServer::formatPrometheus(snapshot, status);
+    EXPECT_NE(text.find("server_info{name=\"Test \\\"server\\\"\"} 1\n"), std::string::npos);
+    EXPECT_NE(text.find("server_logins_total 3\n"), std::string::npos);
+    EXPECT_NE(text.find("server_users 2\n"), std::string::npos);
+    EXPECT_NE(text.find("server_topics 5\n"), std::string::npos);
+    EXPECT_NE(text.find("server_handler_time_ns{type=\"0x11\",quantile=\"0.99\"} 10\n"), std::string::npos);
+    EXPECT_NE(text.find("server_handler_time_ns_count{type=\"0x11\"} 1\n"), std::string::npos);
+}
+
+TEST(AdminServerTest, TakesPortArgument) {
+    std::vector<std::string> args {"3001", "--admin", "9100", "node:1"};
+    EXPECT_EQ(AdminServer::takePortArgument(args), 9100);
+    EXPECT_EQ(args, (std::vector<std::string> {"3001", "node:1"}));
+    EXPECT_EQ(AdminServer::takePortArgument(args), 0);
+}
+
+TEST(AdminServerTest, TakesAddressArgument) {
+    std::vector<std::string> args {"--admin", "9100", "--admin-address", "0.0.0.0", "3001"};
+    EXPECT_EQ(AdminServer::takeAddressArgument(args), "0.0.0.0");
+    EXPECT_EQ(args, (std::vector<std::string> {"--admin", "9100", "3001"}));
+
+    // Only local by default
+    EXPECT_EQ(AdminServer::takeAddressArgument(args), "127.0.0.1");
+}
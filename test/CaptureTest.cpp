@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+#include <cstdio>
+
+#include <string>
+#include <vector>
+
+#include "Capture.hpp"
+
+using namespace server;
+
+TEST(CaptureTest, ReadsTheRecordsItWrote) {
+    const std::string path = "/tmp/CaptureTest-" + std::to_string(getpid()) + ".bin";
+    const uint8_t frame[] = {0x00, 0x00, 0x05, 0x00, 't', 'o', 'k', '1', '\0'};
+    {
+    Capture capture;
+    ASSERT_TRUE(capture.open(path));
+    capture.recordConnect(3);
+    capture.recordFrame(3, frame, sizeof(frame));
+    capture.recordSent(3, 4);
+    capture.recordDisconnect(3);
+    }
+
+    FILE* in = fopen(path.c_str(), "rb");
+    ASSERT_NE(in, nullptr);
+    std::vector<Capture::Record> records;
+    EXPECT_TRUE(Capture::read(in, records));
+    fclose(in);
+    remove(path.c_str());
+
+    ASSERT_EQ(records.size(), 4u);
+    EXPECT_EQ(records[0].kind, Capture::CONNECT);
+    EXPECT_EQ(records[1].kind, Capture::FRAME);
+    EXPECT_EQ(records[1].data, std::vector<uint8_t>(frame, frame + sizeof(frame)));
+    EXPECT_EQ(records[2].kind, Capture::SENT);
+    EXPECT_EQ(records[2].size, 4u);
+    EXPECT_EQ(records[3].kind, Capture::DISCONNECT);
+    for (std::size_t i = 0; i < records.size(); i++) {
+        EXPECT_EQ(records[i].connection, 3u);
+        if (i > 0) {
+            EXPECT_GE(records[i].time_us, records[i - 1].time_us);
+        }
+    }
+}
+
+TEST(CaptureTest, RejectsOtherFiles) {
+    FILE* in = tmpfile();
+    ASSERT_NE(in, nullptr);
+    fputs("not a capture", in);
+    rewind(in);
+    std::vector<Capture::Record> records;
+    EXPECT_FALSE(Capture::read(in, records));
+    fclose(in);
+}
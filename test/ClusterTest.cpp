@@ -0,0 +1,108 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MessageServer/Cluster.hpp"
+
+using namespace std::chrono_literals;
+
+// Nodes on loopback, as separate instances would run in one machine
+class ClusterTest : public ::testing::Test {
+protected:
+    std::mutex mMutex;
+    std::vector<std::vector<uint8_t>> mReceived;
+
+    Cluster::ForwardHandler receiver() {
+        return [this](std::vector<uint8_t>&& frame) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mReceived.push_back(std::move(frame));
+        };
+    }
+
+    std::size_t numReceived() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mReceived.size();
+    }
+
+    static bool waitFor(const std::function<bool()>& condition) {
+        for (int i = 0; i < 300 && !condition(); i++) {
+            std::this_thread::sleep_for(10ms);
+        }
+        return condition();
+    }
+};
+
+TEST_F(ClusterTest, ForwardsOnlyToInterestedNodes) {
+    Cluster nodeA("127.0.0.1:9711", {"127.0.0.1:9712"}, [](std::vector<uint8_t>&&) { });
+    Cluster nodeB("127.0.0.1:9712", {"127.0.0.1:9711"}, receiver());
+    ASSERT_TRUE(nodeA.start());
+    ASSERT_TRUE(nodeB.start());
+    ASSERT_TRUE(waitFor([&]() {
+        return nodeA.getNumConnectedNodes() == 1 && nodeB.getNumConnectedNodes() == 1;
+    }));
+
+    const std::vector<uint8_t> frame {0x11, 0x00, 0xEE, 0x00, 0x00};
+
+    // No users in B yet
+    nodeA.forwardToAll(frame);
+    nodeB.setUserOnline("user", true);
+    ASSERT_TRUE(waitFor([&]() { return nodeA.getNumRemoteUsers() == 1; }));
+
+    nodeA.forwardToAll(frame);
+    ASSERT_TRUE(waitFor([&]() { return numReceived() == 1; }));
+    EXPECT_EQ(mReceived[0], frame);
+
+    // Topics without subscribers in B are not forwarded
+    nodeA.forwardToTopic("topic", frame);
+    nodeB.setTopicActive("topic", true);
+    std::this_thread::sleep_for(100ms);
+    nodeA.forwardToTopic("topic", frame);
+    ASSERT_TRUE(waitFor([&]() { return numReceived() == 2; }));
+
+    nodeB.setUserOnline("user", false);
+    ASSERT_TRUE(waitFor([&]() { return nodeA.getNumRemoteUsers() == 0; }));
+}
+
+TEST_F(ClusterTest, ForgetsPresenceOfDisconnectedNodes) {
+    Cluster nodeA("127.0.0.1:9721", {"127.0.0.1:9722"}, [](std::vector<uint8_t>&&) { });
+    ASSERT_TRUE(nodeA.start());
+
+    {
+    Cluster nodeB("127.0.0.1:9722", {"127.0.0.1:9721"}, receiver());
+    nodeB.setUserOnline("user", true);
+    ASSERT_TRUE(nodeB.start());
+    ASSERT_TRUE(waitFor([&]() { return nodeA.getNumRemoteUsers() == 1; }));
+    }
+
+    // The presence of a node is forgotten when its link closes
+    ASSERT_TRUE(waitFor([&]() { return nodeA.getNumRemoteUsers() == 0; }));
+}
+
+TEST_F(ClusterTest, ForwardsToEveryNode) {
+    Cluster nodeA("127.0.0.1:9731", {"127.0.0.1:9732"}, [](std::vector<uint8_t>&&) { });
+    Cluster nodeB("127.0.0.1:9732", {"127.0.0.1:9731"}, receiver());
+    ASSERT_TRUE(nodeA.start());
+    ASSERT_TRUE(nodeB.start());
+    ASSERT_TRUE(waitFor([&]() {
+        return nodeA.getNumConnectedNodes() == 1 && nodeB.getNumConnectedNodes() == 1;
+    }));
+
+    // Even with no users in B
+    const std::vector<uint8_t> frame {0x11, 0x00, 0xEE, 0x00, 0x00};
+    nodeA.forwardToNodes(frame);
+    ASSERT_TRUE(waitFor([&]() { return numReceived() == 1; }));
+    EXPECT_EQ(mReceived[0], frame);
+
+    EXPECT_FALSE(nodeA.isUserOnline("user"));
+    nodeB.setUserOnline("user", true);
+    ASSERT_TRUE(waitFor([&]() { return nodeA.isUserOnline("user"); }));
+    EXPECT_FALSE(nodeB.isUserOnline("user"));
+
+    nodeB.setUserOnline("user", false);
+    ASSERT_TRUE(waitFor([&]() { return !nodeA.isUserOnline("user"); }));
+}
@@ -0,0 +1,52 @@
+#include <gtest/gtest.h>
+
+#include <memory>
+
+#include "debug.hpp"
+
+TEST(DebugTest, SetsLevelsAtRuntime) {
+    Debug::Tag tag("DebugTest");
+    EXPECT_TRUE(tag.isEnabled(Debug::LEVEL_INFO));
+
+    EXPECT_TRUE(Debug::setLevels("DebugTest=e"));
+    EXPECT_FALSE(tag.isEnabled(Debug::LEVEL_WARNING));
+    EXPECT_TRUE(tag.isEnabled(Debug::LEVEL_ERROR));
+
+    // Rules also apply to the tags registered later
+    auto laterTag = std::make_unique<Debug::Tag>("DebugTest");
+    EXPECT_FALSE(laterTag->isEnabled(Debug::LEVEL_WARNING));
+
+    EXPECT_FALSE(Debug::setLevels("DebugTest"));
+    EXPECT_FALSE(Debug::setLevels("DebugTest=x"));
+    EXPECT_FALSE(tag.isEnabled(Debug::LEVEL_WARNING));
+
+    EXPECT_TRUE(Debug::setLevels("DebugTest=1"));
+    EXPECT_TRUE(tag.isEnabled(Debug::LEVEL_DEBUG));
+    EXPECT_NE(Debug::getLevels().find("DebugTest=1"), std::string::npos);
+}
+
+TEST(DebugTest, FormatsBinaryArguments) {
+    char args[Debug::AsyncLog::LINE_SIZE];
+    const std::string token = "user";
+    const std::size_t size = Debug::AsyncLog::encodeArgs(args, sizeof(args),
+        token.c_str(), 42, -7L, 3000000000UL, 2.5, 'x');
+
+    EXPECT_EQ(Debug::AsyncLog::formatArgs("%s(): %d %ld %lu %.1f %c %%", args, size),
+              "user(): 42 -7 3000000000 2.5 x %");
+
+    // Arguments that did not fit
+    EXPECT_EQ(Debug::AsyncLog::formatArgs("%d %d", args, 0), "? ?");
+}
+
+TEST(DebugTest, FormatsBinaryWidthAndPrecisionArguments) {
+    char args[Debug::AsyncLog::LINE_SIZE];
+    const std::string text = "abcdef";
+    const std::size_t size = Debug::AsyncLog::encodeArgs(args, sizeof(args),
+        3, text.c_str(), 4, 42, -4, 7, -1, text.c_str());
+
+    EXPECT_EQ(Debug::AsyncLog::formatArgs("[%.*s] [%*d] [%*d] [%.*s]", args, size),
+              "[abc] [  42] [7   ] [abcdef]");
+
+    // A string where the width should be
+    EXPECT_EQ(Debug::AsyncLog::formatArgs("[%*s]", args + 9, size - 9), "[?]");
+}
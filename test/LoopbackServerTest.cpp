@@ -0,0 +1,339 @@
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "Communication.hpp"
+#include "MessageServer/MessageServer.hpp"
+#include "Metrics.hpp"
+#include "NotificationServer/NotificationServer.hpp"
+#include "Server.hpp"
+#include "Tracing.hpp"
+#include "net/Loopback.hpp"
+
+using server::Metrics;
+using server::Tracing;
+using server::comm::Message;
+using server::net::Connection;
+using server::net::LoopbackAcceptor;
+using server::net::LoopbackChannel;
+namespace ServerMsgTypes = server::comm::ServerMsgTypes;
+
+static constexpr server::comm::MessageType ECHO = 0x10;
+static constexpr int NO_MESSAGE = -1;
+
+/** Server that sends every message back to the client that sent it */
+class EchoServer final : public server::Server {
+public:
+    EchoServer() : Server("EchoServer", 0) { }
+
+    int removedClients = 0;
+
+protected:
+    void onLogin(Client&) override { }
+
+    void onClientRemoved(User&, ClientId) override {
+        removedClients++;
+    }
+
+    void onMessageReceived(Client& client, const Message& message) override {
+        sendMessage(message, client);
+    }
+};
+
+class LoopbackServerTest : public ::testing::Test {
+protected:
+    // Servers open server.db in the working directory
+    static void SetUpTestSuite() {
+        char directory[] = "/tmp/LoopbackServerTestXXXXXX";
+        ASSERT_NE(mkdtemp(directory), nullptr);
+        sDirectory = directory;
+        sPrevious = getcwd(nullptr, 0);
+        ASSERT_EQ(chdir(directory), 0);
+    }
+
+    static void TearDownTestSuite() {
+        ASSERT_EQ(chdir(sPrevious), 0);
+        free(sPrevious);
+        const std::string command = "rm -rf " + sDirectory;
+        ASSERT_EQ(system(command.c_str()), 0);
+    }
+
+    static void send(const Connection& connection, const Message& message) {
+        std::vector<uint8_t> frame;
+        message.serialize(frame);
+        connection.Send(frame.data(), frame.size());
+    }
+
+    static void login(const Connection& connection, const std::string& token = "token") {
+        send(connection, Message(ServerMsgTypes::LOGIN, (const uint8_t*) token.c_str(), token.length() + 1));
+    }
+
+    // Returns the type of the next message, or NO_MESSAGE if nothing was received
+    static int receiveType(const Connection& connection, int flags = MSG_DONTWAIT) {
+        uint8_t buffer[server::BUFFER_SIZE];
+        const ssize_t numBytes = connection.Read(buffer, sizeof(buffer), flags);
+        if (numBytes <= 0) {
+            return NO_MESSAGE;
+        }
+        const Message message(buffer, numBytes);
+        return message.isValid()? message.getType() : NO_MESSAGE;
+    }
+
+    struct Received {
+        int type;
+        std::string payload;
+    };
+
+    // Returns every message received so far. A read may hold several of them.
+    static std::vector<Received> receiveAll(const Connection& connection) {
+        std::vector<uint8_t> bytes;
+        uint8_t buffer[server::BUFFER_SIZE];
+        ssize_t numBytes;
+        while ((numBytes = connection.Read(buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            bytes.insert(bytes.end(), buffer, buffer + numBytes);
+        }
+
+        std::vector<Received> messages;
+        for (std::size_t position = 0; position < bytes.size(); ) {
+            const std::size_t size = std::min<std::size_t>(bytes.size() - position, UINT16_MAX);
+            const Message message(bytes.data() + position, size);
+            if (!message.isValid()) {
+                ADD_FAILURE() << "Invalid message at byte " << position;
+                break;
+            }
+            messages.push_back({message.getType(),
+                std::string((const char*) message.getPayload(), message.getPayloadSize())});
+            position += message.getLength();
+        }
+        return messages;
+    }
+
+    static const Received* find(const std::vector<Received>& messages, int type) {
+        for (const Received& message : messages) {
+            if (message.type == type) {
+                return &message;
+            }
+        }
+        return nullptr;
+    }
+
+    // Steps the server until the client receives a message of a type, for the replies
+    // prepared off the server loop. Returns every message received until then.
+    static std::vector<Received> stepUntil(server::Server& server, const Connection& connection,
+                                           int type) {
+        std::vector<Received> messages;
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (find(messages, type) == nullptr && std::chrono::steady_clock::now() < deadline) {
+            server.step();
+            const std::vector<Received> received = receiveAll(connection);
+            messages.insert(messages.end(), received.begin(), received.end());
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return messages;
+    }
+
+    // Number of times the database time of a message type was recorded
+    static uint64_t getDatabaseCount(server::comm::MessageType type) {
+        const Metrics::Snapshot snapshot = Metrics::getSnapshot();
+        const auto& timer = snapshot.timers[Metrics::DATABASE_TIME];
+        const auto histogram = timer.find(type);
+        return (histogram != timer.end())? histogram->second.count : 0;
+    }
+
+    // Number of traced events of a stage for a message type
+    static uint64_t getTracedCount(Tracing::Stage stage, server::comm::MessageType type) {
+        char pattern[64];
+        snprintf(pattern, sizeof(pattern), "\"name\":\"%s\",\"cat\":\"0x%02X\"",
+                 Tracing::getName(stage), type);
+        const std::string trace = Tracing::getChromeTrace();
+        uint64_t found = 0;
+        for (std::size_t i = trace.find(pattern); i != std::string::npos; i = trace.find(pattern, i + 1)) {
+            found++;
+        }
+        return found;
+    }
+
+    // Executors record a job once it ends, which can be after its results were sent
+    static uint64_t waitForCount(const std::function<uint64_t()>& getCount, uint64_t count) {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (getCount() < count && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return getCount();
+    }
+
+    // Writes to server.db through a connection of its own, like the scripts do
+    static void exec(const char* sql) {
+        sqlite3* db;
+        ASSERT_EQ(sqlite3_open("server.db", &db), SQLITE_OK);
+        sqlite3_busy_timeout(db, 5000);
+        char* error = nullptr;
+        EXPECT_EQ(sqlite3_exec(db, sql, nullptr, nullptr, &error), SQLITE_OK) << error;
+        sqlite3_free(error);
+        sqlite3_close(db);
+    }
+
+private:
+    static std::string sDirectory;
+    static char* sPrevious;
+};
+
+std::string LoopbackServerTest::sDirectory;
+char* LoopbackServerTest::sPrevious = nullptr;
+
+TEST_F(LoopbackServerTest, StepHandlesOneMessagePerClient) {
+    EchoServer server;
+    auto [client, serverEnd] = LoopbackChannel::createPair();
+    server.addConnection(serverEnd);
+
+    login(client);
+    EXPECT_EQ(receiveType(client), NO_MESSAGE);
+    server.step();
+    EXPECT_EQ(receiveType(client), ServerMsgTypes::OK);
+
+    send(client, Message(ECHO));
+    send(client, Message(ECHO));
+    server.step();
+    EXPECT_EQ(receiveType(client), ECHO);
+    EXPECT_EQ(receiveType(client), NO_MESSAGE);
+    server.step();
+    EXPECT_EQ(receiveType(client), ECHO);
+
+    client.Disconnect();
+    server.step();
+    EXPECT_EQ(server.removedClients, 1);
+}
+
+TEST_F(LoopbackServerTest, RunAcceptsFromLoopbackAcceptor) {
+    EchoServer server;
+    auto acceptor = std::make_unique<LoopbackAcceptor>();
+    LoopbackAcceptor& loopback = *acceptor;
+    server.setAcceptor(std::move(acceptor));
+    std::thread serverThread([&server]() {
+        server.run();
+    });
+
+    Connection client = loopback.Connect();
+    client.SetReceiveTimeout(2000);
+    login(client);
+    EXPECT_EQ(receiveType(client, 0), ServerMsgTypes::OK);
+    send(client, Message(ECHO));
+    EXPECT_EQ(receiveType(client, 0), ECHO);
+
+    server.stop();
+    serverThread.join();
+}
+
+TEST_F(LoopbackServerTest, MessageServerRelaysPostsAndQueuesThemWhileOffline) {
+    MessageServer server(0);
+    auto [alice, aliceEnd] = LoopbackChannel::createPair();
+    auto [bob, bobEnd] = LoopbackChannel::createPair();
+    server.addConnection(aliceEnd);
+    server.addConnection(bobEnd);
+
+    login(alice, "alice");
+    login(bob, "bob");
+    server.step();
+    EXPECT_NE(find(receiveAll(alice), ServerMsgTypes::OK), nullptr);
+    EXPECT_NE(find(receiveAll(bob), ServerMsgTypes::OK), nullptr);
+
+    // Relayed with the timestamp and the sender in front of the payload
+    const std::string hello = "hello";
+    send(alice, Message(POST_MSG, (const uint8_t*) hello.c_str(), hello.length() + 1));
+    server.step();
+    std::vector<Received> received = receiveAll(bob);
+    const Received* post = find(received, POST_MSG);
+    ASSERT_NE(post, nullptr);
+    EXPECT_EQ(post->payload.substr(sizeof(PostHeader)), std::string("alice\0hello\0", 12));
+    EXPECT_EQ(find(receiveAll(alice), POST_MSG), nullptr);
+
+    // Queued while bob is offline, and delivered when bob logs in again
+    bob.Disconnect();
+    server.step();
+    const std::string missed = "missed";
+    send(alice, Message(POST_MSG, (const uint8_t*) missed.c_str(), missed.length() + 1));
+    server.step();
+
+    auto [bobAgain, bobAgainEnd] = LoopbackChannel::createPair();
+    server.addConnection(bobAgainEnd);
+    login(bobAgain, "bob");
+    received = stepUntil(server, bobAgain, POST_MSG);
+    ASSERT_GE(received.size(), 2u);
+    EXPECT_EQ(received[0].type, ServerMsgTypes::OK);
+    post = find(received, POST_MSG);
+    ASSERT_NE(post, nullptr);
+    EXPECT_EQ(post->payload.substr(sizeof(PostHeader)), std::string("alice\0missed\0", 13));
+
+    // Only once
+    server.step();
+    EXPECT_EQ(find(receiveAll(bobAgain), POST_MSG), nullptr);
+}
+
+TEST_F(LoopbackServerTest, NotificationServerPagesTasks) {
+    NotificationServer server(0);
+    exec("INSERT OR REPLACE INTO Users (Token, Name, Notification) VALUES ('token', 'User', 1);");
+    exec("INSERT INTO Notifications (id, user, active, title, description, schedule) VALUES "
+         "(1, 'token', 1, 'First', '', '0 9 * * *'), "
+         "(2, 'token', 1, 'Second', '', '0 9 * * *'), "
+         "(3, 'token', 1, 'Third', '', '0 9 * * *'), "
+         "(4, 'other', 1, 'Not mine', '', '0 9 * * *');");
+
+    auto [client, serverEnd] = LoopbackChannel::createPair();
+    server.addConnection(serverEnd);
+
+    login(client);
+    EXPECT_NE(find(stepUntil(server, client, ServerMsgTypes::OK), ServerMsgTypes::OK), nullptr);
+
+    const auto requestTasks = [&client](const std::string& json) {
+        send(client, Message(NotificationServer::REQUEST_TASKS,
+                             (const uint8_t*) json.c_str(), json.length() + 1));
+    };
+
+    const uint64_t databaseCount = getDatabaseCount(NotificationServer::REQUEST_TASKS);
+    const auto getTraced = [](Tracing::Stage stage) {
+        return [stage]() { return getTracedCount(stage, NotificationServer::REQUEST_TASKS); };
+    };
+    const uint64_t queuedCount = getTraced(Tracing::DB_QUEUED)();
+    const uint64_t tracedCount = getTraced(Tracing::DATABASE)();
+    const uint64_t completionCount = getTraced(Tracing::COMPLETION)();
+    requestTasks("{\"limit\": 2}");
+    std::vector<Received> received =
+        stepUntil(server, client, NotificationServer::RESPONSE_TASKS_END);
+    ASSERT_EQ(received.size(), 3u);
+    EXPECT_EQ(received[0].type, NotificationServer::RESPONSE_TASKS);
+    EXPECT_NE(received[0].payload.find("\"id\":1,"), std::string::npos);
+    EXPECT_EQ(received[1].type, NotificationServer::RESPONSE_TASKS);
+    EXPECT_NE(received[1].payload.find("\"id\":2,"), std::string::npos);
+    EXPECT_EQ(received[2].type, NotificationServer::RESPONSE_TASKS_END);
+    EXPECT_NE(received[2].payload.find("\"next\":2}"), std::string::npos) << received[2].payload;
+
+    // The query is timed and traced for REQUEST_TASKS
+    const auto getDatabaseTimes = []() { return getDatabaseCount(NotificationServer::REQUEST_TASKS); };
+    EXPECT_EQ(waitForCount(getDatabaseTimes, databaseCount + 1), databaseCount + 1);
+    EXPECT_EQ(getTraced(Tracing::DB_QUEUED)(), queuedCount + 1);
+    EXPECT_EQ(waitForCount(getTraced(Tracing::DATABASE), tracedCount + 1), tracedCount + 1);
+    EXPECT_EQ(getTraced(Tracing::COMPLETION)(), completionCount + 1);
+
+    // The last page has no cursor
+    requestTasks("{\"after\": 2, \"limit\": 2}");
+    received = stepUntil(server, client, NotificationServer::RESPONSE_TASKS_END);
+    ASSERT_EQ(received.size(), 2u);
+    EXPECT_EQ(received[0].type, NotificationServer::RESPONSE_TASKS);
+    EXPECT_NE(received[0].payload.find("\"id\":3,"), std::string::npos);
+    EXPECT_EQ(received[1].type, NotificationServer::RESPONSE_TASKS_END);
+    EXPECT_EQ(received[1].payload.find("\"next\""), std::string::npos) << received[1].payload;
+}
@@ -0,0 +1,174 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "Communication.hpp"
+#include "MessageServer/MessageLog.hpp"
+
+using server::comm::Message;
+
+class MessageLogTest : public ::testing::Test {
+protected:
+    std::string mDirectory;
+
+    void SetUp() override {
+        char directory[] = "/tmp/MessageLogTestXXXXXX";
+        ASSERT_NE(mkdtemp(directory), nullptr);
+        mDirectory = directory;
+    }
+
+    void TearDown() override {
+        const std::string command = "rm -rf " + mDirectory;
+        ASSERT_EQ(system(command.c_str()), 0);
+    }
+
+    static void append(MessageLog& log, uint8_t value, int64_t timestamp) {
+        uint8_t payload[16];
+        memset(payload, value, sizeof(payload));
+        const Message message(0x11, payload, sizeof(payload));
+        log.append(message, timestamp);
+    }
+
+    // Returns the first payload byte of each replayed message
+    static std::vector<uint8_t> replay(MessageLog& log, uint64_t from, std::size_t maxBytes,
+                                       uint64_t* next = nullptr) {
+        std::vector<uint8_t> bytes;
+        const uint64_t nextOffset = log.replay(from, UINT64_MAX, maxBytes, [&](const uint8_t* data, std::size_t size) {
+            bytes.insert(bytes.end(), data, data + size);
+            return size;
+        });
+        if (next != nullptr) {
+            *next = nextOffset;
+        }
+
+        std::vector<uint8_t> values;
+        for (std::size_t position = 0; position < bytes.size(); ) {
+            Message message(bytes.data() + position, bytes.size() - position);
+            EXPECT_TRUE(message.isValid());
+            values.push_back(message.getPayload()[0]);
+            position += message.getLength();
+        }
+        return values;
+    }
+};
+
+static constexpr std::size_t RECORD_SIZE = sizeof(Message::Header) + 16;
+
+TEST_F(MessageLogTest, ReplayFromOffset) {
+    MessageLog log(mDirectory, 1024 * 1024, 1024 * 1024, 1000000);
+    for (uint8_t i = 0; i < 10; i++) {
+        append(log, i, 1000 + i);
+    }
+    EXPECT_EQ(log.getEndOffset(), 10u);
+
+    uint64_t next;
+    EXPECT_EQ(replay(log, 7, SIZE_MAX, &next), std::vector<uint8_t>({7, 8, 9}));
+    EXPECT_EQ(next, 10u);
+
+    // Parts of at most 2 records
+    EXPECT_EQ(replay(log, 0, 2 * RECORD_SIZE, &next), std::vector<uint8_t>({0, 1}));
+    EXPECT_EQ(next, 2u);
+
+    EXPECT_TRUE(replay(log, 10, SIZE_MAX).empty());
+}
+
+TEST_F(MessageLogTest, ReplayWithoutFlushing) {
+    MessageLog log(mDirectory, 1024 * 1024, 1024 * 1024, 1000000);
+    for (uint8_t i = 0; i < 3; i++) {
+        append(log, i, 1000 + i);
+    }
+    log.flush();
+    for (uint8_t i = 3; i < 6; i++) {
+        append(log, i, 1000 + i);
+    }
+
+    // Flushed records from the file and the others from memory
+    EXPECT_EQ(replay(log, 1, SIZE_MAX), std::vector<uint8_t>({1, 2, 3, 4, 5}));
+    EXPECT_EQ(replay(log, 4, SIZE_MAX), std::vector<uint8_t>({4, 5}));
+
+    // Replays did not write them
+    const std::string path = mDirectory + "/00000000000000000000.log";
+    struct stat file;
+    ASSERT_EQ(stat(path.c_str(), &file), 0);
+    EXPECT_EQ(static_cast<std::size_t>(file.st_size), 3 * RECORD_SIZE);
+}
+
+TEST_F(MessageLogTest, ReplayStopsWhenTheSenderWouldBlock) {
+    MessageLog log(mDirectory, 1024 * 1024, 1024 * 1024, 1000000);
+    for (uint8_t i = 0; i < 5; i++) {
+        append(log, i, 1000 + i);
+    }
+
+    // Room for two messages
+    std::size_t calls = 0;
+    const uint64_t next = log.replay(0, UINT64_MAX, SIZE_MAX, [&](const uint8_t*, std::size_t size) {
+        calls++;
+        return std::min(size, 2 * RECORD_SIZE);
+    });
+    EXPECT_EQ(next, 2u);
+    EXPECT_EQ(calls, 1u);
+
+    EXPECT_EQ(replay(log, next, SIZE_MAX), std::vector<uint8_t>({2, 3, 4}));
+}
+
+TEST_F(MessageLogTest, FindOffsetByTime) {
+    MessageLog log(mDirectory, 1024 * 1024, 1024 * 1024, 1000000);
+    append(log, 0, 1000);
+    append(log, 1, 2000);
+    append(log, 2, 1500);   // Clock went back. Stored as 2000.
+    append(log, 3, 3000);
+    log.flush();
+
+    EXPECT_EQ(log.findOffset(0), 0u);
+    EXPECT_EQ(log.findOffset(1001), 1u);
+    EXPECT_EQ(log.findOffset(2500), 3u);
+    EXPECT_EQ(log.findOffset(4000), 4u);
+}
+
+TEST_F(MessageLogTest, SegmentsAndRetention) {
+    // Three records per segment
+    MessageLog log(mDirectory, 3 * RECORD_SIZE, 6 * RECORD_SIZE, 1000000);
+    for (uint8_t i = 0; i < 9; i++) {
+        append(log, i, 1000 + i);
+    }
+    EXPECT_EQ(replay(log, 2, SIZE_MAX), std::vector<uint8_t>({2, 3, 4, 5, 6, 7, 8}));
+
+    // Only written segments are deleted
+    log.flush();
+    log.applyRetention(2000);
+    EXPECT_EQ(log.getBeginOffset(), 3u);
+    EXPECT_EQ(log.getSize(), 6 * RECORD_SIZE);
+
+    // Deleted records are skipped
+    EXPECT_EQ(replay(log, 0, SIZE_MAX), std::vector<uint8_t>({3, 4, 5, 6, 7, 8}));
+
+    // Segments whose records are too old are deleted, except the active one
+    log.applyRetention(1000000 + 1009);
+    EXPECT_EQ(log.getBeginOffset(), 6u);
+}
+
+TEST_F(MessageLogTest, ReloadDropsIncompleteRecords) {
+    {
+    MessageLog log(mDirectory, 1024 * 1024, 1024 * 1024, 1000000);
+    for (uint8_t i = 0; i < 5; i++) {
+        append(log, i, 1000 + i);
+    }
+    }
+
+    // Simulate a crash in the middle of a write
+    const std::string path = mDirectory + "/00000000000000000000.log";
+    const std::string command = "printf 'xyz' >> " + path;
+    ASSERT_EQ(system(command.c_str()), 0);
+
+    MessageLog log(mDirectory, 1024 * 1024, 1024 * 1024, 1000000);
+    EXPECT_EQ(log.getEndOffset(), 5u);
+    append(log, 5, 2000);
+    EXPECT_EQ(replay(log, 3, SIZE_MAX), std::vector<uint8_t>({3, 4, 5}));
+}
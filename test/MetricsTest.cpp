@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+#include "Metrics.hpp"
+
+using namespace server;
+
+TEST(MetricsTest, HistogramBucketsHaveBoundedError) {
+    for (uint64_t value : {0ul, 1ul, 31ul, 32ul, 33ul, 1000ul, 123456ul, 987654321ul}) {
+        const uint64_t limit = HistogramSnapshot::getBucketLimit(HistogramSnapshot::getBucket(value));
+        EXPECT_GE(limit, value);
+        EXPECT_LE(limit - value, value / HistogramSnapshot::SUB_BUCKETS);
+    }
+
+    HistogramSnapshot histogram;
+    for (uint64_t value = 1; value <= 1000; value++) {
+        histogram.buckets[HistogramSnapshot::getBucket(value)]++;
+        histogram.count++;
+        histogram.sum += value;
+        histogram.max = value;
+    }
+    EXPECT_NEAR(histogram.getPercentile(0.5), 500, 500 / HistogramSnapshot::SUB_BUCKETS);
+    EXPECT_NEAR(histogram.getPercentile(0.99), 990, 990 / HistogramSnapshot::SUB_BUCKETS);
+    EXPECT_EQ(histogram.getPercentile(1.0), 1000);
+}
+
+TEST(MetricsTest, SnapshotAddsUpThreads) {
+    const Metrics::Snapshot before = Metrics::getSnapshot();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([]() {
+            for (int j = 0; j < 1000; j++) {
+                Metrics::increment(Metrics::MESSAGES_IN);
+                Metrics::record(Metrics::HANDLER_TIME, 0x7F, 1000);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    const Metrics::Snapshot after = Metrics::getSnapshot();
+    EXPECT_EQ(after.counters[Metrics::MESSAGES_IN] - before.counters[Metrics::MESSAGES_IN], 4000u);
+
+    const HistogramSnapshot& histogram = after.timers[Metrics::HANDLER_TIME].at(0x7F);
+    const uint64_t previous = before.timers[Metrics::HANDLER_TIME].count(0x7F)?
+        before.timers[Metrics::HANDLER_TIME].at(0x7F).count : 0;
+    EXPECT_EQ(histogram.count - previous, 4000u);
+    EXPECT_GE(histogram.max, 1000u);
+}
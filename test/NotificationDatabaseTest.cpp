@@ -0,0 +1,314 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "NotificationServer/NotificationDatabase.hpp"
+
+static constexpr int LATEST_VERSION = 7;
+
+namespace server {
+
+class DatabaseTest final {
+public:
+    /**
+     * \brief Use a connection of the test instead of the one of the DatabaseManager.
+     */
+    static void setDb(Database& database, sqlite3* db) {
+        database.setDb(db);
+    }
+};
+
+}  // namespace server
+
+using server::DatabaseTest;
+
+class NotificationDatabaseTest : public ::testing::Test {
+protected:
+    std::string mDirectory;
+    sqlite3* mDb = nullptr;
+    std::unique_ptr<NotificationDatabase> mDatabase;
+
+    void SetUp() override {
+        char directory[] = "/tmp/NotificationDatabaseTestXXXXXX";
+        ASSERT_NE(mkdtemp(directory), nullptr);
+        mDirectory = directory;
+        ASSERT_EQ(sqlite3_open((mDirectory + "/test.db").c_str(), &mDb), SQLITE_OK);
+    }
+
+    void TearDown() override {
+        // Statements are finalized before the connection is closed
+        mDatabase.reset();
+        sqlite3_close(mDb);
+        const std::string command = "rm -rf " + mDirectory;
+        ASSERT_EQ(system(command.c_str()), 0);
+    }
+
+    // Opens the database of the test, migrating it to the latest version
+    NotificationDatabase& open() {
+        mDatabase = std::make_unique<NotificationDatabase>();
+        DatabaseTest::setDb(*mDatabase, mDb);
+        mDatabase->init();
+        return *mDatabase;
+    }
+
+    void exec(const char* sql) {
+        char* error = nullptr;
+        ASSERT_EQ(sqlite3_exec(mDb, sql, nullptr, nullptr, &error), SQLITE_OK) << error;
+    }
+
+    int64_t queryInt(const char* sql) {
+        sqlite3_stmt* stmt;
+        EXPECT_EQ(sqlite3_prepare_v2(mDb, sql, -1, &stmt, nullptr), SQLITE_OK);
+        int64_t value = -1;
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            value = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        return value;
+    }
+
+    static Notification makeNotification(int64_t id, const std::string& title,
+                                         const std::string& description = "", bool active = true) {
+        return {id, active, title, description, "0 9 * * *"};
+    }
+
+    // Returns the ids of the notifications of a user that match a query
+    static std::vector<int64_t> getIds(NotificationDatabase& database, const std::string& user,
+                                       const NotificationQuery& query) {
+        std::vector<int64_t> ids;
+        database.forEachNotification(user, query, [&ids](const NotificationView& notification) {
+            ids.push_back(notification.id);
+            return true;
+        });
+        return ids;
+    }
+
+    // Returns the ids of the notifications of a user that match a search
+    static std::vector<int64_t> search(NotificationDatabase& database, const std::string& user,
+                                       const std::string& text,
+                                       const NotificationSearch& search = NotificationSearch()) {
+        std::vector<int64_t> ids;
+        database.searchNotifications(user, text, search, [&ids](const NotificationView& notification) {
+            ids.push_back(notification.id);
+            return true;
+        });
+        return ids;
+    }
+
+    static int64_t getVersion(NotificationDatabase& database, int64_t id) {
+        NotificationChange change;
+        EXPECT_TRUE(database.getNotification(id, change));
+        return change.notification.version;
+    }
+};
+
+TEST_F(NotificationDatabaseTest, MigratesFromTheFirstVersion) {
+    exec("CREATE TABLE SchemaVersions (Schema TEXT PRIMARY KEY NOT NULL, Version INT NOT NULL);"
+         "INSERT INTO SchemaVersions (Schema, Version) VALUES ('Notifications', 1);"
+         "CREATE TABLE Notifications ("
+             "id INT PRIMARY KEY NOT NULL, user TEXT NOT NULL, active INT NOT NULL, "
+             "title TEXT NOT NULL, description TEXT, schedule TEXT NOT NULL);"
+         "INSERT INTO Notifications VALUES (1, 'alice', 1, 'water plants', NULL, '0 9 * * *');"
+         "INSERT INTO Notifications VALUES (2, 'alice', 0, 'call dentist', 'at noon', '0 12 * * *');");
+
+    NotificationDatabase& database = open();
+    EXPECT_EQ(queryInt("SELECT Version FROM SchemaVersions WHERE Schema = 'Notifications';"),
+              LATEST_VERSION);
+
+    // Rows from before the versions exist are older than any change
+    EXPECT_EQ(getIds(database, "alice", NotificationQuery()), std::vector<int64_t>({1}));
+    EXPECT_EQ(getVersion(database, 1), 0);
+    EXPECT_EQ(database.getClockVersion(), 0);
+
+    // The search index is built from the existing rows
+    std::vector<int64_t> found;
+    database.searchNotifications("alice", "plants", NotificationSearch(), [&found](const NotificationView& n) {
+        found.push_back(n.id);
+        return true;
+    });
+    EXPECT_EQ(found, std::vector<int64_t>({1}));
+
+    ASSERT_TRUE(database.saveNotification("alice", makeNotification(3, "gym")));
+    EXPECT_EQ(getVersion(database, 3), 1);
+    EXPECT_EQ(database.getClockVersion(), 1);
+
+    // Migrating again does nothing
+    open();
+    EXPECT_EQ(queryInt("SELECT COUNT(*) FROM Notifications;"), 3);
+}
+
+TEST_F(NotificationDatabaseTest, SyncsOnlyTheChangesAfterAVersion) {
+    NotificationDatabase& database = open();
+    std::set<std::string> changedUsers;
+    database.setChangeListener([&changedUsers](const std::string& user) {
+        changedUsers.insert(user);
+    });
+
+    // A batch takes one version per row
+    ASSERT_EQ(database.saveNotifications({
+        {"alice", makeNotification(1, "water plants")},
+        {"alice", makeNotification(2, "call dentist")},
+        {"bob", makeNotification(3, "pay rent")},
+    }), 3);
+    EXPECT_EQ(getVersion(database, 1), 1);
+    EXPECT_EQ(getVersion(database, 2), 2);
+    EXPECT_EQ(getVersion(database, 3), 3);
+    EXPECT_EQ(database.getClockVersion(), 3);
+    EXPECT_EQ(changedUsers, std::set<std::string>({"alice", "bob"}));
+
+    ASSERT_TRUE(database.saveNotification("alice", makeNotification(2, "call dentist", "", false)));
+    EXPECT_EQ(getVersion(database, 2), 4);
+
+    // Deactivated notifications are part of the changes
+    NotificationQuery query;
+    query.sinceVersion = 3;
+    EXPECT_EQ(getIds(database, "alice", query), std::vector<int64_t>({2}));
+    query.sinceVersion = 4;
+    EXPECT_TRUE(getIds(database, "alice", query).empty());
+    EXPECT_EQ(database.getUserVersion("alice"), 4);
+    EXPECT_EQ(database.getUserVersion("bob"), 3);
+
+    const std::vector<NotificationChange> changes = database.getChangesSince(2, 10);
+    ASSERT_EQ(changes.size(), 2u);
+    EXPECT_EQ(changes[0].user, "bob");
+    EXPECT_EQ(changes[0].notification.id, 3);
+    EXPECT_EQ(changes[1].user, "alice");
+    EXPECT_EQ(changes[1].notification.id, 2);
+    EXPECT_FALSE(changes[1].notification.active);
+}
+
+TEST_F(NotificationDatabaseTest, SavingAgainKeepsTheVersion) {
+    NotificationDatabase& database = open();
+    int notifiedChanges = 0;
+    database.setChangeListener([&notifiedChanges](const std::string&) {
+        notifiedChanges++;
+    });
+
+    ASSERT_TRUE(database.saveNotification("alice", makeNotification(1, "water plants")));
+    ASSERT_TRUE(database.saveNotification("alice", makeNotification(1, "water plants")));
+    EXPECT_EQ(getVersion(database, 1), 1);
+    EXPECT_EQ(database.getClockVersion(), 1);
+    EXPECT_EQ(notifiedChanges, 1);
+
+    ASSERT_TRUE(database.saveNotification("alice", makeNotification(1, "water the plants")));
+    EXPECT_EQ(getVersion(database, 1), 2);
+    EXPECT_EQ(database.getClockVersion(), 2);
+    EXPECT_EQ(notifiedChanges, 2);
+
+    // The user of a notification cannot change
+    EXPECT_FALSE(database.saveNotification("bob", makeNotification(1, "water the plants")));
+    EXPECT_FALSE(database.saveNotification("bob", makeNotification(1, "mine now")));
+    EXPECT_EQ(getVersion(database, 1), 2);
+    EXPECT_EQ(database.getClockVersion(), 2);
+}
+
+TEST_F(NotificationDatabaseTest, TriggersVersionExternalWrites) {
+    NotificationDatabase& database = open();
+    ASSERT_TRUE(database.saveNotification("alice", makeNotification(1, "water plants")));
+
+    // Scripts do not know about versions
+    exec("UPDATE Notifications SET title = 'water all the plants' WHERE id = 1;");
+    EXPECT_EQ(getVersion(database, 1), 2);
+    exec("INSERT INTO Notifications (id, user, active, title, schedule) "
+         "VALUES (2, 'alice', 1, 'gym', '0 18 * * *');");
+    EXPECT_EQ(getVersion(database, 2), 3);
+    EXPECT_EQ(database.getClockVersion(), 3);
+
+    // Writes that do not touch the notification fields keep the version
+    exec("UPDATE Notifications SET version = version WHERE id = 1;");
+    EXPECT_EQ(getVersion(database, 1), 2);
+}
+
+TEST_F(NotificationDatabaseTest, PagesByIdWithACursor) {
+    NotificationDatabase& database = open();
+    ASSERT_EQ(database.saveNotifications({
+        {"alice", makeNotification(5, "e")},
+        {"alice", makeNotification(1, "a")},
+        {"alice", makeNotification(2, "b", "", false)},
+        {"alice", makeNotification(4, "d")},
+        {"bob", makeNotification(3, "c")},
+    }), 5);
+
+    NotificationQuery query;
+    EXPECT_EQ(getIds(database, "alice", query), std::vector<int64_t>({1, 4, 5}));
+
+    // The last id of a page is the cursor of the next one
+    query.limit = 2;
+    EXPECT_EQ(getIds(database, "alice", query), std::vector<int64_t>({1, 4}));
+    query.afterId = 4;
+    EXPECT_EQ(getIds(database, "alice", query), std::vector<int64_t>({5}));
+    query.afterId = 5;
+    EXPECT_TRUE(getIds(database, "alice", query).empty());
+
+    query.includeInactive = true;
+    query.afterId = INT64_MIN;
+    EXPECT_EQ(getIds(database, "alice", query), std::vector<int64_t>({1, 2}));
+    query.afterId = 2;
+    EXPECT_EQ(getIds(database, "alice", query), std::vector<int64_t>({4, 5}));
+
+    query.afterId = INT64_MIN;
+    query.limit = -1;
+    EXPECT_EQ(getIds(database, "bob", query), std::vector<int64_t>({3}));
+}
+
+TEST_F(NotificationDatabaseTest, SearchesTheWordsOfTheUser) {
+    NotificationDatabase& database = open();
+    ASSERT_EQ(database.saveNotifications({
+        {"alice", makeNotification(1, "water plants", "the ones in the kitchen")},
+        {"alice", makeNotification(2, "call dentist", "ask about the \"cleaning\" offer")},
+        {"alice", makeNotification(3, "water the garden", "", false)},
+        {"bob", makeNotification(4, "water plants")},
+    }), 4);
+
+    EXPECT_EQ(search(database, "alice", "plants"), std::vector<int64_t>({1}));
+    EXPECT_EQ(search(database, "alice", "kitchen"), std::vector<int64_t>({1}));
+    EXPECT_EQ(search(database, "bob", "water"), std::vector<int64_t>({4}));
+    EXPECT_TRUE(search(database, "carol", "water").empty());
+
+    // All the words must match, and the last one is a prefix
+    EXPECT_EQ(search(database, "alice", "plants wat"), std::vector<int64_t>({1}));
+    EXPECT_EQ(search(database, "alice", "dent"), std::vector<int64_t>({2}));
+    EXPECT_TRUE(search(database, "alice", "wat dentist").empty());
+
+    NotificationSearch all;
+    all.includeInactive = true;
+    EXPECT_EQ(search(database, "alice", "water", all).size(), 2u);
+    all.limit = 1;
+    EXPECT_EQ(search(database, "alice", "water", all).size(), 1u);
+    all.offset = 1;
+    EXPECT_EQ(search(database, "alice", "water", all).size(), 1u);
+    all.offset = 2;
+    EXPECT_TRUE(search(database, "alice", "water", all).empty());
+}
+
+TEST_F(NotificationDatabaseTest, SearchesOperatorsAsWords) {
+    NotificationDatabase& database = open();
+    ASSERT_EQ(database.saveNotifications({
+        {"alice", makeNotification(1, "water plants", "ask about the \"cleaning\" offer")},
+        {"alice", makeNotification(2, "call dentist")},
+        {"bob", makeNotification(3, "water or call")},
+    }), 3);
+
+    // Quotes in the input do not end the quoted words
+    EXPECT_EQ(search(database, "alice", "\"cleaning\""), std::vector<int64_t>({1}));
+    EXPECT_EQ(search(database, "alice", "\"clean"), std::vector<int64_t>({1}));
+
+    // Operators are matched as words
+    EXPECT_TRUE(search(database, "alice", "water OR call").empty());
+    EXPECT_TRUE(search(database, "alice", "NOT dentist").empty());
+    EXPECT_TRUE(search(database, "alice", "NEAR(water call)").empty());
+    EXPECT_TRUE(search(database, "alice", "user:bob").empty());
+    EXPECT_TRUE(search(database, "alice", "\") OR user : bob OR (\"").empty());
+    EXPECT_TRUE(search(database, "alice", "   ").empty());
+
+    // Other punctuation is dropped by the tokenizer
+    EXPECT_EQ(search(database, "alice", "water*"), std::vector<int64_t>({1}));
+}
@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "NotificationServer/NotificationScheduler.hpp"
+
+class NotificationSchedulerTest : public ::testing::Test {
+protected:
+    std::mutex mMutex;
+    std::vector<NotificationScheduler::DueNotification> mDue;
+
+    NotificationScheduler::DueListener listener() {
+        return [this](std::vector<NotificationScheduler::DueNotification>& due) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mDue.insert(mDue.end(), due.begin(), due.end());
+        };
+    }
+
+    std::vector<NotificationScheduler::DueNotification> getDue() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mDue;
+    }
+
+    std::vector<int64_t> getDueIds() {
+        std::vector<int64_t> ids;
+        for (const auto& notification : getDue()) {
+            ids.push_back(notification.id);
+        }
+        return ids;
+    }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // One-shot schedule some seconds from now
+    static std::string in(int64_t seconds) {
+        return std::to_string(now() + seconds);
+    }
+
+    // Fire times are far enough for the scheduler thread not to fire them during a test
+    static constexpr int64_t LATER = 3600;
+
+    // Time is driven by the test instead of the clock
+    static void fireDue(NotificationScheduler& scheduler, int64_t now) {
+        scheduler.fireDue(now);
+    }
+
+    static std::size_t getHeapSize(const NotificationScheduler& scheduler) {
+        std::lock_guard<std::mutex> lock(scheduler.mMutex);
+        return scheduler.mHeap.size();
+    }
+
+    static std::size_t getMaxDueBatch() {
+        return NotificationScheduler::MAX_DUE_BATCH;
+    }
+};
+
+TEST_F(NotificationSchedulerTest, FiresInOrder) {
+    NotificationScheduler scheduler(listener());
+    const int64_t start = now() + LATER;
+    scheduler.schedule(2, "user", std::to_string(start + 3));
+    scheduler.schedule(1, "user", std::to_string(start + 2));
+
+    // Moved later, so it fires once at the new time
+    scheduler.schedule(3, "user", std::to_string(start + 2));
+    scheduler.schedule(3, "user", std::to_string(start + 4));
+
+    scheduler.schedule(4, "user", std::to_string(start + 2));
+    scheduler.cancel(4);
+
+    // Already past
+    scheduler.schedule(5, "user", std::to_string(now() - 10));
+    EXPECT_EQ(scheduler.getNumScheduled(), 3u);
+
+    fireDue(scheduler, start + 1);
+    EXPECT_TRUE(getDueIds().empty());
+    fireDue(scheduler, start + 2);
+    EXPECT_EQ(getDueIds(), std::vector<int64_t>({1}));
+    fireDue(scheduler, start + 4);
+    EXPECT_EQ(getDueIds(), std::vector<int64_t>({1, 2, 3}));
+
+    const std::vector<NotificationScheduler::DueNotification> due = getDue();
+    ASSERT_EQ(due.size(), 3u);
+    EXPECT_EQ(due[2].fireTime, start + 4);
+    EXPECT_EQ(due[2].user, "user");
+    EXPECT_EQ(scheduler.getNumScheduled(), 0u);
+
+    // Fired only once
+    fireDue(scheduler, start + 5);
+    EXPECT_EQ(getDue().size(), 3u);
+}
+
+TEST_F(NotificationSchedulerTest, RebuildReplacesTheSchedule) {
+    NotificationScheduler scheduler(listener());
+    const int64_t start = now() + LATER;
+    scheduler.schedule(1, "user", std::to_string(start));
+
+    // Every day, half a day from now
+    const int64_t hour = (now() / 3600 + 12) % 24;
+    scheduler.rebuild({
+        {2, "userA", std::to_string(start)},
+        {3, "userB", "not a schedule"},
+        {4, "userB", "0 " + std::to_string(hour) + " * * *"},
+    });
+    EXPECT_EQ(scheduler.getNumScheduled(), 2u);
+
+    fireDue(scheduler, start);
+    const std::vector<NotificationScheduler::DueNotification> due = getDue();
+    ASSERT_EQ(due.size(), 1u);
+    EXPECT_EQ(due[0].id, 2);
+    EXPECT_EQ(due[0].user, "userA");
+
+    // Recurrent notifications stay scheduled
+    EXPECT_EQ(scheduler.getNumScheduled(), 1u);
+}
+
+TEST_F(NotificationSchedulerTest, DropsStaleEntries) {
+    NotificationScheduler scheduler(listener());
+    const std::size_t count = 4 * getMaxDueBatch();
+    for (std::size_t id = 0; id < count; id++) {
+        scheduler.schedule(id, "user", in(LATER));
+    }
+
+    for (std::size_t id = 10; id < count; id++) {
+        scheduler.cancel(id);
+    }
+    EXPECT_EQ(scheduler.getNumScheduled(), 10u);
+    EXPECT_LE(getHeapSize(scheduler), 2 * 10 + getMaxDueBatch());
+
+    // Rescheduling the same ones over and over
+    for (int i = 0; i < 500; i++) {
+        for (std::size_t id = 0; id < 10; id++) {
+            scheduler.schedule(id, "user", in(LATER + i));
+        }
+    }
+    EXPECT_LE(getHeapSize(scheduler), 2 * 10 + getMaxDueBatch());
+}
@@ -0,0 +1,223 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Communication.hpp"
+#include "MessageServer/MessageLog.hpp"
+#include "MessageServer/OfflineQueues.hpp"
+
+using server::comm::Message;
+
+class OfflineQueuesTest : public ::testing::Test {
+protected:
+    std::string mDirectory;
+    std::unique_ptr<MessageLog> mLog;
+
+    void SetUp() override {
+        char directory[] = "/tmp/OfflineQueuesTestXXXXXX";
+        ASSERT_NE(mkdtemp(directory), nullptr);
+        mDirectory = directory;
+        mLog = std::make_unique<MessageLog>(mDirectory, 1024 * 1024, 1024 * 1024, 1000000);
+    }
+
+    void TearDown() override {
+        mLog.reset();
+        const std::string command = "rm -rf " + mDirectory;
+        ASSERT_EQ(system(command.c_str()), 0);
+    }
+
+    // Relays a message to the log and the queues, like the server does
+    void push(OfflineQueues& queues, uint8_t value) {
+        uint8_t payload[16];
+        memset(payload, value, sizeof(payload));
+        const Message message(0x11, payload, sizeof(payload));
+
+        auto frame = std::make_shared<std::vector<uint8_t>>();
+        message.serialize(*frame);
+        const uint64_t offset = mLog->append(frame->data(), frame->size(), 1000 + value);
+        queues.push(offset, frame);
+    }
+
+    // Returns the first payload byte of each message delivered in one batch
+    static std::vector<uint8_t> drain(OfflineQueues& queues, const std::string& user,
+                                      std::size_t maxBytes, bool* more = nullptr) {
+        std::vector<uint8_t> bytes;
+        const bool hasMore = queues.drain(user, maxBytes, [&](const uint8_t* data, std::size_t size) {
+            bytes.insert(bytes.end(), data, data + size);
+            return size;
+        });
+        if (more != nullptr) {
+            *more = hasMore;
+        }
+
+        std::vector<uint8_t> values;
+        for (std::size_t position = 0; position < bytes.size(); ) {
+            Message message(bytes.data() + position, bytes.size() - position);
+            EXPECT_TRUE(message.isValid());
+            values.push_back(message.getPayload()[0]);
+            position += message.getLength();
+        }
+        return values;
+    }
+
+    static OfflineQueues::Limits makeLimits(std::size_t maxMessagesPerUser, std::size_t maxUsers) {
+        OfflineQueues::Limits limits;
+        limits.maxMessagesPerUser = maxMessagesPerUser;
+        limits.maxUsers = maxUsers;
+        return limits;
+    }
+};
+
+static constexpr std::size_t RECORD_SIZE = sizeof(Message::Header) + 16;
+
+TEST_F(OfflineQueuesTest, DeliversTheMessagesMissedWhileOffline) {
+    OfflineQueues queues(*mLog, OfflineQueues::Limits());
+    push(queues, 0);
+
+    queues.addUser("user");
+    push(queues, 1);
+    push(queues, 2);
+
+    ASSERT_TRUE(queues.stopQueueing("user"));
+    push(queues, 3);
+
+    bool more;
+    EXPECT_EQ(drain(queues, "user", SIZE_MAX, &more), std::vector<uint8_t>({1, 2}));
+    EXPECT_FALSE(more);
+    EXPECT_EQ(queues.getNumUsers(), 0u);
+
+    // Nothing missed
+    queues.addUser("user");
+    EXPECT_FALSE(queues.stopQueueing("user"));
+    EXPECT_EQ(queues.getNumUsers(), 0u);
+}
+
+TEST_F(OfflineQueuesTest, DeliversOnceWhileDraining) {
+    OfflineQueues queues(*mLog, OfflineQueues::Limits());
+    queues.addUser("user");
+    for (uint8_t i = 0; i < 3; i++) {
+        push(queues, i);
+    }
+
+    ASSERT_TRUE(queues.stopQueueing("user"));
+
+    bool more;
+    EXPECT_EQ(drain(queues, "user", RECORD_SIZE, &more), std::vector<uint8_t>({0}));
+    EXPECT_TRUE(more);
+
+    // Another client logs in before the first one got all of them
+    EXPECT_FALSE(queues.stopQueueing("user"));
+
+    EXPECT_EQ(drain(queues, "user", SIZE_MAX, &more), std::vector<uint8_t>({1, 2}));
+    EXPECT_FALSE(more);
+}
+
+TEST_F(OfflineQueuesTest, KeepsTheUndeliveredMessagesWhenOfflineAgain) {
+    OfflineQueues queues(*mLog, OfflineQueues::Limits());
+    queues.addUser("user");
+    for (uint8_t i = 0; i < 4; i++) {
+        push(queues, i);
+    }
+
+    ASSERT_TRUE(queues.stopQueueing("user"));
+    EXPECT_EQ(drain(queues, "user", RECORD_SIZE), std::vector<uint8_t>({0}));
+
+    // Disconnected in the middle of the delivery
+    queues.addUser("user");
+    EXPECT_TRUE(drain(queues, "user", SIZE_MAX).empty());
+    push(queues, 4);
+
+    ASSERT_TRUE(queues.stopQueueing("user"));
+    EXPECT_EQ(drain(queues, "user", SIZE_MAX), std::vector<uint8_t>({1, 2, 3, 4}));
+}
+
+TEST_F(OfflineQueuesTest, DeliversTheLastMessagesOfAUser) {
+    OfflineQueues queues(*mLog, makeLimits(2, 100));
+    queues.addUser("user");
+    for (uint8_t i = 0; i < 5; i++) {
+        push(queues, i);
+    }
+
+    ASSERT_TRUE(queues.stopQueueing("user"));
+    EXPECT_EQ(drain(queues, "user", SIZE_MAX), std::vector<uint8_t>({3, 4}));
+}
+
+TEST_F(OfflineQueuesTest, ReadsOlderMessagesFromTheLog) {
+    OfflineQueues::Limits limits;
+    limits.maxMemoryBytes = 2 * RECORD_SIZE;
+    OfflineQueues queues(*mLog, limits);
+
+    queues.addUser("user");
+    for (uint8_t i = 0; i < 5; i++) {
+        push(queues, i);
+    }
+    EXPECT_EQ(queues.getMemorySize(), 2 * RECORD_SIZE);
+
+    ASSERT_TRUE(queues.stopQueueing("user"));
+
+    std::vector<uint8_t> values;
+    bool more = true;
+    while (more) {
+        const std::vector<uint8_t> batch = drain(queues, "user", 2 * RECORD_SIZE, &more);
+        values.insert(values.end(), batch.begin(), batch.end());
+    }
+    EXPECT_EQ(values, std::vector<uint8_t>({0, 1, 2, 3, 4}));
+}
+
+TEST_F(OfflineQueuesTest, DropsTheUsersOfflineTheLongest) {
+    OfflineQueues queues(*mLog, makeLimits(100, 3));
+    for (uint8_t i = 0; i < 3; i++) {
+        queues.addUser("user" + std::to_string(i));
+        push(queues, i);
+    }
+    EXPECT_EQ(queues.getNumUsers(), 3u);
+
+    // user0 is being delivered, so user1 is dropped
+    ASSERT_TRUE(queues.stopQueueing("user0"));
+    queues.addUser("user3");
+    push(queues, 3);
+    EXPECT_EQ(queues.getNumUsers(), 3u);
+
+    EXPECT_FALSE(queues.stopQueueing("user1"));
+    EXPECT_EQ(drain(queues, "user0", SIZE_MAX), std::vector<uint8_t>({0, 1, 2}));
+    ASSERT_TRUE(queues.stopQueueing("user2"));
+    EXPECT_EQ(drain(queues, "user2", SIZE_MAX), std::vector<uint8_t>({2, 3}));
+    ASSERT_TRUE(queues.stopQueueing("user3"));
+    EXPECT_EQ(drain(queues, "user3", SIZE_MAX), std::vector<uint8_t>({3}));
+}
+
+TEST_F(OfflineQueuesTest, ResumesWhenTheSenderWouldBlock) {
+    OfflineQueues::Limits limits;
+    limits.maxMemoryBytes = 3 * RECORD_SIZE;
+    OfflineQueues queues(*mLog, limits);
+
+    queues.addUser("user");
+    for (uint8_t i = 0; i < 6; i++) {
+        push(queues, i);
+    }
+    ASSERT_TRUE(queues.stopQueueing("user"));
+
+    // From the log, and then from memory, with room for one message each time
+    const auto sendOne = [](const uint8_t*, std::size_t size) {
+        return std::min(size, RECORD_SIZE);
+    };
+    for (int i = 0; i < 5; i++) {
+        EXPECT_TRUE(queues.drain("user", SIZE_MAX, sendOne));
+    }
+
+    // Nothing fits, and the messages stay queued
+    const auto sendNone = [](const uint8_t*, std::size_t) {
+        return std::size_t(0);
+    };
+    EXPECT_TRUE(queues.drain("user", SIZE_MAX, sendNone));
+
+    EXPECT_EQ(drain(queues, "user", SIZE_MAX), std::vector<uint8_t>({5}));
+    EXPECT_EQ(queues.getNumUsers(), 0u);
+}
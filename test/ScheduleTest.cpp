@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+#include "NotificationServer/Schedule.hpp"
+
+// 2020-09-13T12:26:40Z, a Sunday
+static constexpr int64_t SUNDAY = 1600000000;
+
+TEST(ScheduleTest, OneShotTimestamp) {
+    Schedule schedule;
+    ASSERT_TRUE(Schedule::parse("1600000000", schedule));
+    EXPECT_FALSE(schedule.isRecurrent());
+    EXPECT_EQ(schedule.nextFireTime(SUNDAY - 1), SUNDAY);
+    EXPECT_EQ(schedule.nextFireTime(SUNDAY), Schedule::NEVER);
+}
+
+TEST(ScheduleTest, OneShotIsoDate) {
+    Schedule schedule;
+    ASSERT_TRUE(Schedule::parse("2020-09-13T12:26:40Z", schedule));
+    EXPECT_EQ(schedule.nextFireTime(0), SUNDAY);
+
+    ASSERT_TRUE(Schedule::parse("2020-09-13T12:26", schedule));
+    EXPECT_EQ(schedule.nextFireTime(0), SUNDAY - 40);
+
+    EXPECT_FALSE(Schedule::parse("2020-13-13T12:26", schedule));
+    EXPECT_FALSE(Schedule::parse("2020-09-13T12:26:40+01", schedule));
+    EXPECT_FALSE(Schedule::parse("tomorrow", schedule));
+}
+
+TEST(ScheduleTest, CronEveryMinute) {
+    Schedule schedule;
+    ASSERT_TRUE(Schedule::parse("* * * * *", schedule));
+    EXPECT_TRUE(schedule.isRecurrent());
+    EXPECT_EQ(schedule.nextFireTime(SUNDAY), SUNDAY - 40 + 60);
+    EXPECT_EQ(schedule.nextFireTime(SUNDAY - 40), SUNDAY - 40 + 60);
+}
+
+TEST(ScheduleTest, CronDailyAtTime) {
+    Schedule schedule;
+    ASSERT_TRUE(Schedule::parse("30 8 * * *", schedule));
+
+    // Next day at 08:30
+    const int64_t midnight = SUNDAY - (12 * 3600 + 26 * 60 + 40);
+    EXPECT_EQ(schedule.nextFireTime(SUNDAY), midnight + 86400 + 8 * 3600 + 30 * 60);
+    EXPECT_EQ(schedule.nextFireTime(midnight), midnight + 8 * 3600 + 30 * 60);
+}
+
+TEST(ScheduleTest, CronStepsRangesAndLists) {
+    Schedule schedule;
+    ASSERT_TRUE(Schedule::parse("*/15 9-17 * * 1-5", schedule));
+
+    // Sunday -> Monday 09:00
+    const int64_t midnight = SUNDAY - (12 * 3600 + 26 * 60 + 40);
+    const int64_t monday = midnight + 86400;
+    EXPECT_EQ(schedule.nextFireTime(SUNDAY), monday + 9 * 3600);
+    EXPECT_EQ(schedule.nextFireTime(monday + 9 * 3600), monday + 9 * 3600 + 15 * 60);
+    EXPECT_EQ(schedule.nextFireTime(monday + 17 * 3600 + 45 * 60), monday + 86400 + 9 * 3600);
+
+    ASSERT_TRUE(Schedule::parse("0,30 12 * * 0", schedule));
+    EXPECT_EQ(schedule.nextFireTime(SUNDAY), midnight + 12 * 3600 + 30 * 60);
+
+    // 7 is also Sunday
+    ASSERT_TRUE(Schedule::parse("0 0 * * 7", schedule));
+    EXPECT_EQ(schedule.nextFireTime(SUNDAY), midnight + 7 * 86400);
+}
+
+TEST(ScheduleTest, CronDayOfMonthOrDayOfWeek) {
+    Schedule schedule;
+    ASSERT_TRUE(Schedule::parse("0 0 1 * 1", schedule));
+
+    // Monday 14th matches the day of week before October 1st matches the day of month
+    const int64_t midnight = SUNDAY - (12 * 3600 + 26 * 60 + 40);
+    EXPECT_EQ(schedule.nextFireTime(SUNDAY), midnight + 86400);
+}
+
+TEST(ScheduleTest, CronImpossibleDate) {
+    Schedule schedule;
+    ASSERT_TRUE(Schedule::parse("0 0 30 2 *", schedule));
+    EXPECT_EQ(schedule.nextFireTime(SUNDAY), Schedule::NEVER);
+}
+
+TEST(ScheduleTest, CronInvalid) {
+    Schedule schedule;
+    EXPECT_FALSE(Schedule::parse("60 * * * *", schedule));
+    EXPECT_FALSE(Schedule::parse("* 24 * * *", schedule));
+    EXPECT_FALSE(Schedule::parse("* * 0 * *", schedule));
+    EXPECT_FALSE(Schedule::parse("* * * * 8", schedule));
+    EXPECT_FALSE(Schedule::parse("*/0 * * * *", schedule));
+    EXPECT_FALSE(Schedule::parse("5-1 * * * *", schedule));
+    EXPECT_FALSE(Schedule::parse("* * * *", schedule));
+    EXPECT_FALSE(Schedule::parse("a * * * *", schedule));
+}
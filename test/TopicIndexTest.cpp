@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "MessageServer/TopicIndex.hpp"
+#include "net/Socket.hpp"
+
+using server::net::Connection;
+
+class TopicIndexTest : public ::testing::Test {
+protected:
+    const Connection mConnection;
+
+    static std::vector<TopicIndex::ClientId> getSubscriberIds(const TopicIndex& index,
+                                                              const std::string& topic) {
+        std::vector<TopicIndex::ClientId> ids;
+        const TopicIndex::Subscribers* subscribers = index.getSubscribers(topic);
+        if (subscribers != nullptr) {
+            for (const auto& subscriber : *subscribers) {
+                ids.push_back(subscriber.first);
+            }
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+};
+
+TEST_F(TopicIndexTest, SubscribeAndUnsubscribe) {
+    TopicIndex index(16);
+    EXPECT_TRUE(index.subscribe("news", 1, mConnection));
+    EXPECT_TRUE(index.subscribe("news", 2, mConnection));
+    EXPECT_TRUE(index.subscribe("sports", 2, mConnection));
+
+    // Subscribing again does nothing
+    EXPECT_TRUE(index.subscribe("news", 1, mConnection));
+
+    EXPECT_EQ(getSubscriberIds(index, "news"), std::vector<TopicIndex::ClientId>({1, 2}));
+    EXPECT_EQ(getSubscriberIds(index, "sports"), std::vector<TopicIndex::ClientId>({2}));
+    EXPECT_EQ(index.getNumTopics(), 2u);
+
+    EXPECT_TRUE(index.unsubscribe("news", 1));
+    EXPECT_FALSE(index.unsubscribe("news", 1));
+    EXPECT_FALSE(index.unsubscribe("weather", 2));
+    EXPECT_EQ(getSubscriberIds(index, "news"), std::vector<TopicIndex::ClientId>({2}));
+}
+
+TEST_F(TopicIndexTest, DropsEmptyTopics) {
+    TopicIndex index(16);
+    index.subscribe("news", 1, mConnection);
+    index.subscribe("sports", 1, mConnection);
+
+    EXPECT_TRUE(index.unsubscribe("news", 1));
+    EXPECT_EQ(index.getSubscribers("news"), nullptr);
+    EXPECT_EQ(index.getNumTopics(), 1u);
+
+    EXPECT_TRUE(index.unsubscribe("sports", 1));
+    EXPECT_EQ(index.getSubscribers("sports"), nullptr);
+    EXPECT_EQ(index.getNumTopics(), 0u);
+}
+
+TEST_F(TopicIndexTest, LimitsTheTopicsOfAClient) {
+    TopicIndex index(2);
+    EXPECT_TRUE(index.subscribe("a", 1, mConnection));
+    EXPECT_TRUE(index.subscribe("b", 1, mConnection));
+    EXPECT_FALSE(index.subscribe("c", 1, mConnection));
+    EXPECT_EQ(index.getSubscribers("c"), nullptr);
+
+    // Other clients have their own limit
+    EXPECT_TRUE(index.subscribe("c", 2, mConnection));
+
+    // Room again after unsubscribing
+    EXPECT_TRUE(index.unsubscribe("a", 1));
+    EXPECT_TRUE(index.subscribe("c", 1, mConnection));
+    EXPECT_EQ(getSubscriberIds(index, "c"), std::vector<TopicIndex::ClientId>({1, 2}));
+}
+
+TEST_F(TopicIndexTest, RemoveClientReturnsTheTopicsItEmptied) {
+    TopicIndex index(16);
+    index.subscribe("news", 1, mConnection);
+    index.subscribe("sports", 1, mConnection);
+    index.subscribe("weather", 1, mConnection);
+    index.subscribe("news", 2, mConnection);
+
+    std::vector<std::string> emptied = index.removeClient(1);
+    std::sort(emptied.begin(), emptied.end());
+    EXPECT_EQ(emptied, std::vector<std::string>({"sports", "weather"}));
+
+    EXPECT_EQ(getSubscriberIds(index, "news"), std::vector<TopicIndex::ClientId>({2}));
+    EXPECT_EQ(index.getNumTopics(), 1u);
+
+    // Nothing left to remove
+    EXPECT_TRUE(index.removeClient(1).empty());
+    EXPECT_FALSE(index.unsubscribe("news", 1));
+
+    EXPECT_EQ(index.removeClient(2), std::vector<std::string>({"news"}));
+    EXPECT_EQ(index.getNumTopics(), 0u);
+}
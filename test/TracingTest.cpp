@@ -0,0 +1,38 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+
+#include "Tracing.hpp"
+
+using namespace server;
+
+static std::size_t count(const std::string& text, const std::string& pattern) {
+    std::size_t found = 0;
+    for (std::size_t i = text.find(pattern); i != std::string::npos; i = text.find(pattern, i + 1)) {
+        found++;
+    }
+    return found;
+}
+
+TEST(TracingTest, KeepsTheLastEventsOfEachThread) {
+    std::thread thread([]() {
+        for (std::size_t i = 0; i < Tracing::RING_SIZE + 10; i++) {
+            Tracing::record(Tracing::HANDLER, 7, 0x7E, Tracing::now_ns());
+        }
+        Tracing::mark(Tracing::DB_QUEUED, Tracing::NO_CLIENT, 0x7E);
+    });
+    thread.join();
+
+    const std::string trace = Tracing::getChromeTrace();
+    EXPECT_EQ(trace.rfind("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0), 0u);
+    EXPECT_EQ(count(trace, "\"name\":\"handler\",\"cat\":\"0x7E\""), Tracing::RING_SIZE - 1);
+    EXPECT_EQ(count(trace, "\"name\":\"db_queued\",\"cat\":\"0x7E\""), 1u);
+    EXPECT_NE(trace.find("\"ph\":\"i\""), std::string::npos);
+    EXPECT_NE(trace.find("\"client\":7"), std::string::npos);
+
+    Tracing::setEnabled(false);
+    Tracing::record(Tracing::SEND, 8, 0x7F, Tracing::now_ns());
+    Tracing::setEnabled(true);
+    EXPECT_EQ(Tracing::getChromeTrace().find("\"cat\":\"0x7F\""), std::string::npos);
+}
@@ -0,0 +1,723 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Drives a running server with many concurrent clients to measure its capacity.
+ *
+ * Each connection logs in with a token of the tokens file, one per line, used in turn, and
+ * then runs a mix of operations, one at a time:
+ *   - post:  POST_MSG to a MessageServer. It completes when another connection of the load
+ *            generator receives it, so it needs at least two connections.
+ *   - tasks: REQUEST_TASKS without payload to a NotificationServer. Completes with OK.
+ *   - sync:  REQUEST_TASKS {"limit": 50} to a NotificationServer. Completes with
+ *            RESPONSE_TASKS_END.
+ * Operations that get no answer in REQUEST_TIMEOUT_ms are counted as timeouts. The report
+ * has the throughput and latency percentiles of each operation, the latency of every
+ * delivery of a post, and the connection setup rate and errors.
+ *
+ * Usage: LoadGenerator <port> <tokens file> [options]
+ *        --host <address>     Server address. Default: 127.0.0.1
+ *        --connections <n>    Concurrent connections. Default: 100
+ *        --threads <n>        Threads that drive the connections. Default: number of CPUs
+ *        --duration <s>       Seconds to run the mix. Default: 10
+ *        --mix <op=weight,..> Weights of the operations. Default: tasks=1
+ *        --size <bytes>       Payload size of the posts. Default: 64
+ *        --rate <n>           Maximum operations per second of each connection, or 0 to
+ *                             send the next one as soon as the last one completes. Default: 0
+ *        --json               Write the report as JSON instead of text
+ */
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "Communication.hpp"
+#include "Metrics.hpp"
+#include "MessageServer/MessageServer.hpp"
+#include "NotificationServer/NotificationServer.hpp"
+#include "net/Socket.hpp"
+
+using server::HistogramSnapshot;
+using server::comm::Message;
+using server::comm::MessageType;
+using server::net::ClientSocket;
+using server::net::SocketException;
+
+static __attribute_used__ Debug::Tag LOG_TAG("LoadGenerator");
+
+static constexpr unsigned REQUEST_TIMEOUT_ms = 5000;
+static constexpr int POLL_TIMEOUT_ms = 1;
+static constexpr std::size_t READ_SIZE = 64 * 1024;
+static constexpr const char* SYNC_REQUEST = "{\"limit\": 50}";
+
+enum Operation : unsigned {
+    OP_POST,
+    OP_TASKS,
+    OP_SYNC,
+    NUM_OPERATIONS
+};
+
+static constexpr const char* OPERATION_NAMES[NUM_OPERATIONS] = {
+    "post",
+    "tasks",
+    "sync",
+};
+
+/** Start of the payload of the posts, to know who sent them and when */
+struct __attribute__((packed)) PostProbe {
+    uint32_t client;
+    uint64_t id;
+    int64_t sent_ns;
+};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    uint16_t port = 0;
+    std::string tokensFile;
+    unsigned connections = 100;
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    unsigned duration_s = 10;
+    std::array<unsigned, NUM_OPERATIONS> weights {0, 1, 0};
+    unsigned postSize = 64;
+    double rate = 0;
+    bool json = false;
+};
+
+/** Client socket that exposes its descriptor to poll it */
+class LoadSocket final : public ClientSocket {
+public:
+    using ClientSocket::ClientSocket;
+
+    int getDescriptor() const {
+        return m_sockfd;
+    }
+};
+
+/** A connection with the operation it is waiting for */
+struct LoadClient {
+    uint32_t index;
+    std::string token;
+    std::unique_ptr<LoadSocket> socket;
+    std::vector<uint8_t> received;
+    bool connected = false;
+
+    bool waiting = false;
+    Operation operation;
+    int64_t sent_ns = 0;
+    int64_t next_ns = 0;
+
+    uint64_t postId = 0;
+    std::atomic<uint64_t> deliveredPostId {0};  // Set by the thread of the receiver
+};
+
+/** Results of a thread, merged at the end */
+struct Stats {
+    std::array<HistogramSnapshot, NUM_OPERATIONS> latency;
+    std::array<uint64_t, NUM_OPERATIONS> errors {};
+    std::array<uint64_t, NUM_OPERATIONS> timeouts {};
+    HistogramSnapshot delivery;
+    HistogramSnapshot setup;
+    uint64_t connectErrors = 0;
+    uint64_t loginErrors = 0;
+    uint64_t disconnects = 0;
+    uint64_t bytesOut = 0;
+    uint64_t bytesIn = 0;
+
+    void merge(const Stats& other) {
+        for (unsigned op = 0; op < NUM_OPERATIONS; op++) {
+            latency[op].merge(other.latency[op]);
+            errors[op] += other.errors[op];
+            timeouts[op] += other.timeouts[op];
+        }
+        delivery.merge(other.delivery);
+        setup.merge(other.setup);
+        connectErrors += other.connectErrors;
+        loginErrors += other.loginErrors;
+        disconnects += other.disconnects;
+        bytesOut += other.bytesOut;
+        bytesIn += other.bytesIn;
+    }
+};
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void addValue(HistogramSnapshot& histogram, int64_t value) {
+    const uint64_t positive = std::max<int64_t>(value, 0);
+    histogram.buckets[HistogramSnapshot::getBucket(positive)]++;
+    histogram.count++;
+    histogram.sum += positive;
+    histogram.max = std::max(histogram.max, positive);
+}
+
+/**
+ * \brief Drives a part of the connections from a thread of its own.
+ */
+class Worker final {
+public:
+    Worker(const Options& options, std::vector<std::unique_ptr<LoadClient>>& allClients,
+           unsigned id)
+    :   mOptions(options),
+        mAllClients(allClients),
+        mRandom(id)
+    {
+        for (std::size_t i = id; i < allClients.size(); i += options.threads) {
+            mClients.push_back(allClients[i].get());
+        }
+
+        unsigned totalWeight = 0;
+        for (const unsigned weight : options.weights) {
+            totalWeight += weight;
+        }
+        mPick = std::uniform_int_distribution<unsigned>(0, totalWeight - 1);
+
+        mPostPayload.resize(std::max<std::size_t>(options.postSize, sizeof(PostProbe)), 'x');
+        mInterval_ns = (options.rate > 0)? static_cast<int64_t>(1e9 / options.rate) : 0;
+    }
+
+    /**
+     * \brief Connect and log in the clients one at a time.
+     */
+    void setUp() {
+        for (LoadClient* client : mClients) {
+            const int64_t start = now_ns();
+            client->socket = std::make_unique<LoadSocket>(
+                LoadSocket::Domain::IPv4, LoadSocket::Type::STREAM, mOptions.host, mOptions.port);
+            try {
+                client->socket->Connect();
+            } catch (const SocketException& e) {
+                Debug::Log::d(LOG_TAG, "Can't connect client %u: %s", client->index, e.what());
+                client->socket->Disconnect();
+                mStats.connectErrors++;
+                continue;
+            }
+            client->socket->SetNoDelay();
+            client->connected = true;
+
+            sendMessage(*client, Message(server::comm::ServerMsgTypes::LOGIN,
+                (const uint8_t*) client->token.c_str(), client->token.length() + 1));
+            if (!waitLogin(*client)) {
+                Debug::Log::d(LOG_TAG, "Client %u could not log in", client->index);
+                disconnect(*client);
+                mStats.loginErrors++;
+                continue;
+            }
+            addValue(mStats.setup, now_ns() - start);
+        }
+    }
+
+    /**
+     * \brief Run the mix until a time.
+     * \param end_ns End time from now_ns().
+     */
+    void run(int64_t end_ns) {
+        const int epollFd = epoll_create1(0);
+        for (LoadClient* client : mClients) {
+            if (client->connected) {
+                epoll_event event {};
+                event.events = EPOLLIN;
+                event.data.ptr = client;
+                epoll_ctl(epollFd, EPOLL_CTL_ADD, client->socket->getDescriptor(), &event);
+            }
+        }
+
+        std::vector<epoll_event> events(std::max<std::size_t>(mClients.size(), 1));
+        int64_t now = now_ns();
+        while (now < end_ns) {
+            for (LoadClient* client : mClients) {
+                if (!client->connected) {
+                    continue;
+                }
+
+                if (client->waiting) {
+                    if (client->operation == OP_POST &&
+                        client->deliveredPostId.load(std::memory_order_acquire) >= client->postId)
+                    {
+                        complete(*client, now, true);
+                    } else if (now - client->sent_ns >= REQUEST_TIMEOUT_ms * 1000000ll) {
+                        mStats.timeouts[client->operation]++;
+                        client->waiting = false;
+                        client->next_ns = now;
+                    }
+                }
+                if (!client->waiting && now >= client->next_ns) {
+                    start(*client, now);
+                }
+            }
+
+            const int numEvents = epoll_wait(epollFd, events.data(), events.size(), POLL_TIMEOUT_ms);
+            for (int i = 0; i < numEvents; i++) {
+                LoadClient& client = *static_cast<LoadClient*>(events[i].data.ptr);
+                if (client.connected && !receive(client)) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, client.socket->getDescriptor(), nullptr);
+                    disconnect(client);
+                    mStats.disconnects++;
+                }
+            }
+            now = now_ns();
+        }
+
+        close(epollFd);
+    }
+
+    void tearDown() {
+        for (LoadClient* client : mClients) {
+            if (client->connected) {
+                sendMessage(*client, Message(server::comm::ServerMsgTypes::LOGOUT));
+                disconnect(*client);
+            }
+        }
+    }
+
+    const Stats& getStats() const {
+        return mStats;
+    }
+
+private:
+    const Options& mOptions;
+    std::vector<std::unique_ptr<LoadClient>>& mAllClients;
+    std::vector<LoadClient*> mClients;
+    Stats mStats;
+
+    std::mt19937 mRandom;
+    std::uniform_int_distribution<unsigned> mPick;
+    std::vector<uint8_t> mPostPayload;
+    int64_t mInterval_ns;
+
+    Operation pickOperation() {
+        unsigned value = mPick(mRandom);
+        for (unsigned op = 0; op < NUM_OPERATIONS; op++) {
+            if (value < mOptions.weights[op]) {
+                return static_cast<Operation>(op);
+            }
+            value -= mOptions.weights[op];
+        }
+        return OP_TASKS;
+    }
+
+    void start(LoadClient& client, int64_t now) {
+        client.operation = pickOperation();
+        client.sent_ns = now;
+        client.waiting = true;
+
+        switch (client.operation) {
+            case OP_POST: {
+                const PostProbe probe {client.index, ++client.postId, now};
+                memcpy(mPostPayload.data(), &probe, sizeof(probe));
+                sendMessage(client, Message(POST_MSG, mPostPayload.data(), mPostPayload.size()));
+                break;
+            }
+
+            case OP_TASKS:
+                sendMessage(client, Message(NotificationServer::REQUEST_TASKS));
+                break;
+
+            case OP_SYNC:
+                sendMessage(client, Message(NotificationServer::REQUEST_TASKS,
+                    (const uint8_t*) SYNC_REQUEST, strlen(SYNC_REQUEST) + 1));
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    void complete(LoadClient& client, int64_t now, bool ok) {
+        if (ok) {
+            addValue(mStats.latency[client.operation], now - client.sent_ns);
+        } else {
+            mStats.errors[client.operation]++;
+        }
+        client.waiting = false;
+        client.next_ns = std::max(now, client.sent_ns + mInterval_ns);
+    }
+
+    void sendMessage(LoadClient& client, const Message& message) {
+        std::vector<uint8_t> frame;
+        message.serialize(frame);
+        const ssize_t numBytes = client.socket->Send(frame.data(), frame.size(), MSG_NOSIGNAL);
+        if (numBytes > 0) {
+            mStats.bytesOut += numBytes;
+        }
+    }
+
+    void disconnect(LoadClient& client) {
+        client.socket->Disconnect();
+        client.connected = false;
+        client.waiting = false;
+    }
+
+    /**
+     * \brief Read until OK or ERROR, blocking for up to REQUEST_TIMEOUT_ms.
+     * \return true if the client logged in, false otherwise.
+     */
+    bool waitLogin(LoadClient& client) {
+        client.socket->SetReceiveTimeout(REQUEST_TIMEOUT_ms);
+        uint8_t buffer[READ_SIZE];
+        while (true) {
+            std::size_t position = 0;
+            while (client.received.size() - position >= sizeof(Message::Header)) {
+                const Message message(client.received.data() + position,
+                                      client.received.size() - position);
+                if (!message.isValid()) {
+                    break;
+                }
+                position += message.getLength();
+
+                const MessageType type = message.getType();
+                if (type == server::comm::ServerMsgTypes::OK ||
+                    type == server::comm::ServerMsgTypes::ERROR)
+                {
+                    client.received.erase(client.received.begin(),
+                                          client.received.begin() + position);
+                    return (type == server::comm::ServerMsgTypes::OK);
+                }
+            }
+            client.received.erase(client.received.begin(), client.received.begin() + position);
+
+            const ssize_t numBytes = client.socket->Read(buffer, sizeof(buffer), 0);
+            if (numBytes <= 0) {
+                return false;
+            }
+            mStats.bytesIn += numBytes;
+            client.received.insert(client.received.end(), buffer, buffer + numBytes);
+        }
+    }
+
+    /**
+     * \brief Read what a client received and handle the complete messages.
+     * \return false if the connection was closed, true otherwise.
+     */
+    bool receive(LoadClient& client) {
+        uint8_t buffer[READ_SIZE];
+        while (true) {
+            const ssize_t numBytes = client.socket->Read(buffer, sizeof(buffer));
+            if (numBytes == 0) {
+                return false;
+            } else if (numBytes < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                }
+                break;
+            }
+            mStats.bytesIn += numBytes;
+            client.received.insert(client.received.end(), buffer, buffer + numBytes);
+        }
+
+        const int64_t now = now_ns();
+        std::size_t position = 0;
+        while (client.received.size() - position >= sizeof(Message::Header)) {
+            const Message message(client.received.data() + position,
+                                  client.received.size() - position);
+            if (!message.isValid()) {
+                break;
+            }
+            position += message.getLength();
+            handleMessage(client, message, now);
+        }
+        client.received.erase(client.received.begin(), client.received.begin() + position);
+        return true;
+    }
+
+    void handleMessage(LoadClient& client, const Message& message, int64_t now) {
+        const MessageType type = message.getType();
+
+        if (type == POST_MSG) {
+            // PostHeader, token of the sender, null and the posted payload
+            const char* payload = (const char*) message.getPayload();
+            const std::size_t size = message.getPayloadSize();
+            if (size < sizeof(PostHeader)) {
+                return;
+            }
+            const std::size_t tokenLength =
+                strnlen(payload + sizeof(PostHeader), size - sizeof(PostHeader));
+            const std::size_t offset = sizeof(PostHeader) + tokenLength + 1;
+            if (offset + sizeof(PostProbe) > size) {
+                return;
+            }
+
+            PostProbe probe;
+            memcpy(&probe, payload + offset, sizeof(probe));
+            if (probe.client < mAllClients.size()) {
+                addValue(mStats.delivery, now - probe.sent_ns);
+                mAllClients[probe.client]->deliveredPostId.store(probe.id, std::memory_order_release);
+            }
+            return;
+        }
+
+        if (!client.waiting) {
+            return;
+        }
+
+        if (type == server::comm::ServerMsgTypes::ERROR) {
+            complete(client, now, false);
+        } else if ((client.operation == OP_TASKS && type == server::comm::ServerMsgTypes::OK) ||
+                   (client.operation == OP_SYNC && type == NotificationServer::RESPONSE_TASKS_END))
+        {
+            complete(client, now, true);
+        }
+    }
+};
+
+static bool parseMix(const std::string& text, std::array<unsigned, NUM_OPERATIONS>& weights) {
+    weights.fill(0);
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        const std::size_t separator = item.find('=');
+        const std::string name = item.substr(0, separator);
+        const unsigned weight = (separator == std::string::npos)?
+            1 : atoi(item.c_str() + separator + 1);
+
+        const auto* found = std::find_if(std::begin(OPERATION_NAMES), std::end(OPERATION_NAMES),
+            [&name](const char* operation) { return name == operation; });
+        if (found == std::end(OPERATION_NAMES)) {
+            return false;
+        }
+        weights[found - std::begin(OPERATION_NAMES)] = weight;
+    }
+
+    unsigned totalWeight = 0;
+    for (const unsigned weight : weights) {
+        totalWeight += weight;
+    }
+    return totalWeight > 0;
+}
+
+static bool parseOptions(int argc, char* argv[], Options& options) {
+    if (argc < 3) {
+        return false;
+    }
+    options.port = atoi(argv[1]);
+    options.tokensFile = argv[2];
+
+    for (int i = 3; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option == "--json") {
+            options.json = true;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (option == "--host") {
+            options.host = value;
+        } else if (option == "--connections") {
+            options.connections = std::max(atoi(value), 1);
+        } else if (option == "--threads") {
+            options.threads = std::max(atoi(value), 1);
+        } else if (option == "--duration") {
+            options.duration_s = std::max(atoi(value), 1);
+        } else if (option == "--mix") {
+            if (!parseMix(value, options.weights)) {
+                return false;
+            }
+        } else if (option == "--size") {
+            options.postSize = std::max(atoi(value), 0);
+        } else if (option == "--rate") {
+            options.rate = std::max(atof(value), 0.0);
+        } else {
+            return false;
+        }
+    }
+
+    options.threads = std::min(options.threads, options.connections);
+    return true;
+}
+
+static std::vector<std::string> readTokens(const std::string& path) {
+    std::vector<std::string> tokens;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line[0] != '#') {
+            tokens.push_back(line);
+        }
+    }
+    return tokens;
+}
+
+static double toMicroseconds(uint64_t value_ns) {
+    return value_ns / 1000.0;
+}
+
+static void printText(const Options& options, const Stats& stats, double setup_s, double run_s) {
+    const uint64_t established = stats.setup.count;
+    printf("Connections: %u, logged in %" PRIu64 ", connect errors %" PRIu64
+           ", login errors %" PRIu64 ", disconnects %" PRIu64 "\n",
+        options.connections, established, stats.connectErrors, stats.loginErrors,
+        stats.disconnects);
+    printf("Setup: %.0f conn/s, p50 %.0f us, p99 %.0f us, p999 %.0f us, max %.0f us\n",
+        established / setup_s,
+        toMicroseconds(stats.setup.getPercentile(0.5)),
+        toMicroseconds(stats.setup.getPercentile(0.99)),
+        toMicroseconds(stats.setup.getPercentile(0.999)),
+        toMicroseconds(stats.setup.max));
+    printf("Run: %.1f s, %.2f MB/s out, %.2f MB/s in\n\n",
+        run_s, stats.bytesOut / run_s / 1e6, stats.bytesIn / run_s / 1e6);
+
+    printf("%-10s %10s %10s %8s %8s %10s %10s %10s %10s\n",
+        "operation", "count", "ops/s", "errors", "timeouts", "p50 us", "p99 us", "p999 us", "max us");
+    auto printRow = [run_s](const char* name, const HistogramSnapshot& histogram, uint64_t errors,
+                            uint64_t timeouts)
+    {
+        printf("%-10s %10" PRIu64 " %10.0f %8" PRIu64 " %8" PRIu64 " %10.0f %10.0f %10.0f %10.0f\n",
+            name, histogram.count, histogram.count / run_s, errors, timeouts,
+            toMicroseconds(histogram.getPercentile(0.5)),
+            toMicroseconds(histogram.getPercentile(0.99)),
+            toMicroseconds(histogram.getPercentile(0.999)),
+            toMicroseconds(histogram.max));
+    };
+    for (unsigned op = 0; op < NUM_OPERATIONS; op++) {
+        if (options.weights[op] > 0) {
+            printRow(OPERATION_NAMES[op], stats.latency[op], stats.errors[op], stats.timeouts[op]);
+        }
+    }
+    if (options.weights[OP_POST] > 0) {
+        printRow("delivery", stats.delivery, 0, 0);
+    }
+}
+
+static std::string formatHistogram(const HistogramSnapshot& histogram, double run_s) {
+    char text[256];
+    snprintf(text, sizeof(text),
+        "{\"count\":%" PRIu64 ",\"per_second\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+        "\"p999_us\":%.1f,\"max_us\":%.1f}",
+        histogram.count, histogram.count / run_s,
+        toMicroseconds(histogram.getPercentile(0.5)),
+        toMicroseconds(histogram.getPercentile(0.99)),
+        toMicroseconds(histogram.getPercentile(0.999)),
+        toMicroseconds(histogram.max));
+    return text;
+}
+
+static void printJson(const Options& options, const Stats& stats, double setup_s, double run_s) {
+    printf("{\"connections\":{\"requested\":%u,\"established\":%" PRIu64 ",\"connect_errors\":%"
+           PRIu64 ",\"login_errors\":%" PRIu64 ",\"disconnects\":%" PRIu64 ",\"setup\":%s},\n",
+        options.connections, stats.setup.count, stats.connectErrors, stats.loginErrors,
+        stats.disconnects, formatHistogram(stats.setup, setup_s).c_str());
+    printf("\"duration_s\":%.3f,\"bytes_out\":%" PRIu64 ",\"bytes_in\":%" PRIu64 ",\n",
+        run_s, stats.bytesOut, stats.bytesIn);
+
+    printf("\"operations\":{");
+    bool first = true;
+    for (unsigned op = 0; op < NUM_OPERATIONS; op++) {
+        if (options.weights[op] == 0) {
+            continue;
+        }
+        const std::string latency = formatHistogram(stats.latency[op], run_s);
+        printf("%s\n\"%s\":{\"errors\":%" PRIu64 ",\"timeouts\":%" PRIu64 ",\"latency\":%s}",
+            first? "" : ",", OPERATION_NAMES[op], stats.errors[op], stats.timeouts[op],
+            latency.c_str());
+        first = false;
+    }
+    printf("}");
+
+    if (options.weights[OP_POST] > 0) {
+        printf(",\n\"delivery\":%s", formatHistogram(stats.delivery, run_s).c_str());
+    }
+    printf("}\n");
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        Debug::Log::e(LOG_TAG, "Usage: %s <port> <tokens file> [--host address] [--connections n] "
+            "[--threads n] [--duration s] [--mix op=weight,...] [--size bytes] [--rate n] [--json]",
+            argv[0]);
+        return 1;
+    }
+
+    const std::vector<std::string> tokens = readTokens(options.tokensFile);
+    if (tokens.empty()) {
+        Debug::Log::e(LOG_TAG, "No tokens in %s", options.tokensFile.c_str());
+        return 1;
+    }
+
+    // Each socket logs its creation
+    Debug::setLevels("net::Socket=w");
+
+    std::vector<std::unique_ptr<LoadClient>> clients;
+    for (uint32_t i = 0; i < options.connections; i++) {
+        clients.push_back(std::make_unique<LoadClient>());
+        clients.back()->index = i;
+        clients.back()->token = tokens[i % tokens.size()];
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (unsigned i = 0; i < options.threads; i++) {
+        workers.push_back(std::make_unique<Worker>(options, clients, i));
+    }
+
+    auto runAll = [&workers](auto function) {
+        std::vector<std::thread> threads;
+        for (auto& worker : workers) {
+            threads.emplace_back(function, worker.get());
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    };
+
+    Debug::Log::i(LOG_TAG, "Connecting %u clients to %s:%u",
+        options.connections, options.host.c_str(), options.port);
+    const int64_t setupStart = now_ns();
+    runAll([](Worker* worker) { worker->setUp(); });
+    const double setup_s = std::max(now_ns() - setupStart, 1l) / 1e9;
+
+    Debug::Log::i(LOG_TAG, "Running for %u s", options.duration_s);
+    const int64_t runStart = now_ns();
+    const int64_t end_ns = runStart + options.duration_s * 1000000000ll;
+    runAll([end_ns](Worker* worker) { worker->run(end_ns); });
+    const double run_s = (now_ns() - runStart) / 1e9;
+
+    runAll([](Worker* worker) { worker->tearDown(); });
+
+    Stats stats;
+    for (const auto& worker : workers) {
+        stats.merge(worker->getStats());
+    }
+
+    if (options.json) {
+        printJson(options, stats, setup_s, run_s);
+    } else {
+        printText(options, stats, setup_s, run_s);
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Writes a binary log as text, as the server would have logged it.
+ * Servers write binary logs when LOG_BINARY_FILE names the file to write.
+ *
+ * Usage: LogDecoder <binary log file>
+ *        "-" reads the log from the standard input.
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#include "debug.hpp"
+
+int main(int argc, char* argv[]) {
+    // Errors are not logged, since logs could go to the file being decoded
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <binary log file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* in = (strcmp(argv[1], "-") == 0)? stdin : fopen(argv[1], "rb");
+    if (in == nullptr) {
+        fprintf(stderr, "Can't open %s\n", argv[1]);
+        return 1;
+    }
+
+    const bool ok = Debug::decodeBinaryLog(in, stdout);
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "%s is not a binary log or is corrupt\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Loads notifications into server.db from a tab-separated file, one notification per line:
+ *
+ *     id <TAB> user <TAB> active <TAB> title <TAB> description <TAB> schedule
+ *
+ * Tabs, new lines and backslashes inside a field are written as \t, \n and \\.
+ * Existing notifications are updated. Rows are written in batches, each in its own
+ * transaction, so a running NotificationServer keeps answering between batches and
+ * picks the changes up through its change feed.
+ *
+ * Usage: NotificationIngest <file> [batch size]
+ */
+
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "NotificationServer/NotificationDatabase.hpp"
+
+static __attribute_used__ Debug::Tag LOG_TAG("NotificationIngest");
+
+static constexpr int DEFAULT_BATCH_SIZE = 10000;
+
+/**
+ * \brief Split a line in tab-separated fields and unescape them.
+ * \param line Line.
+ * \param fields Output fields.
+ */
+static void splitFields(const std::string& line, std::vector<std::string>& fields) {
+    fields.clear();
+    fields.emplace_back();
+
+    for (std::size_t i = 0; i < line.length(); i++) {
+        const char c = line[i];
+        if (c == '\t') {
+            fields.emplace_back();
+        } else if (c == '\\' && i + 1 < line.length()) {
+            const char escaped = line[++i];
+            fields.back() += (escaped == 't')? '\t' : (escaped == 'n')? '\n' : escaped;
+        } else {
+            fields.back() += c;
+        }
+    }
+}
+
+/**
+ * \brief Parse a line of the input file.
+ * \param line Line.
+ * \param change Output notification.
+ * \return true if the line is valid, false otherwise.
+ */
+static bool parseLine(const std::string& line, NotificationChange& change) {
+    static std::vector<std::string> fields;
+    splitFields(line, fields);
+
+    if (fields.size() != 6 || fields[0].empty() || fields[1].empty()) {
+        return false;
+    }
+
+    char* end;
+    change.notification.id = strtoll(fields[0].c_str(), &end, 10);
+    if (*end != '\0') {
+        return false;
+    }
+
+    change.user = std::move(fields[1]);
+    change.notification.active = (fields[2] == "1" || fields[2] == "true");
+    change.notification.title = std::move(fields[3]);
+    change.notification.description = std::move(fields[4]);
+    change.notification.schedule = std::move(fields[5]);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        Debug::Log::e(LOG_TAG, "Usage: %s <file> [batch size]", argv[0]);
+        return 1;
+    }
+
+    const int batchSize = (argc <= 2)? DEFAULT_BATCH_SIZE : std::max(atoi(argv[2]), 1);
+
+    std::ifstream file(argv[1]);
+    if (!file) {
+        Debug::Log::e(LOG_TAG, "Can't open %s", argv[1]);
+        return 1;
+    }
+
+    NotificationDatabase database;
+    server::DatabaseManager::getInstance().initDatabase(database);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<NotificationChange> batch;
+    batch.reserve(batchSize);
+
+    long lineNumber = 0;
+    long saved = 0;
+    long invalid = 0;
+    bool failed = false;
+
+    const auto flush = [&]() {
+        const int rc = database.saveNotifications(batch);
+        if (rc < 0) {
+            Debug::Log::e(LOG_TAG, "Batch ending at line %ld failed", lineNumber);
+            failed = true;
+        } else {
+            saved += rc;
+        }
+        batch.clear();
+    };
+
+    std::string line;
+    while (!failed && std::getline(file, line)) {
+        lineNumber++;
+        if (line.empty()) {
+            continue;
+        }
+
+        NotificationChange change;
+        if (!parseLine(line, change)) {
+            Debug::Log::w(LOG_TAG, "Invalid line %ld", lineNumber);
+            invalid++;
+            continue;
+        }
+
+        batch.push_back(std::move(change));
+        if (static_cast<int>(batch.size()) >= batchSize) {
+            flush();
+        }
+    }
+
+    if (!failed && !batch.empty()) {
+        flush();
+    }
+
+    const auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+    Debug::Log::i(LOG_TAG, "Saved %ld notifications in %ld ms (%ld invalid lines)",
+        saved, elapsed_ms, invalid);
+    return failed? 1 : 0;
+}
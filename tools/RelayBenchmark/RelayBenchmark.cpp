@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Measures how long a running MessageServer takes to relay POST_MSG messages, for each
+ * combination of payload size and fan-out (number of receiving clients).
+ *
+ * A sender posts one message at a time and waits until every receiver got it, so the
+ * latency includes the period of the server loop. Each combination logs in new users,
+ * so that they get no messages queued by a previous one.
+ *
+ * Usage: RelayBenchmark <port> [messages] [sizes] [fan-outs]
+ *        Sizes and fan-outs are comma-separated lists. Defaults: 500 16,256,1024 1,8,64
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "Communication.hpp"
+#include "MessageServer/MessageServer.hpp"
+
+using server::comm::Message;
+using server::comm::ServerMsgTypes::LOGIN;
+using server::comm::ServerMsgTypes::LOGOUT;
+
+static __attribute_used__ Debug::Tag LOG_TAG("RelayBenchmark");
+
+static constexpr int DEFAULT_MESSAGES = 500;
+static constexpr int RECEIVE_TIMEOUT_ms = 2000;
+
+/** A connection to the server with the bytes received and not yet parsed */
+struct BenchClient {
+    int fd = -1;
+    std::string token;
+    std::vector<uint8_t> received;
+};
+
+static std::vector<int> parseList(const char* text) {
+    std::vector<int> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        values.push_back(atoi(item.c_str()));
+    }
+    return values;
+}
+
+static void sendMessage(const BenchClient& client, const Message& message) {
+    std::vector<uint8_t> frame;
+    message.serialize(frame);
+    if (send(client.fd, frame.data(), frame.size(), 0) != static_cast<ssize_t>(frame.size())) {
+        Debug::Log::w(LOG_TAG, "Could not send message of client %s", client.token.c_str());
+    }
+}
+
+/**
+ * \brief Read from a client until it receives a message of a type.
+ * \param client Client.
+ * \param type Message type. Messages of other types are skipped.
+ * \param payloadSize Output payload size of the message.
+ * \return false if the message did not arrive in RECEIVE_TIMEOUT_ms, true otherwise.
+ */
+static bool receive(BenchClient& client, server::comm::MessageType type, std::size_t& payloadSize) {
+    uint8_t buffer[64 * 1024];
+
+    while (true) {
+        std::size_t position = 0;
+        bool found = false;
+        while (!found && client.received.size() - position >= sizeof(Message::Header)) {
+            const Message message(client.received.data() + position,
+                                  client.received.size() - position);
+            if (!message.isValid()) {
+                break;
+            }
+            found = (message.getType() == type);
+            payloadSize = message.getPayloadSize();
+            position += message.getLength();
+        }
+        client.received.erase(client.received.begin(), client.received.begin() + position);
+        if (found) {
+            return true;
+        }
+
+        const ssize_t numBytes = recv(client.fd, buffer, sizeof(buffer), 0);
+        if (numBytes <= 0) {
+            return false;
+        }
+        client.received.insert(client.received.end(), buffer, buffer + numBytes);
+    }
+}
+
+static bool connectClient(BenchClient& client, uint16_t port) {
+    client.fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    const int noDelay = 1;
+    setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    const timeval timeout {RECEIVE_TIMEOUT_ms / 1000, (RECEIVE_TIMEOUT_ms % 1000) * 1000};
+    setsockopt(client.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (connect(client.fd, (sockaddr*) &address, sizeof(address)) < 0) {
+        Debug::Log::e(LOG_TAG, "Can't connect to port %u", port);
+        return false;
+    }
+
+    sendMessage(client, Message(LOGIN, (const uint8_t*) client.token.c_str(), client.token.length() + 1));
+    std::size_t payloadSize;
+    return receive(client, server::comm::ServerMsgTypes::OK, payloadSize);
+}
+
+static void disconnectClient(BenchClient& client) {
+    sendMessage(client, Message(LOGOUT));
+    close(client.fd);
+}
+
+/**
+ * \brief Relay messages of a size to a number of receivers and print the results.
+ * \return false if the clients could not connect, true otherwise.
+ */
+static bool run(uint16_t port, int messages, int size, int fanOut, int runId) {
+    const std::string prefix = "bench-" + std::to_string(getpid()) + "-" + std::to_string(runId);
+
+    BenchClient sender;
+    sender.token = prefix + "-sender";
+    std::vector<BenchClient> receivers(fanOut);
+    for (int i = 0; i < fanOut; i++) {
+        receivers[i].token = prefix + "-" + std::to_string(i);
+        if (!connectClient(receivers[i], port)) {
+            return false;
+        }
+    }
+    if (!connectClient(sender, port)) {
+        return false;
+    }
+
+    const std::vector<uint8_t> payload(size, 'x');
+    const std::size_t expectedSize = sizeof(PostHeader) + sender.token.length() + 1 + size;
+
+    std::vector<int64_t> latencies_us;
+    latencies_us.reserve(messages);
+    int lost = 0;
+    int corrupted = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < messages; i++) {
+        const auto sent = std::chrono::steady_clock::now();
+        sendMessage(sender, Message(POST_MSG, payload.data(), payload.size()));
+
+        for (BenchClient& receiver : receivers) {
+            std::size_t payloadSize;
+            if (!receive(receiver, POST_MSG, payloadSize)) {
+                lost++;
+            } else if (payloadSize != expectedSize) {
+                corrupted++;
+            }
+        }
+
+        latencies_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - sent).count());
+    }
+    const auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+    const int64_t delivered = static_cast<int64_t>(messages) * fanOut - lost;
+    printf("%8d %8d %10.0f %10.2f %10ld %10ld %10ld %6d %6d\n",
+        size, fanOut,
+        delivered * 1e6 / elapsed_us,
+        delivered * expectedSize / (double) elapsed_us,
+        latencies_us[latencies_us.size() / 2],
+        latencies_us[latencies_us.size() * 99 / 100],
+        latencies_us.back(),
+        lost, corrupted);
+
+    disconnectClient(sender);
+    for (BenchClient& receiver : receivers) {
+        disconnectClient(receiver);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        Debug::Log::e(LOG_TAG, "Usage: %s <port> [messages] [sizes] [fan-outs]", argv[0]);
+        return 1;
+    }
+
+    const uint16_t port = atoi(argv[1]);
+    const int messages = (argc <= 2)? DEFAULT_MESSAGES : std::max(atoi(argv[2]), 1);
+    const std::vector<int> sizes = parseList((argc <= 3)? "16,256,1024" : argv[3]);
+    const std::vector<int> fanOuts = parseList((argc <= 4)? "1,8,64" : argv[4]);
+
+    printf("%8s %8s %10s %10s %10s %10s %10s %6s %6s\n",
+        "size", "fan-out", "msg/s", "MB/s", "p50 us", "p99 us", "max us", "lost", "bad");
+
+    int runId = 0;
+    for (const int size : sizes) {
+        for (const int fanOut : fanOuts) {
+            if (!run(port, messages, size, std::max(fanOut, 1), runId++)) {
+                return 1;
+            }
+
+            // Let the server process the logouts
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    return 0;
+}
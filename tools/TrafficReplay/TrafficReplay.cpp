@@ -0,0 +1,573 @@
+/*
+ * Copyright (C) 2020  Javier Lancha Vázquez
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Replays a traffic capture of a server (see --capture) against a running server.
+ *
+ * Each captured connection is opened again and sends the frames it received, byte for
+ * byte, at the time they were received, and is closed where the client closed it. Frames
+ * are sent as they were read, so a replay keeps the batching of the capture too.
+ *
+ * The latency of a frame is the time from the frame to the first response on its
+ * connection, and is only measured for the frames sent while no other frame was waiting
+ * for a response. It is measured in the same way in the capture, by the server, and in
+ * the replay, by this tool, so both include the time of any messages relayed to the
+ * connection by other clients, and the replay includes the network too.
+ *
+ * Usage: TrafficReplay <port> <capture file> [options]
+ *        --host <address>     Server address. Default: 127.0.0.1
+ *        --speed <x|max>      Speed factor of the replay, or max to send each frame as soon
+ *                             as the response to the last one of its connection arrives, or
+ *                             RESPONSE_TIMEOUT_ms went by if it had none in the capture.
+ *                             Default: 1
+ *        --json               Write the report as JSON instead of text
+ */
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "Capture.hpp"
+#include "Metrics.hpp"
+#include "net/Socket.hpp"
+
+using server::Capture;
+using server::HistogramSnapshot;
+using server::net::ClientSocket;
+using server::net::SocketException;
+
+static __attribute_used__ Debug::Tag LOG_TAG("TrafficReplay");
+
+static constexpr unsigned RESPONSE_TIMEOUT_ms = 1000;
+static constexpr int POLL_TIMEOUT_ms = 1;
+static constexpr std::size_t READ_SIZE = 64 * 1024;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    uint16_t port = 0;
+    std::string captureFile;
+    double speed = 1;           // 0 for max
+    bool json = false;
+};
+
+/** Client socket that exposes its descriptor to poll it */
+class ReplaySocket final : public ClientSocket {
+public:
+    using ClientSocket::ClientSocket;
+
+    int getDescriptor() const {
+        return m_sockfd;
+    }
+};
+
+/** Something a connection does, at a time since the start of the capture */
+struct Step {
+    Capture::Kind kind;             // CONNECT, FRAME or DISCONNECT
+    int64_t time_us;
+    const std::vector<uint8_t>* data;
+    bool answered;                  // Whether the frame had a response in the capture
+};
+
+/** A captured connection and how far its replay went */
+struct ReplayConnection {
+    std::vector<Step> steps;
+    std::size_t next = 0;
+    std::unique_ptr<ReplaySocket> socket;
+    bool connected = false;
+
+    bool pending = false;           // A frame is waiting for a response
+    int64_t sent_ns = 0;
+    bool answered = false;          // The pending frame had a response in the capture
+
+    bool isDone() const {
+        return next == steps.size() && !connected;
+    }
+};
+
+struct Stats {
+    uint64_t connections = 0;
+    uint64_t frames = 0;
+    uint64_t bytesOut = 0;
+    uint64_t bytesIn = 0;
+    uint64_t connectErrors = 0;
+    uint64_t disconnects = 0;       // Connections closed by the server
+    HistogramSnapshot latency;
+};
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void addValue(HistogramSnapshot& histogram, int64_t value) {
+    const uint64_t positive = std::max<int64_t>(value, 0);
+    histogram.buckets[HistogramSnapshot::getBucket(positive)]++;
+    histogram.count++;
+    histogram.sum += positive;
+    histogram.max = std::max(histogram.max, positive);
+}
+
+static double toMicroseconds(uint64_t value_ns) {
+    return value_ns / 1000.0;
+}
+
+/**
+ * \brief Split the records of a capture into the steps of each connection, and measure
+ *        the latencies of the capture.
+ * \param records Records of the capture.
+ * \param connections Output connections, in the order they were accepted.
+ * \param recorded Output latencies of the capture.
+ */
+static void prepare(const std::vector<Capture::Record>& records,
+                    std::vector<ReplayConnection>& connections, HistogramSnapshot& recorded)
+{
+    std::unordered_map<uint64_t, std::size_t> indexes;
+    std::unordered_map<uint64_t, int64_t> pendingSince_us;
+
+    // Last frame of each connection, until it is answered, as an index into its steps
+    std::unordered_map<uint64_t, std::size_t> lastFrames;
+
+    for (const Capture::Record& record : records) {
+        if (record.kind == Capture::CONNECT) {
+            indexes[record.connection] = connections.size();
+            connections.emplace_back();
+            connections.back().steps.push_back({Capture::CONNECT, record.time_us, nullptr, false});
+            continue;
+        }
+
+        auto index = indexes.find(record.connection);
+        if (index == indexes.end()) {
+            continue;   // Accepted before the capture started
+        }
+        ReplayConnection& connection = connections[index->second];
+
+        switch (record.kind) {
+            case Capture::FRAME:
+                connection.steps.push_back({Capture::FRAME, record.time_us, &record.data, false});
+                lastFrames[record.connection] = connection.steps.size() - 1;
+                pendingSince_us.emplace(record.connection, record.time_us);
+                break;
+
+            case Capture::SENT: {
+                auto pending = pendingSince_us.find(record.connection);
+                if (pending != pendingSince_us.end()) {
+                    addValue(recorded, (record.time_us - pending->second) * 1000);
+                    pendingSince_us.erase(pending);
+                }
+                auto lastFrame = lastFrames.find(record.connection);
+                if (lastFrame != lastFrames.end()) {
+                    connection.steps[lastFrame->second].answered = true;
+                    lastFrames.erase(lastFrame);
+                }
+                break;
+            }
+
+            case Capture::DISCONNECT:
+                connection.steps.push_back({Capture::DISCONNECT, record.time_us, nullptr, false});
+                indexes.erase(index);
+                pendingSince_us.erase(record.connection);
+                lastFrames.erase(record.connection);
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * \brief Drives the connections of a capture from one thread.
+ */
+class Replayer final {
+public:
+    /**
+     * \param options Options.
+     * \param connections Connections of the capture.
+     * \param end_us Time of the last record of the capture.
+     */
+    Replayer(const Options& options, std::vector<ReplayConnection>& connections, int64_t end_us)
+    :   mOptions(options),
+        mConnections(connections),
+        mEnd_us(end_us)
+    {}
+
+    void run() {
+        mEpollFd = epoll_create1(0);
+        std::vector<epoll_event> events(64);
+        mStart_ns = now_ns();
+
+        std::size_t firstActive = 0;
+        while (firstActive < mConnections.size()) {
+            int64_t now = now_ns();
+            int64_t wait_ns = POLL_TIMEOUT_ms * 1000000ll;
+
+            for (std::size_t i = firstActive; i < mConnections.size(); i++) {
+                ReplayConnection& connection = mConnections[i];
+                if (connection.next == 0 && getDueTime(connection.steps[0]) > now) {
+                    // Connections are in the order they were accepted
+                    wait_ns = std::min(wait_ns, getDueTime(connection.steps[0]) - now);
+                    break;
+                }
+                advance(connection, now);
+                if (!connection.isDone() && connection.next < connection.steps.size()) {
+                    wait_ns = std::min(wait_ns,
+                        std::max<int64_t>(getDueTime(connection.steps[connection.next]) - now, 0));
+                }
+            }
+            while (firstActive < mConnections.size() && mConnections[firstActive].isDone()) {
+                firstActive++;
+            }
+
+            const int timeout_ms = (wait_ns >= 1000000)? POLL_TIMEOUT_ms : 0;
+            const int numEvents = epoll_wait(mEpollFd, events.data(), events.size(), timeout_ms);
+            now = now_ns();
+            for (int i = 0; i < numEvents; i++) {
+                ReplayConnection& connection = *static_cast<ReplayConnection*>(events[i].data.ptr);
+                if (connection.connected && !receive(connection, now)) {
+                    disconnect(connection);
+                    mStats.disconnects++;
+                    connection.next = connection.steps.size();
+                }
+            }
+        }
+
+        mDuration_ns = now_ns() - mStart_ns;
+        close(mEpollFd);
+    }
+
+    const Stats& getStats() const {
+        return mStats;
+    }
+
+    int64_t getDuration_ns() const {
+        return mDuration_ns;
+    }
+
+private:
+    const Options& mOptions;
+    std::vector<ReplayConnection>& mConnections;
+    const int64_t mEnd_us;
+    Stats mStats;
+
+    int mEpollFd = -1;
+    int64_t mStart_ns = 0;
+    int64_t mDuration_ns = 0;
+
+    bool isMaxSpeed() const {
+        return mOptions.speed <= 0;
+    }
+
+    /**
+     * \brief Returns the time from now_ns() at which a time of the capture is replayed.
+     */
+    int64_t getDueTime(int64_t time_us) const {
+        if (isMaxSpeed()) {
+            return mStart_ns;
+        }
+        return mStart_ns + static_cast<int64_t>(time_us * 1000 / mOptions.speed);
+    }
+
+    /**
+     * \brief Returns the time from now_ns() at which a step is due, ignoring responses.
+     */
+    int64_t getDueTime(const Step& step) const {
+        return getDueTime(step.time_us);
+    }
+
+    /**
+     * \brief Returns whether a connection sent a frame that had a response in the capture
+     *        and has not had it yet, for up to RESPONSE_TIMEOUT_ms.
+     */
+    static bool isWaitingResponse(const ReplayConnection& connection, int64_t now) {
+        return connection.pending && connection.answered &&
+               now - connection.sent_ns < RESPONSE_TIMEOUT_ms * 1000000ll;
+    }
+
+    /**
+     * \brief Run the steps of a connection that are due.
+     */
+    void advance(ReplayConnection& connection, int64_t now) {
+        while (connection.next < connection.steps.size()) {
+            const Step& step = connection.steps[connection.next];
+            if (getDueTime(step) > now) {
+                return;
+            }
+            if (isMaxSpeed() && isWaitingResponse(connection, now)) {
+                return;
+            }
+            connection.next++;
+
+            switch (step.kind) {
+                case Capture::CONNECT:
+                    connect(connection);
+                    break;
+
+                case Capture::FRAME:
+                    if (connection.connected) {
+                        send(connection, *step.data, step.answered, now);
+                    }
+                    break;
+
+                case Capture::DISCONNECT:
+                    if (connection.connected) {
+                        disconnect(connection);
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        // Connections that were still open at the end of the capture, once it is replayed
+        // and they got the response to their last frame, if it had one
+        if (connection.connected && now >= getDueTime(mEnd_us) &&
+            !isWaitingResponse(connection, now))
+        {
+            disconnect(connection);
+        }
+    }
+
+    void connect(ReplayConnection& connection) {
+        connection.socket = std::make_unique<ReplaySocket>(
+            ReplaySocket::Domain::IPv4, ReplaySocket::Type::STREAM, mOptions.host, mOptions.port);
+        try {
+            connection.socket->Connect();
+        } catch (const SocketException& e) {
+            Debug::Log::d(LOG_TAG, "Can't connect: %s", e.what());
+            connection.socket->Disconnect();
+            mStats.connectErrors++;
+            connection.next = connection.steps.size();
+            return;
+        }
+        connection.socket->SetNoDelay();
+        connection.connected = true;
+        mStats.connections++;
+
+        epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.ptr = &connection;
+        epoll_ctl(mEpollFd, EPOLL_CTL_ADD, connection.socket->getDescriptor(), &event);
+    }
+
+    void send(ReplayConnection& connection, const std::vector<uint8_t>& data, bool answered,
+              int64_t now)
+    {
+        const ssize_t numBytes = connection.socket->Send(
+            const_cast<uint8_t*>(data.data()), data.size(), MSG_NOSIGNAL);
+        if (numBytes > 0) {
+            mStats.bytesOut += numBytes;
+        }
+        mStats.frames++;
+
+        if (!connection.pending) {
+            connection.pending = true;
+            connection.sent_ns = now;
+        }
+        connection.answered = answered;
+    }
+
+    void disconnect(ReplayConnection& connection) {
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, connection.socket->getDescriptor(), nullptr);
+        connection.socket->Disconnect();
+        connection.connected = false;
+        connection.pending = false;
+    }
+
+    /**
+     * \brief Read what a connection received. Responses are not parsed, only counted.
+     * \return false if the connection was closed, true otherwise.
+     */
+    bool receive(ReplayConnection& connection, int64_t now) {
+        uint8_t buffer[READ_SIZE];
+        bool received = false;
+        while (true) {
+            const ssize_t numBytes = connection.socket->Read(buffer, sizeof(buffer));
+            if (numBytes == 0) {
+                return false;
+            } else if (numBytes < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                }
+                break;
+            }
+            mStats.bytesIn += numBytes;
+            received = true;
+        }
+
+        if (received && connection.pending) {
+            addValue(mStats.latency, now - connection.sent_ns);
+            connection.pending = false;
+        }
+        return true;
+    }
+};
+
+static bool parseOptions(int argc, char* argv[], Options& options) {
+    if (argc < 3) {
+        return false;
+    }
+    options.port = atoi(argv[1]);
+    options.captureFile = argv[2];
+
+    for (int i = 3; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option == "--json") {
+            options.json = true;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (option == "--host") {
+            options.host = value;
+        } else if (option == "--speed") {
+            options.speed = (value == "max")? 0 : atof(value.c_str());
+            if (value != "max" && options.speed <= 0) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return options.port != 0;
+}
+
+static void printText(const Options& options, const Stats& stats, const HistogramSnapshot& recorded,
+                      double recorded_s, double replay_s)
+{
+    printf("Connections: %" PRIu64 ", connect errors %" PRIu64 ", closed by the server %" PRIu64 "\n",
+        stats.connections, stats.connectErrors, stats.disconnects);
+    printf("Frames: %" PRIu64 ", %" PRIu64 " bytes out, %" PRIu64 " bytes in\n",
+        stats.frames, stats.bytesOut, stats.bytesIn);
+    if (options.speed > 0) {
+        printf("Duration: recorded %.3f s, replay %.3f s at %gx\n\n", recorded_s, replay_s,
+            options.speed);
+    } else {
+        printf("Duration: recorded %.3f s, replay %.3f s at max speed\n\n", recorded_s, replay_s);
+    }
+
+    printf("%-10s %10s %10s %10s %10s %10s\n",
+        "latency", "count", "p50 us", "p99 us", "p999 us", "max us");
+    auto printRow = [](const char* name, const HistogramSnapshot& histogram) {
+        printf("%-10s %10" PRIu64 " %10.0f %10.0f %10.0f %10.0f\n",
+            name, histogram.count,
+            toMicroseconds(histogram.getPercentile(0.5)),
+            toMicroseconds(histogram.getPercentile(0.99)),
+            toMicroseconds(histogram.getPercentile(0.999)),
+            toMicroseconds(histogram.max));
+    };
+    printRow("recorded", recorded);
+    printRow("replay", stats.latency);
+
+    auto difference = [&recorded, &stats](double fraction) {
+        return toMicroseconds(stats.latency.getPercentile(fraction)) -
+               toMicroseconds(recorded.getPercentile(fraction));
+    };
+    printf("%-10s %10s %+10.0f %+10.0f %+10.0f %+10.0f\n", "difference", "",
+        difference(0.5), difference(0.99), difference(0.999),
+        toMicroseconds(stats.latency.max) - toMicroseconds(recorded.max));
+}
+
+static std::string formatHistogram(const HistogramSnapshot& histogram) {
+    char text[256];
+    snprintf(text, sizeof(text),
+        "{\"count\":%" PRIu64 ",\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}",
+        histogram.count,
+        toMicroseconds(histogram.getPercentile(0.5)),
+        toMicroseconds(histogram.getPercentile(0.99)),
+        toMicroseconds(histogram.getPercentile(0.999)),
+        toMicroseconds(histogram.max));
+    return text;
+}
+
+static void printJson(const Options& options, const Stats& stats, const HistogramSnapshot& recorded,
+                      double recorded_s, double replay_s)
+{
+    printf("{\"connections\":%" PRIu64 ",\"connect_errors\":%" PRIu64 ",\"disconnects\":%" PRIu64
+           ",\n\"frames\":%" PRIu64 ",\"bytes_out\":%" PRIu64 ",\"bytes_in\":%" PRIu64 ",\n",
+        stats.connections, stats.connectErrors, stats.disconnects, stats.frames, stats.bytesOut,
+        stats.bytesIn);
+    if (options.speed > 0) {
+        printf("\"speed\":%g,", options.speed);
+    } else {
+        printf("\"speed\":\"max\",");
+    }
+    printf("\"recorded_duration_s\":%.3f,\"replay_duration_s\":%.3f,\n", recorded_s, replay_s);
+    printf("\"recorded\":%s,\n\"replay\":%s}\n",
+        formatHistogram(recorded).c_str(), formatHistogram(stats.latency).c_str());
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        Debug::Log::e(LOG_TAG, "Usage: %s <port> <capture file> [--host address] "
+            "[--speed x|max] [--json]", argv[0]);
+        return 1;
+    }
+
+    FILE* in = fopen(options.captureFile.c_str(), "rb");
+    if (in == nullptr) {
+        Debug::Log::e(LOG_TAG, "Can't open %s", options.captureFile.c_str());
+        return 1;
+    }
+    std::vector<Capture::Record> records;
+    const bool valid = Capture::read(in, records);
+    fclose(in);
+    if (!valid) {
+        Debug::Log::e(LOG_TAG, "%s is not a valid capture", options.captureFile.c_str());
+        return 1;
+    }
+
+    std::vector<ReplayConnection> connections;
+    HistogramSnapshot recorded;
+    prepare(records, connections, recorded);
+    const int64_t end_us = records.empty()? 0 : records.back().time_us;
+
+    // Each socket logs its creation
+    Debug::setLevels("net::Socket=w");
+
+    Debug::Log::i(LOG_TAG, "Replaying %zu connections and %zu records to %s:%u",
+        connections.size(), records.size(), options.host.c_str(), options.port);
+    Replayer replayer(options, connections, end_us);
+    replayer.run();
+    const double recorded_s = end_us / 1e6;
+    const double replay_s = replayer.getDuration_ns() / 1e9;
+
+    if (options.json) {
+        printJson(options, replayer.getStats(), recorded, recorded_s, replay_s);
+    } else {
+        printText(options, replayer.getStats(), recorded, recorded_s, replay_s);
+    }
+    return 0;
+}